@@ -0,0 +1,99 @@
+/*
+ * Connection rate of a single Manager::listen: P client processes start
+ * together and open C connections each, as fast as possible. The server
+ * reports the connections per second, measured from the first new
+ * connection returned by getNext to the last one (accept, handshake and
+ * ready queue included). Then it closes the connections and the clients
+ * exit when they receive the EOS.
+ *
+ * Compare the single listener with one SO_REUSEPORT listener per IO thread:
+ *  $> ./connrate-perf 8 64
+ *  $> MTCL_IO_THREADS=4 MTCL_TCP_REUSEPORT=1 ./connrate-perf 8 64
+ *
+ * $> ./connrate-perf [#processes=8] [#connections-per-process=64] [endpoint=TCP:localhost:13200]
+ */
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include "mtcl.hpp"
+using namespace MTCL;
+
+static int Client(int id, int nconn, const std::string& ep) {
+	Manager::init("client" + std::to_string(id));
+	std::vector<HandleUser> handles;
+	handles.reserve(nconn);
+	for(int i=0; i<nconn; ++i) {
+		auto h = Manager::connect(ep, 100, 50);
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:\t", "connect ERROR -- %s\n", strerror(errno));
+			Manager::finalize(true);
+			return -1;
+		}
+		handles.push_back(std::move(h));
+	}
+	char c;
+	for(auto& h : handles) {
+		h.receive(&c, 1);  // EOS
+		h.close();
+	}
+	Manager::finalize(true);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	const int nproc = (argc > 1) ? std::stoi(argv[1]) : 8;
+	const int nconn = (argc > 2) ? std::stoi(argv[2]) : 64;
+	const std::string ep = (argc > 3) ? argv[3] : "TCP:localhost:13200";
+	if (nproc <= 0 || nconn <= 0) {
+		std::cerr << "use: " << argv[0] << " [#processes=8] [#connections-per-process=64] [endpoint=TCP:localhost:13200]\n";
+		return -1;
+	}
+
+	// the clients retry the connect until the server listens
+	std::vector<pid_t> pids;
+	for(int i=0; i<nproc; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) return Client(i, nconn, ep);
+		pids.push_back(pid);
+	}
+
+	Manager::init("server");
+	if (Manager::listen(ep) == -1) {
+		MTCL_ERROR("[Server]:\t", "listen ERROR -- %s\n", strerror(errno));
+		for(auto pid : pids) kill(pid, SIGTERM);
+		return -1;
+	}
+	const int total = nproc * nconn;
+	std::vector<HandleUser> handles;
+	handles.reserve(total);
+	std::chrono::steady_clock::time_point t0, t1;
+	while((int)handles.size() < total) {
+		auto h = Manager::getNext();
+		if (!h.isValid() || !h.isNewConnection()) continue;
+		if (handles.empty()) t0 = std::chrono::steady_clock::now();
+		handles.push_back(std::move(h));
+	}
+	t1 = std::chrono::steady_clock::now();
+	for(auto& h : handles) h.close();
+
+	int failed = 0;
+	for(auto pid : pids) {
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ++failed;
+	}
+	Manager::finalize(true);
+
+	const double s = std::chrono::duration<double>(t1 - t0).count();
+	std::cout << "processes " << nproc << ", connections " << total
+			  << ", IO threads " << (std::getenv("MTCL_IO_THREADS") ? std::getenv("MTCL_IO_THREADS") : "default")
+			  << ", SO_REUSEPORT " << (std::getenv("MTCL_TCP_REUSEPORT") ? std::getenv("MTCL_TCP_REUSEPORT") : "0") << "\n";
+	std::cout << std::fixed << std::setprecision(3) << "time " << s << " s, "
+			  << std::setprecision(0) << (s > 0 ? (total - 1) / s : 0.0) << " connections/s\n";
+	if (failed) std::cerr << failed << " clients failed\n";
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Throughput of the Manager ready queue: handles per second returned by
+ * getNext and by getNextBatch (at most BATCH handles per call) with 1, 4 
+ * and 16 consumer threads.
+ *
+ * A loop-back protocol ("LOOP") is registered. Its handles are always
+ * readable and are re-enqueued in the ready queue as soon as they are
+ * yielded, thus no transport is involved and the benchmark measures the
+ * addinQ -> getNext -> yield path only. Each consumer thread repeatedly
+ * calls getNext (getNextBatch) and yields the handle(s) back to the Manager.
+ *
+ * $> ./getnext-perf [#handles=64] [seconds-per-run=2] [batch=16]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "mtcl.hpp"
+using namespace MTCL;
+
+class HandleLoop : public Handle {
+public:
+	HandleLoop(ConnType* parent) : Handle(parent) {}
+
+	ssize_t send(const void*, size_t size) { return size; }
+	ssize_t isend(const void*, size_t, Request&) { return 0; }
+	ssize_t isend(const void*, size_t, RequestPool&) { return 0; }
+	ssize_t probe(size_t& size, const bool) { size = 1; return sizeof(size_t); }
+	ssize_t receive(void*, size_t size) { return size; }
+	ssize_t ireceive(void*, size_t, RequestPool&) { return 0; }
+	ssize_t ireceive(void*, size_t, Request&) { return 0; }
+	ssize_t sendEOS() { return 0; }
+	bool peek() { return true; }
+};
+
+class ConnLoop : public ConnType {
+	std::vector<HandleLoop*> handles;
+public:
+	static inline size_t nhandles = 64;
+
+	int init(std::string) {
+		for(size_t i=0; i<nhandles; ++i) {
+			handles.push_back(new HandleLoop(this));
+			addinQ(false, handles.back());
+		}
+		return 0;
+	}
+	int listen(std::string) { return -1; }
+	Handle* connect(const std::string&, int, unsigned) { return nullptr; }
+	void update() {}
+	// the handle is immediately ready again
+	void notify_yield(Handle* h) { addinQ(false, h); }
+	void notify_close(Handle*, bool, bool) {}
+	void end(bool) {}
+};
+
+// runs nconsumers threads for the given time, returns the handles/s
+static double run(int nconsumers, int seconds, size_t batch) {
+	std::atomic<bool> stop{false};
+	std::vector<size_t> counters(nconsumers * 8, 0); // one per cache line
+	std::vector<std::thread> consumers;
+	for(int i=0; i<nconsumers; ++i) {
+		consumers.emplace_back([&, i]() {
+			size_t cnt = 0;
+			if (batch == 0) {
+				while(!stop.load(std::memory_order_relaxed)) {
+					auto h = Manager::getNext(std::chrono::milliseconds(10));
+					if (!h.isValid()) continue;
+					++cnt;
+					h.yield();
+				}
+			} else {
+				std::vector<HandleUser> out(batch);
+				while(!stop.load(std::memory_order_relaxed)) {
+					const size_t n = Manager::getNextBatch(out.data(), batch, std::chrono::milliseconds(10));
+					for(size_t j=0; j<n; ++j) out[j].yield();
+					cnt += n;
+				}
+			}
+			counters[i*8] = cnt;
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	stop = true;
+	for(auto& t : consumers) t.join();
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	size_t total = 0;
+	for(int i=0; i<nconsumers; ++i) total += counters[i*8];
+	return total / elapsed;
+}
+
+int main(int argc, char** argv) {
+	ConnLoop::nhandles = (argc > 1) ? std::stol(argv[1]) : 64;
+	const int seconds  = (argc > 2) ? std::stoi(argv[2]) : 2;
+	const size_t batch = (argc > 3) ? std::stoul(argv[3]) : 16;
+
+	Manager::registerType<ConnLoop>("LOOP");
+	Manager::init("getnext-perf");
+
+	std::cout << "handles: " << ConnLoop::nhandles << ", IO threads: " << Manager::getIOThreads() << "\n";
+	std::cout << std::setw(10) << "consumers" << std::setw(16) << "getNext/s"
+			  << std::setw(16) << "getNextBatch/s" << "\n";
+	for(int nconsumers : {1, 4, 16}) {
+		const double single  = run(nconsumers, seconds, 0);
+		const double batched = run(nconsumers, seconds, batch);
+		std::cout << std::setw(10) << nconsumers << std::fixed << std::setprecision(0)
+				  << std::setw(16) << single << std::setw(16) << batched << "\n";
+	}
+	Manager::finalize();
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * Message rate of small messages (16-256 bytes) on one handle, with and
+ * without the aggregation of the sends (HandleUser::setCork).
+ *
+ * For each size the client sends NMSGS messages as fast as possible
+ * and the server receives them one by one with receive; at the end of each
+ * size the server replies with a 1-byte ack. The rate is computed by the
+ * client from the first send to the ack.
+ *
+ *  $> ./msgrate-perf 0 "TCP:localhost:13000" &
+ *  $> ./msgrate-perf 1 "TCP:localhost:13000" [cork=0|1]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include "mtcl.hpp"
+using namespace MTCL;
+
+const int    NMSGS   = 200000;
+const size_t minsize = 16;
+const size_t maxsize = 256;
+
+void Server(const char serveraddr[]) {
+	if (Manager::listen(serveraddr) == -1) {
+		MTCL_ERROR("[Server]:\t", "listen ERROR -- %s\n", strerror(errno));
+		return;
+	}
+	std::vector<char> buff(maxsize);
+	auto handle = Manager::getNext();
+	for(size_t size=minsize; size<=maxsize; size *= 2) {
+		for(int i=0; i<NMSGS; ++i) {
+			if (handle.receive(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+				return;
+			}
+		}
+		char ack = 'a';
+		if (handle.send(&ack, 1) != 1) {
+			MTCL_ERROR("[Server]:\t", "send error, errno=%d (%s)\n", errno, strerror(errno));
+			return;
+		}
+	}
+	char c;
+	handle.receive(&c, 1);  // EOS
+	handle.close();
+}
+
+void Client(const char serveraddr[], bool cork) {
+	auto handle = Manager::connect(serveraddr, 5, 1000);
+	if (!handle.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		return;
+	}
+	if (cork && handle.setCork(true) < 0) {
+		MTCL_ERROR("[Client]:\t", "setCork error, errno=%d (%s)\n", errno, strerror(errno));
+		return;
+	}
+	std::vector<char> buff(maxsize, 'a');
+
+	std::cout << "   size      msg/s      MB/s  (cork=" << cork << ")\n";
+	std::cout << "----------------------------------\n";
+	for(size_t size=minsize; size<=maxsize; size *= 2) {
+		auto start = std::chrono::steady_clock::now();
+		for(int i=0; i<NMSGS; ++i) {
+			if (handle.send(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Client]:\t", "send error, errno=%d (%s)\n", errno, strerror(errno));
+				return;
+			}
+		}
+		char ack;
+		if (handle.receive(&ack, 1) != 1) {  // it flushes the buffered messages
+			MTCL_ERROR("[Client]:\t", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+			return;
+		}
+		std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+		std::cout << std::fixed << std::setprecision(1)
+				  << std::setw(7) << size << " "
+				  << std::setw(10) << (size_t)(NMSGS / t.count()) << " "
+				  << std::setw(9) << (NMSGS * size) / (1048576 * t.count()) << "\n";
+	}
+	handle.close();
+}
+
+int main(int argc, char** argv){
+    if(argc < 3) {
+		MTCL_ERROR("Usage: ", "%s <0|1> server-addr [cork=0|1]\n", argv[0]);
+        return -1;
+    }
+    Manager::init(argv[1]);
+    if (std::stol(argv[1]) == 0)
+		Server(argv[2]);
+    else
+		Client(argv[2], argc > 3 && std::stol(argv[3]) != 0);
+    Manager::finalize(true);
+    return 0;
+}
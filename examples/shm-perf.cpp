@@ -0,0 +1,228 @@
+/*
+ * Intra-node performance of the SHM transport, between two processes.
+ *
+ *  - ping-pong: the client sends a message and waits for the reply of the
+ *    same size, the round-trip time is reported for sizes 8B-64KB;
+ *  - streaming: the client sends NMSGS messages as fast as possible, the
+ *    server receives them one by one and replies with a 1-byte ack at the
+ *    end of each size; the message rate is reported for sizes 8B-64KB;
+ *  - zero-copy: like streaming for sizes 64KB-2MB, the client writes each
+ *    message and the server reads it. The messages are sent with
+ *    send/receive (copied into and out of the ring) and then with
+ *    loan/commit and receiveView/release (written and read in place);
+ *  - large: the bandwidth of the messages of 4MB-1GB, sent with send and
+ *    received with receive. They are read by the server from the memory of
+ *    the client (SHM_CMA_THRESHOLD), compare with the copy through the ring:
+ *    $> MTCL_SHM_CMA_THRESHOLD=0 ./shm-perf
+ *
+ * The client retries the connect until the server listens.
+ *
+ * $> ./shm-perf [#messages=1000000] [endpoint=SHM:/mtcl_shm_perf]
+ */
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include "mtcl.hpp"
+using namespace MTCL;
+
+const size_t minsize = 8;
+const size_t maxsize = 1<<16;
+const size_t maxframe = 1<<21;
+const size_t minlarge = 1<<22;
+const size_t maxlarge = 1<<30;
+
+// the work of the application on a frame: the client writes it, the server reads it
+static void produce(char* p, size_t size, int i) { memset(p, i, size); }
+static uint64_t consume(const void* p, size_t size) {
+	uint64_t s = 0;
+	for(size_t j=0; j<size/sizeof(uint64_t); ++j) s += ((const uint64_t*)p)[j];
+	return s;
+}
+
+static int Server(const std::string& ep, int nmsgs) {
+	Manager::init("server");
+	if (Manager::listen(ep) == -1) {
+		MTCL_ERROR("[Server]:\t", "listen ERROR -- %s\n", strerror(errno));
+		return -1;
+	}
+	auto h = Manager::getNext();
+	std::vector<char> buff(maxsize);
+	const int rounds = std::max(nmsgs / 10, 1);
+	for(size_t size=minsize; size<=maxsize; size *= 2)   // ping-pong
+		for(int i=0; i<rounds; ++i)
+			if (h.receive(buff.data(), size) != (ssize_t)size || h.send(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "ping-pong error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+	for(size_t size=minsize; size<=maxsize; size *= 2) { // streaming
+		const int n = (size > 4096) ? nmsgs / 10 : nmsgs;
+		for(int i=0; i<n; ++i)
+			if (h.receive(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+		char ack = 'a';
+		if (h.send(&ack, 1) != 1) return -1;
+	}
+	buff.resize(maxframe);
+	for(size_t size=maxsize; size<=maxframe; size *= 2) { // zero-copy
+		const int n = std::max(nmsgs / 100, 1);
+		char ack = 'a';
+		uint64_t sum = 0;
+		for(int i=0; i<n; ++i) {
+			if (h.receive(buff.data(), size) != (ssize_t)size) return -1;
+			sum += consume(buff.data(), size);
+		}
+		if (h.send(&ack, 1) != 1) return -1;
+		for(int i=0; i<n; ++i) {
+			const void* p;
+			if (h.receiveView(p) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "receiveView error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+			sum -= consume(p, size);
+			h.release();
+		}
+		if (sum != 0) MTCL_ERROR("[Server]:\t", "the frames sent with loan are different\n");
+		if (h.send(&ack, 1) != 1) return -1;
+	}
+	buff.resize(maxlarge);
+	for(size_t size=minlarge; size<=maxlarge; size *= 4) { // large
+		const int n = std::max<int>(maxlarge / size, 2);
+		for(int i=0; i<n; ++i)
+			if (h.receive(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+		char ack = 'a';
+		if (h.send(&ack, 1) != 1) return -1;
+	}
+	char c;
+	h.receive(&c, 1);  // EOS
+	h.close();
+	Manager::finalize(true);
+	return 0;
+}
+
+static int Client(const std::string& ep, int nmsgs) {
+	Manager::init("client");
+	HandleUser h;
+	for(int i=0; i<500 && !(h = Manager::connect(ep)).isValid(); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to %s\n", ep.c_str());
+		return -1;
+	}
+	std::vector<char> buff(maxsize, 'a');
+	using clock = std::chrono::steady_clock;
+
+	const int rounds = std::max(nmsgs / 10, 1);
+	std::cout << "ping-pong (" << rounds << " round trips)\n";
+	std::cout << "   size    RTT (us)\n";
+	std::cout << "--------------------\n";
+	for(size_t size=minsize; size<=maxsize; size *= 2) {
+		auto start = clock::now();
+		for(int i=0; i<rounds; ++i)
+			if (h.send(buff.data(), size) != (ssize_t)size || h.receive(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Client]:\t", "ping-pong error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+		std::chrono::duration<double, std::micro> t = clock::now() - start;
+		std::cout << std::fixed << std::setprecision(3)
+				  << std::setw(7) << size << " " << std::setw(11) << t.count() / rounds << "\n";
+	}
+
+	std::cout << "streaming\n";
+	std::cout << "   size        msg/s       MB/s\n";
+	std::cout << "--------------------------------\n";
+	for(size_t size=minsize; size<=maxsize; size *= 2) {
+		const int n = (size > 4096) ? nmsgs / 10 : nmsgs;
+		auto start = clock::now();
+		for(int i=0; i<n; ++i)
+			if (h.send(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Client]:\t", "send error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+		char ack;
+		if (h.receive(&ack, 1) != 1) return -1;
+		std::chrono::duration<double> t = clock::now() - start;
+		std::cout << std::fixed << std::setprecision(1)
+				  << std::setw(7) << size << " "
+				  << std::setw(12) << (size_t)(n / t.count()) << " "
+				  << std::setw(10) << (n * size) / (1048576 * t.count()) << "\n";
+	}
+
+	std::cout << "zero-copy\n";
+	std::cout << "   size   copy MB/s  zero-copy MB/s\n";
+	std::cout << "-----------------------------------\n";
+	buff.resize(maxframe);
+	for(size_t size=maxsize; size<=maxframe; size *= 2) {
+		const int n = std::max(nmsgs / 100, 1);
+		char ack;
+		auto start = clock::now();
+		for(int i=0; i<n; ++i) {
+			produce(buff.data(), size, i);
+			if (h.send(buff.data(), size) != (ssize_t)size) return -1;
+		}
+		if (h.receive(&ack, 1) != 1) return -1;
+		auto middle = clock::now();
+		for(int i=0; i<n; ++i) {
+			char* p = (char*)h.loan(size);
+			if (!p) {
+				MTCL_ERROR("[Client]:\t", "loan error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+			produce(p, size, i);
+			if (h.commit() != (ssize_t)size) return -1;
+		}
+		if (h.receive(&ack, 1) != 1) return -1;
+		std::chrono::duration<double> t1 = middle - start, t2 = clock::now() - middle;
+		std::cout << std::fixed << std::setprecision(1)
+				  << std::setw(7) << size << " "
+				  << std::setw(11) << (n * size) / (1048576 * t1.count()) << " "
+				  << std::setw(15) << (n * size) / (1048576 * t2.count()) << "\n";
+	}
+
+	std::cout << "large\n";
+	std::cout << "      size       MB/s\n";
+	std::cout << "---------------------\n";
+	buff.resize(maxlarge, 'a');
+	for(size_t size=minlarge; size<=maxlarge; size *= 4) {
+		const int n = std::max<int>(maxlarge / size, 2);
+		auto start = clock::now();
+		for(int i=0; i<n; ++i)
+			if (h.send(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Client]:\t", "send error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+		char ack;
+		if (h.receive(&ack, 1) != 1) return -1;
+		std::chrono::duration<double> t = clock::now() - start;
+		std::cout << std::fixed << std::setprecision(1)
+				  << std::setw(10) << size << " "
+				  << std::setw(10) << (n * size) / (1048576 * t.count()) << "\n";
+	}
+	h.close();
+	Manager::finalize(true);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	const int nmsgs = (argc > 1) ? std::stoi(argv[1]) : 1000000;
+	const std::string ep = (argc > 2) ? argv[2] : "SHM:/mtcl_shm_perf";
+	if (nmsgs <= 0) {
+		std::cerr << "use: " << argv[0] << " [#messages=1000000] [endpoint=SHM:/mtcl_shm_perf]\n";
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) return Client(ep, nmsgs);
+	int r = Server(ep, nmsgs);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return (r == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
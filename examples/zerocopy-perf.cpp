@@ -0,0 +1,99 @@
+/*
+ * Bandwidth and sender CPU usage of large TCP messages (64KB-64MB), to find
+ * the crossover point of the zero-copy sends (MSG_ZEROCOPY). Run it with and
+ * without zero-copy and compare the two tables:
+ *
+ *  $> ./zerocopy-perf 0 "TCP:localhost:13000" &
+ *  $> MTCL_TCP_ZEROCOPY_THRESHOLD=0 ./zerocopy-perf 1 "TCP:localhost:13000"
+ *  $> ./zerocopy-perf 0 "TCP:localhost:13000" &
+ *  $> MTCL_TCP_ZEROCOPY_THRESHOLD=1 ./zerocopy-perf 1 "TCP:localhost:13000"
+ *
+ * For each size the client sends NBYTES bytes with blocking sends and the
+ * server acknowledges them with 1 byte. The CPU time is the one of the
+ * client process (user + system).
+ */
+
+#include <sys/resource.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include "mtcl.hpp"
+using namespace MTCL;
+
+const size_t NBYTES  = (size_t)2 << 30;   // bytes sent for each size
+const size_t minsize = (1<<16);
+const size_t maxsize = (1<<26);
+
+static double cpuTime() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+void Server(const char serveraddr[]) {
+	if (Manager::listen(serveraddr) == -1) {
+		MTCL_ERROR("[Server]:\t", "listen ERROR -- %s\n", strerror(errno));
+		return;
+	}
+	std::vector<char> buff(maxsize);
+	auto handle = Manager::getNext();
+	for(size_t size=minsize; size<=maxsize; size *= 4) {
+		for(size_t i=0; i<NBYTES/size; ++i) {
+			if (handle.receive(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Server]:\t", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+				return;
+			}
+		}
+		char ack = 'a';
+		handle.send(&ack, 1);
+	}
+	char c;
+	handle.receive(&c, 1);  // EOS
+	handle.close();
+}
+
+void Client(const char serveraddr[]) {
+	auto handle = Manager::connect(serveraddr, 5, 1000);
+	if (!handle.isValid()) {
+		MTCL_ERROR("[Client]:\t", "cannot connect to server, exit\n");
+		return;
+	}
+	std::vector<char> buff(maxsize, 'a');
+	const char* thr = getenv("MTCL_TCP_ZEROCOPY_THRESHOLD");
+	std::cout << "zero-copy threshold: " << (thr ? thr : "default") << "\n";
+	std::cout << "     size       MB/s   CPU s/GB\n";
+	std::cout << "-------------------------------\n";
+	for(size_t size=minsize; size<=maxsize; size *= 4) {
+		const double c0 = cpuTime();
+		auto start = std::chrono::steady_clock::now();
+		for(size_t i=0; i<NBYTES/size; ++i) {
+			if (handle.send(buff.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[Client]:\t", "send error, errno=%d (%s)\n", errno, strerror(errno));
+				return;
+			}
+		}
+		char ack;
+		handle.receive(&ack, 1);
+		std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+		const double gb = (double)(NBYTES/size*size) / (1<<30);
+		std::cout << std::fixed << std::setprecision(3)
+				  << std::setw(9) << size << " "
+				  << std::setw(10) << std::setprecision(1) << gb * 1024 / t.count() << " "
+				  << std::setw(10) << std::setprecision(3) << (cpuTime() - c0) / gb << "\n";
+	}
+	handle.close();
+}
+
+int main(int argc, char** argv){
+    if(argc < 3) {
+		MTCL_ERROR("Usage: ", "%s <0|1> server-addr\n", argv[0]);
+        return -1;
+    }
+    Manager::init(argv[1]);
+    if (std::stol(argv[1]) == 0)
+		Server(argv[2]);
+    else
+		Client(argv[2]);
+    Manager::finalize(true);
+    return 0;
+}
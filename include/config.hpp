@@ -6,17 +6,60 @@ namespace MTCL {
 
 // all timeouts are in microseconds unless otherwise stated
 const unsigned IO_THREAD_POLL_TIMEOUT  = 10;
+const unsigned IO_THREAD_IDLE_TIMEOUT  = 100000; // max blocking wait if no protocol needs polling
+const int      IO_THREADS              = 1;      // default number of IO threads (env MTCL_IO_THREADS)
+const unsigned READY_QUEUE_SIZE        = 4096;   // slots of the lock-free ready queue of each IO thread
+const unsigned READY_QUEUE_SPIN        = 20;     // max spinning time of getNext before parking
+const int      REACTOR_THREADS         = 2;      // default workers running the callbacks (env MTCL_REACTOR_THREADS)
+const unsigned REACTOR_MAX_BURST       = 64;     // max messages delivered to a callback before yielding the handle
+const unsigned CORO_BATCH_SIZE         = 64;     // ready handles taken at once by coScheduler::run
+const unsigned CORO_SEND_POLL_MAX      = 1000;   // max wait (us) of coScheduler::run between two polls of the pending sends
 const unsigned WAIT_INTERNAL_TIMEOUT   = 100;
 const unsigned SPIN_THRESHOLD          = 300;
+const size_t   CORK_BUFFER_SIZE        = (1<<14); // aggregation buffer of a corked handle (see setCork)
+const unsigned CORK_FLUSH_TIMEOUT      = 200;     // max time a message waits in the aggregation buffer
 
 // ------ TCP ------
 const unsigned TCP_BACKLOG             = 128;
 const unsigned TCP_POLL_TIMEOUT        = 10; 
-const unsigned UNREACHABLE_ADDR_TIMOUT = 100;  // milliseconds   
+const unsigned TCP_EPOLL_MAX_EVENTS    = 256;  // events retrieved per update (epoll only)
+const bool     TCP_REUSEPORT           = false;// one listening socket per IO thread, SO_REUSEPORT (env MTCL_TCP_REUSEPORT=1)
+const unsigned UNREACHABLE_ADDR_TIMOUT = 100;  // milliseconds
+const unsigned CONNECT_ATTEMPT_DELAY   = 50;   // milliseconds between the starts of two parallel connection attempts
+const unsigned RESOLVE_CACHE_TTL       = 60000;// milliseconds, lifetime of the cached host addresses, 0 = no cache (env MTCL_RESOLVE_TTL)
+const size_t   TCP_RX_BUFFER_SIZE      = (1<<16); // read-ahead buffer of each connection
+const unsigned TCP_ASYNC_MAX_IOV       = 64;   // iovec entries of one sendmsg of the pending isends
+const int      TCP_ASYNC_WAIT_TIMEOUT  = 10;   // milliseconds, max poll time of Request::wait
+const size_t   TCP_SPLICE_PIPE_SIZE    = (1<<20); // pipe moving the data from the socket to the file (receiveToFile)
+const size_t   TCP_ZEROCOPY_THRESHOLD  = 0;    // min size of MSG_ZEROCOPY sends, 0 = disabled (env MTCL_TCP_ZEROCOPY_THRESHOLD)
+
+// ------ UDS (Unix domain sockets, the other TCP parameters apply) ------
+const unsigned UDS_MAX_FDS             = 16;   // max descriptors passed with one message (sendFds)
+
+// ------ TCPX (multi-stream TCP, the other TCP parameters apply) ------
+const unsigned TCPX_STREAMS            = 4;       // sockets of each connection (env MTCL_TCPX_STREAMS)
+const unsigned TCPX_MAX_STREAMS        = 16;
+const size_t   TCPX_STRIPE_THRESHOLD   = (1<<20); // min size of the striped messages (env MTCL_TCPX_STRIPE_THRESHOLD)
+const int      TCPX_HELLO_TIMEOUT      = 1000;    // milliseconds, max wait of the hello of an accepted socket
+const int      TCPX_CONNECT_TIMEOUT    = 5000;    // milliseconds, max time to accept all the sockets of a connection
+
+// ------ TCPU (TCP over io_uring) ------
+const unsigned TCPU_RING_ENTRIES       = 256;      // SQ entries of the ring of each shard (the CQ is 4x)
+const unsigned TCPU_RX_BUFFERS         = 256;      // provided receive buffers of each shard (power of 2)
+const unsigned TCPU_RX_BUFFER_SIZE     = (1<<14);
+const size_t   TCPU_RX_HIGH_WATERMARK  = (1<<22);  // buffered bytes per connection before pausing the receive
+const unsigned TCPU_MAX_IOV            = 64;       // iovec entries of one batched sendmsg
+const unsigned TCPU_REGISTERED_FILES   = 1024;     // registered sockets of each shard
 
 // ------ SHM ------
 const unsigned SHM_SMALL_MSG_SIZE      = (1<<22);
 const unsigned SHM_MAX_CONCURRENT_CONN = 1024;
+const unsigned SHM_WAIT_TIMEOUT        = 100000; // max sleep of a blocked sender/receiver before checking the ring again
+const char     SHM_DOORBELL_DIR[]      = "/dev/shm";  // where the doorbells of the IO threads are created (FIFOs)
+const char     SHM_DOORBELL_PREFIX[]   = "mtcl_bell_"; // name prefix of the doorbells, the only ones a producer opens
+const size_t   SHM_DOORBELL_PATH_MAX   = 128;
+const size_t   SHM_CMA_THRESHOLD       = SHM_SMALL_MSG_SIZE; // min size of the messages read from the sender memory, 0 = disabled (env MTCL_SHM_CMA_THRESHOLD); if lower than the ring, those that fit in it are copied
+const unsigned SHM_CMA_MAX_IOV         = 16;      // max buffers of a message read from the sender memory (sendv)
 
 // ------ MPI ------
 const unsigned MPI_POLL_TIMEOUT        = 10; 
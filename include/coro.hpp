@@ -0,0 +1,374 @@
+#pragma once
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <exception>
+#include <chrono>
+#include <algorithm>
+
+#include "config.hpp"
+#include "async.hpp"
+#include "handleUser.hpp"
+#include "manager.hpp"
+
+namespace MTCL {
+
+class coScheduler;
+
+/**
+ * @brief Return type of the coroutines run by coScheduler (i.e., the logical
+ * flows of the application).
+ *
+ * A coTask starts when it is spawned on a scheduler or when it is awaited by
+ * another coTask, in the latter case the awaiting coroutine is resumed when
+ * the awaited one completes and the exceptions are propagated to it.
+ */
+class coTask {
+	friend class coScheduler;
+public:
+	struct promise_type;
+	using handle_t = std::coroutine_handle<promise_type>;
+
+	struct promise_type {
+		std::coroutine_handle<> continuation;  // awaiting coroutine, if any
+		coScheduler*       sched = nullptr;    // set for the spawned flows
+		std::exception_ptr exception;
+
+		coTask get_return_object() { return coTask(handle_t::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		struct finalAwaiter {
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(handle_t h) noexcept;
+			void await_resume() noexcept {}
+		};
+		finalAwaiter final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	coTask(coTask&& o) : h(o.h) { o.h = nullptr; }
+	coTask& operator=(coTask&& o) {
+		if (this != &o) {
+			if (h) h.destroy();
+			h = o.h;
+			o.h = nullptr;
+		}
+		return *this;
+	}
+	coTask(const coTask&) = delete;
+	coTask& operator=(const coTask&) = delete;
+	~coTask() { if (h) h.destroy(); }
+
+	// awaiting a coTask runs it as part of the awaiting flow
+	bool await_ready() const noexcept { return !h || h.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+		h.promise().continuation = c;
+		return h;
+	}
+	void await_resume() {
+		if (h && h.promise().exception) std::rethrow_exception(h.promise().exception);
+	}
+
+private:
+	explicit coTask(handle_t h) : h(h) {}
+	handle_t h;
+};
+
+
+/*
+ * Awaiters returned by HandleUser::async_receive, HandleUser::async_send and
+ * Manager::next. They complete without suspending the coroutine whenever
+ * possible, otherwise the coroutine is suspended and it is resumed by the
+ * coScheduler running it.
+ */
+class receiveAwaiter {
+	friend class coScheduler;
+	HandleUser&             h;
+	void*                   buff;
+	size_t                  size;
+	ssize_t                 result  = -1;
+	bool                    pending = false;
+	std::coroutine_handle<> co;
+
+	// returns false if the receive would block
+	bool tryReceive(bool blocking) {
+		size_t sz;
+		const ssize_t r = h.probe(sz, blocking);
+		if (r == -1 && errno == EWOULDBLOCK) return false;
+		if (r <= 0) {
+			result = r;
+			return true;
+		}
+		result = h.receive(buff, size);
+		return true;
+	}
+
+public:
+	receiveAwaiter(HandleUser& h, void* buff, size_t size) : h(h), buff(buff), size(size) {}
+
+	bool await_ready() {
+		if (!h.isValid()) {
+			errno = EBADF;
+			return true;
+		}
+		if (!h.isReadable) return false;  // the Handle is managed by the IO thread
+		return tryReceive(false);
+	}
+	inline bool await_suspend(std::coroutine_handle<> c);
+	ssize_t await_resume() {
+		if (pending) tryReceive(true);
+		return result;
+	}
+};
+
+class sendAwaiter {
+	friend class coScheduler;
+	HandleUser&             h;
+	const void*             buff;
+	size_t                  size;
+	ssize_t                 result = -1;
+	Request                 req;
+	std::coroutine_handle<> co;
+
+	// takes the final status of the send from the completed request
+	void complete() { result = (req.wait() == -1) ? -1 : (ssize_t)size; }
+
+public:
+	sendAwaiter(HandleUser& h, const void* buff, size_t size) : h(h), buff(buff), size(size) {}
+
+	bool await_ready() {
+		if (h.isend(buff, size, req) == -1) return true;
+		if (!test(req)) return false;
+		complete();
+		return true;
+	}
+	inline bool await_suspend(std::coroutine_handle<> c);
+	ssize_t await_resume() { return result; }
+};
+
+class nextAwaiter {
+	friend class coScheduler;
+	HandleUser              result;
+	std::coroutine_handle<> co;
+
+public:
+	inline bool await_ready();
+	inline bool await_suspend(std::coroutine_handle<> c);
+	HandleUser await_resume() { return std::move(result); }
+};
+
+
+/**
+ * @brief Single-threaded scheduler of coroutines (coTask).
+ *
+ * The thread calling run() resumes the spawned flows until all of them
+ * are completed. When no flow can proceed, it waits for the Handles made
+ * ready by the IO threads with Manager::getNextBatch and resumes the flows
+ * waiting for them: the ones receiving from a Handle (async_receive) or,
+ * for new connections and for Handles nobody is receiving from, the ones
+ * waiting in Manager::next(). Each suspended flow only costs its coroutine
+ * frame, thus a few threads can serve a large number of conversations.
+ * The Handles used by the flows of a scheduler must not be used outside it.
+ */
+class coScheduler {
+	friend class coTask;
+	friend class receiveAwaiter;
+	friend class sendAwaiter;
+	friend class nextAwaiter;
+
+	inline static thread_local coScheduler* current = nullptr;
+
+	std::deque<std::coroutine_handle<>>         runq;
+	std::unordered_set<void*>                   flows;      // addresses of the spawned flows
+	std::vector<coTask::handle_t>               completed;
+	std::unordered_map<size_t, receiveAwaiter*> receivers;  // by Handle ID
+	std::vector<sendAwaiter*>                   senders;
+	std::deque<nextAwaiter*>                    nexts;
+	std::deque<HandleUser>                      unclaimed;  // for the next Manager::next()
+	unsigned                                    sendPoll = 0;  // us between two polls of the senders
+	HandleUser batch[CORO_BATCH_SIZE];
+
+	void reap() {
+		for(auto h : completed) {
+			flows.erase(h.address());
+			std::exception_ptr e = h.promise().exception;
+			h.destroy();
+			if (e) {
+				completed.clear();
+				std::rethrow_exception(e);
+			}
+		}
+		completed.clear();
+	}
+
+	void pollSenders() {
+		for(size_t i = 0; i < senders.size(); ) {
+			if (test(senders[i]->req)) {
+				senders[i]->complete();
+				runq.push_back(senders[i]->co);
+				sendPoll = 0;
+				senders[i] = senders.back();
+				senders.pop_back();
+			} else ++i;
+		}
+	}
+
+	void dispatch(HandleUser&& h) {
+		if (!h.isNewConnection()) {
+			auto it = receivers.find(h.getID());
+			if (it != receivers.end()) {
+				// the receiving flow holds h: it becomes readable again and
+				// the reference returned by getNext is dropped
+				receiveAwaiter* w = it->second;
+				receivers.erase(it);
+				w->h.isReadable = true;
+				h.isReadable = false;
+				HandleUser release(std::move(h));
+				runq.push_back(w->co);
+				return;
+			}
+		}
+		if (!nexts.empty()) {
+			nextAwaiter* w = nexts.front();
+			nexts.pop_front();
+			w->result = std::move(h);
+			runq.push_back(w->co);
+			return;
+		}
+		unclaimed.push_back(std::move(h));
+	}
+
+public:
+	coScheduler() = default;
+	coScheduler(const coScheduler&) = delete;
+	coScheduler& operator=(const coScheduler&) = delete;
+
+	~coScheduler() {
+		for(void* a : flows) std::coroutine_handle<>::from_address(a).destroy();
+	}
+
+	/**
+	 * @brief Add a flow to the scheduler, it starts running in run().
+	 */
+	void spawn(coTask t) {
+		coTask::handle_t h = t.h;
+		t.h = nullptr;
+		if (!h) return;
+		h.promise().sched = this;
+		flows.insert(h.address());
+		runq.push_back(h);
+	}
+
+	/**
+	 * @brief Run the flows until all of them are completed. It can be called
+	 * again after having spawned new flows. An exception escaping a flow is
+	 * rethrown by run.
+	 */
+	void run() {
+		struct guard_t {
+			coScheduler* prev;
+			guard_t(coScheduler* s) : prev(current) { current = s; }
+			~guard_t() { current = prev; }
+		} guard(this);
+
+		while(!flows.empty()) {
+			while(!runq.empty()) {
+				auto c = runq.front();
+				runq.pop_front();
+				c.resume();
+				reap();
+			}
+			if (flows.empty()) break;
+			pollSenders();
+			if (!runq.empty()) continue;
+			// pending sends are polled backing off up to CORO_SEND_POLL_MAX us,
+			// otherwise we block on the IO threads
+			unsigned us = IO_THREAD_IDLE_TIMEOUT;
+			if (!senders.empty())
+				us = sendPoll = std::min(CORO_SEND_POLL_MAX, sendPoll ? 2 * sendPoll : 1);
+			const size_t n = Manager::getNextBatch(batch, std::chrono::microseconds(us));
+			for(size_t i = 0; i < n; ++i) dispatch(std::move(batch[i]));
+		}
+	}
+
+	/**
+	 * @brief Return the scheduler running the calling thread's flows, if any.
+	 */
+	static coScheduler* running() { return current; }
+
+	/**
+	 * @brief Return the number of flows not yet completed.
+	 */
+	size_t size() const { return flows.size(); }
+};
+
+
+inline std::coroutine_handle<> coTask::promise_type::finalAwaiter::await_suspend(handle_t h) noexcept {
+	auto& p = h.promise();
+	if (p.continuation) return p.continuation;
+	if (p.sched) p.sched->completed.push_back(h);
+	return std::noop_coroutine();
+}
+
+inline bool receiveAwaiter::await_suspend(std::coroutine_handle<> c) {
+	coScheduler* s = coScheduler::current;
+	if (!s) {
+		errno = EPERM;
+		return false;
+	}
+	if (s->receivers.count(h.getID())) {
+		errno = EBUSY;  // another flow is receiving from h
+		return false;
+	}
+	co = c;
+	pending = true;
+	s->receivers.emplace(h.getID(), this);
+	h.yield();  // the IO thread notifies when h becomes readable
+	return true;
+}
+
+inline bool sendAwaiter::await_suspend(std::coroutine_handle<> c) {
+	coScheduler* s = coScheduler::current;
+	if (!s) {
+		complete();
+		return false;
+	}
+	co = c;
+	s->senders.push_back(this);
+	return true;
+}
+
+inline bool nextAwaiter::await_ready() {
+	coScheduler* s = coScheduler::current;
+	if (!s || s->unclaimed.empty()) return false;
+	result = std::move(s->unclaimed.front());
+	s->unclaimed.pop_front();
+	return true;
+}
+
+inline bool nextAwaiter::await_suspend(std::coroutine_handle<> c) {
+	coScheduler* s = coScheduler::current;
+	if (!s) {
+		result = Manager::getNext();
+		return false;
+	}
+	co = c;
+	s->nexts.push_back(this);
+	return true;
+}
+
+inline receiveAwaiter HandleUser::async_receive(void* buff, size_t size) {
+	return receiveAwaiter(*this, buff, size);
+}
+
+inline sendAwaiter HandleUser::async_send(const void* buff, size_t size) {
+	return sendAwaiter(*this, buff, size);
+}
+
+inline nextAwaiter Manager::next() { return nextAwaiter(); }
+
+} // namespace
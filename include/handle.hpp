@@ -2,6 +2,10 @@
 
 #include <iostream>
 #include <atomic>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <algorithm>
 
 #include "protocolInterface.hpp"
 #include "utils.hpp"
@@ -22,6 +26,21 @@ enum HandleType {
     INVALID_TYPE
 };
 
+class HandleUser;
+
+/**
+ * @brief Callback invoked by the Manager for each message received on a
+ * handle (see Manager::onMessage). \b size is 0 (and \b buff is nullptr)
+ * when the connection has been closed by the peer or because of an error.
+ */
+using msgCallback  = std::function<void(HandleUser& h, const char* buff, size_t size)>;
+
+/**
+ * @brief Callback invoked by the Manager for each new connection (see
+ * Manager::onConnection).
+ */
+using connCallback = std::function<void(HandleUser& h)>;
+
 class CommunicationHandle {
     friend class HandleUser;
 	friend class FanInGeneric;
@@ -34,11 +53,22 @@ protected:
 	std::atomic<bool> closed_rd = false, closed_wr = false;
     std::atomic<int> counter = 0;
     HandleType type = P2P;
+	int shard = 0;  // shard (i.e., IO thread) managing this handle
+	// buffers of the copying implementation of loan/commit and receiveView/release
+	std::vector<char> loanBuff, viewBuff;
+	bool loanPending = false, viewPending = false;
 
 
     virtual void incrementReferenceCounter() = 0;
     virtual void decrementReferenceCounter() = 0;
 
+	// total length of the buffers of a vectored operation
+	static size_t iovLength(const struct iovec* iov, int iovcnt) {
+		size_t size = 0;
+		for(int i=0; i<iovcnt; ++i) size += iov[i].iov_len;
+		return size;
+	}
+
 public:
 
 	/**
@@ -177,6 +207,248 @@ public:
 		return -1;
 	}
 
+	/**
+	 * @brief Send one message gathered from the \b iovcnt buffers of \b iov.
+	 *
+	 * The pieces are sent as a single message whose size is the sum of their
+	 * lengths, thus the receiver can use either \c receive() or \c receivev().
+	 * Backends supporting vectored I/O send the pieces directly, the default
+	 * implementation copies them into a temporary buffer and calls \c send().
+	 *
+	 * @return On success, returns the number of bytes sent (the total length).
+	 *         Returns \c -1 on error and sets \b errno accordingly.
+	 */
+	virtual ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		if (iovcnt < 0 || (iovcnt > 0 && !iov)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (iovcnt == 1) return send(iov[0].iov_base, iov[0].iov_len);
+		std::vector<char> buff(iovLength(iov, iovcnt));
+		for(size_t i=0, p=0; i<(size_t)iovcnt; p += iov[i++].iov_len)
+			if (iov[i].iov_len) memcpy(buff.data() + p, iov[i].iov_base, iov[i].iov_len);
+		return send(buff.data(), buff.size());
+	}
+
+	/**
+	 * @brief Receive one message scattering it into the \b iovcnt buffers of \b iov.
+	 *
+	 * The buffers are filled in order, each one completely before the next.
+	 * The total capacity is the sum of the lengths of the buffers. The return
+	 * values are the ones of \c receive(): if the incoming message is larger
+	 * than the total capacity, returns \c -1 with \b errno set to \c EMSGSIZE
+	 * (the message is not consumed). The default implementation receives the
+	 * message into a temporary buffer.
+	 */
+	virtual ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (iovcnt <= 0 || !iov) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (iovcnt == 1) return receive(iov[0].iov_base, iov[0].iov_len);
+		size_t size;
+		ssize_t r = probe(size, true);
+		if (r <= 0) return r;
+		if (size > iovLength(iov, iovcnt)) {
+			MTCL_PRINT(100, "[MTCL]:", "CommunicationHandle::receivev EMSGSIZE, buffers too small\n");
+			errno = EMSGSIZE;
+			return -1;
+		}
+		std::vector<char> buff(size);
+		if ((r = receive(buff.data(), size)) <= 0) return r;
+		for(size_t i=0, p=0; p<(size_t)r; p += iov[i++].iov_len)
+			memcpy(iov[i].iov_base, buff.data() + p, std::min(iov[i].iov_len, (size_t)r - p));
+		return r;
+	}
+
+	/**
+	 * @brief Pass the \b nfds file descriptors \b fds to the peer process.
+	 *
+	 * Supported only by the connections between processes of the same host
+	 * (UDS). The descriptors are sent as one message that must be received
+	 * with \c receiveFds(), in order with the other messages.
+	 *
+	 * @return The number of descriptors sent, \c -1 on error with \b errno set
+	 *         (\c ENOTSUP if the backend cannot pass descriptors).
+	 */
+	virtual ssize_t sendFds(const int* fds, int nfds) {
+		MTCL_PRINT(100, "[MTCL]:", "CommunicationHandle::sendFds not supported.\n");
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/**
+	 * @brief Receive the file descriptors sent by the peer with \c sendFds().
+	 *
+	 * @return The number of descriptors stored in \b fds (at most \b nfds),
+	 *         \c 0 on EOS, \c -1 on error with \b errno set (\c EPROTO if the
+	 *         next message does not carry descriptors).
+	 */
+	virtual ssize_t receiveFds(int* fds, int nfds) {
+		MTCL_PRINT(100, "[MTCL]:", "CommunicationHandle::receiveFds not supported.\n");
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/**
+	 * @brief Send \b len bytes of the file \b fd starting at \b offset as one
+	 * message.
+	 *
+	 * If \b offset is \c -1 the range starts at the current position of the
+	 * file, which is advanced. The receiver can use either \c receive() or
+	 * \c receiveToFile(). TCP moves the data from the page cache to the socket
+	 * (\c sendfile), the default implementation maps the range of the file
+	 * and sends it with \c send().
+	 *
+	 * @return On success, returns \b len. Returns \c -1 on error and sets
+	 *         \b errno accordingly (\c EINVAL if \b len is 0 or the range is
+	 *         beyond the end of the file).
+	 */
+	virtual ssize_t sendFile(int fd, off_t offset, size_t len) {
+		fileRange f;
+		const char* p = f.open(fd, offset, len, false);
+		if (!p) return -1;
+		const ssize_t r = send(p, len);
+		if (r < 0 || f.close() < 0) return -1;
+		return r;
+	}
+
+	/**
+	 * @brief Receive one message writing it into the file \b fd at \b offset
+	 * (\c -1 for the current position of the file, which is advanced).
+	 *
+	 * The file is extended if needed. The return values are the ones of
+	 * \c receive(), \b maxlen is the capacity: larger messages give \c -1
+	 * with \b errno set to \c EMSGSIZE (the message is not consumed). TCP
+	 * moves the data from the socket to the file (\c splice), the default
+	 * implementation receives the message into the mapped range of the file.
+	 */
+	virtual ssize_t receiveToFile(int fd, off_t offset, size_t maxlen) {
+		size_t size;
+		ssize_t r = probe(size, true);
+		if (r <= 0) return r;
+		if (size > maxlen) {
+			MTCL_PRINT(100, "[MTCL]:", "CommunicationHandle::receiveToFile EMSGSIZE, message larger than maxlen\n");
+			errno = EMSGSIZE;
+			return -1;
+		}
+		fileRange f;
+		char* p = f.open(fd, offset, size, true);
+		if (!p) return -1;
+		if ((r = receive(p, size)) <= 0) return r;
+		if (f.close() < 0) return -1;
+		return r;
+	}
+
+	/**
+	 * @brief Get a buffer of \b size bytes where to write the next message,
+	 * that is sent by \c commit().
+	 *
+	 * Backends with a shared buffer (SHM) return a region of the buffer
+	 * visible to the peer, so that the message is never copied (if the peer
+	 * reads it with \c receiveView()). The default implementation returns a
+	 * buffer of the handle and \c commit() sends it. Until \c commit() no
+	 * other message can be sent on the handle.
+	 *
+	 * @return The buffer, \c nullptr on error with \b errno set (\c EBUSY if
+	 *         a loaned buffer has not been committed yet, \c EINVAL if
+	 *         \b size is 0).
+	 */
+	virtual void* loan(size_t size) {
+		if (loanPending) {
+			errno = EBUSY;
+			return nullptr;
+		}
+		if (!size) {
+			errno = EINVAL;
+			return nullptr;
+		}
+		loanBuff.resize(size);
+		loanPending = true;
+		return loanBuff.data();
+	}
+
+	/**
+	 * @brief Send the message written into the buffer returned by \c loan().
+	 *
+	 * @return The size of the message, \c -1 on error with \b errno set
+	 *         (\c EINVAL if there is no loaned buffer).
+	 */
+	virtual ssize_t commit() {
+		if (!loanPending) {
+			errno = EINVAL;
+			return -1;
+		}
+		loanPending = false;
+		return send(loanBuff.data(), loanBuff.size());
+	}
+
+	/**
+	 * @brief Receive one message without copying it into a user buffer.
+	 *
+	 * \b buff is set to the message, that is valid (read-only) until
+	 * \c release(), and the return values are the ones of \c receive().
+	 * Backends with a shared buffer (SHM) return the message in place,
+	 * the default implementation receives it into a buffer of the handle.
+	 * Until \c release() no other message can be received on the handle
+	 * (\c EBUSY).
+	 */
+	virtual ssize_t receiveView(const void*& buff) {
+		if (viewPending) {
+			errno = EBUSY;
+			return -1;
+		}
+		size_t size;
+		ssize_t r = probe(size, true);
+		if (r <= 0) return r;
+		viewBuff.resize(size);
+		if ((r = receive(viewBuff.data(), size)) <= 0) return r;
+		viewPending = true;
+		buff = viewBuff.data();
+		return r;
+	}
+
+	/**
+	 * @brief Release the message returned by \c receiveView().
+	 *
+	 * @return 0 on success, \c -1 with \b errno set to \c EINVAL if there is
+	 *         no message to release.
+	 */
+	virtual int release() {
+		if (!viewPending) {
+			errno = EINVAL;
+			return -1;
+		}
+		viewPending = false;
+		return 0;
+	}
+
+	/**
+	 * @brief Enable (or disable) the aggregation of small messages.
+	 *
+	 * When enabled, the messages sent with \c send() are packed into a buffer
+	 * and transmitted together when the buffer is full (CORK_BUFFER_SIZE),
+	 * when the first buffered message is older than CORK_FLUSH_TIMEOUT, on
+	 * \c flush() and before any blocking receive. The framing is unchanged,
+	 * thus the receiver needs no changes. Disabling the aggregation flushes
+	 * the buffer.
+	 *
+	 * @return 0 on success, \c -1 with \b errno set to \c ENOTSUP if the
+	 *         backend does not support the aggregation.
+	 */
+	virtual int setCork(bool enable) {
+		MTCL_PRINT(100, "[MTCL]:", "CommunicationHandle::setCork not supported.\n");
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/**
+	 * @brief Send the messages buffered by the aggregation mode (see setCork).
+	 *
+	 * @return 0 on success, \c -1 on error with \b errno set.
+	 */
+	virtual ssize_t flush() { return 0; }
+
 	/**
 	 * @brief Return the team size associated with this handle, if applicable.
 	 *
@@ -213,6 +485,11 @@ public:
 	 * @brief Return the backend type associated with this handle.
 	 */
 	HandleType getType() { return type; }
+
+	/**
+	 * @brief Return the shard (i.e., the IO thread) managing this handle.
+	 */
+	int getShard() const { return shard; }
 	
 	/**
 	 * @brief Return true if both read and write sides have been closed.
@@ -229,6 +506,8 @@ class Handle : public CommunicationHandle {
     friend class ConnType;
 
     ConnType* parent;
+	bool handshaking = false;  // the Manager is receiving the connection handshake
+	std::shared_ptr<msgCallback> msgHandler;  // set by Manager::onMessage
 	
     void incrementReferenceCounter(){
         counter++;
@@ -285,7 +564,7 @@ public:
 		}*/
     }
     
-    Handle(ConnType* parent) : parent(parent) {}	
+    Handle(ConnType* parent, int shard=0) : parent(parent) { this->shard = shard; }	
     virtual ~Handle() {};
 };
 
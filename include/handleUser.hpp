@@ -8,9 +8,18 @@
 
 namespace MTCL {
 
+#ifdef MTCL_ENABLE_COROUTINES
+class receiveAwaiter;
+class sendAwaiter;
+#endif
+
 class HandleUser {
     friend class ConnType;
     friend class Manager;
+#ifdef MTCL_ENABLE_COROUTINES
+    friend class coScheduler;
+    friend class receiveAwaiter;
+#endif
     CommunicationHandle* realHandle;
     bool isReadable    = false;
     bool newConnection = true;
@@ -64,6 +73,7 @@ public:
     }
 
 	const std::string& getName() { return realHandle->getName(); }
+	int getShard() { return realHandle ? realHandle->getShard() : -1; }
 	void setName(const std::string& name) { realHandle->setName(name);}
 	
     ssize_t send(const void* buff, size_t size){
@@ -189,15 +199,176 @@ public:
 		return realHandle->ireceive(buff, size, req);
     }
 
+	// see CommunicationHandle::sendv
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::sendv EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+            return -1;
+        }
+        return realHandle->sendv(iov, iovcnt);
+    }
+
+	// the lengths of `iov` are the buffers capacity, see CommunicationHandle::receivev
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		newConnection = false;
+		if (!isReadable){
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receivev handle not readable\n");
+			return 0;
+		}
+		if (!realHandle) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receivev EBADF\n");
+			errno = EBADF; // the handle is not valid or closed
+			return -1;
+		}
+		if (realHandle->closed_rd) return 0;
+		return realHandle->receivev(iov, iovcnt);
+    }
+
+	// see CommunicationHandle::sendFds
+    ssize_t sendFds(const int* fds, int nfds) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::sendFds EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+            return -1;
+        }
+        return realHandle->sendFds(fds, nfds);
+    }
+
+    ssize_t receiveFds(int* fds, int nfds) {
+		newConnection = false;
+		if (!isReadable){
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveFds handle not readable\n");
+			return 0;
+		}
+		if (!realHandle) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveFds EBADF\n");
+			errno = EBADF; // the handle is not valid or closed
+			return -1;
+		}
+		if (realHandle->closed_rd) return 0;
+		return realHandle->receiveFds(fds, nfds);
+    }
+
+	// see CommunicationHandle::sendFile
+    ssize_t sendFile(int fd, off_t offset, size_t len) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::sendFile EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+            return -1;
+        }
+        return realHandle->sendFile(fd, offset, len);
+    }
+
+	// `maxlen` is the capacity, see CommunicationHandle::receiveToFile
+    ssize_t receiveToFile(int fd, off_t offset, size_t maxlen) {
+		newConnection = false;
+		if (!isReadable){
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveToFile handle not readable\n");
+			return 0;
+		}
+		if (!realHandle) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveToFile EBADF\n");
+			errno = EBADF; // the handle is not valid or closed
+			return -1;
+		}
+		if (realHandle->closed_rd) return 0;
+		return realHandle->receiveToFile(fd, offset, maxlen);
+    }
+
+	// see CommunicationHandle::loan
+    void* loan(size_t size) {
+        newConnection = false;
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::loan EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+            return nullptr;
+        }
+        return realHandle->loan(size);
+    }
+
+    ssize_t commit() {
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::commit EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+            return -1;
+        }
+        return realHandle->commit();
+    }
+
+	// see CommunicationHandle::receiveView
+    ssize_t receiveView(const void*& buff) {
+		newConnection = false;
+		if (!isReadable){
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveView handle not readable\n");
+			return 0;
+		}
+		if (!realHandle) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::receiveView EBADF\n");
+			errno = EBADF; // the handle is not valid or closed
+			return -1;
+		}
+		if (realHandle->closed_rd) return 0;
+		return realHandle->receiveView(buff);
+    }
+
+    int release() {
+		if (!realHandle) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::release EBADF\n");
+			errno = EBADF; // the handle is not valid or closed
+			return -1;
+		}
+		return realHandle->release();
+    }
+
     ssize_t sendrecv(const void* sendbuff, size_t sendsize, void* recvbuff, size_t recvsize, size_t datasize = 1) {
 		realHandle->probed={false,0};
         return realHandle->sendrecv(sendbuff, sendsize, recvbuff, recvsize, datasize);
     }
 
+	// see CommunicationHandle::setCork
+	int setCork(bool enable) {
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::setCork EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+			return -1;
+        }
+		return realHandle->setCork(enable);
+	}
+
+	ssize_t flush() {
+        if (!realHandle || realHandle->closed_wr) {
+			MTCL_PRINT(100, "[MTCL]:", "HandleUser::flush EBADF\n");
+            errno = EBADF; // the handle is not valid or closed
+			return -1;
+        }
+		return realHandle->flush();
+	}
+
     void close(){
         if (realHandle) realHandle->close(true, false);
     }
 
+#ifdef MTCL_ENABLE_COROUTINES
+	/**
+	 * @brief Awaitable receive (see coScheduler), co_await returns the same 
+	 * values of receive. If no message is available, the coroutine is 
+	 * suspended and the handle is yielded until the IO thread reports it as
+	 * readable. Only one coroutine at a time can receive from a handle.
+	 */
+	receiveAwaiter async_receive(void* buff, size_t size);
+
+	/**
+	 * @brief Awaitable send (see coScheduler), co_await returns \b size on 
+	 * success, -1 on error. It is based on isend, the coroutine is suspended
+	 * until the send request completes.
+	 */
+	sendAwaiter async_send(const void* buff, size_t size);
+#endif
+
     int size() {
         return realHandle->getSize();
     }
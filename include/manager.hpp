@@ -5,8 +5,10 @@
 #include <cstdlib>
 #include <map>
 #include <set>
+#include <deque>
 #include <vector>
-#include <queue>
+#include <memory>
+#include <algorithm>
 #include <mutex>
 #include <thread>
 #include <chrono>
@@ -20,11 +22,21 @@
 #include "handleUser.hpp"
 #include "protocolInterface.hpp"
 #include "utils.hpp"
+#include "readyQueue.hpp"
+#include "reactor.hpp"
 
 #ifndef MTCL_DISABLE_TCP
 #include "protocols/tcp.hpp"
 #endif
 
+#ifdef MTCL_ENABLE_UDS
+#include "protocols/uds.hpp"
+#endif
+
+#ifdef MTCL_ENABLE_TCPX
+#include "protocols/tcpx.hpp"
+#endif
+
 #ifdef ENABLE_CONFIGFILE
 #include <fstream>
 #include <rapidjson/rapidjson.h>
@@ -55,12 +67,25 @@
 #include "protocols/shm.hpp"
 #endif
 
+#ifdef MTCL_ENABLE_TCPU
+#include "protocols/tcp_uring.hpp"
+#endif
+
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 
 
 namespace MTCL {
 
 int  mtcl_verbose = -1;
 
+#ifdef MTCL_ENABLE_COROUTINES
+class nextAwaiter;
+#endif
+
 /**
  * Main class for the library
 */
@@ -69,7 +94,17 @@ class Manager {
     friend class CollectiveContext;
    
     inline static std::map<std::string, std::shared_ptr<ConnType>> protocolsMap;    
-	inline static std::queue<HandleUser> handleReady;
+
+	// Each IO thread manages a shard of the Handles and has its own lock-free
+	// queue of ready Handles. Collective contexts are managed by the first 
+	// IO thread. Consumers spin for a while and then park on an event count,
+	// thus the IO threads never block on consumers.
+	struct readyShard {
+		readyQueue<HandleUser> queue;
+		eventCount             event;  // getNext(shard) waiters
+	};
+	inline static std::deque<readyShard> handleReady;
+	inline static eventCount anyReady;  // getNext() waiters
     inline static std::map<std::string, std::map<std::string,Handle*>> groupsReady;
 #ifndef MTCL_DISABLE_COLLECTIVES
     inline static std::map<CollectiveContext*, bool> contexts;
@@ -85,148 +120,416 @@ class Manager {
     inline static std::map<std::string, std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>> components;
 #endif
 
+    inline static int numIOThreads = IO_THREADS;
 #ifndef SINGLE_IO_THREAD
-    inline static std::thread t1;
+    inline static std::vector<std::thread> ioThreads;
 #endif
     inline static bool end;
     inline static bool initialized = false;
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	struct eventWait {
+		int  io_epfd  = -1;           // aggregates the event fds of the shard
+		int  doorbell = -1;           // eventfd used to wake up the IO thread
+		bool pollingRequired = true;  // at least one protocol must be polled
+	};
+	inline static std::vector<eventWait> ioEvents;  // one for each IO thread
+#endif
+
+	// The callbacks registered with onMessage and onConnection run on the
+	// reactor pool, it is started by the first registration.
+	inline static std::atomic<workStealingPool<HandleUser>*> reactor{nullptr};
+	inline static std::shared_ptr<connCallback> connHandler;
+	inline static int numReactorThreads = REACTOR_THREADS;
+	inline static std::mutex reactor_mutex;
 
-    inline static std::mutex mutex;
     inline static std::mutex group_mutex;
     inline static std::mutex ctx_mutex;
-    inline static std::condition_variable condv;
     inline static std::condition_variable group_cond;
 
+	// The attempts of a parallel connect (see connectEndpoints). Those still
+	// running when the caller returns are cancelled and joined later.
+	struct connectRace {
+		std::mutex              mtx;
+		std::condition_variable cv;
+		std::atomic<bool>       cancel{false};
+		Handle* winner   = nullptr;
+		size_t  released = 1;  // the attempts with a lower index may start
+		size_t  finished = 0;
+		int     error    = ECONNREFUSED;
+	};
+	inline static std::mutex connect_mutex;
+	inline static std::vector<std::pair<std::shared_ptr<connectRace>, std::vector<std::thread>>> connectRaces;
+	inline static std::vector<std::string> connectPreference;  // protocols, the preferred first
+
 private:
 
 	Manager() {}
 
-	// initial handshake for a connection, it could be a p2p connection or a connection
-	// part of a collective handle
+	// Initial handshake of an accepted connection: it could be a p2p connection
+	// or a connection part of a collective handle. Each step consumes one
+	// message: its header is probed without blocking and its payload read with
+	// ireceive. If the header or the payload is not yet available the Handle
+	// is parked (i.e., yielded to its protocol) and the handshake goes on the
+	// next time the protocol reports the Handle as readable, so that a slow
+	// peer never stalls the IO thread.
+	struct handshake_t {
+		enum step_t { FLAG, APPNAME, TEAMID } step = FLAG;
+		std::string appName;
+		std::string payload;   // payload of the current step
+		Request     req;       // receive of the payload, if posted
+		bool        posted = false;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	struct handshakeShard {
+		std::mutex mtx;
+		std::map<Handle*, handshake_t> pending;
+		std::atomic<size_t> npending{0};
+	};
+	inline static std::deque<handshakeShard> handshakes;  // one for each shard
+	inline static thread_local std::vector<Handle*> toPark;
+
+	// Advances the handshake of h without blocking. It returns 1 if h is a
+	// p2p connection, 2 if h is part of the collective teamID, 0 if more data
+	// is needed and -1 on error.
 #ifdef ISPROXY
-    static inline int connectionHandshake(char *& teamID, char *& appName, Handle *h) { return 0; }
+	static inline int handshakeStep(Handle*, handshake_t&, std::string&) { return 1; }
 #else
-	static inline int connectionHandshake(char *& teamID, char *& appName, Handle *h) {
-		// new connection, read handle type (p2p=0, collective=1)
-		int collective = 0;		
+	static inline int handshakeStep(Handle* h, handshake_t& hs, std::string& teamID) {
+		static const char* stepName[] = {"collective flag", "appName", "teamID"};
 		size_t size;
-		if (nb_probe_with_timeout(h, size, CCONNECTION_RETRY, CCONNECTION_TIMEOUT) <= 0) {
-			MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in probe, errno=%d (%s)\n", errno, strerror(errno));
-			teamID=nullptr;
-			appName=nullptr;
-			return -1;
-		}
-		
-		if (h->receive(&collective, sizeof(int)) <=0) {
-			MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in receiving collective flag, errno=%d (%s)\n", errno, strerror(errno));
-			teamID=nullptr;
-			appName=nullptr;
-			return -1;
-		}
-		// If collective, the handle sends further data with string teamID.
-		// The teamID uniquely associate a single context to all handles of the same collective
-		// This is useful to synchronize the root thread for the accepts.
-		if (collective) {
-			if (nb_probe_with_timeout(h, size, CCONNECTION_RETRY, CCONNECTION_TIMEOUT) <= 0) {
-				MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in probe, appName size, errno=%d (%s)\n", errno, strerror(errno));
-				teamID=nullptr;
-				appName=nullptr;
-				return -1;
-			}
-			appName = new char[size+1];
-			assert(appName);
-			if (h->receive(appName, size) <=0) {
-				MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in receive appName, errno=%d (%s)\n", errno, strerror(errno));
-				teamID=nullptr;
-				appName=nullptr;
-				return -1;			
+		while(true) {
+			if (hs.posted) {
+				if (!test(hs.req)) return 0;
+				hs.posted = false;
+				if (hs.req.wait() < 0) {
+					MTCL_ERROR("[MTCL]:", "Manager::handshakeStep error in receiving %s, errno=%d (%s)\n", stepName[hs.step], errno, strerror(errno));
+					return -1;
+				}
+				switch(hs.step) {
+				case handshake_t::FLAG: {
+					// handle type (p2p=0, collective=1)
+					int collective = 0;
+					memcpy(&collective, hs.payload.data(), hs.payload.size());
+					if (!collective) return 1;
+					// If collective, the handle sends further data with string teamID.
+					// The teamID uniquely associate a single context to all handles of the same collective
+					// This is useful to synchronize the root thread for the accepts.
+					hs.step = handshake_t::APPNAME;
+				} break;
+				case handshake_t::APPNAME: {
+					hs.appName = std::move(hs.payload);
+					hs.step = handshake_t::TEAMID;
+				} break;
+				case handshake_t::TEAMID: {
+					teamID = std::move(hs.payload);
+					MTCL_PRINT(100, "[MTCL]:", "Manager::handshakeStep received connection for team %s from appName=%s\n", teamID.c_str(), hs.appName.c_str());
+					return 2;
+				}
+				}
+				continue;
 			}
-			appName[size]='\0';
-			if (nb_probe_with_timeout(h, size, CCONNECTION_RETRY, CCONNECTION_TIMEOUT) <= 0) {
-				MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in probe, teamID size, errno=%d (%s)\n", errno, strerror(errno));
-				teamID=nullptr;
-				appName=nullptr;
+			const ssize_t r = h->probe(size, false);
+			if (r <= 0) {
+				if (r == 0) {
+					errno = ECONNRESET;
+					// e.g. the loser of a parallel connect, closed before the handshake
+					if (hs.step == handshake_t::FLAG) {
+						MTCL_PRINT(100, "[MTCL]:", "Manager::handshakeStep connection closed before the handshake\n");
+						return -1;
+					}
+				}
+				else if (errno == EWOULDBLOCK || errno == EAGAIN) return 0;
+				MTCL_ERROR("[MTCL]:", "Manager::handshakeStep error in probe (step %d), errno=%d (%s)\n", hs.step, errno, strerror(errno));
 				return -1;
 			}
 			// sanity check
-			if (size>1048576) {
-				MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in probe, teamID size TOO LARGE (size=%ld)\n", size);
-				teamID=nullptr;
-				delete [] appName;
-				appName=nullptr;
+			if (size > (hs.step == handshake_t::FLAG ? sizeof(int) : (size_t)1048576)) {
+				MTCL_ERROR("[MTCL]:", "Manager::handshakeStep error in probe, %s size TOO LARGE (size=%ld)\n", stepName[hs.step], size);
+				errno = EMSGSIZE;
 				return -1;
-			}			
-			teamID = new char[size+1];
-			assert(teamID);
-			if (h->receive(teamID, size) <=0) {
-				MTCL_ERROR("[MTCL]:", "Manager::connectionHandshake error in probe, receiving teamID, errno=%d (%s)\n", errno, strerror(errno));
-				delete [] teamID;
-				delete [] appName;
-				teamID=nullptr;
-				appName=nullptr;
+			}
+			hs.payload.assign(size, '\0');
+			if (h->ireceive(hs.payload.data(), size, hs.req) < 0) {
+				MTCL_ERROR("[MTCL]:", "Manager::handshakeStep error in receiving %s, errno=%d (%s)\n", stepName[hs.step], errno, strerror(errno));
 				return -1;
 			}
-			teamID[size] = '\0';			
-			MTCL_PRINT(100, "[MTCL]:", "Manager::connectionHandshake received connection for team %s from appName=%s\n", teamID, appName);
-		}	
-		return 0;
+			hs.posted = true;
+		}
 	}
 #endif
-	
-#if defined(SINGLE_IO_THREAD)
-	static inline void addinQ(bool b, Handle* h) {
-        if(b) { // we have to see if it is part of a collective
-			char *teamID=nullptr;
-			char *appName=nullptr;
-			if (connectionHandshake(teamID, appName, h)==-1) {
-				MTCL_PRINT(100, "[MTCL]:", "Manager::addinQ connectionHandshake failed errno=%d (%s) for team %s from appName=%s\n", errno, strerror(errno), teamID, appName);
-				h->close(true,true);
+
+	// Runs the handshake of the new connection h as far as the available data
+	// allows. It returns true if h has to be delivered to the user.
+	static bool acceptHandshake(Handle* h) {
+		auto& hsh = handshakes[h->getShard()];
+		handshake_t* hs;
+		{
+			std::unique_lock lk(hsh.mtx);
+			auto [it, fresh] = hsh.pending.try_emplace(h);
+			hs = &it->second;
+			if (fresh) {
+				hs->deadline = std::chrono::steady_clock::now() +
+					std::chrono::milliseconds(CCONNECTION_RETRY * CCONNECTION_TIMEOUT);
+				++hsh.npending;
+			}
+		}
+		std::string teamID;
+		const int r = handshakeStep(h, *hs, teamID);
+		if (r == 0) {
+			h->handshaking = true;
+			toPark.push_back(h);  // parked until more data arrive
+			return false;
+		}
+		std::string appName = std::move(hs->appName);
+		{
+			std::unique_lock lk(hsh.mtx);
+			hsh.pending.erase(h);
+			--hsh.npending;
+		}
+		h->handshaking = false;
+		if (r == -1) {
+			MTCL_PRINT(100, "[MTCL]:", "Manager::acceptHandshake failed errno=%d (%s)\n", errno, strerror(errno));
+			h->close(true,true);
+			return false;
+		}
+		if (r == 2) {
+#if !defined(SINGLE_IO_THREAD)
+			std::unique_lock lk(group_mutex);
+#endif
+			if(groupsReady.count(teamID) == 0)
+				groupsReady.emplace(teamID, std::map<std::string, Handle*>{});
+			groupsReady.at(teamID).insert({appName, h});
+#if !defined(SINGLE_IO_THREAD)
+			group_cond.notify_one();
+#endif
+			return false;
+		}
+		return true;
+	}
+
+	// Parks the Handles whose handshake is waiting for more data. It must be
+	// called after the protocols' updates, since a protocol may call addinQ
+	// while holding the lock used by its notify_yield.
+	static void parkHandshakes() {
+		if (toPark.empty()) return;
+		std::vector<Handle*> handles;
+		handles.swap(toPark);
+		for(auto h : handles) h->yield();
+	}
+
+	// Closes the connections of the shard whose handshake did not complete
+	// within CCONNECTION_RETRY*CCONNECTION_TIMEOUT milliseconds. It must be
+	// called by the thread running the updates of the shard.
+	static void expireHandshakes(int shard) {
+		auto& hsh = handshakes[shard];
+		if (hsh.npending.load(std::memory_order_relaxed) == 0) return;
+		const auto now = std::chrono::steady_clock::now();
+		std::vector<Handle*> expired;
+		{
+			std::unique_lock lk(hsh.mtx);
+			for(auto it = hsh.pending.begin(); it != hsh.pending.end(); ) {
+				if (it->first->handshaking && it->second.deadline <= now) {
+					expired.push_back(it->first);
+					it = hsh.pending.erase(it);
+					--hsh.npending;
+				} else ++it;
+			}
+		}
+		for(auto h : expired) {
+			MTCL_ERROR("[MTCL]:", "Manager::expireHandshakes handshake timeout, closing the connection\n");
+			h->handshaking = false;
+			h->close(true,true);
+		}
+	}
+
+	// b is true for a new connection, false for a readable Handle
+	static inline void addinQ(const bool b, Handle* h) {
+		if (b || h->handshaking) {
+			if (!acceptHandshake(h)) return;
+			if (auto r = reactor.load(std::memory_order_acquire); r && getConnHandler()) {
+				r->submit(HandleUser(h, true, true), reactorHint(h));
 				return;
 			}
+			pushReady(h->getShard(), HandleUser(h, true, true));
+			return;
+		}
+		// the handler is set by the owner of h before yielding it
+		if (auto r = reactor.load(std::memory_order_acquire); r && h->msgHandler) {
+			r->submit(HandleUser(h, true, false), reactorHint(h));
+			return;
+		}
+		pushReady(h->getShard(), HandleUser(h, true, b));
+	}
 
-			if (teamID) {
-                if(groupsReady.count(teamID) == 0)
-                    groupsReady.emplace(teamID, std::map<std::string, Handle*>{});
+	// the tasks of a Handle go to the same worker (unless stolen)
+	static inline size_t reactorHint(Handle* h) { return (uintptr_t)h >> 6; }
 
-				groupsReady.at(teamID).insert({appName, h});
-                delete [] teamID;
-				delete [] appName;
-                return;
-            }
-        }
-		
-		handleReady.push(HandleUser(h, true, b));
+	static inline std::shared_ptr<connCallback> getConnHandler() {
+		std::unique_lock lk(reactor_mutex);
+		return connHandler;
 	}
-#else
-    static inline void addinQ(const bool b, Handle* h) {
 
-        if(b) { // For each new connection... is the handle coming from a collective?
-			char *teamID  = nullptr;
-			char *appName = nullptr;
-			if (connectionHandshake(teamID, appName, h) == -1) {
-				h->close(true,true);
+	static void startReactor() {
+		std::unique_lock lk(reactor_mutex);
+		if (reactor.load(std::memory_order_relaxed)) return;
+		reactor.store(new workStealingPool<HandleUser>(numReactorThreads, reactorRun), std::memory_order_release);
+	}
+
+	// Runs on the reactor pool. For a new connection it invokes the
+	// connection callback, for a readable Handle it delivers to the message
+	// callback up to REACTOR_MAX_BURST messages without going back to the IO
+	// thread. When h is destroyed, the Handle is yielded (if still readable).
+	static void reactorRun(HandleUser& h) {
+		if (h.isNewConnection()) {
+			if (auto cb = getConnHandler()) (*cb)(h);
+			else pushReady(h.getShard(), std::move(h));  // callback removed in the meantime
+			return;
+		}
+		Handle* realHandle = static_cast<Handle*>(h.realHandle);
+		// keeps the callback alive even if the callback itself replaces it
+		std::shared_ptr<msgCallback> cb = realHandle->msgHandler;
+		if (!cb) {
+			pushReady(h.getShard(), std::move(h));
+			return;
+		}
+		static thread_local std::vector<char> buffer;
+		for(unsigned i=0; i<REACTOR_MAX_BURST && h.isReadable; ++i) {
+			size_t size;
+			const ssize_t r = h.probe(size, i == 0);
+			if (r <= 0) {
+				if (r == -1 && errno == EWOULDBLOCK) break;
+				if (r == -1) {
+					MTCL_ERROR("[MTCL]:", "Manager::reactorRun error in probe, errno=%d (%s)\n", errno, strerror(errno));
+					h.isReadable = false;
+					realHandle->close(true, true);
+				}
+				(*cb)(h, nullptr, 0);
 				return;
 			}
+			if (buffer.size() < size) buffer.resize(size);
+			if (h.receive(buffer.data(), size) != (ssize_t)size) {
+				MTCL_ERROR("[MTCL]:", "Manager::reactorRun error in receive, errno=%d (%s)\n", errno, strerror(errno));
+				h.isReadable = false;
+				realHandle->close(true, true);
+				(*cb)(h, nullptr, 0);
+				return;
+			}
+			(*cb)(h, buffer.data(), size);
+		}
+	}
+
+	static inline void pushReady(int shard, HandleUser&& h) {
+		auto& rs = handleReady[shard];
+		rs.queue.push(std::move(h));
+		rs.event.notify();  // getNext(shard) waiters
+		anyReady.notify();  // getNext() waiters
+	}
+
+	// Pops a ready Handle from any shard. Shards are inspected round-robin
+	// (starting from a per-thread position) so that a busy shard cannot 
+	// starve the others.
+	static inline bool popReady(HandleUser& h) {
+		const unsigned n = handleReady.size();
+		if (n == 1) return handleReady[0].queue.pop(h);
+		static thread_local unsigned next = 0;
+		for(unsigned i=0; i<n; ++i) {
+			const unsigned s = (next + i) % n;
+			if (handleReady[s].queue.pop(h)) {
+				next = s + 1;
+				return true;
+			}
+		}
+		return false;
+	}
 
-			if (teamID) {
-				std::unique_lock lk(group_mutex);
-                if(groupsReady.count(teamID) == 0)
-                    groupsReady.emplace(teamID, std::map<std::string, Handle*>{});
+	// Pops up to n ready Handles from the shards, visited round-robin as in
+	// popReady. It returns the number of Handles moved into out.
+	static inline size_t popReady(HandleUser* out, size_t n) {
+		const unsigned nshards = handleReady.size();
+		if (nshards == 1) return handleReady[0].queue.pop(out, n);
+		static thread_local unsigned next = 0;
+		size_t cnt = 0;
+		for(unsigned i=0; i<nshards && cnt<n; ++i) {
+			const unsigned s = (next + i) % nshards;
+			cnt += handleReady[s].queue.pop(out + cnt, n - cnt);
+		}
+		++next;
+		return cnt;
+	}
 
-                groupsReady.at(teamID).insert({appName, h});
-                group_cond.notify_one();
+	// Consumer side waiting: it spins for at most READY_QUEUE_SPIN 
+	// microseconds (if there is more than one core) and then parks on ev.
+	template<typename F>
+	static bool waitReady(eventCount& ev, std::chrono::microseconds us, F&& tryPop) {
+		if (tryPop()) return true;
+		using clock = std::chrono::steady_clock;
+		static const bool spin = std::thread::hardware_concurrency() > 1;
+		const auto start = clock::now();
+		if (spin) {
+			const auto spinEnd = start + std::min(us, std::chrono::microseconds(READY_QUEUE_SPIN));
+			while(clock::now() < spinEnd) {
+				mtcl_cpu_relax();
+				if (tryPop()) return true;
+			}
+		}
+		const auto deadline = start + us;
+		while(true) {
+			const uint32_t key = ev.prepareWait();
+			if (tryPop()) {
+				ev.cancelWait();
+				return true;
+			}
+			const auto now = clock::now();
+			if (now >= deadline) {
+				ev.cancelWait();
+				return false;
+			}
+			ev.wait(key, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now) + std::chrono::microseconds(1));
+		}
+	}
 
-                delete[] teamID;
-				delete[] appName;
-                return;
+#if defined(SINGLE_IO_THREAD)
+	// SINGLE_IO_THREAD version of waitReady: the caller thread runs the 
+	// protocols' updates until tryPop succeeds or the timeout expires.
+	template<typename F>
+	static bool pollReady(std::chrono::microseconds us, F&& tryPop) {
+		if (tryPop()) return true;
+		const auto deadline = std::chrono::steady_clock::now() + us;
+		do { 
+			for(auto& [prot, conn] : protocolsMap) {
+				conn->updateShard(0);
+			}
+			parkHandshakes();
+			expireHandshakes(0);
+			bool polling = false;
+#ifndef MTCL_DISABLE_COLLECTIVES
+            for(auto& [ctx, toManage] : contexts) {
+                if(toManage) {
+                    bool res = poll(ctx);
+                    if(res) {
+                        toManage = false;
+                        pushReady(0, HandleUser(ctx, true, false));
+                    } else polling = true;
+                }
             }
-        }
+#endif
 
-        std::unique_lock lk(mutex);
-        handleReady.push(HandleUser(h, true, b));
-		condv.notify_one();
-    }
+			if (tryPop()) return true;
+			const auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) break;
+			waitEvents(0, std::chrono::duration_cast<std::chrono::microseconds>(deadline - now), polling);
+		} while(true);
+		return false;
+	}
 #endif
+
+	// Gives back to the Manager the Handles still held by out[0..n-1] (as if
+	// they were destroyed), so that they can be overwritten.
+	static inline void releaseBatch(HandleUser* out, size_t n) {
+		for(size_t i=0; i<n; ++i) {
+			HandleUser old(std::move(out[i]));
+		}
+	}
 #ifndef MTCL_DISABLE_COLLECTIVES	
     static bool poll(CollectiveContext* realHandle) {
 		if (realHandle->probed.first) { // previously probed
@@ -236,31 +539,105 @@ private:
         return realHandle->peek();
     }
 #endif
-	// IO thread function
-    static void getReadyBackend() {
+	// Builds the set of event file descriptors the IO thread blocks on. If a
+	// protocol does not provide an event fd, the wait is bounded by
+	// IO_THREAD_POLL_TIMEOUT so that the protocol keeps being polled.
+	static void setupEventWait() {
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		ioEvents.assign(numIOThreads, eventWait{});
+		for(int shard=0; shard<numIOThreads; ++shard) {
+			auto& w = ioEvents[shard];
+			if ((w.io_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+				(w.doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+				MTCL_ERROR("[MTCL]:", "Manager::setupEventWait cannot create the event fds, errno=%d (%s), falling back to polling\n", errno, strerror(errno));
+				continue;
+			}
+			w.pollingRequired = false;
+			auto add = [&w](int fd) {
+				struct epoll_event ev{};
+				ev.events  = EPOLLIN;
+				ev.data.fd = fd;
+				return epoll_ctl(w.io_epfd, EPOLL_CTL_ADD, fd, &ev);
+			};
+			if (add(w.doorbell) == -1) w.pollingRequired = true;
+			for(auto& [prot, conn] : protocolsMap) {
+				if (shard >= conn->nshards) continue;
+				const int fd = conn->getEventFd(shard);
+				if (fd == -1 || add(fd) == -1) {
+					MTCL_PRINT(100, "[MTCL]:", "Manager::setupEventWait protocol %s is polled by the IO thread %d\n", prot.c_str(), shard);
+					w.pollingRequired = true;
+				}
+			}
+		}
+#endif
+	}
+
+	// Wakes up the IO thread managing shard if it is blocked in waitEvents
+	static inline void wakeIOThread(int shard=0) {
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (shard >= (int)ioEvents.size() || ioEvents[shard].doorbell == -1) return;
+		const uint64_t one = 1;
+		if (write(ioEvents[shard].doorbell, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			MTCL_PRINT(100, "[MTCL]:", "Manager::wakeIOThread write errno=%d\n", errno);
+#endif
+	}
+	
+	// Blocks until at least one protocol has events to manage in the given
+	// shard, or the timeout expires. If polling is true (or some protocol must
+	// be polled), the wait lasts at most IO_THREAD_POLL_TIMEOUT microseconds.
+	static void waitEvents(int shard, std::chrono::microseconds timeout, bool polling=false) {
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		auto& w = ioEvents[shard];
+		polling |= w.pollingRequired;
+		for(auto& [prot, conn] : protocolsMap) {
+			if (shard < conn->nshards && !conn->prepareWait(shard)) polling = true;
+		}
+		timeout = std::min(timeout, std::chrono::microseconds(polling ? IO_THREAD_POLL_TIMEOUT : IO_THREAD_IDLE_TIMEOUT));
+		if (timeout.count() <= 0) return;
+		if (w.io_epfd == -1) {
+			std::this_thread::sleep_for(timeout);
+			return;
+		}
+		
+		struct pollfd pfd = { .fd = w.io_epfd, .events = POLLIN, .revents = 0 };
+		struct timespec ts = { .tv_sec  = (time_t)(timeout.count() / 1000000),
+							   .tv_nsec = (long)(timeout.count() % 1000000) * 1000 };
+		if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+			uint64_t v;
+			if (read(w.doorbell, &v, sizeof(v)) == -1 && errno != EAGAIN)
+				MTCL_PRINT(100, "[MTCL]:", "Manager::waitEvents read errno=%d\n", errno);
+		}
+#else
+		if constexpr (IO_THREAD_POLL_TIMEOUT > 0)
+			std::this_thread::sleep_for(std::min(timeout, std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT)));
+#endif
+	}
+	
+	// IO thread function, it manages the Handles of the given shard
+    static void getReadyBackend(int shard) {
         while(!end){
             for(auto& [prot, conn] : protocolsMap) {
-                conn->update();
-            }			
-			if constexpr (IO_THREAD_POLL_TIMEOUT > 0)
-				std::this_thread::sleep_for(std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT));
-
+				if (shard < conn->nshards) conn->updateShard(shard);
+            }
+			parkHandshakes();
+			expireHandshakes(shard);
+			// collective contexts do not have an event fd, they are polled 
+			bool polling = false;
 #ifndef MTCL_DISABLE_COLLECTIVES
-            {
+            if (shard == 0) {
                 std::unique_lock lk(ctx_mutex);
                 for(auto& [ctx, toManage] : contexts) {
                     if(toManage) {
                         bool res = poll(ctx);
                         if(res) {
                             toManage = false;
-                            std::unique_lock readylk(mutex);
-                            handleReady.push(HandleUser(ctx, true, false));
-                            condv.notify_one();
-                        }
+                            pushReady(0, HandleUser(ctx, true, false));
+                        } else polling = true;
                     }
                 }
             }
 #endif
+			waitEvents(shard, std::chrono::microseconds(IO_THREAD_IDLE_TIMEOUT), polling);
         }
     }
 #ifdef ENABLE_CONFIGFILE
@@ -324,6 +701,31 @@ private:
         return true;
     }
 
+	// true if the host of a component ([pool:]hostname) is the one of this component
+	static bool sameHost(const std::string& host) {
+		const std::string name = getNameFromHost(host);
+		if (name == "localhost" || name == "127.0.0.1" || name == "::1") return true;
+		return name == getNameFromHost(std::get<0>(components[appName]));
+	}
+
+	// Resolves once, in parallel, the hosts of the TCP-based listen-endpoints
+	// (PROTOCOL:host:port) of the other components, the connects find their
+	// addresses in the cache (see resolveCache).
+	static void prefetchEndpoints() {
+		std::set<std::string> hosts;
+		for(auto& [name, c] : components) {
+			if (name == appName) continue;
+			for(auto& le : std::get<2>(c)) {
+				std::string proto, rest;
+				if (!splitProtoRest(le, proto, rest)) continue;
+				if (proto != "TCP" && proto != "TCPX" && proto != "TCPU" && proto != "UCX") continue;
+				const size_t pos = rest.find(':');
+				if (pos != std::string::npos) hosts.insert(rest.substr(0, pos));
+			}
+		}
+		resolveCache::prefetch(std::vector<std::string>(hosts.begin(), hosts.end()));
+	}
+
     static int parseConfig(std::string& f){
         std::ifstream ifs(f);
         if ( !ifs.is_open() ) {
@@ -385,12 +787,132 @@ private:
     }
 #endif
 
+	// connects to the endpoint PROTOCOL:address
+	static Handle* connectEndpoint(const std::string& le, int retry, unsigned timeout) {
+		const size_t pos = le.find(":");
+		auto it = protocolsMap.find(le.substr(0, pos));
+		if (pos == std::string::npos || it == protocolsMap.end()) {
+			errno = EPROTONOSUPPORT;
+			return nullptr;
+		}
+		return it->second->connect(le.substr(pos + 1), retry, timeout);
+	}
+
+	// Connects to the first reachable endpoint of the list (happy eyeballs).
+	// The attempts run in parallel, in the order of the list: each one starts
+	// CONNECT_ATTEMPT_DELAY milliseconds after the previous one, or as soon as
+	// an attempt fails. The first connection established wins, the attempts
+	// still running are cancelled and the connections established later are
+	// closed.
+	static Handle* connectEndpoints(const std::vector<std::string>& endpoints, int retry, unsigned timeout) {
+		if (endpoints.empty()) {
+			errno = ECONNREFUSED;
+			return nullptr;
+		}
+		if (endpoints.size() == 1) return connectEndpoint(endpoints[0], retry, timeout);
+
+		joinConnectRaces(false);
+		auto race = std::make_shared<connectRace>();
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for(size_t i=0; i<endpoints.size(); ++i)
+			threads.emplace_back([race, start, i, le=endpoints[i], retry, timeout]() {
+				{
+					std::unique_lock lk(race->mtx);
+					race->cv.wait_until(lk, start + i * std::chrono::milliseconds(CONNECT_ATTEMPT_DELAY),
+										[&]() { return i < race->released || race->cancel; });
+					if (race->cancel) {
+						++race->finished;
+						race->cv.notify_all();
+						return;
+					}
+					race->released = std::max(race->released, i + 1);
+				}
+				MTCL_PRINT(100, "[MTCL]:", "Manager::connect attempt %ld to %s\n", i, le.c_str());
+				mtcl_connect_cancel = &race->cancel;
+				Handle* h = connectEndpoint(le, retry, timeout);
+				const int error = errno;
+				mtcl_connect_cancel = nullptr;
+
+				std::unique_lock lk(race->mtx);
+				if (h && !race->cancel) {
+					race->winner = h;
+					race->cancel = true;
+				} else if (h) {
+					lk.unlock();
+					MTCL_PRINT(100, "[MTCL]:", "Manager::connect closing the connection to %s, another one won\n", le.c_str());
+					h->close(true, true);
+					lk.lock();
+				} else {
+					race->error = error;
+					++race->released;  // the next one starts at once
+				}
+				++race->finished;
+				race->cv.notify_all();
+			});
+
+		Handle* winner;
+		bool over;
+		{
+			std::unique_lock lk(race->mtx);
+			race->cv.wait(lk, [&]() { return race->winner || race->finished == threads.size(); });
+			winner = race->winner;
+			over = race->finished == threads.size();
+			race->cancel = true;
+			race->cv.notify_all();
+			if (!winner) errno = race->error;
+		}
+		if (over) {
+			for(auto& t : threads) t.join();
+		} else {
+			std::unique_lock lk(connect_mutex);
+			connectRaces.emplace_back(race, std::move(threads));
+		}
+		return winner;
+	}
+
+	// Joins the threads of the parallel connects that are over. If all is
+	// true, the attempts still running are cancelled and waited for.
+	static void joinConnectRaces(bool all) {
+		std::vector<std::thread> done;
+		{
+			std::unique_lock lk(connect_mutex);
+			for(auto it = connectRaces.begin(); it != connectRaces.end();) {
+				auto& [race, threads] = *it;
+				{
+					std::unique_lock rlk(race->mtx);
+					if (all) {
+						race->cancel = true;
+						race->cv.notify_all();
+					} else if (race->finished < threads.size()) {
+						++it;
+						continue;
+					}
+				}
+				for(auto& t : threads) done.push_back(std::move(t));
+				it = connectRaces.erase(it);
+			}
+		}
+		for(auto& t : done) t.join();
+	}
+
+	// sorts the endpoints by the preference of their protocols (see
+	// setConnectPreference), the other ones follow in the same order
+	static void sortByPreference(std::vector<std::string>& endpoints) {
+		auto rank = [](const std::string& le) {
+			return std::find(connectPreference.begin(), connectPreference.end(), le.substr(0, le.find(":"))) - connectPreference.begin();
+		};
+		std::stable_sort(endpoints.begin(), endpoints.end(),
+						 [&](const std::string& a, const std::string& b) { return rank(a) < rank(b); });
+	}
+
 #ifndef MTCL_DISABLE_COLLECTIVES
     static void releaseTeam(CollectiveContext* ctx) {
         std::unique_lock lk(ctx_mutex);
         auto it = contexts.find(ctx);
         if (it != contexts.end())
             it->second = true;
+		wakeIOThread();
     }
 #endif
 
@@ -424,6 +946,30 @@ public:
 				}
 		}
 		
+		if ((level=std::getenv("MTCL_IO_THREADS"))!= NULL) {
+			try {
+				setIOThreads(std::stoi(level));
+			} catch(...) {
+				MTCL_ERROR("[Manger]:", "invalid MTCL_IO_THREADS value, it should be a positive number\n");
+			}
+		}
+		if ((level=std::getenv("MTCL_RESOLVE_TTL"))!= NULL) {
+			try {
+				resolveCache::setTTL(std::stoul(level));
+			} catch(...) {
+				MTCL_ERROR("[Manger]:", "invalid MTCL_RESOLVE_TTL value, it should be a number of milliseconds\n");
+			}
+		}
+		if ((level=std::getenv("MTCL_CONNECT_PREFERENCE"))!= NULL)
+			setConnectPreference(level);
+		if ((level=std::getenv("MTCL_REACTOR_THREADS"))!= NULL) {
+			try {
+				setReactorThreads(std::stoi(level));
+			} catch(...) {
+				MTCL_ERROR("[Manger]:", "invalid MTCL_REACTOR_THREADS value, it should be a positive number\n");
+			}
+		}
+		
         Manager::appName = appName;
 
 #ifndef MTCL_DISABLE_TCP
@@ -431,6 +977,14 @@ public:
         registerType<ConnTcp>("TCP");
 #endif
 
+#ifdef MTCL_ENABLE_UDS
+        registerType<ConnUDS>("UDS");
+#endif
+
+#ifdef MTCL_ENABLE_TCPX
+        registerType<ConnTcpX>("TCPX");
+#endif
+
 #ifdef MTCL_ENABLE_SHM
 		registerType<ConnSHM>("SHM");
 #endif
@@ -451,6 +1005,10 @@ public:
         registerType<ConnUCX>("UCX");
 #endif
 
+#ifdef MTCL_ENABLE_TCPU
+        registerType<ConnTcpUring>("TCPU");
+#endif
+
 #ifdef ENABLE_CONFIGFILE
         if (!configFile1.empty()) if (parseConfig(configFile1)<0) return -1;
         if (!configFile2.empty()) if (parseConfig(configFile2)<0) return -1;
@@ -464,11 +1022,18 @@ public:
         // set the pool name if in the host definition
         poolName = getPoolFromHost(std::get<0>(components[appName]));
 
+        prefetchEndpoints();
+
 #else
      // 
 #endif
 		end = false;
+		handleReady.clear();
+		for(int i=0; i<numIOThreads; ++i) handleReady.emplace_back();
+		handshakes.clear();
+		for(int i=0; i<numIOThreads; ++i) handshakes.emplace_back();
         for (auto &el : protocolsMap) {
+			el.second->nshards = std::max(1, std::min(numIOThreads, el.second->maxShards()));
             if (el.second->init(appName) == -1) {
 				MTCL_PRINT(100, "[MTCL]:", "ERROR initializing protocol %s\n", el.first.c_str());
 			}
@@ -479,9 +1044,11 @@ public:
             Manager::listen(le);
         }
 #endif
-
+		setupEventWait();
+		
 #ifndef SINGLE_IO_THREAD
-        t1 = std::thread([&](){Manager::getReadyBackend();});
+		for(int i=0; i<numIOThreads; ++i)
+			ioThreads.emplace_back([i](){ Manager::getReadyBackend(i); });
 #endif
         initialized = true;
 		return 0;
@@ -499,10 +1066,21 @@ public:
     static void finalize(bool blockflag=false) {
 		end = true;
 #ifndef SINGLE_IO_THREAD
-		try {
-			t1.join();
-		} catch(...) {}
+		for(size_t i=0; i<ioThreads.size(); ++i) {
+			wakeIOThread(i);
+			try {
+				ioThreads[i].join();
+			} catch(...) {}
+		}
+		ioThreads.clear();
 #endif		
+		joinConnectRaces(true);
+		// no more tasks can be submitted, the workers run the pending ones
+		if (auto r = reactor.exchange(nullptr)) delete r;
+		{
+			std::unique_lock lk(reactor_mutex);
+			connHandler.reset();
+		}
 #ifndef MTCL_DISABLE_COLLECTIVES
         for(auto& [ctx, _] : contexts) {
             ctx->finalize(blockflag, ctx->getName());
@@ -514,67 +1092,267 @@ public:
         for (auto [_,v]: protocolsMap) {
             v->end(blockflag);
         }
+		// releases the Handles still in the ready queues, they must not be 
+		// yielded back to the protocols
+		for(auto& rs : handleReady) {
+			HandleUser h;
+			while(rs.queue.pop(h)) {
+				h.isReadable = h.newConnection = false;
+				HandleUser release(std::move(h));
+			}
+		}
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		for(auto& w : ioEvents) {
+			if (w.io_epfd != -1)  close(w.io_epfd);
+			if (w.doorbell != -1) close(w.doorbell);
+		}
+		ioEvents.clear();
+#endif
     }
 
+    /**
+     * \brief Set the number of IO threads. It must be called before init.
+     * 
+     * Each IO thread manages a shard of the Handles of the protocols supporting
+     * sharding (e.g., TCP, SHM, UCX), new Handles are assigned to shards in a
+     * round-robin fashion when they are accepted or connected. The other
+     * protocols are managed by the first IO thread. The MTCL_IO_THREADS
+     * environment variable, if set, overrides this value.
+     * In the SINGLE_IO_THREAD version there is always one shard.
+     * 
+     * @param n number of IO threads (at least 1)
+     * @return 0 on success, -1 on error (errno is set)
+     */
+    static int setIOThreads(int n) {
+		if (initialized) {
+			MTCL_ERROR("[MTCL]:", "The Manager has been already initialized. Impossible to change the number of IO threads.\n");
+			errno = EBUSY;
+			return -1;
+		}
+		if (n <= 0) {
+			errno = EINVAL;
+			return -1;
+		}
+#if defined(SINGLE_IO_THREAD)
+		if (n > 1) MTCL_PRINT(100, "[MTCL]:", "setIOThreads: SINGLE_IO_THREAD version, using one shard\n");
+		n = 1;
+#endif
+		numIOThreads = n;
+		return 0;
+	}
+
+    /**
+     * \brief Return the number of IO threads, i.e. the number of shards.
+     */
+    static int getIOThreads() { return numIOThreads; }
+
+    /**
+     * \brief Set the number of worker threads running the callbacks registered
+     * with onMessage and onConnection. It must be called before the first 
+     * registration. The MTCL_REACTOR_THREADS environment variable, if set, 
+     * overrides this value.
+     * 
+     * @param n number of worker threads (at least 1)
+     * @return 0 on success, -1 on error (errno is set)
+     */
+    static int setReactorThreads(int n) {
+		if (reactor.load()) {
+			MTCL_ERROR("[MTCL]:", "The reactor pool has been already started. Impossible to change the number of its threads.\n");
+			errno = EBUSY;
+			return -1;
+		}
+		if (n <= 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		numReactorThreads = n;
+		return 0;
+	}
+
+    /**
+     * \brief Set the order of preference of the protocols used to connect to
+     * a label of the configuration file without an explicit protocol.
+     * 
+     * The connection attempts to the listen-endpoints of the component start
+     * in this order, CONNECT_ATTEMPT_DELAY milliseconds apart, and run in
+     * parallel: the first connection established is returned. The endpoints
+     * with a protocol not in the list follow in the order of the 
+     * configuration file. It should be called before connect. The
+     * MTCL_CONNECT_PREFERENCE environment variable, if set, overrides this
+     * value.
+     * 
+     * @param protocols comma-separated protocol names, e.g. "SHM,UDS,TCP"
+     */
+    static void setConnectPreference(const std::string& protocols) {
+		connectPreference.clear();
+		std::stringstream ss(protocols);
+		std::string p;
+		while(std::getline(ss, p, ',')) {
+			p.erase(std::remove_if(p.begin(), p.end(), ::isspace), p.end());
+			if (!p.empty()) connectPreference.push_back(p);
+		}
+	}
+
+    /**
+     * \brief Register a callback invoked for each new connection, instead of
+     * returning the new connection with getNext.
+     * 
+     * The callback runs on the reactor pool (see setReactorThreads). It 
+     * typically sends a greeting and/or registers a message callback with 
+     * onMessage; the handle may also be moved out of the callback to be 
+     * kept by the application. If it is not moved, the handle is yielded
+     * when the callback returns. An empty callback restores getNext.
+     * It should be called before listen.
+     */
+    static void onConnection(connCallback cb) {
+		if (cb) startReactor();
+		std::unique_lock lk(reactor_mutex);
+		connHandler = cb ? std::make_shared<connCallback>(std::move(cb)) : nullptr;
+	}
+
+    /**
+     * \brief Register a callback invoked for each message received on \b h,
+     * instead of returning \b h with getNext when it is readable.
+     * 
+     * When \b h becomes readable, a worker of the reactor pool probes it,
+     * receives the message into a buffer owned by the worker and invokes 
+     * the callback; then it goes on with the next messages already arrived 
+     * (at most REACTOR_MAX_BURST) before giving \b h back to the IO thread,
+     * so a busy handle does not pay the yield round-trip for each message.
+     * The callbacks of the same handle are never run concurrently and are
+     * invoked in the order the messages are received. The buffer is valid 
+     * only during the callback. The callback is invoked once with size 0 
+     * when the connection is closed. Inside the callback, the handle can be
+     * used to send messages, it must not be yielded nor moved.
+     * 
+     * It must be called by the owner of \b h, i.e. before yielding it (e.g.,
+     * after connect or in the onConnection callback). An empty callback
+     * restores getNext. Collective handles are not supported. In the 
+     * SINGLE_IO_THREAD version, the IO is progressed by getNext.
+     * 
+     * @return 0 on success, -1 on error (errno is set)
+     */
+    static int onMessage(HandleUser& h, msgCallback cb) {
+		Handle* realHandle = dynamic_cast<Handle*>(h.realHandle);
+		if (!realHandle) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!cb) {
+			realHandle->msgHandler.reset();
+			return 0;
+		}
+		startReactor();
+		realHandle->msgHandler = std::make_shared<msgCallback>(std::move(cb));
+		return 0;
+	}
+
     /**
      * \brief Get an handle ready to receive.
      * 
      * The returned value is an Handle passed by value.
+	 * Handles are taken from the ready queues of all shards.
     */  
 #if defined(SINGLE_IO_THREAD)
     static inline HandleUser getNext(std::chrono::microseconds us=std::chrono::hours(87600)) {
-		if (!handleReady.empty()) {
-			auto el = std::move(handleReady.front());
-			handleReady.pop();
-			return el;
-		}
-		// if us is not multiple of the IO_THREAD_POLL_TIMEOUT we wait a bit less....
-		// if the poll timeout is 0, we just iterate us times
-		size_t niter = us.count(); // in case IO_THREAD_POLL_TIMEOUT is set to 0
-		if constexpr (!!IO_THREAD_POLL_TIMEOUT)
-			niter = us/std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT);
-		if (niter==0) niter++;
-		size_t i=0;
-		do { 
-			for(auto& [prot, conn] : protocolsMap) {
-				conn->update();
-			}
-#ifndef MTCL_DISABLE_COLLECTIVES
-            for(auto& [ctx, toManage] : contexts) {
-                if(toManage) {
-                    bool res = poll(ctx);
-                    if(res) {
-                        toManage = false;
-                        handleReady.push(HandleUser(ctx, true, false));
-                    }
-                }
-            }
-#endif
-
-			if (!handleReady.empty()) {
-				auto el = std::move(handleReady.front());
-				handleReady.pop();
-				return el;
-			}
-			if (i >= niter) break;
-			++i;
-			if constexpr (!!IO_THREAD_POLL_TIMEOUT)
-				std::this_thread::sleep_for(std::chrono::microseconds(IO_THREAD_POLL_TIMEOUT));	
-		} while(true);
+		auto& ready = handleReady[0].queue;
+		HandleUser el;
+		if (pollReady(us, [&]{ return ready.pop(el); })) return el;
 		return HandleUser(nullptr, true, true);
     }	
 #else	
     static inline HandleUser getNext(std::chrono::microseconds us=std::chrono::hours(87600)) { 
-        std::unique_lock lk(mutex);
-        if (condv.wait_for(lk, us, [&]{return !handleReady.empty();})) {
-			auto el = std::move(handleReady.front());
-			handleReady.pop();
-			lk.unlock();
-			return el;
+		HandleUser el;
+		if (waitReady(anyReady, us, [&]{ return popReady(el); })) return el;
+        return HandleUser(nullptr, true, true);
+    }
+#endif
+
+    /**
+     * \brief Get an handle ready to receive among the ones managed by the 
+     * IO thread \b shard.
+     * 
+     * It allows to have one consumer thread for each IO thread, see setIOThreads.
+     * If \b shard is not valid, an invalid handle is returned and errno is set
+     * to EINVAL.
+    */  
+    static inline HandleUser getNext(int shard, std::chrono::microseconds us=std::chrono::hours(87600)) {
+		if (shard < 0 || shard >= (int)handleReady.size()) {
+			errno = EINVAL;
+			return HandleUser(nullptr, true, true);
 		}
+#if defined(SINGLE_IO_THREAD)
+		return getNext(us);
+#else
+		auto& rs = handleReady[shard];
+		HandleUser el;
+		if (waitReady(rs.event, us, [&]{ return rs.queue.pop(el); })) return el;
         return HandleUser(nullptr, true, true);
+#endif
     }
+
+    /**
+     * \brief Get up to \b n handles ready to receive with a single call.
+     * 
+     * It waits (at most \b us) until at least one handle is ready, then it
+     * drains up to \b n ready handles without waiting any further, so that 
+     * under load the consumer pays one wake-up every \b n handles instead 
+     * of one for each handle. The handles are moved into out[0..ret-1], the 
+     * handles previously held by the elements of \b out are given back to 
+     * the Manager (as if they were destroyed). Each returned handle must be 
+     * yielded (or destroyed) as the ones returned by getNext.
+     * 
+     * @param out array of at least \b n elements
+     * @param n maximum number of handles to return
+     * @return the number of handles returned, 0 if the timeout expired
+    */
+    static inline size_t getNextBatch(HandleUser* out, size_t n, std::chrono::microseconds us=std::chrono::hours(87600)) {
+		if (n == 0) return 0;
+		releaseBatch(out, n);
+		size_t cnt = 0;
+#if defined(SINGLE_IO_THREAD)
+		pollReady(us, [&]{ return (cnt = handleReady[0].queue.pop(out, n)) > 0; });
+#else
+		waitReady(anyReady, us, [&]{ return (cnt = popReady(out, n)) > 0; });
+#endif
+		return cnt;
+    }
+
+    template<size_t N>
+    static inline size_t getNextBatch(HandleUser (&out)[N], std::chrono::microseconds us=std::chrono::hours(87600)) {
+		return getNextBatch(out, N, us);
+	}
+
+#ifdef MTCL_ENABLE_COROUTINES
+    /**
+     * \brief Awaitable version of getNext for the coroutines run by a
+     * coScheduler: co_await returns a new connection or a ready handle no
+     * coroutine of the scheduler is receiving from.
+    */
+    static nextAwaiter next();
 #endif
+
+    /**
+     * \brief As getNextBatch, but only the handles managed by the IO thread
+     * \b shard are returned. If \b shard is not valid, 0 is returned and 
+     * errno is set to EINVAL.
+    */
+    static inline size_t getNextBatch(int shard, HandleUser* out, size_t n, std::chrono::microseconds us=std::chrono::hours(87600)) {
+		if (shard < 0 || shard >= (int)handleReady.size()) {
+			errno = EINVAL;
+			return 0;
+		}
+#if defined(SINGLE_IO_THREAD)
+		return getNextBatch(out, n, us);
+#else
+		if (n == 0) return 0;
+		releaseBatch(out, n);
+		auto& rs = handleReady[shard];
+		size_t cnt = 0;
+		waitReady(rs.event, us, [&]{ return (cnt = rs.queue.pop(out, n)) > 0; });
+		return cnt;
+#endif
+    }
 	
     /**
      * \brief Create an instance of the protocol implementation.
@@ -702,23 +1480,23 @@ public:
 				}
 				return nullptr;
 			} else {
-				// direct connection
+				// direct connection, to the endpoints with the requested protocol or,
+				// without an explicit protocol, to all the endpoints whose protocol is
+				// registered, in order of preference (see setConnectPreference). By
+				// default the UDS endpoints come first if the component runs on our
+				// host, they are never used otherwise. The attempts run in parallel.
+				auto isUDS = [](const std::string& le) { return le.compare(0, 4, "UDS:") == 0; };
+				std::vector<std::string> endpoints;
 				for (auto& le : std::get<2>(component)){
-					if (protocol.empty()){
-						std::string sWoProtocol = le.substr(le.find(":") + 1, le.length());
-						std::string remote_protocol = le.substr(0, le.find(":"));
-						if (protocolsMap.count(remote_protocol)){
-							auto* h = protocolsMap[remote_protocol]->connect(sWoProtocol, retry, timeout);
-							if (h) return h;
-						}
-					}
-					else if (le.find(protocol) != std::string::npos){
-						auto* handle = protocolsMap[protocol]->connect(le.substr(le.find(":") + 1, le.length()), retry, timeout);
-						if (handle) return handle;
-					}
+					if (protocol.empty() ? (protocolsMap.count(le.substr(0, le.find(":"))) && (!isUDS(le) || sameHost(host)))
+						                 : le.compare(0, protocol.length() + 1, protocol + ":") == 0)
+						endpoints.push_back(le);
 				}
-                
-				return nullptr;
+				if (protocol.empty()) {
+					std::stable_partition(endpoints.begin(), endpoints.end(), isUDS);
+					sortByPreference(endpoints);
+				}
+				return connectEndpoints(endpoints, retry, timeout);
 			} 
 		}
         #endif
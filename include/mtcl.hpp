@@ -26,6 +26,16 @@ const bool UCX_ENABLED     = false;
 const bool UCC_ENABLED     = false;
 #endif
 
+// Unix domain sockets, they share the implementation of TCP
+#if !defined(DISABLE_TCP) && !defined(DISABLE_UDS) && defined(__linux__)
+#define MTCL_ENABLE_UDS
+#endif
+
+// Multi-stream TCP, large messages are striped across several sockets
+#if !defined(DISABLE_TCP) && !defined(DISABLE_TCPX)
+#define MTCL_ENABLE_TCPX
+#endif
+
 #ifdef ENABLE_SHM
 #define MTCL_ENABLE_SHM
 #endif
@@ -34,10 +44,23 @@ const bool UCC_ENABLED     = false;
 #define MTCL_ENABLE_MQTT
 #endif
 
+// TCP over io_uring, it requires Linux >= 6.0
+#if defined(ENABLE_TCPU) && defined(__linux__)
+#define MTCL_ENABLE_TCPU
+#endif
+
+// coroutine interface (coro.hpp), it requires C++20
+#if defined(__cpp_impl_coroutine) && !defined(DISABLE_COROUTINES)
+#define MTCL_ENABLE_COROUTINES
+#endif
+
 } // namespace
 
 
 #include "config.hpp"
 #include "utils.hpp"
 #include "manager.hpp"
+#ifdef MTCL_ENABLE_COROUTINES
+#include "coro.hpp"
+#endif
 
@@ -17,6 +17,10 @@ protected:
 
     std::function<void(bool, Handle*)> addinQ;
 
+	// number of shards (i.e., IO threads) the Handles of this protocol are 
+	// split into. It is set by the Manager before calling init.
+	int nshards = 1;
+
     static void setAsClosed(Handle* h, bool blockflag);
 
 public:
@@ -58,6 +62,43 @@ public:
      * 
      */
     virtual void update() = 0; 
+
+    /**
+     * @brief Maximum number of shards this protocol can split its Handle\a s
+     * into. Each shard is managed by a different IO thread. Protocols that do
+     * not support sharding are entirely managed by the first IO thread.
+     */
+    virtual int maxShards() { return 1; }
+
+    /**
+     * @brief Same as update() but restricted to the Handle\a s of shard
+     * \b shard. It is called by the IO thread owning the shard.
+     * 
+     * @param[in] shard index of the shard, in [0, nshards)
+     */
+    virtual void updateShard(int shard) { update(); }
+
+    /**
+     * @brief Return a file descriptor that becomes readable when update()
+     * has something to manage (new connections, data on managed Handle\a s, ...).
+     * It is used by the IO thread to block until some protocol has work to do.
+     * 
+     * @param[in] shard index of the shard managed by the calling IO thread
+     * @return the event file descriptor, or \c -1 if the protocol does not
+     * provide one and must be periodically polled
+     */
+    virtual int getEventFd(int shard=0) { return -1; }
+
+    /**
+     * @brief Called by the IO thread just before blocking on the event file
+     * descriptor returned by getEventFd.
+     * 
+     * @param[in] shard index of the shard managed by the calling IO thread
+     * @return \b false if the protocol has (or may have) events that will not
+     * be signaled on the event file descriptor, in this case the IO thread
+     * does not block for more than IO_THREAD_POLL_TIMEOUT
+     */
+    virtual bool prepareWait(int shard=0) { return true; }
     
 
     /**
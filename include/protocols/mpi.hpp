@@ -7,6 +7,7 @@
 #include <thread>
 #include <errno.h>
 #include <atomic>
+#include <limits>
 
 #include <mpi.h>
 
@@ -169,6 +170,44 @@ public:
     }
 
 
+    // the pieces are described by a hindexed datatype of absolute addresses
+    // (used with MPI_BOTTOM), thus they are transferred without copies
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+        if (iovcnt <= 0 || !iov) return Handle::sendv(iov, iovcnt);
+        MPI_Datatype type;
+        if (iovType(iov, iovcnt, type) < 0) return -1;
+        int rc = MPI_Send(MPI_BOTTOM, 1, type, this->rank, this->tag, MPI_COMM_WORLD);
+        MPI_Type_free(&type);
+        if (rc != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::sendv MPI_Send ERROR\n");
+            errno = ECOMM;
+            return -1;
+        }
+        return iovLength(iov, iovcnt);
+    }
+
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+        if (iovcnt <= 0 || !iov) return Handle::receivev(iov, iovcnt);
+        int r=0;
+        MPI_Status s;
+        MPI_Datatype type;
+        if (iovType(iov, iovcnt, type) < 0) return -1;
+		int rc = MPI_Recv(MPI_BOTTOM, 1, type, this->rank, this->tag, MPI_COMM_WORLD, &s);
+        MPI_Type_free(&type);
+		if (rc != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::receivev MPI_Recv ERROR\n");
+			if (s.MPI_ERROR == MPI_ERR_TRUNCATE) errno = EMSGSIZE;
+			else errno = ECOMM;
+			return -1;
+        }
+        // the bytes received (a partially filled datatype has no count)
+        MPI_Get_elements(&s, MPI_BYTE, &r);
+		if (r == 0) { // EOS
+			this->closed_rd = true;
+		}
+        return r;
+    }
+
     ssize_t receive(void* buff, size_t size){
         int r=0;
         MPI_Status s;
@@ -255,6 +294,32 @@ public:
     ssize_t sendEOS() {
 		return MPI_Send(nullptr, 0, MPI_BYTE, this->rank, this->tag, MPI_COMM_WORLD); 
 	}
+
+private:
+    int iovType(const struct iovec* iov, int iovcnt, MPI_Datatype& type) {
+        std::vector<int>      lens(iovcnt);
+        std::vector<MPI_Aint> displs(iovcnt);
+        for(int i=0; i<iovcnt; ++i) {
+            if (iov[i].iov_len > (size_t)std::numeric_limits<int>::max()) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            lens[i] = (int)iov[i].iov_len;
+            MPI_Get_address(iov[i].iov_base, &displs[i]);
+        }
+        if (MPI_Type_create_hindexed(iovcnt, lens.data(), displs.data(), MPI_BYTE, &type) != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::iovType MPI_Type_create_hindexed ERROR\n");
+            errno = ECOMM;
+            return -1;
+        }
+        if (MPI_Type_commit(&type) != MPI_SUCCESS) {
+            MTCL_MPI_PRINT(100, "HandleMPI::iovType MPI_Type_commit ERROR\n");
+            MPI_Type_free(&type);
+            errno = ECOMM;
+            return -1;
+        }
+        return 0;
+    }
 };
 
 
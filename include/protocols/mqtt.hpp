@@ -31,6 +31,10 @@
 #include "../config.hpp"
 #include "../utils.hpp"
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+#include <sys/eventfd.h>
+#endif
+
 namespace MTCL {
 
 namespace mqtt_detail {
@@ -629,7 +633,28 @@ private:
     std::string appName;
     size_t count = 0;
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	// eventfd signaled by the Paho callback threads upon message arrival
+	std::atomic<int> evfd{-1};
+	// last time update() found the eventfd signaled
+	std::chrono::steady_clock::time_point lastEvent{};
+#endif
+
+	// Rings the eventfd every time a message arrives on one of our clients.
+	void watchClient(mqtt::async_client* cli) {
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (evfd == -1) return;
+		cli->set_message_callback([this](mqtt::const_message_ptr) {
+			const uint64_t one = 1;
+			const int fd = evfd;
+			if (fd != -1 && write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+				MTCL_MQTT_PRINT(100, "ConnMQTT message callback, write errno=%d\n", errno);
+		});
+#endif
+	}
+
     bool createClient(mqtt::string topic, mqtt::async_client* aux_cli) {
+		watchClient(aux_cli);
         auto aux_connOpts = mqtt::connect_options_builder()
             .user_name(MQTT_USERNAME)
             .password(MQTT_PASSWORD)
@@ -675,7 +700,13 @@ public:
 		if ((addr=getenv("MQTT_SERVER_ADDRESS")) != NULL) {
 			server_address = std::string(addr);
 		}
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			MTCL_MQTT_PRINT(100, "ConnMQTT::init eventfd errno=%d, the clients will be polled\n", errno);
+		}
+#endif
         newConnClient = new mqtt::async_client(server_address, appName);
+		watchClient(newConnClient);
         auto connOpts = mqtt::connect_options_builder()
             .user_name(MQTT_USERNAME)
             .password(MQTT_PASSWORD)
@@ -725,9 +756,25 @@ public:
         return 0;
     }
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	int getEventFd(int shard=0) { return evfd; }
+
+	// Paho invokes the message callback right before pushing the message in
+	// the consumer queue, thus a wake-up may find the queue still empty.
+	// For this reason, after an event we keep polling for MQTT_POLL_TIMEOUT.
+	bool prepareWait(int shard=0) {
+		return (std::chrono::steady_clock::now() - lastEvent) > std::chrono::milliseconds(MQTT_POLL_TIMEOUT);
+	}
+#endif
+
     void update() {
         REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		uint64_t nevents;
+		if (evfd != -1 && read(evfd, &nevents, sizeof(nevents)) > 0)
+			lastEvent = std::chrono::steady_clock::now();
+#endif
         // Consume new-connection messages
         mqtt::const_message_ptr msg;
 		if (listening && newconn_consuming) {
@@ -840,6 +887,7 @@ public:
         connOpts.set_password(MQTT_PASSWORD);
 
 		mqtt::async_client* client = new mqtt::async_client(server_address, topic);
+		watchClient(client);
 		try {
             client->connect(connOpts)->wait();
             client->subscribe({topic_out}, {0})->wait();
@@ -979,6 +1027,10 @@ public:
                 setAsClosed(handle, blockflag);
 
         delete newConnClient;
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		const int fd = evfd.exchange(-1);
+		if (fd != -1) close(fd);
+#endif
     }
 
 };
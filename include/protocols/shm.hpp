@@ -3,6 +3,9 @@
 
 #include <cassert>
 #include <cstring>
+#include <deque>
+#include <limits>
+#include <shared_mutex>
 
 #include "../handle.hpp"
 #include "../protocolInterface.hpp"
@@ -14,20 +17,87 @@ class HandleSHM : public Handle {
 public:	
 	shmBuffer in;
 	shmBuffer out;
+	uint32_t bellId = 0;  // id rung by the peer on the doorbell of the shard
 
-    HandleSHM(ConnType* parent, shmBuffer& in, shmBuffer& out): Handle(parent), in(in), out(out) {}
+    HandleSHM(ConnType* parent, shmBuffer& in, shmBuffer& out, int shard=0): Handle(parent, shard), in(in), out(out) {}
+
+	// the buffer is held by a loaned message (see loan)
+	bool loanBusy() {
+		if (!out.loaned()) return false;
+		errno = EBUSY;
+		return true;
+	}
 
 	ssize_t sendEOS() {
+		out.abort();  // a message loaned and not committed is discarded
 		return out.put(nullptr, 0);
 	}
 	
     ssize_t send(const void* buff, size_t size) {
+		if (loanBusy()) return -1;
 		return out.put(buff,size);
     }
 
+	// the pieces are copied directly into the shared segment
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		if (loanBusy()) return -1;
+		return out.putv(iov, iovcnt);
+    }
+
 	ssize_t isend(const void* buff, size_t size, Request& r) {
+		if (loanBusy()) return -1;
+		return out.put(buff,size);
+	}
+
+	ssize_t isend(const void* buff, size_t size, RequestPool& r) {
+		if (loanBusy()) return -1;
 		return out.put(buff,size);
 	}
+
+	// the message is written directly into the ring of the peer, the larger
+	// ones use the copying implementation
+	void* loan(size_t size) {
+		if (out.loaned() || loanPending) {
+			errno = EBUSY;
+			return nullptr;
+		}
+		if (!size || size > shmBuffer::MAX_LOAN) return Handle::loan(size);
+		return out.loan(size);
+	}
+
+	ssize_t commit() {
+		if (out.loaned()) return out.commit();
+		return Handle::commit();
+	}
+
+	// the message is returned in place if it is contiguous in the ring
+	ssize_t receiveView(const void*& buff) {
+		if (in.viewing() || viewPending) {
+			errno = EBUSY;
+			return -1;
+		}
+		size_t size;
+		if (!probed.first) {
+			ssize_t r = probe(size, true);
+			if (r <= 0) return r;
+		} else size = probed.second;
+		if (size == 0) {
+			probed = {false, 0};
+			return 0;
+		}
+		const char* p;
+		ssize_t r = in.view(p);
+		if (r < 0) return -1;
+		if (!p) return Handle::receiveView(buff);
+		probed = {false, 0};
+		buff = p;
+		return r;
+	}
+
+	int release() {
+		if (in.viewing()) return in.release();
+		return Handle::release();
+	}
 	// receives the header containing the size (sizeof(size_t) bytes)
 	ssize_t probe(size_t& size, const bool blocking=true) {
 		if (probed.first){
@@ -76,6 +146,40 @@ public:
 		return in.get(buff, probedSize);
     }
 
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (iovcnt <= 0 || !iov) {
+			errno = EINVAL;
+			return -1;
+		}
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize, true);
+			if (r <= 0) return r;
+		} else {
+			probedSize = probed.second;
+		}
+		if (probedSize == 0) {
+			probed = {false, 0};
+			return 0;
+		}
+		if (probedSize > iovLength(iov, iovcnt)){
+			errno = EMSGSIZE;
+			return -1;
+		}
+		probed = {false, 0};
+		return in.getv(iov, iovcnt);
+    }
+
+	ssize_t ireceive(void* buff, size_t size, RequestPool& r) {
+        auto ret = receive(buff, size);
+		return (ret>=0 ? 0 : -1);
+    }
+
+	ssize_t ireceive(void* buff, size_t size, Request& r) {
+        auto ret = receive(buff, size);
+		return (ret>=0 ? 0 : -1);
+    }
+
     bool peek() {
 		ssize_t r = in.peek();
 		return (r > 0);
@@ -91,19 +195,166 @@ protected:
 	std::atomic<int> shmconnid{0};  // to generate unique name
 	
     shmBuffer connbuff;    
-    std::map<HandleSHM*, bool> connections;  // Active connections for this Connector
 
-#if defined(NO_MTCL_MULTITHREADED)
-    std::shared_mutex shm;
+	// The connections are split into shards, each one polled by a different
+	// IO thread. New connections are assigned to the shards round-robin.
+	// The connection buffer is managed by shard 0.
+	struct shard_t {
+		std::map<HandleSHM*, bool> connections;  // Active connections of this shard
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		// doorbell of the shard, a FIFO where the producers write the id of
+		// the armed buffers they publish data in (see shmBuffer::arm). The IO
+		// thread blocks on it and inspects only the buffers rung. If it cannot
+		// be created, the connections are scanned at each update.
+		int bell = -1;
+		std::string bellPath;
+		std::map<uint32_t, HandleSHM*> ids;
+#endif
+#if !defined(NO_MTCL_MULTITHREADED)
+		std::shared_mutex shm;
 #endif
+	};
+	std::deque<shard_t> shards;
+	std::atomic<unsigned> nextShard{0};
+	static constexpr uint32_t LISTENER_ID = 0;  // id of the connection buffer
+	size_t cmaThreshold = 0;  // see shmBuffer::setCmaThreshold
+	std::atomic<uint32_t> nextId{LISTENER_ID + 1};
+
+	// creates the Handle for a new connection and assigns it to a shard
+	HandleSHM* addConnection(shmBuffer& in, shmBuffer& out) {
+		const int s = nextShard++ % shards.size();
+		auto handle = new HandleSHM(this, in, out, s);
+		handle->out.setCmaThreshold(cmaThreshold);
+		auto& sh = shards[s];
+		REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+		sh.connections.insert({handle, false});
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (sh.bell != -1) {
+			handle->bellId = nextId++;
+			handle->in.setDoorbell(sh.bellPath, handle->bellId);
+			sh.ids.insert({handle->bellId, handle});
+		}
+#endif
+		return handle;
+	}
+
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	void openDoorbell(shard_t& sh, int shard) {
+		const std::string path = std::string(SHM_DOORBELL_DIR) + "/" + SHM_DOORBELL_PREFIX +
+			std::to_string(getpid()) + "_" + std::to_string(shard);
+		::unlink(path.c_str());
+		if (mkfifo(path.c_str(), S_IRUSR|S_IWUSR) == -1 ||
+			(sh.bell = ::open(path.c_str(), O_RDWR|O_NONBLOCK|O_CLOEXEC)) == -1) {
+			MTCL_SHM_PRINT(100, "ConnSHM::init, cannot create the doorbell %s, errno=%d (%s), the connections are polled\n", path.c_str(), errno, strerror(errno));
+			::unlink(path.c_str());
+			return;
+		}
+		sh.bellPath = path;
+	}
+	void ringSelf(shard_t& sh, uint32_t id) {
+		if (::write(sh.bell, &id, sizeof(id)) == -1)
+			MTCL_SHM_PRINT(100, "ConnSHM::ringSelf, write errno=%d\n", errno);
+	}
+
+	// inspects only the buffers rung since the last call
+	void updateDoorbell(shard_t& sh) {
+		uint32_t ids[256];
+		ssize_t n;
+		bool accept = false;
+		while((n = ::read(sh.bell, ids, sizeof(ids))) > 0) {
+			REMOVE_CODE_IF(std::unique_lock ulock(sh.shm));
+			for(size_t i=0; i<n/sizeof(uint32_t); ++i) {
+				if (ids[i] == LISTENER_ID) {
+					accept = true;
+					continue;
+				}
+				auto it = sh.ids.find(ids[i]);
+				if (it == sh.ids.end()) continue;  // closed meanwhile
+				auto handle = it->second;
+				auto c = sh.connections.find(handle);
+				// owned by the user, or nothing to read yet (the buffer is re-armed)
+				if (c == sh.connections.end() || !c->second) continue;
+				if (!handle->in.peek() && !handle->in.arm()) continue;
+				c->second = false;
+				addinQ(false, handle);
+			}
+		}
+		if (accept && connbuff.isOpen()) {
+			while(acceptConnection());
+			if (connbuff.arm()) ringSelf(sh, LISTENER_ID);
+		}
+	}
+#endif
+
+	// accepts the next connection request, false if there is none
+	bool acceptConnection() {
+		ssize_t sz;
+		if ((sz=connbuff.trygetsize())==-1) {
+			if (errno!=EAGAIN)
+				MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
+			return false;
+		}
+		std::string msg(sz, '\0');
+		if (sz == 0) {  // consumes the spurious EOS
+			char dummy;
+			(void)connbuff.tryget(&dummy, 1);
+			return true;
+		}
+		if ((sz=connbuff.get(msg.data(), sz))==-1) {
+			MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
+			return false;
+		}
+		auto c = msg.find(":");
+		if (c == std::string::npos) {
+			MTCL_SHM_ERROR("ConnSHM::update ERROR invalid message\n");
+			return true;
+		}
+		std::string inname  = msg.substr(0, c);
+		std::string outname = msg.substr(c+1);
+		
+		shmBuffer in;
+		if (in.open(outname)==-1) {
+			MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", outname.c_str(), errno, strerror(errno));
+			return true;
+		}
+		shmBuffer out;
+		if (out.open(inname)==-1) {
+			MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", inname.c_str(), errno, strerror(errno));
+			in.close();
+			return true;
+		}
+		
+		addinQ(true, addConnection(in, out));
+		return true;
+	}
 
 public:
 
    ConnSHM(){};
    ~ConnSHM(){};
 
+	int maxShards() { return std::numeric_limits<int>::max(); }
+
     int init(std::string name) {
 		shmname = name;
+#if defined(MTCL_SHM_CMA)
+		cmaThreshold = SHM_CMA_THRESHOLD;
+		char *thr;
+		if ((thr=std::getenv("MTCL_SHM_CMA_THRESHOLD")) != NULL) {
+			try {
+				cmaThreshold = std::stoull(thr);
+			} catch(...) {
+				MTCL_SHM_ERROR("invalid MTCL_SHM_CMA_THRESHOLD value, it should be a number of bytes (0 to disable)\n");
+			}
+		}
+#endif
+		shards.clear();
+		for(int i=0; i<nshards; ++i) {
+			shards.emplace_back();
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+			openDoorbell(shards.back(), i);
+#endif
+		}
 		return 0;
 	}
 	
@@ -112,10 +363,10 @@ public:
 		//FIX: controllo che l'indirizzo parte con '/' e che non sia piu' lungo di NAME_MAX
 		// vale la pena prependere name all'address e mettere noi lo slash?
 
-		if (connbuff.create(address, false)==-1) {
+		if (connbuff.create(address, false, true)==-1) {
 			// If a previous run crashed, the name might still exist.
 			if (errno == EEXIST) {
-				if (connbuff.create(address, true) == 0) {
+				if (connbuff.create(address, true, true) == 0) {
 					MTCL_SHM_PRINT(1, "ConnSHM::listen, removed stale endpoint %s\n", address.c_str());
 				} else {
 					MTCL_SHM_PRINT(100, "ConnSHM::listen ERROR errno=%d (%s)\n", errno, strerror(errno));
@@ -126,63 +377,42 @@ public:
 				return -1;
 			}
 		}
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (shards[0].bell != -1) {
+			connbuff.setDoorbell(shards[0].bellPath, LISTENER_ID);
+			if (connbuff.arm()) ringSelf(shards[0], LISTENER_ID);
+		}
+#endif
         MTCL_SHM_PRINT(1, "listening to %s\n", address.c_str());
 
         return 0;
     }
 
-    void update() {
+    void update() { updateShard(0); }
 
-        REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));		
-		ssize_t sz=-1;
-		if (connbuff.isOpen()) { // we are listening for incoming connections
-			// check first for new connections
-			if (((sz=connbuff.trygetsize())==-1) && errno!=EAGAIN) {
-				MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
-				goto skip;
-			}
-			if (sz!=-1) { // new connection
-				char msg[SHM_SMALL_MSG_SIZE];
-				if ((sz=connbuff.get(msg, SHM_SMALL_MSG_SIZE))==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update ERROR errno=%d (%s)\n", errno,strerror(errno));
-					goto skip;
-				}
-				msg[sz]='\0';
-				auto c = std::string(msg).find(":");
-				if (c == std::string::npos) {
-					MTCL_SHM_ERROR("ConnSHM::update ERROR invalid message\n");
-					goto skip;
-				}
-				std::string inname  = std::string(msg).substr(0, c);
-				std::string outname = std::string(msg).substr(c+1);
-				
-				shmBuffer in;
-				if (in.open(outname)==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", outname.c_str(), errno, strerror(errno));
-					goto skip;
-				}
-				shmBuffer out;
-				if (out.open(inname)==-1) {
-					MTCL_SHM_ERROR("ConnSHM::update, opening %s errno=%d (%s)\n", inname.c_str(), errno, strerror(errno));
-					goto skip;
-				}
-				
-				auto handle = new HandleSHM(this, in, out);
-				REMOVE_CODE_IF(ulock.lock());
-				connections.insert({handle, false});
-				REMOVE_CODE_IF(ulock.unlock());                    
-				addinQ(true, handle);
-			}
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	// the doorbell becomes readable when a peer publishes data in an armed buffer
+	int getEventFd(int shard=0) { return shards[shard].bell; }
+#endif
+
+    void updateShard(int shard) {
+		auto& sh = shards[shard];
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (sh.bell != -1) {
+			updateDoorbell(sh);
+			return;
 		}
-	skip:
+#endif
+        REMOVE_CODE_IF(std::unique_lock ulock(sh.shm, std::defer_lock));		
+		// we are listening for incoming connections
+		if (shard == 0 && connbuff.isOpen()) acceptConnection();
 		REMOVE_CODE_IF(ulock.lock());		
-        for (auto &[handle, to_manage] : connections) {
+        for (auto &[handle, to_manage] : sh.connections) {
             if(to_manage) {
-				if (((sz=handle->in.peek())<0)) {
-					if (errno!=EWOULDBLOCK)
-						MTCL_SHM_ERROR("ConnSHM::update, peek errno=%d (%s)\n", errno, strerror(errno));
-					continue;
-				}
+				// nothing to read yet (peek returns 0 if the buffer is empty)
+				if (handle->in.peek() <= 0) continue;
+				// the handle is owned by the user until the next notify_yield
+				to_manage = false;
 				// NOTE: called with ulock lock hold. Double lock if there is the IO-thread!
 				addinQ(false, handle);
 			}
@@ -206,6 +436,8 @@ public:
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, cannot create input buffer, errno=%d\n", errno);
 			return nullptr;
 		}
+		// the peer writes into it, the listener created the connection buffer
+		in.setPeerPid(connshm.creator());
 		shmBuffer out;
 		// create a buffer for output messages
 		if (out.create(outname, false)<0) {
@@ -218,15 +450,11 @@ public:
 			MTCL_SHM_PRINT(100, "ConnSHM::connect, ERROR sending the connect message %s, errno=%d (%s)\n", msg.c_str(), errno, strerror(errno));
 			return nullptr;
 		}
+		connshm.close();
 		
 		MTCL_SHM_PRINT(100, "connected to %s, (in=%s, out=%s)\n", address.c_str(), inname.c_str(), outname.c_str());
 		
-        HandleSHM *handle = new HandleSHM(this, in, out);
-		{
-			REMOVE_CODE_IF(std::unique_lock lock(shm));
-			connections[handle] = false;
-		}
-        return handle;
+        return addConnection(in, out);
     }
 
     void notify_close(Handle* h, bool close_wr=true, bool close_rd=true) {
@@ -236,27 +464,51 @@ public:
 		}
 		if (close_rd) {
 			{
-				REMOVE_CODE_IF(std::unique_lock lock(shm));
-				connections.erase(handle);
+				auto& sh = shards[h->getShard()];
+				REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+				sh.connections.erase(handle);
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+				sh.ids.erase(handle->bellId);
+#endif
 			}
 			handle->in.close(true);			
 		}
     }
 
     void notify_yield(Handle* h) override {
-		REMOVE_CODE_IF(std::unique_lock l(shm));
+		auto& sh = shards[h->getShard()];
 		auto handle = reinterpret_cast<HandleSHM*>(h);
-		auto it = connections.find(handle);
-		if (it != connections.end())
-			connections[handle] = true;
+		bool ready = false;
+		{
+			REMOVE_CODE_IF(std::unique_lock l(sh.shm));
+			auto it = sh.connections.find(handle);
+			if (it == sh.connections.end()) return;
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+			// the buffer is armed, unless it already has data
+			ready = sh.bell != -1 && handle->in.arm();
+#endif
+			it->second = !ready;
+		}
+		// the Handle is ready (addinQ without the lock held)
+		if (ready) addinQ(false, h);
     }
 
     void end(bool blockflag=false) {
-        auto modified_connections = connections;
-        for(auto& [handle, _] : modified_connections) {
-			setAsClosed(handle, blockflag);
+		for(auto& sh : shards) {
+			auto modified_connections = sh.connections;
+			for(auto& [handle, _] : modified_connections) {
+				setAsClosed(handle, blockflag);
+			}
 		}
 		connbuff.close(true);
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		for(auto& sh : shards) {
+			if (sh.bell == -1) continue;
+			::close(sh.bell);
+			::unlink(sh.bellPath.c_str());
+			sh.bell = -1;
+		}
+#endif
     }
 
 };
@@ -3,106 +3,569 @@
 
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <cmath>
+#include <cstdint>
 #include <atomic>
 #include <mutex>
-#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <climits>
+#include <cstring>
 
 #include <pthread.h>
 
+// Single-copy transfer of the large messages (Linux >= 3.2), see SHM_CMA_THRESHOLD
+#if defined(__linux__)
+#define MTCL_SHM_CMA
+#endif
+
 namespace MTCL {
 
 /*
- * shared-memory buffer, one single slot of SHM_SMAL_MSG_SIZE size
+ * shared-memory buffer, a lock-free single-producer single-consumer ring of
+ * SHM_SMALL_MSG_SIZE bytes (a power of 2).
+ *
+ * Each message is a record: an 8-byte header with the size of the message
+ * followed by the payload, padded to a multiple of 8 bytes (a record of
+ * size 0 is the EOS). head and tail are the bytes ever consumed and
+ * produced, each one written only by its side and kept in its own cache
+ * line. The producer runs ahead of the consumer by up to the capacity of the
+ * ring; a message larger than the free space is streamed, the producer
+ * publishes the part written and waits for the consumer to free some space.
+ * The buffer used to accept the connections has several producers, they
+ * are serialized by a spinlock in the segment.
+ *
+ * A side that finds the ring empty (consumer) or full (producer) spins for
+ * SPIN_THRESHOLD microseconds (if there is more than one core) and then
+ * sleeps on a futex word of the segment, after having announced itself in
+ * the waiters counter. The other side issues the wake-up system call only
+ * if it sees a waiter, thus a busy connection never enters the kernel.
+ *
+ * A message can also be written and read in place (loan/commit and
+ * view/release): its record must be contiguous, thus the producer skips
+ * the end of the ring (a SKIP record) if the record would wrap around it.
+ * The messages written with put may wrap, the consumer reads them in place
+ * only if they do not.
+ *
+ * The IO thread of the consumer does not scan its buffers: it arms a buffer
+ * when it finds it empty (arm), and the producer that publishes new data
+ * in an armed buffer disarms it and writes the id of the buffer into the
+ * doorbell of the consumer (a FIFO whose path is stored in the segment),
+ * see ConnSHM.
+ *
+ * The messages of at least SHM_CMA_THRESHOLD bytes are not copied through
+ * the ring: the producer publishes a rendezvous record, with its pid and
+ * the addresses of the message, and waits. The consumer reads the message
+ * from the memory of the producer directly into the user buffer
+ * (process_vm_readv) and signals the completion in the segment. If the
+ * read is not permitted the producer sends the message through the ring,
+ * as all the next ones. With the default threshold (the capacity of the
+ * ring) these messages never fit in the ring; with a lower one, a message
+ * that fits in the free space is copied, so that the producer does not
+ * wait for the consumer.
  */
 
 class shmBuffer {
 protected:
-	struct buffer_element_t {
-		size_t  size;
-		char    data[SHM_SMALL_MSG_SIZE];
+	static constexpr size_t   HDR_SZ   = sizeof(uint64_t);
+	static constexpr size_t   CAPACITY = SHM_SMALL_MSG_SIZE;
+	static constexpr uint64_t MASK     = CAPACITY - 1;
+	static constexpr uint64_t SKIP     = ~(uint64_t)0;  // header of the record filling the end of the ring
+	static constexpr uint64_t CMA      = (uint64_t)1 << 62; // flag of the header of a rendezvous record
+
+	// body of a rendezvous record, the message is in the memory of pid
+	struct cmaDesc {
+		int32_t  pid;
+		uint32_t ticket;  // the consumer stores ticket+1 in cmaDone
+		uint32_t iovcnt;
+		uint32_t pad;
+		struct { uint64_t base, len; } iov[SHM_CMA_MAX_IOV];
 	};
+	static_assert(CAPACITY >= 64 && (CAPACITY & MASK) == 0, "SHM_SMALL_MSG_SIZE must be a power of 2");
+
 	struct shmSegment {
-		pthread_spinlock_t spinlock;
-		void* guard;
-		buffer_element_t data;
+		alignas(64) std::atomic<uint64_t> head;  // written by the consumer
+		alignas(64) std::atomic<uint64_t> tail;  // written by the producer(s)
+		// futex words and waiters of the blocked consumer (data) and producer
+		// (space), written only when a side goes to sleep or is woken up
+		alignas(64) std::atomic<uint32_t> dataEpoch;
+		std::atomic<uint32_t> dataWaiters;
+		std::atomic<uint32_t> spaceEpoch;
+		std::atomic<uint32_t> spaceWaiters;
+		// the consumer waits for data on its doorbell (see arm)
+		alignas(64) std::atomic<uint32_t> armed;
+		uint32_t bellId;
+		char     bell[SHM_DOORBELL_PATH_MAX];
+		// completion of the rendezvous: the producer waits for cmaDone
+		alignas(64) std::atomic<uint32_t> cmaDone;
+		std::atomic<uint32_t> doneEpoch;
+		std::atomic<uint32_t> doneWaiters;
+		int32_t  cmaStatus;    // errno of the read of the consumer, 0 on success
+		uint32_t cmaPosted;    // rendezvous published, written by the producer
+		int32_t  cmaDisabled;  // the consumer cannot read the memory of the producer
+		int32_t  creatorPid;   // process that created the segment
+		alignas(64) pthread_spinlock_t spinlock; // serializes multiple producers
+		int  multiProducer;
+		alignas(64) char data[CAPACITY];
 	} *shmp = nullptr;
 
-	
+	// local copies of the indexes, to touch the line of the other side only
+	// when the ring looks full (producer) or empty (consumer)
+	uint64_t ptail = 0, cachedHead = 0;
+	uint64_t chead = 0, cachedTail = 0;
+	// message loaned to the producer (its size and the end of its record)
+	// and message viewed by the consumer (the end of its record, 0 if none)
+	std::atomic<size_t> loanSize{0};
+	uint64_t loanEnd = 0;
+	uint64_t viewEnd = 0;
+	int bellFd = -1;  // doorbell of the consumer, opened by the producer when it rings it
+	size_t cmaThreshold = 0;  // min size of the messages sent by rendezvous, 0 = disabled
+	pid_t  peerPid = 0;       // producer of the rendezvous records, set at connect time
+
 	std::string segmentname{};
 	std::atomic<bool> opened{false};
 
     std::mutex mutex;
 
-	int createBuffer(const std::string& name, bool force=false) {
-		int flags = O_CREAT|O_RDWR|O_EXCL;
-		if (force) flags |= O_TRUNC;
-		int fd = shm_open(name.c_str(), flags, S_IRUSR|S_IWUSR);
-		if (fd == -1) return -1;
-		if (ftruncate(fd, sizeof(shmSegment)) == -1) return -1;
+	static size_t recordSize(size_t sz) { return HDR_SZ + ((sz + 7) & ~(size_t)7); }
+	// size of the record and of the message of a header
+	static size_t recordOf(uint64_t hdr) { return recordSize((hdr & CMA) ? sizeof(cmaDesc) : hdr); }
+	static size_t sizeOf(uint64_t hdr) { return hdr & ~CMA; }
+
+	int mapSegment(int fd) {
 		shmp = (shmSegment*)mmap(NULL, sizeof(shmSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 		::close(fd);
 		if (shmp == MAP_FAILED) {
 			shmp = nullptr;
 			return -1;
 		}
-		int rc;
-		if ((rc=posix_madvise(shmp, sizeof(shmSegment), POSIX_MADV_SEQUENTIAL))==-1) {
-			MTCL_SHM_PRINT(100, "shmBuffer::createBuffer, ERROR madvise errno=%d\n", rc);
+		return 0;
+	}
+
+	int createBuffer(const std::string& name, bool force, bool multiProducer) {
+		int flags = O_CREAT|O_RDWR|O_EXCL;
+		if (force) flags = O_CREAT|O_RDWR|O_TRUNC;
+		int fd = shm_open(name.c_str(), flags, S_IRUSR|S_IWUSR);
+		if (fd == -1) return -1;
+		if (ftruncate(fd, sizeof(shmSegment)) == -1) {
+			::close(fd);
+			return -1;
 		}
+		if (mapSegment(fd) == -1) return -1;
+		int rc;
 		if ((rc=pthread_spin_init(&shmp->spinlock, PTHREAD_PROCESS_SHARED)) != 0) {
 			MTCL_SHM_PRINT(100, "shmBuffer::createBuffer, ERROR pthread_spin_init errno=%d\n", rc);
 			return -1;
 		}
-		
-		shmp->guard = nullptr;		
+		shmp->head.store(0, std::memory_order_relaxed);
+		shmp->tail.store(0, std::memory_order_relaxed);
+		shmp->dataEpoch.store(0, std::memory_order_relaxed);
+		shmp->dataWaiters.store(0, std::memory_order_relaxed);
+		shmp->spaceEpoch.store(0, std::memory_order_relaxed);
+		shmp->spaceWaiters.store(0, std::memory_order_relaxed);
+		shmp->armed.store(0, std::memory_order_relaxed);
+		shmp->bell[0] = '\0';
+		shmp->cmaDone.store(0, std::memory_order_relaxed);
+		shmp->doneEpoch.store(0, std::memory_order_relaxed);
+		shmp->doneWaiters.store(0, std::memory_order_relaxed);
+		shmp->cmaStatus = shmp->cmaPosted = shmp->cmaDisabled = 0;
+		shmp->multiProducer = multiProducer;
+		shmp->creatorPid = getpid();
+		ptail = cachedHead = chead = cachedTail = 0;
 		segmentname=name;
 		opened=true;
 		return 0;
 	}
+
+	// Blocks until ready() is true: it spins for a while and then sleeps on
+	// epoch, announcing itself in waiters (see wakeUp).
+	template<typename F>
+	static void waitUntil(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters, F&& ready) {
+		using clock = std::chrono::steady_clock;
+		static const bool spin = std::thread::hardware_concurrency() > 1;
+		const auto spinEnd = clock::now() + std::chrono::microseconds(SPIN_THRESHOLD);
+		for(unsigned i=1; ; ++i) {
+			if (ready()) return;
+			if ((!spin || (i & 63) == 0) && clock::now() >= spinEnd) break;
+			// with one core the other side can make progress only if we yield
+			if (spin) mtcl_cpu_relax(); else std::this_thread::yield();
+		}
+		while(true) {
+			const uint32_t key = epoch.load(std::memory_order_acquire);
+			waiters.fetch_add(1, std::memory_order_seq_cst);
+			// pairs with the fence in wakeUp: either we see the new data or
+			// the other side sees us
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ready()) {
+				waiters.fetch_sub(1, std::memory_order_relaxed);
+				return;
+			}
+#if defined(__linux__)
+			const struct timespec ts = { .tv_sec  = (time_t)(SHM_WAIT_TIMEOUT / 1000000),
+										 .tv_nsec = (long)(SHM_WAIT_TIMEOUT % 1000000) * 1000 };
+			mtcl_futex_wait(&epoch, key, &ts, true);
+#else
+			(void)key;
+			std::this_thread::sleep_for(std::chrono::microseconds(WAIT_INTERNAL_TIMEOUT));
+#endif
+			waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+	// wakes up the other side if it sleeps in waitUntil, called after having
+	// published the new indexes
+	static void wakeUp(std::atomic<uint32_t>& epoch, std::atomic<uint32_t>& waiters) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) == 0) return;
+		epoch.fetch_add(1, std::memory_order_seq_cst);
+#if defined(__linux__)
+		mtcl_futex_wake(&epoch, INT_MAX, true);
+#endif
+	}
+	void publishTail(uint64_t t) {
+		shmp->tail.store(t, std::memory_order_release);
+		wakeUp(shmp->dataEpoch, shmp->dataWaiters);
+		// the fence in wakeUp pairs with the one in arm
+		if (shmp->armed.load(std::memory_order_relaxed) && shmp->armed.exchange(0)) ring();
+	}
+	// writes the id of the buffer into the doorbell of the consumer
+	void ring() {
+		if (bellFd == -1 && (bellFd = openDoorbell()) == -1) return;
+		const uint32_t id = shmp->bellId;
+		if (::write(bellFd, &id, sizeof(id)) == -1)
+			MTCL_SHM_PRINT(100, "shmBuffer::ring, write errno=%d\n", errno);
+	}
+	// opens the doorbell named in the segment. The path is written by the
+	// peer: only a FIFO named SHM_DOORBELL_DIR/SHM_DOORBELL_PREFIX* is opened
+	int openDoorbell() {
+		char path[SHM_DOORBELL_PATH_MAX];
+		memcpy(path, shmp->bell, sizeof(path));
+		path[sizeof(path) - 1] = '\0';
+		const size_t dirLen = strlen(SHM_DOORBELL_DIR), prefixLen = strlen(SHM_DOORBELL_PREFIX);
+		if (strncmp(path, SHM_DOORBELL_DIR, dirLen) != 0 || path[dirLen] != '/' ||
+			strncmp(path + dirLen + 1, SHM_DOORBELL_PREFIX, prefixLen) != 0 ||
+			strchr(path + dirLen + 1, '/') != nullptr) {
+			MTCL_SHM_PRINT(100, "shmBuffer::ring, invalid doorbell %s\n", path);
+			return -1;
+		}
+		const int fd = ::open(path, O_WRONLY|O_NONBLOCK|O_CLOEXEC|O_NOFOLLOW|O_NOCTTY);
+		if (fd == -1) {
+			MTCL_SHM_PRINT(100, "shmBuffer::ring, cannot open the doorbell %s, errno=%d\n", path, errno);
+			return -1;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+			MTCL_SHM_PRINT(100, "shmBuffer::ring, the doorbell %s is not a FIFO\n", path);
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	void publishHead(uint64_t h) {
+		shmp->head.store(h, std::memory_order_release);
+		wakeUp(shmp->spaceEpoch, shmp->spaceWaiters);
+	}
+
+	// free bytes of the ring, at least n: if needed it publishes the bytes
+	// written so far and waits for the consumer
+	size_t waitSpace(uint64_t t, size_t n) {
+		size_t avail = CAPACITY - (t - cachedHead);
+		if (avail >= n) return avail;
+		cachedHead = shmp->head.load(std::memory_order_acquire);
+		if ((avail = CAPACITY - (t - cachedHead)) >= n) return avail;
+		publishTail(t);
+		waitUntil(shmp->spaceEpoch, shmp->spaceWaiters, [&]() {
+			cachedHead = shmp->head.load(std::memory_order_acquire);
+			return (avail = CAPACITY - (t - cachedHead)) >= n;
+		});
+		return avail;
+	}
+	// bytes available to the consumer, at least n if blocking (possibly less
+	// otherwise): if needed it releases the bytes consumed so far and waits
+	// for the producer
+	size_t waitData(uint64_t h, bool blocking, size_t n=1) {
+		size_t avail = cachedTail - h;
+		if (avail >= n) return avail;
+		cachedTail = shmp->tail.load(std::memory_order_acquire);
+		if ((avail = cachedTail - h) >= n || !blocking) return avail;
+		if (shmp->head.load(std::memory_order_relaxed) != h) publishHead(h);
+		waitUntil(shmp->dataEpoch, shmp->dataWaiters, [&]() {
+			cachedTail = shmp->tail.load(std::memory_order_acquire);
+			return (avail = cachedTail - h) >= n;
+		});
+		return avail;
+	}
+	// moves h to the header of the next message skipping the SKIP records,
+	// false if there is none and blocking is false
+	bool nextRecord(uint64_t& h, bool blocking) {
+		while(waitData(h, blocking)) {
+			if (*(const uint64_t*)(shmp->data + (h & MASK)) != SKIP) return true;
+			chead = h += CAPACITY - (h & MASK);
+		}
+		return false;
+	}
+
+	// appends a record with header hdr and a body of len bytes to the ring,
+	// copy(dst, off, n) copies n bytes of the body from the offset off. The
+	// lock of the producer must be held.
+	template<typename F>
+	void append(uint64_t hdr, size_t len, F&& copy) {
+		uint64_t t = ptail;
+		waitSpace(t, HDR_SZ);
+		*(uint64_t*)(shmp->data + (t & MASK)) = hdr;
+		t += HDR_SZ;
+		const size_t body = recordSize(len) - HDR_SZ;
+		for(size_t off=0; off<body;) {
+			const size_t n = std::min(waitSpace(t, 1), body - off);
+			if (off < len) {  // the padding is not written
+				const size_t c = std::min(n, len - off);
+				const size_t p = t & MASK, first = std::min(c, CAPACITY - p);
+				copy(shmp->data + p, off, first);
+				if (first < c) copy(shmp->data, off + first, c - first);
+			}
+			t += n;
+			off += n;
+		}
+		ptail = t;
+	}
+
+	// true if the record of a message of sz bytes fits in the free space of
+	// the ring, i.e., it can be written without waiting for the consumer
+	bool fits(size_t sz) {
+		cachedHead = shmp->head.load(std::memory_order_acquire);
+		return CAPACITY - (ptail - cachedHead) >= recordSize(sz);
+	}
+
+	// writes a message of sz bytes, copy(dst, off, n) copies n bytes of the
+	// message from the offset off. If iov is not null (the iovcnt buffers of
+	// the message) and the message is large enough, it is sent by
+	// rendezvous, unless it fits in the free space of the ring (only
+	// possible with a threshold lower than the default one).
+	template<typename F>
+	ssize_t write(size_t sz, F&& copy, const struct iovec* iov=nullptr, int iovcnt=0) {
+		std::unique_lock lk(mutex);
+		const bool mp = shmp->multiProducer;
+		if (mp) {
+			pthread_spin_lock(&shmp->spinlock);
+			ptail = shmp->tail.load(std::memory_order_relaxed);
+			cachedHead = shmp->head.load(std::memory_order_acquire);
+		}
+#if defined(MTCL_SHM_CMA)
+		if (iov && cmaThreshold && sz >= cmaThreshold && !shmp->cmaDisabled && iovcnt <= (int)SHM_CMA_MAX_IOV && !fits(sz)) {
+			cmaDesc d{};
+			d.pid    = getpid();
+			d.ticket = shmp->cmaPosted++;
+			for(int i=0; i<iovcnt; ++i)
+				if (iov[i].iov_len) d.iov[d.iovcnt++] = {(uint64_t)iov[i].iov_base, iov[i].iov_len};
+			append(CMA | sz, sizeof(d), [&d](char* dst, size_t off, size_t n) { memcpy(dst, (const char*)&d + off, n); });
+			publishTail(ptail);
+			waitUntil(shmp->doneEpoch, shmp->doneWaiters, [&]() {
+				return shmp->cmaDone.load(std::memory_order_acquire) == d.ticket + 1;
+			});
+			if (shmp->cmaStatus == 0 || shmp->cmaStatus == EPROTO) {
+				if (mp) pthread_spin_unlock(&shmp->spinlock);
+				if (shmp->cmaStatus == 0) return sz;
+				errno = EPROTO;  // the consumer rejected the record
+				return -1;
+			}
+			// the consumer waits for the message through the ring
+			MTCL_SHM_PRINT(100, "shmBuffer::write, rendezvous failed (errno=%d), the large messages are copied\n", shmp->cmaStatus);
+			shmp->cmaDisabled = 1;
+		}
+#endif
+		append(sz, sz, copy);
+		publishTail(ptail);
+		if (mp) pthread_spin_unlock(&shmp->spinlock);
+		return sz;
+	}
+
+#if defined(MTCL_SHM_CMA)
+	// true if the descriptor copied from the segment (written by the peer)
+	// comes from the producer recorded at connect time and describes exactly
+	// a message of size bytes
+	bool validDesc(const cmaDesc& d, size_t size) const {
+		if (d.pid != peerPid || d.iovcnt == 0 || d.iovcnt > SHM_CMA_MAX_IOV) return false;
+		size_t total = 0;
+		for(uint32_t i=0; i<d.iovcnt; ++i) {
+			if (d.iov[i].len > size - total) return false;
+			total += d.iov[i].len;
+		}
+		return total == size;
+	}
+
+	// reads the message (of size bytes) of the rendezvous record at h into
+	// the buffers liov, that are large enough, and releases the producer. An
+	// invalid record is consumed and completed with EPROTO.
+	int readRemote(uint64_t h, size_t size, const struct iovec* liov, int liovcnt) {
+		cmaDesc d;
+		const size_t p = (h + HDR_SZ) & MASK, first = std::min(sizeof(d), CAPACITY - p);
+		memcpy(&d, shmp->data + p, first);
+		if (first < sizeof(d)) memcpy((char*)&d + first, shmp->data, sizeof(d) - first);
+		chead = h + recordOf(CMA);
+		publishHead(chead);
+
+		// if process_vm_readv returns less, the pieces already read are skipped
+		std::vector<struct iovec> l, r;
+		int status = 0;
+		if (!validDesc(d, size)) {
+			MTCL_SHM_PRINT(100, "shmBuffer::read, invalid rendezvous record (pid=%d, iovcnt=%u)\n", d.pid, d.iovcnt);
+			status = EPROTO;
+		}
+		for(size_t done=0; status == 0 && done<size;) {
+			l.clear(); r.clear();
+			for(size_t i=0, skip=done; i<(size_t)liovcnt && l.size()<IOV_MAX; ++i) {
+				if (skip >= liov[i].iov_len) { skip -= liov[i].iov_len; continue; }
+				l.push_back({(char*)liov[i].iov_base + skip, liov[i].iov_len - skip});
+				skip = 0;
+			}
+			for(size_t i=0, skip=done; i<d.iovcnt; ++i) {
+				if (skip >= d.iov[i].len) { skip -= d.iov[i].len; continue; }
+				r.push_back({(char*)d.iov[i].base + skip, (size_t)(d.iov[i].len - skip)});
+				skip = 0;
+			}
+			const ssize_t n = process_vm_readv(d.pid, l.data(), l.size(), r.data(), r.size(), 0);
+			if (n <= 0) {
+				status = n ? errno : EFAULT;
+				break;
+			}
+			done += n;
+		}
+		shmp->cmaStatus = status;
+		shmp->cmaDone.store(d.ticket + 1, std::memory_order_release);
+		wakeUp(shmp->doneEpoch, shmp->doneWaiters);
+		return status;
+	}
+#endif
+
+	// reads the next message into a buffer of capacity sz, copy(src, off, n)
+	// copies n bytes to the offset off of the message. A message sent by
+	// rendezvous is read directly into the liovcnt buffers liov. If blocking
+	// is false and the ring is empty it returns -1 with errno EAGAIN.
+	template<typename F>
+	ssize_t read(size_t sz, bool blocking, const struct iovec* liov, int liovcnt, F&& copy) {
+		std::unique_lock lk(mutex);
+		if (viewEnd) {
+			errno = EBUSY;
+			return -1;
+		}
+		uint64_t h = chead;
+		if (!nextRecord(h, blocking)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		const uint64_t hdr = *(const uint64_t*)(shmp->data + (h & MASK));
+		const size_t size = sizeOf(hdr);
+		if (size > sz) {  // the message is not consumed
+			errno = EMSGSIZE;
+			return -1;
+		}
+#if defined(MTCL_SHM_CMA)
+		if (hdr & CMA) {
+			waitData(h, true, recordOf(hdr));
+			const int status = readRemote(h, size, liov, liovcnt);
+			if (status == 0) return size;
+			if (status == EPROTO) {
+				errno = EPROTO;
+				return -1;
+			}
+			// the producer sends the message through the ring
+			h = chead;
+			nextRecord(h, true);
+		}
+#endif
+		h += HDR_SZ;
+		const size_t body = recordSize(size) - HDR_SZ;
+		for(size_t off=0; off<body;) {
+			const size_t n = std::min(waitData(h, true), body - off);
+			if (off < size) {
+				const size_t c = std::min(n, size - off);
+				const size_t p = h & MASK, first = std::min(c, CAPACITY - p);
+				copy(shmp->data + p, off, first);
+				if (first < c) copy(shmp->data, off + first, c - first);
+			}
+			h += n;
+			off += n;
+		}
+		chead = h;
+		publishHead(h);
+		return size;
+	}
+
+	// size of the next message, -1 with errno EAGAIN if there is none and
+	// blocking is false
+	ssize_t nextSize(bool blocking) {
+		std::unique_lock lk(mutex);
+		if (viewEnd) {
+			errno = EBUSY;
+			return -1;
+		}
+		uint64_t h = chead;
+		if (!nextRecord(h, blocking)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		return sizeOf(*(const uint64_t*)(shmp->data + (h & MASK)));
+	}
+
+	// copies the pieces of the message from/to the iovec, in order
+	struct iovCursor {
+		const struct iovec* iov;
+		int    i   = 0;
+		size_t off = 0;
+		iovCursor(const struct iovec* iov) : iov(iov) {}
+		template<typename F>
+		void step(size_t n, F&& f) {
+			for(size_t p=0, c; p<n; p+=c, off+=c) {
+				while (off == iov[i].iov_len) { ++i; off=0; }
+				c = std::min(n - p, iov[i].iov_len - off);
+				f((char*)iov[i].iov_base + off, p, c);
+			}
+		}
+	};
+
 public:
+	// largest message that can be loaned (its record fills the ring)
+	static constexpr size_t MAX_LOAN = CAPACITY - HDR_SZ;
 
 	shmBuffer() {}
-	shmBuffer(const shmBuffer& o):shmp(o.shmp),segmentname(o.segmentname),opened(o.opened.load()) {}
-	
+	shmBuffer(const shmBuffer& o):shmp(o.shmp),ptail(o.ptail),cachedHead(o.cachedHead),
+								  chead(o.chead),cachedTail(o.cachedTail),
+								  peerPid(o.peerPid),segmentname(o.segmentname),opened(o.opened.load()) {}
+	~shmBuffer() { if (bellFd != -1) ::close(bellFd); }
+
 	const std::string& name() {return segmentname;}
-	
-	// creates a shared-memory buffer with a name
-	int create(const std::string name, bool force=false) {
-		if constexpr (SHM_SMALL_MSG_SIZE<sizeof(size_t)) {
-			errno = EINVAL;
-			return -1;
-		}
-		return createBuffer(name,force);
+
+	// the messages sent of at least threshold bytes are read by the consumer
+	// from the memory of this process (0 = never)
+	void setCmaThreshold(size_t threshold) { cmaThreshold = threshold; }
+	// the process that created the segment
+	pid_t creator() const { return shmp ? shmp->creatorPid : 0; }
+	// the only process whose rendezvous records are read from this buffer,
+	// by default the creator of the segment opened (see open)
+	void setPeerPid(pid_t pid) { peerPid = pid; }
+
+	// creates a shared-memory buffer with a name, multiProducer if several
+	// processes send on it
+	int create(const std::string name, bool force=false, bool multiProducer=false) {
+		return createBuffer(name,force,multiProducer);
 	}
 	const bool isOpen() { return opened;}
 	// opens an existing shared-memory buffer
 	int open(const std::string name) {
-		if constexpr (SHM_SMALL_MSG_SIZE<sizeof(size_t)) {
-			errno = EINVAL;
-			return -1;
-		}
 		if (opened) {
 			errno = EPERM;
 			return -1;
 		}
-		int fd = shm_open(name.c_str(), O_RDWR, 0); 
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
 		if (fd == -1)
 			return -1;
-		//struct stat sb;
-		//if (fstat(fd, &sb) == -1) return -1;
-		//assert(sb.st_size == sizeof(shmSegment));
-		shmp = (shmSegment*)mmap(NULL, sizeof(shmSegment), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-		if (shmp == MAP_FAILED) return -1;
-		::close(fd);
-		int rc;
-		if ((rc=posix_madvise(shmp, sizeof(shmSegment), POSIX_MADV_SEQUENTIAL))==-1) {
-			MTCL_SHM_PRINT(100, "shmBuffer::open, ERROR madvise errno=%d\n", rc);
-		}
+		if (mapSegment(fd) == -1) return -1;
+		ptail = shmp->tail.load(std::memory_order_acquire);
+		chead = cachedHead = cachedTail = shmp->head.load(std::memory_order_acquire);
+		peerPid = shmp->creatorPid;
 		segmentname=name;
-		opened = true;		
+		opened = true;
 		return 0;
 	}
 	// closes and destroys (unlink=true) a shared-memory buffer previously
@@ -115,172 +578,207 @@ public:
 		munmap(shmp,sizeof(shmSegment));
 		if (unlink) shm_unlink(segmentname.c_str());
 		shmp=nullptr;
+		if (bellFd != -1) ::close(bellFd);
+		bellFd = -1;
 		opened = false;
 		return 0;
-	}	
+	}
 	// adds a message to the buffer
 	ssize_t put(const void* data, const size_t sz) {
-		if (!shmp || !data) {
+		if (!shmp || (!data && sz)) {
 			errno=EINVAL;
 			return -1;
 		}
-
-		std::unique_lock lk(mutex);
-		if (sz==0) {
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard==0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				mtcl_cpu_relax();
-			} while(1);
-			shmp->data.size=sz;
-			shmp->guard=(void*)data;
-			pthread_spin_unlock(&shmp->spinlock);
-			return 0;
-		}
-		posix_madvise((void*)data, sz, POSIX_MADV_SEQUENTIAL);
-		for (size_t size = sz, s=0, p=0; size>0; size-=s, p+=s) {
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard==0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				mtcl_cpu_relax();
-			} while(1);
-			shmp->data.size=sz;
-			s = std::min(size, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy(shmp->data.data, (char*)data + p, s);
-			shmp->guard = (void*)data;
-			pthread_spin_unlock(&shmp->spinlock);
-		}
-		posix_madvise((void*)data, sz, POSIX_MADV_NORMAL);
-		return sz;
+		const struct iovec iov = {(void*)data, sz};
+		return write(sz, [data](char* dst, size_t off, size_t n) { memcpy(dst, (const char*)data + off, n); }, &iov, 1);
 	}
-	// retrieves a message from the buffer, it blocks if the buffer is empty	
+	// adds a message gathered from iovcnt buffers, the pieces are copied
+	// directly into the segment
+	ssize_t putv(const struct iovec* iov, int iovcnt) {
+		if (!shmp || iovcnt < 0 || (iovcnt && !iov)) {
+			errno=EINVAL;
+			return -1;
+		}
+		size_t sz = 0;
+		for(int i=0; i<iovcnt; ++i) sz += iov[i].iov_len;
+		iovCursor cur(iov);
+		return write(sz, [&cur](char* dst, size_t, size_t n) {
+			cur.step(n, [dst](char* src, size_t p, size_t c) { memcpy(dst + p, src, c); });
+		}, iov, iovcnt);
+	}
+	// retrieves a message scattering it into iovcnt buffers, the buffers must
+	// be large enough to contain the message. It blocks if the buffer is empty
+	ssize_t getv(const struct iovec* iov, int iovcnt) {
+		if (!shmp || !iov || iovcnt <= 0) {
+			errno=EINVAL;
+			return -1;
+		}
+		size_t sz = 0;
+		for(int i=0; i<iovcnt; ++i) sz += iov[i].iov_len;
+		iovCursor cur(iov);
+		return read(sz, true, iov, iovcnt, [&cur](const char* src, size_t, size_t n) {
+			cur.step(n, [src](char* dst, size_t p, size_t c) { memcpy(dst, src + p, c); });
+		});
+	}
+	// retrieves a message from the buffer, it blocks if the buffer is empty
 	ssize_t get(void* data, const size_t sz) {
 		if (!shmp || !data || !sz) {
 			errno=EINVAL;
 			return -1;
 		}
-		
-		std::unique_lock lk(mutex);
-
-		do {
-			pthread_spin_lock(&shmp->spinlock);
-			if (shmp->guard != nullptr) {
-				break;
-			}
-			pthread_spin_unlock(&shmp->spinlock);
-			mtcl_cpu_relax();
-		} while(true);				
-
-		size_t size = shmp->data.size;
-		if (size==0) {
-			shmp->guard=0;
-			pthread_spin_unlock(&shmp->spinlock);
-			return 0;
-		}
-		posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
-		int nmsgs = std::ceil((float)size / SHM_SMALL_MSG_SIZE);
-		for (size_t sz=size, s=0, p=0; nmsgs; sz-=s, p+=s) {
-			s = std::min(sz, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy((char*)data + p, shmp->data.data, s);
-			shmp->guard = 0;
-			pthread_spin_unlock(&shmp->spinlock);
-			if (--nmsgs == 0) break;
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard!=0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				mtcl_cpu_relax();
-			} while(true);
-		}
-		posix_madvise(data, sz, POSIX_MADV_NORMAL);
-		return size;
+		const struct iovec iov = {data, sz};
+		return read(sz, true, &iov, 1, [data](const char* src, size_t off, size_t n) { memcpy((char*)data + off, src, n); });
 	}
 	// retrieves the size of the message in the buffer without removing the message
-	// from the buffer, it blocks if the buffer is empty	
+	// from the buffer, it blocks if the buffer is empty
 	ssize_t getsize() {
 		if (!shmp) {
 			errno=EINVAL;
 			return -1;
 		}
-		//std::unique_lock lk(mutex);
-		do {
-			pthread_spin_lock(&shmp->spinlock);
-			if (shmp->guard != nullptr) {
-				break;
-			}
-			pthread_spin_unlock(&shmp->spinlock);
-			mtcl_cpu_relax();
-		} while(true);				
-		size_t size = shmp->data.size;
-		pthread_spin_unlock(&shmp->spinlock);
-		return size;
+		return nextSize(true);
 	}
-	// retrieves a message from the buffer, it doesn't block if the buffer is empty	
+	// retrieves a message from the buffer, it doesn't block if the buffer is empty
 	ssize_t tryget(void* data, const size_t sz) {
 		if (!shmp || !data || !sz) {
 			errno=EINVAL;
 			return -1;
 		}
-
-		std::unique_lock lk(mutex);
-
-		pthread_spin_lock(&shmp->spinlock);
-		if (shmp->guard == nullptr) {
-			pthread_spin_unlock(&shmp->spinlock);
-			errno = EAGAIN;
-			return -1;
-		}
-		size_t size = shmp->data.size;
-		if (size==0) {
-			shmp->guard=0;
-			pthread_spin_unlock(&shmp->spinlock);
-			return 0;
-		}
-		posix_madvise(data, sz, POSIX_MADV_SEQUENTIAL);
-		int nmsgs = std::ceil((float)size / SHM_SMALL_MSG_SIZE);
-		for (size_t sz=size, s=0, p=0; nmsgs; sz-=s, p+=s) {
-			s = std::min(sz, (size_t)SHM_SMALL_MSG_SIZE);
-			memcpy((char*)data + p, shmp->data.data, s);
-			shmp->guard = 0;
-			pthread_spin_unlock(&shmp->spinlock);
-			if (--nmsgs == 0) break;
-			do {
-				pthread_spin_lock(&shmp->spinlock);
-				if (shmp->guard!=0) break;
-				pthread_spin_unlock(&shmp->spinlock);
-				mtcl_cpu_relax();
-			} while(true);
-		}
-		posix_madvise(data, sz, POSIX_MADV_NORMAL);
-		return size;
+		const struct iovec iov = {data, sz};
+		return read(sz, false, &iov, 1, [data](const char* src, size_t off, size_t n) { memcpy((char*)data + off, src, n); });
 	}
 	// retrieves the size of the message in the buffer without removing the message
-	// from the buffer, it doesn't block if the buffer is empty	
+	// from the buffer, it doesn't block if the buffer is empty
 	ssize_t trygetsize() {
 		if (!shmp) {
 			errno=EINVAL;
 			return -1;
 		}
-		//std::unique_lock lk(mutex);
-		pthread_spin_lock(&shmp->spinlock);
-		if (shmp->guard == nullptr) {
-			pthread_spin_unlock(&shmp->spinlock);
-			errno = EAGAIN;
+		return nextSize(false);
+	}
+	// reserves a message of sz bytes (at most MAX_LOAN) in the ring and
+	// returns where to write it, it blocks until there is enough space. The
+	// message is published by commit, meanwhile the other threads sending on
+	// this buffer are blocked. It returns nullptr with errno EMSGSIZE if sz
+	// is too large.
+	char* loan(const size_t sz) {
+		if (!shmp || !sz) {
+			errno=EINVAL;
+			return nullptr;
+		}
+		if (sz > MAX_LOAN) {
+			errno=EMSGSIZE;
+			return nullptr;
+		}
+		mutex.lock();
+		if (shmp->multiProducer) {
+			pthread_spin_lock(&shmp->spinlock);
+			ptail = shmp->tail.load(std::memory_order_relaxed);
+			cachedHead = shmp->head.load(std::memory_order_acquire);
+		}
+		uint64_t t = ptail;
+		const size_t rec = recordSize(sz);
+		if ((t & MASK) + rec > CAPACITY) {  // the record would wrap
+			const size_t n = CAPACITY - (t & MASK);
+			waitSpace(t, n);
+			*(uint64_t*)(shmp->data + (t & MASK)) = SKIP;
+			ptail = t += n;
+		}
+		waitSpace(t, rec);
+		*(uint64_t*)(shmp->data + (t & MASK)) = sz;
+		loanEnd = t + rec;
+		loanSize = sz;
+		return shmp->data + (t & MASK) + HDR_SZ;
+	}
+	// size of the message loaned and not yet committed (0 if none)
+	size_t loaned() const { return loanSize; }
+	// publishes the message loaned, it must be called by the thread that
+	// called loan
+	ssize_t commit() {
+		const size_t sz = loanSize;
+		if (!sz) {
+			errno=EINVAL;
+			return -1;
+		}
+		ptail = loanEnd;
+		publishTail(ptail);
+		loanSize = 0;
+		if (shmp->multiProducer) pthread_spin_unlock(&shmp->spinlock);
+		mutex.unlock();
+		return sz;
+	}
+	// discards the message loaned
+	void abort() {
+		if (!loanSize) return;
+		loanSize = 0;
+		if (shmp->multiProducer) pthread_spin_unlock(&shmp->spinlock);
+		mutex.unlock();
+	}
+	// returns the size of the next message and in p where it is in the ring,
+	// it blocks if the buffer is empty. The message is consumed by release,
+	// until then the other reads fail with errno EBUSY. If the message is
+	// not contiguous in the ring (it wraps around the end or it is larger
+	// than the ring) or it is the EOS, p is nullptr and the message is not
+	// consumed: it must be read with get.
+	ssize_t view(const char*& p) {
+		if (!shmp) {
+			errno=EINVAL;
 			return -1;
 		}
-		size_t size = shmp->data.size;
-		pthread_spin_unlock(&shmp->spinlock);
+		std::unique_lock lk(mutex);
+		if (viewEnd) {
+			errno = EBUSY;
+			return -1;
+		}
+		uint64_t h = chead;
+		nextRecord(h, true);
+		const uint64_t hdr = *(const uint64_t*)(shmp->data + (h & MASK));
+		const size_t size = sizeOf(hdr), rec = recordSize(size);
+		p = nullptr;
+		if (!size || (hdr & CMA) || (h & MASK) + rec > CAPACITY) return size;
+		waitData(h, true, rec);
+		p = shmp->data + (h & MASK) + HDR_SZ;
+		viewEnd = h + rec;
 		return size;
 	}
+	// true if a message returned by view has not been released yet
+	bool viewing() const { return viewEnd != 0; }
+	// consumes the message returned by view
+	int release() {
+		std::unique_lock lk(mutex);
+		if (!viewEnd) {
+			errno=EINVAL;
+			return -1;
+		}
+		chead = viewEnd;
+		viewEnd = 0;
+		publishHead(chead);
+		return 0;
+	}
+	// sets the doorbell of the consumer, the FIFO bell where the producers
+	// write id
+	int setDoorbell(const std::string& bell, uint32_t id) {
+		if (!shmp || bell.size() >= SHM_DOORBELL_PATH_MAX) {
+			errno=EINVAL;
+			return -1;
+		}
+		shmp->bellId = id;
+		memcpy(shmp->bell, bell.c_str(), bell.size() + 1);
+		return 0;
+	}
+	// asks the producer to ring the doorbell when it publishes new data, it
+	// returns true (and the buffer is not armed) if the buffer is not empty
+	bool arm() {
+		shmp->armed.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!peek()) return false;
+		shmp->armed.store(0, std::memory_order_relaxed);
+		return true;
+	}
 	// it peeks at whether there are any messages in the buffer
 	// WARNING: The buffer may already be emptied by the time 'pick' returns.
 	ssize_t peek() {
-		pthread_spin_lock(&shmp->spinlock);
-		int val = ((shmp->guard)?1:0);
-		pthread_spin_unlock(&shmp->spinlock);
-		return val;
+		return shmp->tail.load(std::memory_order_acquire) != shmp->head.load(std::memory_order_relaxed);
 	}
 };
 
@@ -18,21 +18,241 @@
 #include <vector>
 #include <queue>
 #include <map>
+#include <set>
+#include <deque>
+#include <limits>
+#include <climits>
 #include <shared_mutex>
+#include <mutex>
+
+// On Linux the readiness of TCP connections is detected with epoll, the
+// select-based implementation (limited to FD_SETSIZE descriptors) can be
+// forced by compiling with -DMTCL_TCP_USE_SELECT
+#if defined(__linux__) && !defined(MTCL_TCP_USE_SELECT)
+#include <sys/epoll.h>
+#define MTCL_TCP_EPOLL
+#endif
+
+// Zero-copy sends of large messages (Linux >= 4.14), see TCP_ZEROCOPY_THRESHOLD
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define MTCL_TCP_ZEROCOPY
+#endif
+#endif
+
+// Kernel-assisted file transfers (sendFile/receiveToFile)
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#define MTCL_TCP_SENDFILE
+#endif
 
 #include "../handle.hpp"
 #include "../protocolInterface.hpp"
 
 namespace MTCL {
 
+// Creates a TCP socket listening on address:port. It returns the socket or -1.
+// With reuseport, several sockets can listen on the same address and the
+// kernel spreads the incoming connections among them (SO_REUSEPORT).
+static inline int tcpListenSocket(const std::string& address, int port, bool reuseport=false) {
+	int listen_sck;
+	if ((listen_sck=socket(AF_INET, SOCK_STREAM, 0)) < 0){
+		MTCL_TCP_PRINT(100, "tcpListenSocket socket errno=%d\n", errno);
+		return -1;
+	}
+
+	int enable = 1;
+	// enable the reuse of the address
+	if (setsockopt(listen_sck, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+		MTCL_TCP_PRINT(100, "tcpListenSocket setsockopt errno=%d\n", errno);
+		close(listen_sck);
+		return -1;
+	}
+#if defined(SO_REUSEPORT)
+	if (reuseport && setsockopt(listen_sck, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+		MTCL_TCP_PRINT(100, "tcpListenSocket setsockopt SO_REUSEPORT errno=%d\n", errno);
+		close(listen_sck);
+		return -1;
+	}
+#endif
+
+	const auto addrs = resolveCache::resolve(address, std::to_string(port), true);
+	if (addrs.empty()) {
+		MTCL_TCP_PRINT(100, "tcpListenSocket resolve errno=%d\n", errno);
+		close(listen_sck);
+		return -1;
+	}
+
+	bool ok = false;
+	for (auto& a : addrs) {
+		if (bind(listen_sck, (const struct sockaddr*)&a.addr, a.len) < 0){
+			MTCL_TCP_PRINT(100, "tcpListenSocket bind errno=%d, continue\n", errno);
+			continue;
+		}
+		ok = true;
+		break;
+	}
+	if (!ok) {
+		MTCL_TCP_PRINT(100, "tcpListenSocket bind loop exit with errno=%d\n", errno);
+		close(listen_sck);
+		return -1;
+	}
+	if (::listen(listen_sck, TCP_BACKLOG) < 0){
+		MTCL_TCP_PRINT(100, "tcpListenSocket listen errno=%d\n", errno);
+		close(listen_sck);
+		return -1;
+	}
+	return listen_sck;
+}
+
+// State of one isend/ireceive of HandleTCP, shared by the Request and by
+// the queue of the Handle.
+struct tcpAsyncOp {
+	std::atomic<bool> done{false};
+	int      err   = 0;
+	ssize_t  count = -1;
+	uint64_t hdr   = 0;        // big-endian header (sent or being received)
+	size_t   hoff  = 0;        // header bytes already transferred
+	size_t   off   = 0;        // payload bytes already transferred
+	size_t   size  = 0;        // send: payload size, receive: buffer capacity
+	const char* sbuf = nullptr;
+	char*       rbuf = nullptr;  // nullptr if the receive Request has been destroyed
+	size_t   msgsize = 0;      // receive: size read from the header
+	bool     oob = false;      // receive: the payload is not carried by the stream
+	std::vector<char> data;    // send: owned already framed messages (see setCork)
+	bool     zc = false;       // send: with MSG_ZEROCOPY
+	unsigned zcPending = 0;    // send: zero-copy sendmsg not notified yet
+};
+
+class HandleTCP;
+class HandleTCPX;
+class ConnTcp;
+
+class requestTCP : public request_internal {
+	HandleTCP* h;
+	std::shared_ptr<tcpAsyncOp> op;
+public:
+	requestTCP(HandleTCP* h, std::shared_ptr<tcpAsyncOp> op) : h(h), op(std::move(op)) {}
+
+	int test(int& result);
+	int wait();
+	int make_progress();
+	ssize_t count() const override { return op->done ? op->count : -1; }
+	~requestTCP();
+};
+
+class ConnRequestVectorTCP : public ConnRequestVector {
+	friend class HandleTCP;
+	friend class HandleTCPX;
+	std::vector<request_internal*> requests;
+public:
+	ConnRequestVectorTCP(size_t sizeHint = 1) {
+		requests.reserve(sizeHint);
+	}
+
+	bool testAll() {
+		int res = 0;
+		for(auto r : requests) {
+			r->test(res);
+			if (!res) return false;
+		}
+		return true;
+	}
+
+	void waitAll() {
+		for(auto r : requests) r->wait();
+	}
+
+	void reset() {
+		for(auto r : requests) delete r;
+		requests.clear();
+	}
+};
+
 class HandleTCP : public Handle {
+	friend class requestTCP;
+	friend class ConnTcp;
+
+	// Pending isend and ireceive, completed in order by progress() with
+	// non-blocking system calls. The blocking operations complete the
+	// pending ones before touching the stream.
+	std::deque<std::shared_ptr<tcpAsyncOp>> sendq, recvq;
+#if !defined(NO_MTCL_MULTITHREADED)
+	std::mutex amtx;
+#endif
+	// Aggregation mode (setCork): the small messages are framed into the cork
+	// buffer and sent all together by flush. The IO thread of the shard
+	// flushes the buffer when its first message is older than CORK_FLUSH_TIMEOUT.
+	ConnTcp* owner = nullptr;
+	bool corked = false;
+	// Messages of at least zcThreshold bytes (0 = disabled) are sent with
+	// MSG_ZEROCOPY: they complete when the kernel notifies, through the error
+	// queue of the socket, that the pages of the buffer have been released.
+	size_t   zcThreshold = 0;
+	uint32_t zcNext = 0;  // sequence number of the next zero-copy sendmsg
+	std::deque<std::pair<uint32_t, std::shared_ptr<tcpAsyncOp>>> zcSeqs;
+	std::vector<char> cork;
+	std::chrono::steady_clock::time_point corkSince;
 
-    ssize_t readn(int fd, char *ptr, size_t n) {  
+protected:
+	// all the reads from the socket, overridden by the Unix domain sockets
+	// (HandleUDS) to receive the descriptors passed with the data
+	virtual ssize_t sockRecv(void* buf, size_t n, int flags) { return recv(fd, buf, n, flags); }
+	virtual ssize_t sockReadv(struct iovec* v, int count) { return readv(fd, v, count); }
+
+	// Called by the asynchronous receive once the header has been read: it
+	// returns false if the payload follows the header, otherwise the payload
+	// is not carried by this stream (see HandleTCPX) and it is received by
+	// progressOutOfBand. As rxRead, progressOutOfBand returns the number of
+	// bytes read without blocking or -1 (EAGAIN if nothing is available), op
+	// is completed once the whole payload has been read. outOfBandFds sets
+	// the sockets the payload is waiting for, it returns their number.
+	virtual bool recvOutOfBand(tcpAsyncOp& op) { return false; }
+	virtual ssize_t progressOutOfBand(tcpAsyncOp& op) { errno = EINVAL; return -1; }
+	virtual int outOfBandFds(struct pollfd* pfd) { return 0; }
+
+	// Read-ahead buffer: each read from the socket takes as much data as
+	// available (up to TCP_RX_BUFFER_SIZE), then the headers and the small
+	// payloads are served from user space. Large payloads are read directly
+	// into the user buffer once the buffered part has been consumed.
+	std::unique_ptr<char[]> rxbuf;
+	size_t rxhead = 0, rxtail = 0;
+	int splicePipe[2] = {-1, -1};  // from the socket to the files (receiveToFile)
+
+	// appends the data available on the socket to the buffer
+	ssize_t rxFill(int flags) {
+		if (!rxbuf) rxbuf.reset(new char[TCP_RX_BUFFER_SIZE]);
+		if (rxhead > 0) {
+			memmove(rxbuf.get(), rxbuf.get() + rxhead, buffered());
+			rxtail -= rxhead;
+			rxhead  = 0;
+		}
+		const ssize_t r = sockRecv(rxbuf.get() + rxtail, TCP_RX_BUFFER_SIZE - rxtail, flags);
+		if (r > 0) rxtail += r;
+		return r;
+	}
+
+	// reads at most n bytes, from the buffer if it is not empty. It returns
+	// the number of bytes read, 0 at the end of the stream or -1.
+	ssize_t rxRead(char* dst, size_t n, int flags) {
+		if (buffered() == 0) {
+			if (n >= TCP_RX_BUFFER_SIZE/2) return sockRecv(dst, n, flags);
+			const ssize_t r = rxFill(flags);
+			if (r <= 0) return r;
+		}
+		const size_t c = std::min(n, buffered());
+		memcpy(dst, rxbuf.get() + rxhead, c);
+		rxhead += c;
+		return c;
+	}
+
+    ssize_t readn(char *ptr, size_t n) {  
         size_t   nleft = n;
         ssize_t  nread;
 
         while (nleft > 0) {
-            if((nread = read(fd, ptr, nleft)) < 0) {
+            if((nread = rxRead(ptr, nleft, 0)) < 0) {
                 if (nleft == n) return -1; /* error, return -1 */
                 else break; /* error, return amount read so far */
             } else if (nread == 0) break; /* EOF */
@@ -42,10 +262,10 @@ class HandleTCP : public Handle {
         return(n - nleft); /* return >= 0 */
     }
 
-	ssize_t readvn(int fd, struct iovec *v, int count){
+	ssize_t readvn(struct iovec *v, int count){
 		ssize_t rread;
 		for (int cur = 0;;) {
-			rread = readv(fd, v+cur, count-cur);
+			rread = sockReadv(v+cur, count-cur);
 			if (rread <= 0) return rread; // error or closed connection
 			while (cur < count && rread >= (ssize_t)v[cur].iov_len)
 				rread -= v[cur++].iov_len;
@@ -85,17 +305,365 @@ class HandleTCP : public Handle {
 		return -1;
 	}
 	
+	static void completeOp(tcpAsyncOp& op, ssize_t count, int err=0) {
+		op.count = count;
+		op.err   = err;
+		op.done  = true;
+	}
+
+	// the send is complete when all its bytes have been sent and (zero-copy)
+	// all its sendmsg notified
+	static void checkSent(tcpAsyncOp& op) {
+		if (op.hoff == HDR_SZ && op.off == op.size && op.zcPending == 0)
+			completeOp(op, op.size);
+	}
+
+	// Sends as many queued messages as possible with one sendmsg, a
+	// zero-copy message is sent alone.
+	// It returns -1 on error (all the queued sends fail), 0 otherwise.
+	int progressSend() {
+		while(!sendq.empty()) {
+			struct iovec iov[TCP_ASYNC_MAX_IOV];
+			int cnt = 0;
+			const bool zc = sendq.front()->zc;
+			for(size_t i=0; i<sendq.size() && cnt+2 <= (int)TCP_ASYNC_MAX_IOV; ++i) {
+				tcpAsyncOp& op = *sendq[i];
+				if (i > 0 && (zc || op.zc)) break;
+				if (op.hoff < HDR_SZ) {
+					iov[cnt].iov_base = (char*)&op.hdr + op.hoff;
+					iov[cnt++].iov_len = HDR_SZ - op.hoff;
+				}
+				if (op.off < op.size) {
+					iov[cnt].iov_base = const_cast<char*>(op.sbuf) + op.off;
+					iov[cnt++].iov_len = op.size - op.off;
+				}
+			}
+			struct msghdr msg{};
+			msg.msg_iov    = iov;
+			msg.msg_iovlen = cnt;
+			int flags = MSG_DONTWAIT;
+#if defined(MTCL_TCP_ZEROCOPY)
+			if (zc) flags |= MSG_ZEROCOPY;
+#endif
+			ssize_t n = sendmsg(fd, &msg, flags);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+				if (errno == EINTR) continue;
+				if (zc && errno == ENOBUFS) {  // no memory to pin the pages, copy
+					sendq.front()->zc = false;
+					continue;
+				}
+				const int err = errno;
+				for(auto& op : sendq) completeOp(*op, -1, err);
+				sendq.clear();
+				errno = err;
+				return -1;
+			}
+			if (zc && n > 0) {
+				zcSeqs.emplace_back(zcNext++, sendq.front());
+				++sendq.front()->zcPending;
+			}
+			while(!sendq.empty()) {
+				tcpAsyncOp& op = *sendq.front();
+				const size_t h = std::min((size_t)n, HDR_SZ - op.hoff);
+				op.hoff += h; n -= h;
+				const size_t p = std::min((size_t)n, op.size - op.off);
+				op.off  += p; n -= p;
+				if (op.hoff < HDR_SZ || op.off < op.size) break;
+				checkSent(op);
+				sendq.pop_front();
+			}
+		}
+		return 0;
+	}
+
+	// Reads the zero-copy notifications from the error queue of the socket
+	int progressZeroCopy() {
+#if defined(MTCL_TCP_ZEROCOPY)
+		while(!zcSeqs.empty()) {
+			char control[128];
+			struct msghdr msg{};
+			msg.msg_control    = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+					  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+				const struct sock_extended_err* ee = (const struct sock_extended_err*)CMSG_DATA(cm);
+				if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+				// the notifications of the range [ee_info, ee_data] (wrapping)
+				const uint32_t lo = ee->ee_info, len = ee->ee_data - lo;
+				for(auto it = zcSeqs.begin(); it != zcSeqs.end(); ) {
+					if (it->first - lo > len) { ++it; continue; }
+					tcpAsyncOp& op = *it->second;
+					--op.zcPending;
+					checkSent(op);
+					it = zcSeqs.erase(it);
+				}
+			}
+		}
+#endif
+		return 0;
+	}
+
+	// Reads the posted receives, in order, as long as data is available.
+	// It returns -1 if the connection broke (all the posted receives fail).
+	int progressRecv() {
+		char drain[4096];
+		while(!recvq.empty()) {
+			tcpAsyncOp& op = *recvq.front();
+			ssize_t n;
+			if (op.hoff < HDR_SZ) {
+				n = rxRead((char*)&op.hdr + op.hoff, HDR_SZ - op.hoff, MSG_DONTWAIT);
+				if (n > 0 && (op.hoff += n) == HDR_SZ) {
+					op.msgsize = (size_t)be64toh(op.hdr);
+					if (op.msgsize == 0) {  // EOS
+						completeOp(op, 0);
+						recvq.pop_front();
+					} else op.oob = recvOutOfBand(op);
+				}
+			} else if (op.oob) {
+				n = progressOutOfBand(op);
+				if (op.done) recvq.pop_front();
+			} else {
+				// too large messages are drained to keep the stream aligned
+				const bool fits = op.rbuf && op.msgsize <= op.size;
+				n = rxRead(fits ? op.rbuf + op.off : drain,
+						 std::min(op.msgsize - op.off, fits ? op.msgsize : sizeof(drain)), MSG_DONTWAIT);
+				if (n > 0 && (op.off += n) == op.msgsize) {
+					if (fits) completeOp(op, op.msgsize);
+					else {
+						MTCL_TCP_PRINT(100, "HandleTCP::ireceive EMSGSIZE, buffer too small\n");
+						completeOp(op, op.msgsize, EMSGSIZE);
+					}
+					recvq.pop_front();
+				}
+			}
+			if (n > 0) continue;
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+				if (errno == EINTR) continue;
+			}
+			if (n == 0 && op.hoff == 0) {  // the peer closed without EOS
+				completeOp(op, 0);
+				recvq.pop_front();
+				continue;
+			}
+			const int err = (n == 0) ? ECONNRESET : errno;
+			for(auto& o : recvq) completeOp(*o, -1, err);
+			recvq.clear();
+			errno = err;
+			return -1;
+		}
+		return 0;
+	}
+
+	int progress() {
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		const int rs = progressSend();
+		const int rz = progressZeroCopy();
+		const int rr = progressRecv();
+		return (rs < 0 || rz < 0 || rr < 0) ? -1 : 0;
+	}
+
+	// Drives the progress until op completes, blocking in poll when the
+	// socket is not ready. It returns -1 if poll fails: the pending operations
+	// fail with its errno, since the state of the stream is unknown.
+	int waitOp(const std::shared_ptr<tcpAsyncOp>& op) {
+		while(!op->done) {
+			struct pollfd pfd[1 + TCPX_MAX_STREAMS];
+			int np = 1;
+			pfd[0] = {fd, 0, 0};
+			{
+				REMOVE_CODE_IF(std::lock_guard lk(amtx));
+				progressSend();
+				progressZeroCopy();   // the notifications are signaled with POLLERR
+				progressRecv();
+				if (op->done) break;
+				if (!sendq.empty()) pfd[0].events |= POLLOUT;
+				if (!recvq.empty()) {
+					if (recvq.front()->oob) np += outOfBandFds(pfd + 1);
+					else pfd[0].events |= POLLIN;
+				}
+			}
+			if (fd == -1) {
+				completeOp(*op, -1, EBADF);
+				errno = EBADF;
+				return -1;
+			}
+			if (poll(pfd, np, TCP_ASYNC_WAIT_TIMEOUT) < 0 && errno != EINTR) {
+				const int err = errno;
+				MTCL_TCP_ERROR("HandleTCP::wait poll ERROR: errno=%d -- %s\n", err, strerror(err));
+				REMOVE_CODE_IF(std::lock_guard lk(amtx));
+				for(auto& o : sendq) completeOp(*o, -1, err);
+				for(auto& o : recvq) completeOp(*o, -1, err);
+				sendq.clear();
+				recvq.clear();
+				if (!op->done) completeOp(*op, -1, err);
+				errno = err;
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// completes the pending sends (resp. receives) before a blocking operation
+	int drainSends() {
+		std::shared_ptr<tcpAsyncOp> last;
+		{
+			REMOVE_CODE_IF(std::lock_guard lk(amtx));
+			if (sendq.empty()) return 0;
+			last = sendq.back();
+		}
+		waitOp(last);
+		if (last->err) {  // a failure makes all the following sends fail
+			errno = last->err;
+			return -1;
+		}
+		return 0;
+	}
+	bool recvPending() {
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		return !recvq.empty();
+	}
+	void drainReceives() {
+		std::shared_ptr<tcpAsyncOp> last;
+		{
+			REMOVE_CODE_IF(std::lock_guard lk(amtx));
+			if (recvq.empty()) return;
+			last = recvq.back();
+		}
+		waitOp(last);
+	}
+
+	std::shared_ptr<tcpAsyncOp> postSend(const void* buff, size_t size) {
+		auto op  = std::make_shared<tcpAsyncOp>();
+		op->hdr  = htobe64((uint64_t)size);
+		op->sbuf = (const char*)buff;
+		op->size = size;
+		op->zc   = zcThreshold && size >= zcThreshold;
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		if (!cork.empty()) pushCork();  // the buffered messages go first
+		sendq.push_back(op);
+		if (sendq.front() == op) progressSend();  // try to send it right away
+		return op;
+	}
+
+	std::shared_ptr<tcpAsyncOp> postReceive(void* buff, size_t size) {
+		auto op  = std::make_shared<tcpAsyncOp>();
+		op->rbuf = (char*)buff;
+		op->size = size;
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		if (!cork.empty()) {  // the peer may be waiting for the buffered messages
+			pushCork();
+			progressSend();
+		}
+		if (probed.first) {  // the header has already been read by probe
+			op->hoff    = HDR_SZ;
+			op->msgsize = probed.second;
+			probed = {false, 0};
+			if (op->msgsize == 0) {
+				completeOp(*op, 0);
+				return op;
+			}
+			op->oob = recvOutOfBand(*op);
+		}
+		recvq.push_back(op);
+		if (recvq.size() == 1) progressRecv();
+		return op;
+	}
+
+	// moves the cork buffer to the send queue (the lock must be held)
+	void pushCork() {
+		auto op  = std::make_shared<tcpAsyncOp>();
+		op->data.swap(cork);
+		op->hoff = HDR_SZ;  // the messages are already framed
+		op->sbuf = op->data.data();
+		op->size = op->data.size();
+		sendq.push_back(op);
+		cork.reserve(CORK_BUFFER_SIZE);
+	}
+
+	// appends the message to the cork buffer, it returns false if the
+	// message has to be sent directly
+	bool corkMessage(const struct iovec* iov, int iovcnt, size_t size, bool& first, bool& expired) {
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		if (!sendq.empty() || cork.size() + HDR_SZ + size > CORK_BUFFER_SIZE) return false;
+		const auto now = std::chrono::steady_clock::now();
+		first = cork.empty();
+		if (first) corkSince = now;
+		const uint64_t szbe = htobe64((uint64_t)size);
+		cork.insert(cork.end(), (const char*)&szbe, (const char*)&szbe + HDR_SZ);
+		for(int i=0; i<iovcnt; ++i)
+			cork.insert(cork.end(), (const char*)iov[i].iov_base, (const char*)iov[i].iov_base + iov[i].iov_len);
+		expired = cork.size() == CORK_BUFFER_SIZE ||
+			(!first && now - corkSince >= std::chrono::microseconds(CORK_FLUSH_TIMEOUT));
+		return true;
+	}
+
+	void addPending();
+
+	// Called by the IO thread: it flushes the expired cork buffer and
+	// advances the pending sends. It returns true if nothing is pending.
+	bool ioFlush(std::chrono::steady_clock::time_point now) {
+		REMOVE_CODE_IF(std::lock_guard lk(amtx));
+		if (!cork.empty() && now - corkSince >= std::chrono::microseconds(CORK_FLUSH_TIMEOUT))
+			pushCork();
+		if (fd != -1) progressSend();
+		return cork.empty() && sendq.empty();
+	}
+
+	// Called by the IO thread when the socket of the yielded connection is
+	// signaled with an error: it reads the zero-copy notifications and
+	// returns true if the connection is still ready, i.e., a message is
+	// buffered or the socket is readable or broken.
+	bool ioErrQueue() {
+		{
+			REMOVE_CODE_IF(std::lock_guard lk(amtx));
+			if (fd == -1) return true;
+			progressZeroCopy();
+		}
+		if (buffered() >= HDR_SZ) return true;
+		struct pollfd pfd{fd, POLLIN, 0};
+		return poll(&pfd, 1, 0) != 0;
+	}
+
 public:
     int fd; // File descriptor of the connection represented by this Handle
-    HandleTCP(ConnType* parent, int fd) : Handle(parent), fd(fd) {}
+    HandleTCP(ConnType* parent, int fd, int shard=0) : Handle(parent, shard), fd(fd) {}
     static constexpr size_t HDR_SZ = sizeof(uint64_t);
 
 	ssize_t sendEOS() {
+		if (flush() < 0) return -1;
 		const uint64_t szbe = htobe64((uint64_t)0);
 		return writen(fd, (char*)&szbe, HDR_SZ);
 	}
 	
     ssize_t send(const void* buff, size_t size) {
+		if (corked) {
+			const struct iovec iov = {const_cast<void*>(buff), size};
+			bool first = false, expired = false;
+			if (corkMessage(&iov, 1, size, first, expired)) {
+				if (expired) return (flush() < 0) ? -1 : (ssize_t)size;
+				if (first) addPending();
+				return size;
+			}
+			if (flush() < 0) return -1;
+		}
+		if (zcThreshold && size >= zcThreshold) {
+			auto op = postSend(buff, size);
+			waitOp(op);
+			if (op->err) {
+				errno = op->err;
+				return -1;
+			}
+			return size;
+		}
+		if (drainSends() < 0) return -1;
 		uint64_t szbe = htobe64((uint64_t)size);
         struct iovec iov[2];
         iov[0].iov_base = &szbe;
@@ -107,18 +675,89 @@ public:
 		return size;
     }
 
+	// The header and the pieces are written with one writev, without
+	// copying them (the zero-copy sends are not used for vectored messages).
+	ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		// invalid arguments or too many pieces for one writev
+		if (iovcnt < 0 || (iovcnt > 0 && !iov) || iovcnt >= IOV_MAX)
+			return Handle::sendv(iov, iovcnt);
+		const size_t size = iovLength(iov, iovcnt);
+		if (corked) {
+			bool first = false, expired = false;
+			if (corkMessage(iov, iovcnt, size, first, expired)) {
+				if (expired) return (flush() < 0) ? -1 : (ssize_t)size;
+				if (first) addPending();
+				return size;
+			}
+			if (flush() < 0) return -1;
+		}
+		if (drainSends() < 0) return -1;
+		uint64_t szbe = htobe64((uint64_t)size);
+		struct iovec small[TCP_ASYNC_MAX_IOV];
+		std::vector<struct iovec> large;
+		struct iovec* v = small;
+		if (iovcnt + 1 > (int)TCP_ASYNC_MAX_IOV) {
+			large.resize(iovcnt + 1);
+			v = large.data();
+		}
+		v[0].iov_base = &szbe;
+		v[0].iov_len  = HDR_SZ;
+		std::copy(iov, iov + iovcnt, v + 1);
+		if (writevn(fd, v, iovcnt + 1) < 0) return -1;
+		return size;
+	}
+
+	int setCork(bool enable) {
+		if (!enable && flush() < 0) return -1;
+		corked = enable;
+		return 0;
+	}
+
+	// sends the buffered messages and waits for the completion of the
+	// pending sends
+	ssize_t flush() {
+		{
+			REMOVE_CODE_IF(std::lock_guard lk(amtx));
+			if (!cork.empty()) pushCork();
+		}
+		return drainSends();
+	}
+
 	ssize_t isend(const void* buff, size_t size, Request& r){
-		auto ret = this->send(buff, size);
-		return (ret>0 ? 0 : -1);
+		// the errors are reported by the Request, also the immediate ones
+		r.__setInternalR(new requestTCP(this, postSend(buff, size)));
+		return 0;
 	}
 
-	ssize_t isend(const void* buff, size_t size, RequestPool&){
-		auto ret = this->send(buff, size);
-		return (ret>0 ? 0 : -1);
+	ssize_t isend(const void* buff, size_t size, RequestPool& r){
+		auto* v = r._getInternalVector<ConnRequestVectorTCP>();
+		v->requests.push_back(new requestTCP(this, postSend(buff, size)));
+		return 0;
 	}
 
 	// receives the header containing the size (HDR_SZ bytes)
 	ssize_t probe(size_t& size, const bool blocking=true) {
+		bool flushing = false;
+		{
+			// cork and recvq are also changed by the IO thread and by isend
+			REMOVE_CODE_IF(std::lock_guard lk(amtx));
+			if (!cork.empty()) {  // the peer may be waiting for the buffered messages
+				pushCork();
+				if (blocking) flushing = true;
+				else progressSend();
+			}
+		}
+		if (flushing && drainSends() < 0) return -1;
+		if (recvPending()) {
+			if (!blocking) {
+				progress();
+				if (recvPending()) {
+					errno = EWOULDBLOCK;
+					return -1;
+				}
+			}
+			drainReceives();
+		}
 		if (probed.first){
 			size = probed.second;
 			return (size ? (ssize_t)HDR_SZ: 0);
@@ -129,32 +768,26 @@ public:
 		uint64_t szbe = 0;
 		
 		if (!blocking) {
-			// Peek first to ensure the full header is available.
-			const ssize_t pr = recv(fd, (char*)&szbe, HDR_SZ, MSG_PEEK | MSG_DONTWAIT);
-			if (pr < 0) return -1;             // errno set by recv
-			if (pr == 0) {                     // EOS
-				size = 0;
-				probed = {true, 0};
-				return 0;
-			}
-			if (pr < (ssize_t)HDR_SZ) {        // header not fully available yet
-				errno = EWOULDBLOCK;
-				return -1;
-			}
-			// Consume the header (it is fully available).
-			const ssize_t r = readn(fd, (char*)&szbe, HDR_SZ);
-			if (r < 0) return -1;
-			if (r == 0) {                      // EOS between peek and read
-				size = 0;
-				probed = {true, 0};
-				return 0;
-			}
-			if (r < (ssize_t)HDR_SZ) {         // should not happen if peek succeeded
-				errno = ECONNRESET;
-				return -1;
+			// a partial header stays in the read-ahead buffer
+			while (buffered() < HDR_SZ) {
+				const ssize_t r = rxFill(MSG_DONTWAIT);
+				if (r < 0) {
+					if (errno == EINTR) continue;
+					return -1;                 // errno set by recv
+				}
+				if (r == 0) {
+					if (buffered() > 0) {      // the stream broke within the header
+						errno = ECONNRESET;
+						return -1;
+					}
+					size = 0;                  // EOS
+					probed = {true, 0};
+					return 0;
+				}
 			}
+			readn((char*)&szbe, HDR_SZ);       // served by the buffer
 		} else { // blocking
-			const ssize_t r = readn(fd, (char*)&szbe, HDR_SZ);
+			const ssize_t r = readn((char*)&szbe, HDR_SZ);
 			if (r < 0) return -1;
 			if (r == 0) {                      // EOS
 				size = 0;
@@ -174,11 +807,15 @@ public:
 
 	// Returns true if a full header (or EOS) is available without consuming it.
 	bool peek() {
-		uint64_t szbe = 0;
-		const ssize_t r = recv(fd, (char*)&szbe, HDR_SZ, MSG_PEEK | MSG_DONTWAIT);
+		if (recvPending()) return false;  // the data belongs to the posted receives
+		if (buffered() >= HDR_SZ) return true;
+		const ssize_t r = rxFill(MSG_DONTWAIT);
 		if (r == 0) return true; // EOS is readable
-		return (r == (ssize_t)HDR_SZ);
+		return buffered() >= HDR_SZ;
 	}
+
+	// bytes read from the socket and not consumed yet
+	size_t buffered() const { return rxtail - rxhead; }
 	
     ssize_t receive(void* buff, size_t size) {
 		size_t probedSize;
@@ -198,28 +835,238 @@ public:
 			return -1;
 		}
 		probed = {false, 0};
-		const ssize_t n = readn(fd, (char*)buff, probedSize);
+		const ssize_t n = readn((char*)buff, probedSize);
 		if (n == (ssize_t)probedSize) return n;
 		// Short reads, the stream broke while receiving the payload
 		errno = (n==0) ? ECONNRESET: EPROTO;
 		return -1;
     }
 
+	// The bytes already in the read-ahead buffer are copied into the pieces,
+	// the rest of a large message is read directly into them with readv.
+	ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (iovcnt <= 0 || !iov) return Handle::receivev(iov, iovcnt);  // EINVAL
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+
+		if (probedSize == 0) {
+			probed = {false, 0};
+			return 0;
+		}
+		if (probedSize > iovLength(iov, iovcnt)){
+			MTCL_TCP_PRINT(100, "[internal]:\t", "HandleTCP::receivev EMSGSIZE, buffers too small\n");
+			errno=EMSGSIZE;
+			return -1;
+		}
+		probed = {false, 0};
+
+		std::vector<struct iovec> v;  // the parts still to be read from the socket
+		size_t left = probedSize;
+		for(int i=0; i<iovcnt && left > 0; ++i) {
+			char* p = (char*)iov[i].iov_base;
+			const size_t n = std::min(left, iov[i].iov_len);
+			const size_t c = std::min(n, buffered());
+			if (c) {
+				memcpy(p, rxbuf.get() + rxhead, c);
+				rxhead += c;
+			}
+			if (n > c) v.push_back({p + c, n - c});
+			left -= n;
+		}
+		ssize_t r = 1;
+		if (iovLength(v.data(), v.size()) >= TCP_RX_BUFFER_SIZE/2) {
+			for(size_t i=0; r > 0 && i<v.size(); i += IOV_MAX)
+				r = readvn(v.data() + i, std::min(v.size() - i, (size_t)IOV_MAX));
+		} else {
+			for(size_t i=0; r > 0 && i<v.size(); ++i) {
+				const ssize_t n = readn((char*)v[i].iov_base, v[i].iov_len);
+				r = (n < 0) ? -1 : (n == (ssize_t)v[i].iov_len);
+			}
+		}
+		if (r > 0) return probedSize;
+		// the stream broke while receiving the payload
+		if (r == 0) errno = ECONNRESET;
+		return -1;
+	}
+
+#if defined(MTCL_TCP_SENDFILE)
+	// The header is written, then the range of a regular file goes from the
+	// page cache to the socket with sendfile (no copy in user space).
+	ssize_t sendFile(int ffd, off_t offset, size_t len) {
+		struct stat st;
+		if (fstat(ffd, &st) < 0) return -1;
+		if (!S_ISREG(st.st_mode) || len == 0) return Handle::sendFile(ffd, offset, len);
+		off_t pos = (offset < 0) ? lseek(ffd, 0, SEEK_CUR) : offset;
+		if (pos < 0) return -1;
+		if ((size_t)pos + len > (size_t)st.st_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (flush() < 0) return -1;
+		const uint64_t szbe = htobe64((uint64_t)len);
+		if (writen(fd, (const char*)&szbe, HDR_SZ) != (ssize_t)HDR_SZ) return -1;
+		for(size_t left = len; left > 0; ) {
+			const ssize_t n = sendfile(fd, ffd, &pos, left);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {  // the stream is broken (or the file has been truncated)
+				if (n == 0) errno = EIO;
+				MTCL_TCP_PRINT(100, "HandleTCP::sendFile sendfile errno=%d\n", errno);
+				return -1;
+			}
+			left -= n;
+		}
+		if (offset < 0 && lseek(ffd, pos, SEEK_SET) < 0) return -1;
+		return len;
+	}
+
+	// The part of the message already read ahead is written with pwrite, the
+	// rest is moved from the socket to a regular file with splice through a
+	// pipe. If writing the file fails, the rest of the message is discarded
+	// to keep the stream aligned.
+	ssize_t receiveToFile(int ffd, off_t offset, size_t maxlen) {
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+
+		if (probedSize == 0) {
+			probed = {false, 0};
+			return 0;
+		}
+		if (probedSize > maxlen){
+			MTCL_TCP_PRINT(100, "HandleTCP::receiveToFile EMSGSIZE, message larger than maxlen\n");
+			errno=EMSGSIZE;
+			return -1;
+		}
+		struct stat st;
+		if (fstat(ffd, &st) < 0) return -1;
+		if (!S_ISREG(st.st_mode)) return Handle::receiveToFile(ffd, offset, maxlen);
+		off_t pos = (offset < 0) ? lseek(ffd, 0, SEEK_CUR) : offset;
+		if (pos < 0) return -1;
+		if (splicePipe[0] == -1) {
+			if (pipe2(splicePipe, O_CLOEXEC) < 0) return Handle::receiveToFile(ffd, offset, maxlen);
+			fcntl(splicePipe[1], F_SETPIPE_SZ, (int)TCP_SPLICE_PIPE_SIZE);  // best effort
+		}
+		probed = {false, 0};
+
+		int ferr = 0;  // error writing the file
+		size_t left = probedSize;
+		for(size_t c = std::min(left, buffered()); c > 0; ) {
+			const ssize_t w = pwrite(ffd, rxbuf.get() + rxhead, c, pos);
+			if (w < 0 && errno == EINTR) continue;
+			if (w <= 0) {
+				ferr = (w < 0) ? errno : EIO;
+				rxhead += c;
+				left   -= c;
+				break;
+			}
+			rxhead += w; left -= w; pos += w; c -= w;
+		}
+		char drain[4096];
+		while(left > 0) {
+			if (ferr) {
+				const ssize_t n = readn(drain, std::min(left, sizeof(drain)));
+				if (n <= 0) break;
+				left -= n;
+				continue;
+			}
+			const ssize_t n = splice(fd, NULL, splicePipe[1], NULL, std::min(left, TCP_SPLICE_PIPE_SIZE), SPLICE_F_MOVE);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {  // the stream broke while receiving the payload
+				if (n == 0) errno = ECONNRESET;
+				return -1;
+			}
+			left -= n;
+			for(ssize_t m = n; m > 0; ) {
+				const ssize_t w = splice(splicePipe[0], NULL, ffd, &pos, m, SPLICE_F_MOVE);
+				if (w < 0 && errno == EINTR) continue;
+				if (w <= 0) {
+					ferr = (w < 0) ? errno : EIO;
+					// the pipe may still contain data, it is replaced
+					::close(splicePipe[0]); ::close(splicePipe[1]);
+					splicePipe[0] = splicePipe[1] = -1;
+					break;
+				}
+				m -= w;
+			}
+		}
+		if (left > 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (ferr) {
+			MTCL_TCP_PRINT(100, "HandleTCP::receiveToFile writing the file errno=%d, message discarded\n", ferr);
+			errno = ferr;
+			return -1;
+		}
+		if (offset < 0 && lseek(ffd, pos, SEEK_SET) < 0) return -1;
+		return probedSize;
+	}
+#endif
+
 	ssize_t ireceive(void* buff, size_t size, RequestPool& r) {
-        auto ret = receive(buff, size);
-		return (ret>=0 ? 0 : -1);
+		auto* v = r._getInternalVector<ConnRequestVectorTCP>();
+		v->requests.push_back(new requestTCP(this, postReceive(buff, size)));
+		return 0;
     }
 
 	ssize_t ireceive(void* buff, size_t size, Request& r) {
-        auto ret = receive(buff, size);
-		return (ret>=0 ? 0 : -1);
+		r.__setInternalR(new requestTCP(this, postReceive(buff, size)));
+		return 0;
     }
 
-    ~HandleTCP() {}
+    ~HandleTCP() {
+		if (splicePipe[0] != -1) {
+			::close(splicePipe[0]);
+			::close(splicePipe[1]);
+		}
+		// the Requests still pending must not refer to this Handle any more
+		for(auto& op : sendq) completeOp(*op, -1, ECONNRESET);
+		for(auto& op : recvq) completeOp(*op, -1, ECONNRESET);
+		for(auto& [seq, op] : zcSeqs) if (!op->done) completeOp(*op, -1, ECONNRESET);
+	}
 };
 
+inline int requestTCP::test(int& result) {
+	if (!op->done) h->progress();
+	result = op->done;
+	if (result && op->err) {
+		errno = op->err;
+		return -1;
+	}
+	return 0;
+}
+
+inline int requestTCP::wait() {
+	if (!op->done) h->waitOp(op);
+	if (op->err) {
+		errno = op->err;
+		return -1;
+	}
+	return 0;
+}
+
+inline int requestTCP::make_progress() {
+	return op->done ? 0 : h->progress();
+}
+
+inline requestTCP::~requestTCP() {
+	// a pending receive goes on, its message is discarded
+	if (!op->done) {
+		REMOVE_CODE_IF(std::lock_guard lk(h->amtx));
+		op->rbuf = nullptr;
+	}
+}
+
 
 class ConnTcp : public ConnType {
+	friend class HandleTCP;
 private:
     // enum class ConnEvent {close, yield};
 
@@ -227,98 +1074,262 @@ protected:
     std::string address;
     int port;
     
-    std::map<int, Handle*> connections;  // Active connections for this Connector
+    int listen_sck;
 
+	// The connections are split into shards, each one managed by a different
+	// IO thread. New connections are assigned to the shards round-robin.
+	// The listening socket belongs to shard 0, unless each shard has its own
+	// one (reusePort): the kernel spreads the connections among the listening
+	// sockets hashing their addresses, and the connections stay in the shard
+	// of the socket that accepted them.
+	struct shard_t {
+		int lsck = -1;                       // listening socket of the shard
+		std::map<int, Handle*> connections;  // Active connections of this shard
+		std::set<HandleTCP*> corked;         // connections with buffered or pending sends
+#if defined(MTCL_TCP_EPOLL)
+		// Readiness is tracked with one-shot registrations: a yielded connection
+		// is (re-)armed in notify_yield and it is automatically disarmed by the
+		// kernel as soon as it is reported ready. The cost of update is thus
+		// proportional to the number of ready handles and not to the highest fd.
+		int epfd = -1;
+		struct epoll_event events[TCP_EPOLL_MAX_EVENTS];
+		std::set<int> armed;                 // connections owned by the IO thread
+#endif
+#if !defined(NO_MTCL_MULTITHREADED)
+		std::shared_mutex shm;
+#endif
+	};
+	std::deque<shard_t> shards;
+	std::atomic<unsigned> nextShard{0};
+	size_t zcThreshold = 0;  // see HandleTCP::zcThreshold
+	bool reusePort = false;  // one listening socket for each shard (epoll only)
+#if !defined(MTCL_TCP_EPOLL)
+	// the select version supports one shard only
     fd_set set, tmpset;
-    int listen_sck;
 #if defined(NO_MTCL_MULTITHREADED)
 	int fdmax;
 #else	
     std::atomic<int> fdmax;
-    std::shared_mutex shm;
+#endif
 #endif
 
-private:
+	// The socket layer, redefined by the protocols sharing the TCP
+	// implementation with a different socket family (see ConnUDS).
 
-	/**
-     * @brief Initializes the main listening socket for this Handle
-     * 
-     * @return int status code
-     */
-    int _init() {
-        if ((listen_sck=socket(AF_INET, SOCK_STREAM, 0)) < 0){
-			MTCL_TCP_PRINT(100, "ConnTcp::_init socket errno=%d\n", errno);
-            return -1;
-        }
+	// creates the listening socket for the address (without the protocol)
+	virtual int listenSocket(const std::string& s) {
+        address = s.substr(0, s.find(":"));
+        port = stoi(s.substr(address.length()+1));
+		const int sck = tcpListenSocket(address, port, reusePort);
+		if (sck >= 0) MTCL_TCP_PRINT(1, "listen to %s:%d\n", address.c_str(),port);
+		return sck;
+	}
+	// returns a socket connected to the address (without the protocol)
+	virtual int connectSocket(const std::string& address, int retry, unsigned timeout_ms) {
+		return internal_connect(address, retry, timeout_ms);
+	}
+	// sets the options of a new connection (accepted or connected)
+	virtual int setupSocket(int fd) {
+#ifdef MTCL_DISABLE_NAGLE
+		int flag = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int)) < 0){
+			MTCL_TCP_ERROR("ConnTcp::setupSocket setsockopt ERROR: errno=%d -- %s\n", errno, strerror(errno));
+			return -1;
+		}
+#endif
+		return 0;
+	}
+	virtual HandleTCP* createHandle(int fd, int shard) { return new HandleTCP(this, fd, shard); }
 
-        int enable = 1;
-        // enable the reuse of the address
-        if (setsockopt(listen_sck, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init setsockopt errno=%d\n", errno);
-            return -1;
-        }
+	// Called by update for the events of the sockets registered with
+	// watchSocket (e.g. the sockets of ConnTcpX waiting for their hello), it
+	// returns false if fd is not one of them. expireSockets is called by
+	// each update of the shard, also without events.
+	virtual bool socketEvent(int fd, int shard) { return false; }
+	virtual void expireSockets(int shard) {}
 
-		struct addrinfo hints;
-		struct addrinfo *result, *rp;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family   = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-		hints.ai_socktype = SOCK_STREAM;  /* Stream socket */
-		hints.ai_flags    = AI_PASSIVE;
-		hints.ai_protocol = IPPROTO_TCP;  /* Allow only TCP */
-		if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init getaddrinfo errno=%d\n", errno);		
+	// adds (level-triggered) the socket to the ones polled by the shard,
+	// without a Handle, and removes it
+	int watchSocket(int fd, int shard) {
+		auto& sh = shards[shard];
+		REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+#if defined(MTCL_TCP_EPOLL)
+		struct epoll_event ev{};
+		ev.events  = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(sh.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			MTCL_TCP_PRINT(100, "ConnTcp::watchSocket epoll_ctl errno=%d\n", errno);
 			return -1;
 		}
+#else
+		if (fd >= FD_SETSIZE) {
+			errno = EMFILE;
+			return -1;
+		}
+		FD_SET(fd, &set);
+		if (fd > fdmax) fdmax = fd;
+#endif
+		return 0;
+	}
+	void unwatchSocket(int fd, int shard) {
+		auto& sh = shards[shard];
+		REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+#if defined(MTCL_TCP_EPOLL)
+		epoll_ctl(sh.epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+		FD_CLR(fd, &set);
+		updateFdmax(fd);
+#endif
+	}
 
-		bool ok = false;
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			if (bind(listen_sck, rp->ai_addr, (int)rp->ai_addrlen) < 0){
-				MTCL_TCP_PRINT(100, "ConnTcp::_init bind errno=%d, continue\n", errno);
-				continue;
-			}
-			ok = true;
-			break;
+	// passes the Handle of a new connection accepted by the shard to the Manager
+	virtual void acceptedSocket(int connfd, int shard) {
+		if (setupSocket(connfd) < 0) {
+			close(connfd);
+			return;
 		}
-		free(result);
-		if (!ok) {
-			MTCL_TCP_PRINT(100, "ConnTcp::_init bind loop exit with errno=%d\n", errno);
-			return -1;
+		addinQ(true, addConnection(connfd, reusePort ? shard : -1));
+	}
+
+	// accepts all the pending connections of the (non-blocking) listening
+	// socket of the shard
+	void acceptConnections(int shard) {
+		const int lsck = shards[shard].lsck;
+		for(;;) {
+#if defined(__linux__)
+			const int connfd = accept4(lsck, (struct sockaddr*)NULL, NULL, SOCK_CLOEXEC);
+#else
+			const int connfd = accept(lsck, (struct sockaddr*)NULL, NULL);
+#endif
+			if (connfd == -1) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					MTCL_TCP_ERROR("ConnTcp::update accept ERROR: errno=%d -- %s\n", errno, strerror(errno));
+				return;
+			}
+			acceptedSocket(connfd, shard);
 		}
-        if (::listen(listen_sck, TCP_BACKLOG) < 0){
-			MTCL_TCP_PRINT(100, "ConnTcp::_init listen errno=%d\n", errno);
-            return -1;
-        }
+	}
 
-        return 0;
-    }
+	// creates the Handle for a new connection and assigns it to the shard
+	// (round-robin if shard is -1)
+	Handle* addConnection(int fd, int shard=-1) {
+		const int s = (shard < 0) ? nextShard++ % shards.size() : shard;
+		HandleTCP* handle = createHandle(fd, s);
+		handle->owner = this;
+#if defined(MTCL_TCP_ZEROCOPY)
+		int one = 1;
+		if (zcThreshold && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+			handle->zcThreshold = zcThreshold;
+#endif
+		auto& sh = shards[s];
+		REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+		sh.connections[fd] = handle;
+		return handle;
+	}
 
+private:
+
+	// flushes the expired cork buffers (the lock of the shard must be held)
+	void flushCorked(shard_t& sh) {
+		if (sh.corked.empty()) return;
+		const auto now = std::chrono::steady_clock::now();
+		for(auto it = sh.corked.begin(); it != sh.corked.end(); ) {
+			if ((*it)->ioFlush(now)) it = sh.corked.erase(it);
+			else ++it;
+		}
+	}
+
+#if !defined(MTCL_TCP_EPOLL)
+	// updates the maximum file descriptor after fd has been removed from set
+	void updateFdmax(int fd) {
+		if (fd != fdmax) return;
+		int ii;
+		for(ii=(fdmax-1);ii>=0;--ii) {
+			if (FD_ISSET(ii, &set)){
+				fdmax = ii;
+				break;
+			}
+		}
+		// the listen socket might not be in the set, thus without the following
+		// we risk to leave fdmax set to the old value.
+		if (ii==-1) fdmax = -1;
+	}
+#endif
 
 public:
 
    ConnTcp(){};
    ~ConnTcp(){};
 
+#if defined(MTCL_TCP_EPOLL)
+	int maxShards() { return std::numeric_limits<int>::max(); }
+#endif
+
     int init(std::string) {
+		listen_sck=-1;
+#if defined(MTCL_TCP_EPOLL) && defined(SO_REUSEPORT)
+		reusePort = TCP_REUSEPORT;
+		char *rp;
+		if ((rp=std::getenv("MTCL_TCP_REUSEPORT")) != NULL) reusePort = (std::string(rp) == "1");
+#endif
+#if defined(MTCL_TCP_ZEROCOPY)
+		zcThreshold = TCP_ZEROCOPY_THRESHOLD;
+		char *thr;
+		if ((thr=std::getenv("MTCL_TCP_ZEROCOPY_THRESHOLD")) != NULL) {
+			try {
+				zcThreshold = std::stoull(thr);
+			} catch(...) {
+				MTCL_TCP_ERROR("invalid MTCL_TCP_ZEROCOPY_THRESHOLD value, it should be a number of bytes (0 to disable)\n");
+			}
+		}
+#endif
+		shards.clear();
+		for(int i=0; i<nshards; ++i) shards.emplace_back();
+#if defined(MTCL_TCP_EPOLL)
+		for(auto& sh : shards) {
+			if ((sh.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+				MTCL_TCP_ERROR("ConnTcp::init epoll_create1 ERROR: errno=%d -- %s\n", errno, strerror(errno));
+				return -1;
+			}
+		}
+#else
 		// For clients who do just connect, the communication thread anyway calls
 		// the update method, and we do not want to call the select function with
 		// invalid fields.
         FD_ZERO(&set);
         FD_ZERO(&tmpset);
-		listen_sck=-1;
 		fdmax = -1;
+#endif
         return 0;
     }
 
     int listen(std::string s) {
-        address = s.substr(0, s.find(":"));
-        port = stoi(s.substr(address.length()+1));
-
-		if (this->_init()) {			
+		if ((listen_sck = listenSocket(s)) < 0) {
 			return -1;
 		}
-		
-        MTCL_TCP_PRINT(1, "listen to %s:%d\n", address.c_str(),port);
+		shards[0].lsck = listen_sck;
+		// the listening sockets are non-blocking, update accepts until EAGAIN
+		fcntl(listen_sck, F_SETFL, fcntl(listen_sck, F_GETFL, 0) | O_NONBLOCK);
 
+#if defined(MTCL_TCP_EPOLL)
+		if (reusePort)
+			for(size_t i=1; i<shards.size(); ++i) {
+				if ((shards[i].lsck = listenSocket(s)) < 0) return -1;
+				fcntl(shards[i].lsck, F_SETFL, fcntl(shards[i].lsck, F_GETFL, 0) | O_NONBLOCK);
+			}
+		// the listening sockets are level-triggered and always armed
+		for(auto& sh : shards) {
+			if (sh.lsck == -1) continue;
+			struct epoll_event ev{};
+			ev.events  = EPOLLIN;
+			ev.data.fd = sh.lsck;
+			if (epoll_ctl(sh.epfd, EPOLL_CTL_ADD, sh.lsck, &ev) == -1) {
+				MTCL_TCP_PRINT(100, "ConnTcp::listen epoll_ctl errno=%d\n", errno);
+				return -1;
+			}
+		}
+#else
         // intialize both sets (master, temp)
         FD_ZERO(&set);
         FD_ZERO(&tmpset);
@@ -328,17 +1339,80 @@ public:
 
         // hold the greater descriptor
         fdmax = this->listen_sck;
+#endif
 
         return 0;
     }
 
+#if defined(MTCL_TCP_EPOLL)
+    void update() { updateShard(0); }
+
+    void updateShard(int shard) {
+		auto& sh = shards[shard];
+		expireSockets(shard);
+		{
+			REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+			flushCorked(sh);
+		}
+		int nready = epoll_wait(sh.epfd, sh.events, TCP_EPOLL_MAX_EVENTS, TCP_POLL_TIMEOUT/1000);
+		if (nready == -1) {
+			if (errno != EINTR)
+				MTCL_TCP_ERROR("ConnTcp::update epoll_wait ERROR: errno=%d -- %s\n", errno, strerror(errno));
+			return;
+		}
+		for(int i=0; i<nready; ++i) {
+			const int fd = sh.events[i].data.fd;
+			if (fd == sh.lsck) {
+				acceptConnections(shard);
+				continue;
+			}
+			if (socketEvent(fd, shard)) continue;
+			REMOVE_CODE_IF(std::unique_lock ulock(sh.shm));
+			// The fd might have been closed (and even reused) after epoll_wait
+			// returned, we consider only connections still owned by the IO thread.
+			if (sh.armed.erase(fd) == 0) continue;
+			auto it = sh.connections.find(fd);
+			if (it == sh.connections.end()) continue;
+			// EPOLLERR also signals the zero-copy notifications of the sends:
+			// they are consumed here and the connection is re-armed, unless
+			// there is something to receive
+			const uint32_t ev = sh.events[i].events;
+			bool ready = ev & (EPOLLIN | EPOLLHUP);
+			if (ev & EPOLLERR)
+				ready = reinterpret_cast<HandleTCP*>((*it).second)->ioErrQueue() || ready;
+			if (!ready && armConnection(sh, fd) == 0) continue;
+			addinQ(false, (*it).second);
+		}
+	}
+
+	// (re-)arms the one-shot registration of the yielded connection fd, the
+	// lock of the shard must be held
+	int armConnection(shard_t& sh, int fd) {
+		struct epoll_event ev{};
+		ev.events  = EPOLLIN | EPOLLONESHOT;
+		ev.data.fd = fd;
+		// the fd is registered the first time the connection is yielded,
+		// afterwards it is just re-armed
+		if (epoll_ctl(sh.epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+			if (errno != ENOENT || epoll_ctl(sh.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+				MTCL_TCP_ERROR("ConnTcp::armConnection epoll_ctl ERROR: errno=%d -- %s\n", errno, strerror(errno));
+				return -1;
+			}
+		}
+		sh.armed.insert(fd);
+		return 0;
+	}
+#else
     void update() {
         // copy the master set to the temporary
 
-        REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
+        auto& sh = shards[0];
+        REMOVE_CODE_IF(std::unique_lock ulock(sh.shm, std::defer_lock));
 
+		expireSockets(0);
         REMOVE_CODE_IF(ulock.lock());
         tmpset = set;
+		flushCorked(sh);
         REMOVE_CODE_IF(ulock.unlock());
 
         struct timeval wait_time = {.tv_sec=0, .tv_usec=TCP_POLL_TIMEOUT};
@@ -359,47 +1433,16 @@ public:
         for(int idx=0; idx <= fdmax && nready>0; idx++){
             if (FD_ISSET(idx, &tmpset)){
                 if (idx == this->listen_sck) {
-                    int connfd = accept(this->listen_sck, (struct sockaddr*)NULL ,NULL);
-                    if (connfd == -1){
-						MTCL_TCP_ERROR("ConnTcp::update accept ERROR: errno=%d -- %s\n", errno, strerror(errno));
-                        return;
-                    }
-					
-#ifdef MTCL_DISABLE_NAGLE
-					int flag = 1;
-        			if (setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int)) < 0){
-						MTCL_TCP_ERROR("ConnTcp::update setsockopt ERROR: errno=%d -- %s\n", errno, strerror(errno));
-                        return;
-					}
-#endif
-                    REMOVE_CODE_IF(ulock.lock());
-                    // FD_SET(connfd, &set);
-                    // if(connfd > fdmax) {
-					// 	fdmax = connfd;
-					// }
-                    connections[connfd] = new HandleTCP(this, connfd);
-					REMOVE_CODE_IF(ulock.unlock());
-					addinQ(true, connections[connfd]);                    
-                } else {
+					acceptConnections(0);
+                } else if (!socketEvent(idx, 0)) {
                     REMOVE_CODE_IF(ulock.lock());
-
 					
                     // Updates ready connections and removes from listening
                     FD_CLR(idx, &set);
+					updateFdmax(idx);
 
-                    // update the maximum file descriptor
-                    if (idx == fdmax) {
-						int ii;
-                        for(ii=(fdmax-1);ii>=0;--ii) {
-                            if (FD_ISSET(ii, &set)){
-                                fdmax = ii;
-                                break;
-                            }
-                        }
-						if (ii==-1) fdmax = -1;
-					}
-					auto it = connections.find(idx);
-					if (it != connections.end()) {
+					auto it = sh.connections.find(idx);
+					if (it != sh.connections.end()) {
 						addinQ(false, (*it).second);
 					}
                     REMOVE_CODE_IF(ulock.unlock());
@@ -408,33 +1451,43 @@ public:
             }
         }
     }
+#endif
+
+	// the expired cork buffers are flushed by update, thus the IO thread
+	// must keep polling while there are some
+	bool prepareWait(int shard=0) {
+		REMOVE_CODE_IF(std::shared_lock lock(shards[shard].shm));
+		return shards[shard].corked.empty();
+	}
+
+#if defined(MTCL_TCP_EPOLL)
+	// the epoll fd becomes readable when a new connection is pending or
+	// an armed connection is ready
+	int getEventFd(int shard=0) { return shards[shard].epfd; }
+#endif
 
     // URL: host:prot || label: user string
     Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
 
-		int fd=internal_connect(address, retry, timeout_ms);
+		int fd=connectSocket(address, retry, timeout_ms);
 		if (fd == -1) {
 			return nullptr;
 		}
-
-#ifdef MTCL_DISABLE_NAGLE
-		int flag = 1;
-		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int)) < 0){
-			MTCL_TCP_ERROR("ConnTcp::connect setsockopt ERROR: errno=%d -- %s\n", errno, strerror(errno));
-            return nullptr;
+		if (setupSocket(fd) < 0) {
+			close(fd);
+			return nullptr;
 		}
-#endif		
 
-        HandleTCP *handle = new HandleTCP(this, fd);
-		{
-			REMOVE_CODE_IF(std::unique_lock lock(shm));
-			connections[fd] = handle;
-		}
-        return handle;
+        return addConnection(fd);
     }
 
     void notify_close(Handle* h, bool close_wr=true, bool close_rd=true) {
 		HandleTCP *handle = reinterpret_cast<HandleTCP*>(h);
+		auto& sh = shards[h->getShard()];
+		if (close_wr && close_rd) {  // the Handle may be deleted
+			REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+			sh.corked.erase(handle);
+		}
 		if (close_wr) {
 			if (handle->fd != -1) {
 				shutdown(handle->fd, SHUT_WR);
@@ -443,7 +1496,7 @@ public:
 				// we have already received the EOS and thus executed the
 				// notify_close with close_rd=true, we can close the connection
 				if (!close_rd &&
-					connections.find(handle->fd) == connections.end()) {
+					sh.connections.find(handle->fd) == sh.connections.end()) {
 					close(handle->fd);
 					handle->fd = -1;
 				}
@@ -455,23 +1508,18 @@ public:
 			if (fd==-1) return;
 			shutdown(handle->fd, SHUT_RD);
 			{
-				REMOVE_CODE_IF(std::unique_lock lock(shm));
-				connections.erase(fd);
+				REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+				sh.connections.erase(fd);
+#if defined(MTCL_TCP_EPOLL)
+				sh.armed.erase(fd);
+				// ENOENT if the connection has never been yielded
+				epoll_ctl(sh.epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
 				FD_CLR(fd, &set);
 				
 				// update the maximum file descriptor
-				if (fd == fdmax) {
-					int ii;
-					for(ii=(fdmax-1);ii>=0;--ii) {
-						if (FD_ISSET(ii, &set)){
-							fdmax = ii;
-							break;
-						}
-					}
-					// the listen socket might not be in the set, thus without the following
-					// we risk to leave fdmax set to the old value.
-					if (ii==-1) fdmax = -1; 
-				}
+				updateFdmax(fd);
+#endif
 			}
 			if (close_wr) {
 				close(fd);
@@ -484,27 +1532,69 @@ public:
     void notify_yield(Handle* h) override {
         int fd = reinterpret_cast<HandleTCP*>(h)->fd;
 		if (fd==-1) return;
-		REMOVE_CODE_IF(std::unique_lock l(shm));
+		// the socket is not readable if the next header has already been
+		// read ahead, the Handle is ready (addinQ without the lock held)
+		if (reinterpret_cast<HandleTCP*>(h)->buffered() >= HandleTCP::HDR_SZ && !h->isClosed()) {
+			addinQ(false, h);
+			return;
+		}
+		auto& sh = shards[h->getShard()];
+		REMOVE_CODE_IF(std::unique_lock l(sh.shm));
 		if (h->isClosed()) return;
+#if defined(MTCL_TCP_EPOLL)
+		if (sh.connections.count(fd) == 0) return;
+		armConnection(sh, fd);
+#else
+		if (fd >= FD_SETSIZE) {
+			MTCL_TCP_ERROR("ConnTcp::notify_yield fd=%d exceeds FD_SETSIZE, the connection cannot be managed\n", fd);
+			return;
+		}
         FD_SET(fd, &set);
         if(fd > fdmax) {
             fdmax = fd;
         }
+#endif
     }
 
     void end(bool blockflag=false) {
-        auto modified_connections = connections;
-        for(auto& [fd, h] : modified_connections) {
-			setAsClosed(h, blockflag);
+		for(auto& sh : shards) {
+			auto modified_connections = sh.connections;
+			for(auto& [fd, h] : modified_connections) {
+				setAsClosed(h, blockflag);
+			}
+			if (sh.lsck != -1) {
+				close(sh.lsck);
+				sh.lsck = -1;
+			}
+#if defined(MTCL_TCP_EPOLL)
+			close(sh.epfd);
+			sh.epfd = -1;
+#endif
 		}
+		listen_sck = -1;
     }
 
     bool isSet(int fd){
-        REMOVE_CODE_IF(std::shared_lock s(shm));
+#if defined(MTCL_TCP_EPOLL)
+		for(auto& sh : shards) {
+			REMOVE_CODE_IF(std::shared_lock s(sh.shm));
+			if (sh.armed.count(fd)) return true;
+		}
+		return false;
+#else
+        REMOVE_CODE_IF(std::shared_lock s(shards[0].shm));
         return FD_ISSET(fd, &set);
+#endif
     }
 
 };
 
+inline void HandleTCP::addPending() {
+	if (!owner) return;
+	auto& sh = owner->shards[getShard()];
+	REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+	sh.corked.insert(this);
+}
+
 } // namespace
 
@@ -0,0 +1,1073 @@
+#pragma once
+
+/*
+ * TCP transport based on io_uring (protocol name "TCPU"), Linux >= 6.0.
+ *
+ * Each shard owns one ring. Every connection has a multishot receive
+ * armed on it: the kernel fills the buffers provided to the ring and the
+ * data is appended to the receive buffer of the connection, from which
+ * probe/receive/ireceive are served without further system calls. Sends
+ * are sendmsg SQEs; while one is in flight on a connection, the following
+ * messages are queued and then sent all together with a single SQE.
+ * The sockets are registered with the ring (when possible) and the listening
+ * socket uses a multishot accept.
+ *
+ * The completions are reaped by the IO thread of the shard (the ring rings
+ * an eventfd) or, while the IO thread is not doing it, by the threads
+ * blocked in send/receive/wait, one at a time. The framing is the one of
+ * HandleTCP (8-byte big-endian size header), so TCP and TCPU peers can be
+ * connected to each other.
+ */
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <memory>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "tcp.hpp"
+
+namespace MTCL {
+
+/*
+ * Minimal io_uring queue built directly on the system calls. It is not
+ * thread-safe: ConnTcpUring accesses it holding the lock of the shard,
+ * except for wait().
+ */
+class uringQueue {
+	int ring_fd = -1;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+	unsigned  sq_entries  = 0;
+	unsigned  sqe_tail    = 0;  // local tail, published by flush
+	unsigned  to_submit   = 0;
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void*  sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+	size_t sq_sz = 0, cq_sz = 0, sqes_sz = 0;
+
+	// provided receive buffers, the recycled ones are given back to the
+	// kernel by the next SQEs (contiguous ids with one PROVIDE_BUFFERS)
+	char*    bufs = (char*)MAP_FAILED;
+	unsigned nbufs = 0, bufsize = 0;
+	uint16_t bgid = 0;
+	std::vector<uint16_t> recycled;
+
+	int enter(unsigned submit, unsigned wait, unsigned flags) {
+		return (int)syscall(__NR_io_uring_enter, ring_fd, submit, wait, flags, NULL, 0);
+	}
+	int reg(unsigned opcode, void* arg, unsigned nargs) {
+		return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nargs);
+	}
+
+public:
+	uringQueue() {}
+	uringQueue(const uringQueue&) = delete;
+	~uringQueue() { destroy(); }
+
+	int setup(unsigned entries) {
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+		p.cq_entries = entries * 4;
+		if ((ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) return -1;
+		if (!(p.features & IORING_FEAT_NODROP)) {  // 5.5
+			errno = ENOTSUP;
+			return -1;
+		}
+		sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_sz = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+		const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single) sq_sz = cq_sz = std::max(sq_sz, cq_sz);
+		sq_ptr = mmap(0, sq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED) return -1;
+		cq_ptr = single ? sq_ptr :
+			mmap(0, cq_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) return -1;
+		sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = (struct io_uring_sqe*)mmap(0, sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) return -1;
+
+		char* sq = (char*)sq_ptr;
+		sq_head  = (unsigned*)(sq + p.sq_off.head);
+		sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+		sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+		sq_flags = (unsigned*)(sq + p.sq_off.flags);
+		sq_entries = p.sq_entries;
+		unsigned* array = (unsigned*)(sq + p.sq_off.array);
+		for(unsigned i=0; i<sq_entries; ++i) array[i] = i;
+		sqe_tail = *sq_tail;
+
+		char* cq = (char*)cq_ptr;
+		cq_head = (unsigned*)(cq + p.cq_off.head);
+		cq_tail = (unsigned*)(cq + p.cq_off.tail);
+		cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+		cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+		return 0;
+	}
+
+	void destroy() {
+		if (ring_fd != -1) close(ring_fd);  // cancels the pending requests
+		ring_fd = -1;
+		if (sqes != MAP_FAILED) munmap(sqes, sqes_sz);
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_sz);
+		if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_sz);
+		if (bufs != MAP_FAILED) munmap(bufs, (size_t)nbufs * bufsize);
+		sqes = (struct io_uring_sqe*)MAP_FAILED;
+		sq_ptr = cq_ptr = MAP_FAILED;
+		recycled.clear();
+		bufs = (char*)MAP_FAILED;
+	}
+
+	// Provides n buffers of size bytes in the buffer group bgid.
+	// The buffer rings (IORING_REGISTER_PBUF_RING) would save the SQEs, but
+	// they are not used because some kernels fail the receives with ENOBUFS.
+	int setupBuffers(uint16_t group, unsigned n, unsigned size) {
+		nbufs = n; bufsize = size; bgid = group;
+		bufs = (char*)mmap(0, (size_t)n * size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (bufs == MAP_FAILED) return -1;
+		recycled.reserve(n);
+		for(unsigned i=0; i<n; ++i) recycleBuffer(i);
+		provide();
+		return (flush() < 0) ? -1 : 0;
+	}
+	char* buffer(unsigned bid) { return bufs + (size_t)bid * bufsize; }
+	// gives the buffer back to the kernel
+	void recycleBuffer(unsigned bid) { recycled.push_back((uint16_t)bid); }
+
+	// user_data of the PROVIDE_BUFFERS completions, they are not passed to reap's f
+	static constexpr uint64_t PROVIDE_DATA = ~0ULL;
+
+	int registerEventFd(int efd) { return reg(IORING_REGISTER_EVENTFD, &efd, 1); }
+
+	// sparse table of n registered files (5.19)
+	int registerFiles(unsigned n) {
+		struct io_uring_rsrc_register r;
+		memset(&r, 0, sizeof(r));
+		r.nr    = n;
+		r.flags = IORING_RSRC_REGISTER_SPARSE;
+		return reg(IORING_REGISTER_FILES2, &r, sizeof(r));
+	}
+	// sets (fd>=0) or clears (fd=-1) the registered file slot
+	int updateFile(unsigned slot, int fd) {
+		struct io_uring_files_update u;
+		memset(&u, 0, sizeof(u));
+		u.offset = slot;
+		u.fds    = (uint64_t)&fd;
+		return (reg(IORING_REGISTER_FILES_UPDATE, &u, 1) == 1) ? 0 : -1;
+	}
+
+	// Prepares the PROVIDE_BUFFERS SQEs of the recycled buffers (as many
+	// as they fit in the SQ, the others are provided later)
+	void provide() {
+		if (recycled.empty()) return;
+		std::sort(recycled.begin(), recycled.end());
+		size_t i = 0;
+		while(i < recycled.size() && sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < sq_entries) {
+			size_t j = i + 1;
+			while(j < recycled.size() && recycled[j] == recycled[j-1] + 1) ++j;
+			struct io_uring_sqe* sqe = &sqes[sqe_tail & *sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd        = (int)(j - i);
+			sqe->addr      = (uint64_t)buffer(recycled[i]);
+			sqe->len       = bufsize;
+			sqe->off       = recycled[i];
+			sqe->buf_group = bgid;
+			sqe->user_data = PROVIDE_DATA;
+			++sqe_tail;
+			++to_submit;
+			i = j;
+		}
+		recycled.erase(recycled.begin(), recycled.begin() + i);
+	}
+
+	// Returns a zeroed SQE, it is submitted by the next flush
+	struct io_uring_sqe* getSqe() {
+		if (ring_fd == -1) return nullptr;
+		provide();  // the buffers must be available to the following SQEs
+		if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+			flush();
+			if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return nullptr;
+		}
+		struct io_uring_sqe* sqe = &sqes[sqe_tail & *sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		++sqe_tail;
+		++to_submit;
+		return sqe;
+	}
+
+	// Submits all the prepared SQEs with one system call
+	int flush() {
+		if (ring_fd == -1) return 0;
+		provide();
+		if (to_submit == 0) return 0;
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+		const int r = enter(to_submit, 0, 0);
+		if (r < 0) {
+			if (errno != EBUSY && errno != EAGAIN && errno != EINTR)
+				MTCL_TCP_ERROR("uringQueue::flush io_uring_enter ERROR: errno=%d -- %s\n", errno, strerror(errno));
+			return -1;  // retried by the next flush
+		}
+		to_submit -= std::min((unsigned)r, to_submit);
+		return r;
+	}
+
+	// Blocks until at least one completion is available
+	int wait() {
+		if (ring_fd == -1) { errno = EBADF; return -1; }
+		return enter(0, 1, IORING_ENTER_GETEVENTS);
+	}
+
+	// Invokes f on each available completion, it returns their number
+	template<typename F>
+	unsigned reap(F&& f) {
+		unsigned n = 0;
+		if (ring_fd == -1) return 0;
+		while(true) {
+			unsigned head = *cq_head;
+			const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for(; head != tail; ++head, ++n) {
+				const struct io_uring_cqe cqe = cqes[head & *cq_mask];
+				__atomic_store_n(cq_head, head+1, __ATOMIC_RELEASE);
+				if (cqe.user_data == PROVIDE_DATA) {
+					if (cqe.res < 0)
+						MTCL_TCP_ERROR("uringQueue PROVIDE_BUFFERS ERROR: errno=%d -- %s\n", -cqe.res, strerror(-cqe.res));
+					continue;
+				}
+				f(cqe);
+			}
+			// completions that did not fit in the CQ are kept by the kernel
+			// and copied into the CQ by io_uring_enter
+			if (!(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) break;
+			enter(0, 0, IORING_ENTER_GETEVENTS);
+		}
+		return n;
+	}
+};
+
+// State of one send or receive, shared by the request and by the connection.
+struct tcpuOp {
+	std::atomic<bool> done{false};
+	int     err   = 0;
+	ssize_t count = -1;
+	// send
+	uint64_t    hdr  = 0;        // big-endian header, it lives until the send completes
+	const char* sbuf = nullptr;
+	size_t      size = 0;
+	size_t      sent = 0;        // bytes of header and payload already sent
+	// receive
+	char*       rbuf = nullptr;  // nullptr if the request has been destroyed
+	size_t      cap  = 0;
+	bool        sized = false;   // the header has been consumed
+	size_t      msgsize = 0;
+	size_t      got  = 0;
+};
+
+class HandleTCPU;
+
+// A connection of ConnTcpUring. It is owned by its shard and it is released
+// when the Handle has been closed and the kernel has no requests on it.
+struct tcpuConn {
+	uint32_t    id;
+	int         fd;
+	int         slot = -1;          // registered file slot, -1 if not registered
+	HandleTCPU* h    = nullptr;
+
+	std::vector<char> rx;           // received but not yet consumed bytes start at rxoff
+	size_t rxoff      = 0;
+	bool   recvArmed  = false;      // a multishot receive is active
+	bool   cancelling = false;      // the receive has been paused (high watermark)
+	bool   eof        = false;
+	int    rxerr      = 0;
+	bool   yielded    = false;      // owned by the IO thread, reported when readable
+	bool   shutRd = false, shutWr = false, closed = false;
+	std::deque<std::shared_ptr<tcpuOp>> posted;  // ireceive, in posting order
+
+	std::deque<std::shared_ptr<tcpuOp>> txq;     // send/isend, in posting order
+	bool   txBusy = false;          // a sendmsg is in flight
+	int    txerr  = 0;
+	struct msghdr msg;
+	struct iovec  iov[TCPU_MAX_IOV];
+
+	size_t buffered() const { return rx.size() - rxoff; }
+	bool   readable() const {
+		return posted.empty() && (buffered() >= HandleTCP::HDR_SZ || eof || rxerr);
+	}
+};
+
+class ConnTcpUring;
+
+class HandleTCPU : public Handle {
+	friend class ConnTcpUring;
+	ConnTcpUring* owner;
+	tcpuConn*     c;
+
+	// blocking send of one message
+	ssize_t sendMsg(const void* buff, size_t size);
+
+public:
+	HandleTCPU(ConnTcpUring* parent, tcpuConn* c, int shard=0);
+
+	ssize_t sendEOS() { return sendMsg(nullptr, 0); }
+	ssize_t send(const void* buff, size_t size) { return sendMsg(buff, size); }
+	ssize_t isend(const void* buff, size_t size, Request& r);
+	ssize_t isend(const void* buff, size_t size, RequestPool& r);
+	ssize_t probe(size_t& size, const bool blocking=true);
+	bool    peek();
+	ssize_t receive(void* buff, size_t size);
+	ssize_t ireceive(void* buff, size_t size, RequestPool& r);
+	ssize_t ireceive(void* buff, size_t size, Request& r);
+
+	~HandleTCPU() {}
+};
+
+// isend/ireceive request, it completes when the IO thread (or any thread
+// reaping the completions of the shard) has moved all the data.
+class requestTCPU : public request_internal {
+	ConnTcpUring* owner;
+	int shard;
+	std::shared_ptr<tcpuOp> op;
+public:
+	requestTCPU(ConnTcpUring* owner, int shard, std::shared_ptr<tcpuOp> op) :
+		owner(owner), shard(shard), op(std::move(op)) {}
+
+	int test(int& result);
+	int wait();
+	int make_progress();
+	ssize_t count() const override { return op->done ? op->count : -1; }
+	~requestTCPU();
+};
+
+class ConnRequestVectorTCPU : public ConnRequestVector {
+	friend class HandleTCPU;
+	std::vector<request_internal*> requests;
+public:
+	ConnRequestVectorTCPU(size_t sizeHint = 1) {
+		requests.reserve(sizeHint);
+	}
+
+	bool testAll() {
+		int res = 0;
+		for(auto r : requests) {
+			r->test(res);
+			if (!res) return false;
+		}
+		return true;
+	}
+
+	void waitAll() {
+		for(auto r : requests) r->wait();
+	}
+
+	void reset() {
+		for(auto r : requests) delete r;
+		requests.clear();
+	}
+};
+
+
+class ConnTcpUring : public ConnType {
+	friend class HandleTCPU;
+	friend class requestTCPU;
+
+	// kinds of requests, stored in the low byte of the user_data
+	enum : unsigned { OP_RECV = 1, OP_SEND, OP_ACCEPT, OP_CANCEL };
+	static constexpr uint16_t BGID = 0;
+
+	struct shard_t {
+		uringQueue ring;
+		int  efd = -1;                 // rung by the ring and by reapers other than the IO thread
+		bool fixedFiles = false;
+		std::mutex mtx;
+		std::condition_variable cv;    // threads waiting for a completion reaped by another one
+		bool leader = false;           // a thread is waiting for completions in the kernel
+		uint32_t nextId = 1;
+		std::map<uint32_t, std::unique_ptr<tcpuConn>> conns;
+		std::vector<int> freeSlots;
+		std::vector<Handle*> ready;    // readable Handles to be passed to addinQ
+		std::vector<int>     accepted; // new connections to be passed to addinQ (shard 0)
+	};
+	std::deque<shard_t> shards;
+	std::atomic<unsigned> nextShard{0};
+
+	std::string address;
+	int  port;
+	int  listen_sck = -1;
+
+	static uint64_t userData(uint32_t id, unsigned kind) { return ((uint64_t)id << 8) | kind; }
+
+	// ---------------- the following ones require the lock of the shard ----------------
+
+	void prepRecv(shard_t& sh, tcpuConn* c) {
+		struct io_uring_sqe* sqe = sh.ring.getSqe();
+		if (!sqe) return;  // retried by the next rxUpdate
+		sqe->opcode    = IORING_OP_RECV;
+		sqe->fd        = (c->slot >= 0) ? c->slot : c->fd;
+		sqe->flags     = IOSQE_BUFFER_SELECT | ((c->slot >= 0) ? IOSQE_FIXED_FILE : 0);
+		sqe->ioprio    = IORING_RECV_MULTISHOT;
+		sqe->buf_group = BGID;
+		sqe->user_data = userData(c->id, OP_RECV);
+		c->recvArmed   = true;
+		c->cancelling  = false;
+	}
+
+	void prepCancel(shard_t& sh, tcpuConn* c) {
+		struct io_uring_sqe* sqe = sh.ring.getSqe();
+		if (!sqe) return;
+		sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+		sqe->fd        = -1;
+		sqe->addr      = userData(c->id, OP_RECV);
+		sqe->user_data = userData(c->id, OP_CANCEL);
+		c->cancelling  = true;
+	}
+
+	void prepAccept(shard_t& sh) {
+		struct io_uring_sqe* sqe = sh.ring.getSqe();
+		if (!sqe) return;
+		sqe->opcode       = IORING_OP_ACCEPT;
+		sqe->fd           = listen_sck;
+		sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data    = userData(0, OP_ACCEPT);
+	}
+
+	// Sends with one sendmsg the queued messages (at most TCPU_MAX_IOV iovecs).
+	// MSG_WAITALL is not used: a partial send completes and the rest is sent
+	// by the next sendmsg.
+	void prepSend(shard_t& sh, tcpuConn* c) {
+		if (c->txBusy || c->txq.empty()) return;
+		constexpr size_t HDR_SZ = HandleTCP::HDR_SZ;
+		int n = 0;
+		for(auto& op : c->txq) {
+			if (n + 2 > (int)TCPU_MAX_IOV) break;
+			if (op->sent < HDR_SZ) {
+				c->iov[n].iov_base = (char*)&op->hdr + op->sent;
+				c->iov[n++].iov_len = HDR_SZ - op->sent;
+			}
+			const size_t off = (op->sent > HDR_SZ) ? op->sent - HDR_SZ : 0;
+			if (op->size > off) {
+				c->iov[n].iov_base = const_cast<char*>(op->sbuf) + off;
+				c->iov[n++].iov_len = op->size - off;
+			}
+		}
+		struct io_uring_sqe* sqe = sh.ring.getSqe();
+		if (!sqe) return;
+		memset(&c->msg, 0, sizeof(c->msg));
+		c->msg.msg_iov    = c->iov;
+		c->msg.msg_iovlen = n;
+		sqe->opcode    = IORING_OP_SENDMSG;
+		sqe->fd        = (c->slot >= 0) ? c->slot : c->fd;
+		sqe->flags     = (c->slot >= 0) ? IOSQE_FIXED_FILE : 0;
+		sqe->addr      = (uint64_t)&c->msg;
+		sqe->len       = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = userData(c->id, OP_SEND);
+		c->txBusy      = true;
+	}
+
+	static void finishOp(tcpuOp* op, ssize_t count, int err) {
+		op->count = count;
+		op->err   = err;
+		op->done.store(true, std::memory_order_release);
+	}
+
+	void consume(tcpuConn* c, size_t n) {
+		c->rxoff += n;
+		if (c->rxoff == c->rx.size()) {
+			c->rx.clear();
+			c->rxoff = 0;
+		} else if (c->rxoff >= TCPU_RX_BUFFER_SIZE && c->rxoff * 2 >= c->rx.size()) {
+			c->rx.erase(c->rx.begin(), c->rx.begin() + c->rxoff);
+			c->rxoff = 0;
+		}
+	}
+
+	// Pauses the receive if too much data is buffered, resumes it otherwise
+	void rxUpdate(shard_t& sh, tcpuConn* c) {
+		if (c->shutRd || c->eof || c->rxerr) return;
+		if (c->recvArmed) {
+			if (!c->cancelling && c->buffered() > TCPU_RX_HIGH_WATERMARK) prepCancel(sh, c);
+		} else if (c->buffered() <= TCPU_RX_HIGH_WATERMARK/2) prepRecv(sh, c);
+	}
+
+	// Moves the buffered data into the posted receives, then reports the
+	// Handle as readable if it has been yielded
+	void deliver(shard_t& sh, tcpuConn* c) {
+		constexpr size_t HDR_SZ = HandleTCP::HDR_SZ;
+		while(!c->posted.empty()) {
+			tcpuOp* op = c->posted.front().get();
+			if (!op->sized) {
+				if (c->buffered() < HDR_SZ) {
+					if (!c->eof && !c->rxerr) break;
+					finishOp(op, -1, c->rxerr ? c->rxerr : ECONNRESET);
+					c->posted.pop_front();
+					continue;
+				}
+				uint64_t szbe;
+				memcpy(&szbe, c->rx.data() + c->rxoff, HDR_SZ);
+				consume(c, HDR_SZ);
+				op->sized   = true;
+				op->msgsize = (size_t)be64toh(szbe);
+			}
+			const size_t n = std::min(c->buffered(), op->msgsize - op->got);
+			// too large messages are drained to keep the stream aligned
+			if (n && op->rbuf && op->msgsize <= op->cap)
+				memcpy(op->rbuf + op->got, c->rx.data() + c->rxoff, n);
+			consume(c, n);
+			op->got += n;
+			if (op->got < op->msgsize) {
+				if (!c->eof && !c->rxerr) break;
+				finishOp(op, -1, c->rxerr ? c->rxerr : ECONNRESET);
+			} else if (op->msgsize > op->cap) {
+				finishOp(op, op->msgsize, EMSGSIZE);
+			} else finishOp(op, op->msgsize, 0);
+			c->posted.pop_front();
+		}
+		rxUpdate(sh, c);
+		if (c->yielded && c->h && c->readable()) {
+			c->yielded = false;
+			sh.ready.push_back(c->h);
+		}
+	}
+
+	void release(shard_t& sh, tcpuConn* c) {
+		if (!c->closed || c->recvArmed || c->txBusy) return;
+		for(auto& op : c->posted) finishOp(op.get(), -1, ECONNRESET);
+		for(auto& op : c->txq)    finishOp(op.get(), -1, EPIPE);
+		if (c->slot >= 0) {
+			sh.ring.updateFile(c->slot, -1);
+			sh.freeSlots.push_back(c->slot);
+		}
+		close(c->fd);
+		sh.conns.erase(c->id);
+	}
+
+	void complete(shard_t& sh, const struct io_uring_cqe& cqe) {
+		const uint32_t id   = (uint32_t)(cqe.user_data >> 8);
+		const unsigned kind = (unsigned)(cqe.user_data & 0xff);
+		const bool     more = cqe.flags & IORING_CQE_F_MORE;
+		if (kind == OP_ACCEPT) {
+			if (cqe.res >= 0) sh.accepted.push_back(cqe.res);
+			else if (cqe.res != -ECANCELED)
+				MTCL_TCP_ERROR("ConnTcpUring accept ERROR: errno=%d -- %s\n", -cqe.res, strerror(-cqe.res));
+			if (!more && listen_sck != -1) prepAccept(sh);
+			return;
+		}
+		if (kind == OP_CANCEL) return;
+
+		auto it = sh.conns.find(id);
+		tcpuConn* c = (it != sh.conns.end()) ? it->second.get() : nullptr;
+		if (kind == OP_RECV) {
+			if (cqe.flags & IORING_CQE_F_BUFFER) {
+				const unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				if (c && cqe.res > 0) {
+					const char* b = sh.ring.buffer(bid);
+					c->rx.insert(c->rx.end(), b, b + cqe.res);
+				}
+				sh.ring.recycleBuffer(bid);
+			}
+			if (!c) return;
+			if (cqe.res == 0) c->eof = true;
+			// ENOBUFS: no provided buffers, ECANCELED: paused or the thread
+			// that armed the receive has exited. In both cases it is re-armed
+			else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) c->rxerr = -cqe.res;
+			if (!more) c->recvArmed = c->cancelling = false;
+			deliver(sh, c);
+			release(sh, c);
+			return;
+		}
+		if (kind == OP_SEND && c) {
+			c->txBusy = false;
+			if (cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -EINTR) {
+				c->txerr = -cqe.res;
+				for(auto& op : c->txq) finishOp(op.get(), -1, c->txerr);
+				c->txq.clear();
+			} else if (cqe.res > 0) {
+				size_t n = cqe.res;
+				while(n) {
+					tcpuOp* op = c->txq.front().get();
+					const size_t left = HandleTCP::HDR_SZ + op->size - op->sent;
+					if (n < left) {
+						op->sent += n;
+						break;
+					}
+					n -= left;
+					finishOp(op, op->size, 0);
+					c->txq.pop_front();
+				}
+			}
+			prepSend(sh, c);
+			release(sh, c);
+		}
+	}
+
+	// Reaps the available completions, the caller must not be the leader
+	unsigned reap(shard_t& sh) {
+		return sh.ring.reap([&](const struct io_uring_cqe& cqe) { complete(sh, cqe); });
+	}
+
+	// Reapers other than the IO thread wake it up if they found work for it
+	void notifyIOThread(shard_t& sh) {
+		if (sh.ready.empty() && sh.accepted.empty()) return;
+		uint64_t one = 1;
+		if (write(sh.efd, &one, sizeof(one)) < 0) {} // the counter cannot overflow
+	}
+
+	// Waits until pred holds. If no other thread is doing it, the caller waits
+	// for the completions in the kernel and reaps them, otherwise it waits for
+	// the thread doing it.
+	template<typename P>
+	void waitFor(shard_t& sh, std::unique_lock<std::mutex>& l, P&& pred) {
+		while(true) {
+			if (!sh.leader && reap(sh)) {
+				notifyIOThread(sh);
+				sh.cv.notify_all();
+			}
+			if (pred()) break;
+			sh.ring.flush();
+			if (sh.leader) {
+				sh.cv.wait(l);
+				continue;
+			}
+			sh.leader = true;
+			l.unlock();
+			sh.ring.wait();
+			l.lock();
+			sh.leader = false;
+			sh.cv.notify_all();  // a waiter may have to become the leader
+		}
+		sh.ring.flush();
+	}
+
+	// ---------------------------------------------------------------------------
+
+	// non-blocking progress of the shard
+	void progress(int shard) {
+		auto& sh = shards[shard];
+		std::unique_lock l(sh.mtx);
+		if (!sh.leader && reap(sh)) {
+			notifyIOThread(sh);
+			sh.cv.notify_all();
+		}
+		sh.ring.flush();
+	}
+
+	void waitOp(int shard, const std::shared_ptr<tcpuOp>& op) {
+		if (op->done) return;
+		auto& sh = shards[shard];
+		std::unique_lock l(sh.mtx);
+		waitFor(sh, l, [&]{ return op->done.load(); });
+	}
+
+	void abandonOp(int shard, const std::shared_ptr<tcpuOp>& op) {
+		if (op->done || shards.empty()) return;
+		std::unique_lock l(shards[shard].mtx);
+		op->rbuf = nullptr;  // the remaining part of the message is discarded
+	}
+
+	// queues the send, the caller waits for its completion if blocking
+	int postSend(HandleTCPU& h, const std::shared_ptr<tcpuOp>& op, bool blocking) {
+		auto& sh = shards[h.getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = h.c;
+		if (c->txerr || c->shutWr) {
+			errno = c->txerr ? c->txerr : EPIPE;
+			return -1;
+		}
+		c->txq.push_back(op);
+		prepSend(sh, c);  // no-op if a sendmsg is in flight, op goes with the next one
+		if (!blocking) {
+			sh.ring.flush();
+			return 0;
+		}
+		waitFor(sh, l, [&]{ return op->done.load(); });
+		if (op->err) {
+			errno = op->err;
+			return -1;
+		}
+		return 0;
+	}
+
+	void postReceive(HandleTCPU& h, const std::shared_ptr<tcpuOp>& op) {
+		auto& sh = shards[h.getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = h.c;
+		if (h.probed.first) {  // the header has been consumed by probe
+			op->sized   = true;
+			op->msgsize = h.probed.second;
+			h.probed    = {false, 0};
+		}
+		c->posted.push_back(op);
+		deliver(sh, c);
+		sh.ring.flush();
+	}
+
+	ssize_t probe(HandleTCPU& h, size_t& size, bool blocking) {
+		constexpr size_t HDR_SZ = HandleTCP::HDR_SZ;
+		auto& sh = shards[h.getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = h.c;
+		if (!c->readable()) {
+			if (!blocking) {
+				if (!sh.leader && reap(sh)) {
+					notifyIOThread(sh);
+					sh.cv.notify_all();
+				}
+				sh.ring.flush();
+				if (!c->readable()) {
+					errno = EWOULDBLOCK;
+					return -1;
+				}
+			} else waitFor(sh, l, [&]{ return c->readable(); });
+		}
+		if (c->buffered() >= HDR_SZ) {
+			uint64_t szbe;
+			memcpy(&szbe, c->rx.data() + c->rxoff, HDR_SZ);
+			consume(c, HDR_SZ);
+			rxUpdate(sh, c);
+			sh.ring.flush();
+			size = (size_t)be64toh(szbe);
+			h.probed = {true, size};
+			return (size ? (ssize_t)HDR_SZ : 0);
+		}
+		if (c->buffered() || c->rxerr) {  // the stream broke in the middle of a header
+			errno = c->rxerr ? c->rxerr : ECONNRESET;
+			return -1;
+		}
+		size = 0;
+		h.probed = {true, 0};
+		return 0;
+	}
+
+	// receives the payload of the probed message
+	ssize_t receivePayload(HandleTCPU& h, void* buff, size_t size) {
+		auto& sh = shards[h.getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = h.c;
+		size_t got = 0;
+		waitFor(sh, l, [&]{
+			const size_t n = std::min(c->buffered(), size - got);
+			if (n) {
+				memcpy((char*)buff + got, c->rx.data() + c->rxoff, n);
+				consume(c, n);
+				rxUpdate(sh, c);
+				got += n;
+			}
+			return got == size || c->eof || c->rxerr;
+		});
+		if (got < size) {
+			errno = c->rxerr ? c->rxerr : ECONNRESET;
+			return -1;
+		}
+		return (ssize_t)got;
+	}
+
+	bool peek(HandleTCPU& h) {
+		auto& sh = shards[h.getShard()];
+		std::unique_lock l(sh.mtx);
+		if (!sh.leader && reap(sh)) {
+			notifyIOThread(sh);
+			sh.cv.notify_all();
+		}
+		sh.ring.flush();
+		return h.c->readable();
+	}
+
+	// creates the Handle for a new connection and assigns it to a shard
+	Handle* addConnection(int fd) {
+		const int s = nextShard++ % shards.size();
+		auto& sh = shards[s];
+		std::unique_lock l(sh.mtx);
+		const uint32_t id = sh.nextId++;
+		if (sh.nextId >= (1u << 24)) sh.nextId = 1;  // the id must fit in 56 bits of user_data
+		auto& c = sh.conns[id];
+		c.reset(new tcpuConn());
+		c->id = id;
+		c->fd = fd;
+		if (sh.fixedFiles && !sh.freeSlots.empty()) {
+			c->slot = sh.freeSlots.back();
+			sh.freeSlots.pop_back();
+			if (sh.ring.updateFile(c->slot, fd) < 0) {
+				sh.freeSlots.push_back(c->slot);
+				c->slot = -1;
+			}
+		}
+		HandleTCPU* handle = new HandleTCPU(this, c.get(), s);
+		c->h = handle;
+		prepRecv(sh, c.get());
+		sh.ring.flush();
+		return handle;
+	}
+
+	static void setNoDelay(int fd) {
+#ifdef MTCL_DISABLE_NAGLE
+		int flag = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int)) < 0)
+			MTCL_TCP_ERROR("ConnTcpUring setsockopt ERROR: errno=%d -- %s\n", errno, strerror(errno));
+#endif
+	}
+
+public:
+	ConnTcpUring() {}
+	~ConnTcpUring() {}
+
+	int maxShards() { return std::numeric_limits<int>::max(); }
+
+	int init(std::string) {
+		listen_sck = -1;
+		shards.clear();
+		for(int i=0; i<nshards; ++i) shards.emplace_back();
+		for(auto& sh : shards) {
+			if (sh.ring.setup(TCPU_RING_ENTRIES) < 0 ||
+				sh.ring.setupBuffers(BGID, TCPU_RX_BUFFERS, TCPU_RX_BUFFER_SIZE) < 0) {
+				MTCL_TCP_ERROR("ConnTcpUring::init io_uring setup ERROR: errno=%d -- %s\n", errno, strerror(errno));
+				return -1;
+			}
+			if ((sh.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+				sh.ring.registerEventFd(sh.efd) < 0) {
+				MTCL_TCP_ERROR("ConnTcpUring::init eventfd ERROR: errno=%d -- %s\n", errno, strerror(errno));
+				return -1;
+			}
+			// without registered files the requests use the plain fds
+			sh.fixedFiles = (sh.ring.registerFiles(TCPU_REGISTERED_FILES) == 0);
+			if (sh.fixedFiles)
+				for(int i=TCPU_REGISTERED_FILES-1; i>=0; --i) sh.freeSlots.push_back(i);
+			else
+				MTCL_TCP_PRINT(100, "ConnTcpUring::init registered files not available, errno=%d\n", errno);
+		}
+		return 0;
+	}
+
+	int listen(std::string s) {
+		address = s.substr(0, s.find(":"));
+		port = stoi(s.substr(address.length()+1));
+		if ((listen_sck = tcpListenSocket(address, port)) < 0) return -1;
+
+		MTCL_TCP_PRINT(1, "listen (io_uring) to %s:%d\n", address.c_str(), port);
+
+		auto& sh = shards[0];
+		std::unique_lock l(sh.mtx);
+		prepAccept(sh);
+		sh.ring.flush();
+		return 0;
+	}
+
+	void update() { updateShard(0); }
+
+	void updateShard(int shard) {
+		auto& sh = shards[shard];
+		uint64_t cnt;
+		if (read(sh.efd, &cnt, sizeof(cnt)) < 0) {}  // EAGAIN if nothing happened
+		std::vector<Handle*> ready;
+		std::vector<int> accepted;
+		{
+			std::unique_lock l(sh.mtx);
+			if (!sh.leader && reap(sh)) sh.cv.notify_all();
+			sh.ring.flush();
+			ready.swap(sh.ready);
+			accepted.swap(sh.accepted);
+		}
+		for(int fd : accepted) {
+			setNoDelay(fd);
+			addinQ(true, addConnection(fd));
+		}
+		for(auto h : ready) addinQ(false, h);
+	}
+
+	// the eventfd is rung by the ring for each completion
+	int getEventFd(int shard=0) { return shards[shard].efd; }
+
+	Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
+		int fd = internal_connect(address, retry, timeout_ms);
+		if (fd == -1) return nullptr;
+		setNoDelay(fd);
+		return addConnection(fd);
+	}
+
+	void notify_yield(Handle* h) override {
+		auto& sh = shards[h->getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = static_cast<HandleTCPU*>(h)->c;
+		if (h->isClosed() || c->shutRd) return;
+		c->yielded = true;
+		deliver(sh, c);  // the data may have been already received
+		sh.ring.flush();
+		notifyIOThread(sh);
+	}
+
+	void notify_close(Handle* h, bool close_wr=true, bool close_rd=true) {
+		auto& sh = shards[h->getShard()];
+		std::unique_lock l(sh.mtx);
+		tcpuConn* c = static_cast<HandleTCPU*>(h)->c;
+		if (close_wr && !c->shutWr) {
+			c->shutWr = true;
+			shutdown(c->fd, SHUT_WR);
+		}
+		if (close_rd && !c->shutRd) {
+			c->shutRd  = true;
+			c->yielded = false;
+			shutdown(c->fd, SHUT_RD);
+			if (c->recvArmed && !c->cancelling) prepCancel(sh, c);
+			for(auto it = sh.ready.begin(); it != sh.ready.end(); )
+				it = (*it == h) ? sh.ready.erase(it) : it + 1;
+		}
+		if (close_wr && close_rd) {
+			c->closed = true;
+			c->h = nullptr;
+			release(sh, c);
+		}
+		sh.ring.flush();
+	}
+
+	void end(bool blockflag=false) {
+		for(auto& sh : shards) {
+			std::vector<Handle*> handles;
+			{
+				std::unique_lock l(sh.mtx);
+				for(auto& [id, c] : sh.conns)
+					if (c->h) handles.push_back(c->h);
+			}
+			for(auto h : handles) setAsClosed(h, blockflag);
+		}
+		if (listen_sck != -1) {
+			close(listen_sck);
+			listen_sck = -1;
+		}
+		for(auto& sh : shards) {
+			std::unique_lock l(sh.mtx);
+			sh.ring.destroy();  // cancels the requests still in flight
+			for(auto& [id, c] : sh.conns) close(c->fd);
+			sh.conns.clear();
+			for(int fd : sh.accepted) close(fd);
+			sh.accepted.clear();
+			sh.ready.clear();
+			if (sh.efd != -1) close(sh.efd);
+			sh.efd = -1;
+		}
+	}
+};
+
+
+inline HandleTCPU::HandleTCPU(ConnTcpUring* parent, tcpuConn* c, int shard) :
+	Handle(parent, shard), owner(parent), c(c) {}
+
+inline ssize_t HandleTCPU::sendMsg(const void* buff, size_t size) {
+	auto op  = std::make_shared<tcpuOp>();
+	op->hdr  = htobe64((uint64_t)size);
+	op->sbuf = (const char*)buff;
+	op->size = size;
+	if (owner->postSend(*this, op, true) < 0) return -1;
+	return size;
+}
+
+inline ssize_t HandleTCPU::isend(const void* buff, size_t size, Request& r) {
+	auto op  = std::make_shared<tcpuOp>();
+	op->hdr  = htobe64((uint64_t)size);
+	op->sbuf = (const char*)buff;
+	op->size = size;
+	if (owner->postSend(*this, op, false) < 0) return -1;
+	r.__setInternalR(new requestTCPU(owner, getShard(), std::move(op)));
+	return 0;
+}
+
+inline ssize_t HandleTCPU::isend(const void* buff, size_t size, RequestPool& r) {
+	auto op  = std::make_shared<tcpuOp>();
+	op->hdr  = htobe64((uint64_t)size);
+	op->sbuf = (const char*)buff;
+	op->size = size;
+	if (owner->postSend(*this, op, false) < 0) return -1;
+	r._getInternalVector<ConnRequestVectorTCPU>()->requests.push_back(new requestTCPU(owner, getShard(), std::move(op)));
+	return 0;
+}
+
+inline ssize_t HandleTCPU::probe(size_t& size, const bool blocking) {
+	if (probed.first) {
+		size = probed.second;
+		return (size ? (ssize_t)HandleTCP::HDR_SZ : 0);
+	}
+	return owner->probe(*this, size, blocking);
+}
+
+inline bool HandleTCPU::peek() { return owner->peek(*this); }
+
+inline ssize_t HandleTCPU::receive(void* buff, size_t size) {
+	size_t probedSize;
+	if (!probed.first) {
+		ssize_t r = probe(probedSize);
+		if (r <= 0) return r;
+	} else
+		probedSize = probed.second;
+
+	if (probedSize == 0) {
+		probed = {false, 0};
+		return 0;
+	}
+	if (probedSize > size) {
+		MTCL_TCP_PRINT(100, "[internal]:\t", "HandleTCPU::receive EMSGSIZE, buffer too small\n");
+		errno = EMSGSIZE;
+		return -1;
+	}
+	probed = {false, 0};
+	return owner->receivePayload(*this, buff, probedSize);
+}
+
+inline ssize_t HandleTCPU::ireceive(void* buff, size_t size, RequestPool& r) {
+	auto op  = std::make_shared<tcpuOp>();
+	op->rbuf = (char*)buff;
+	op->cap  = size;
+	owner->postReceive(*this, op);
+	r._getInternalVector<ConnRequestVectorTCPU>()->requests.push_back(new requestTCPU(owner, getShard(), std::move(op)));
+	return 0;
+}
+
+inline ssize_t HandleTCPU::ireceive(void* buff, size_t size, Request& r) {
+	auto op  = std::make_shared<tcpuOp>();
+	op->rbuf = (char*)buff;
+	op->cap  = size;
+	owner->postReceive(*this, op);
+	r.__setInternalR(new requestTCPU(owner, getShard(), std::move(op)));
+	return 0;
+}
+
+inline int requestTCPU::test(int& result) {
+	if (!op->done) owner->progress(shard);
+	if (!op->done.load(std::memory_order_acquire)) {
+		result = 0;
+		return 0;
+	}
+	result = 1;
+	if (op->err) {
+		errno = op->err;
+		return -1;
+	}
+	return 0;
+}
+
+inline int requestTCPU::wait() {
+	owner->waitOp(shard, op);
+	if (op->err) {
+		errno = op->err;
+		return -1;
+	}
+	return 0;
+}
+
+inline int requestTCPU::make_progress() {
+	owner->progress(shard);
+	return 0;
+}
+
+inline requestTCPU::~requestTCPU() { owner->abandonOp(shard, op); }
+
+} // namespace
@@ -0,0 +1,457 @@
+#ifndef TCPX_HPP
+#define TCPX_HPP
+
+#include <poll.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+#include "tcp.hpp"
+
+namespace MTCL {
+
+/*
+ * Multi-stream TCP (TCPX): each connection is made of TCPX_STREAMS sockets
+ * between the same endpoints, one Handle for all of them.
+ *
+ * The first socket (the primary one) is a regular TCP connection: it carries
+ * the headers, the small messages and the EOS, and it is the one polled for
+ * readiness. The payload of the messages of at least TCPX_STRIPE_THRESHOLD
+ * bytes is split into contiguous slices, one per socket, transferred in
+ * parallel with non-blocking IO and read directly into the user buffer.
+ *
+ * When connecting, every socket sends a hello with the token of the
+ * connection and its index; the listener creates the Handle once all the
+ * sockets of a connection have been accepted. The number of streams and the
+ * threshold are the ones of the connecting side.
+ *
+ * The bandwidth can be compared with the one of TCP with zerocopy-perf, e.g.
+ *  $> ./zerocopy-perf 0 "TCPX:localhost:13000" & ./zerocopy-perf 1 "TCPX:localhost:13000"
+ */
+
+class HandleTCPX : public HandleTCP {
+	friend class ConnTcpX;
+	std::vector<int> streams;  // the sockets of the connection, streams[0] is fd
+	size_t stripeMin = 0;      // min size of the striped messages
+
+	bool striped(size_t size) const { return streams.size() > 1 && size >= stripeMin; }
+
+	// Splits the payload of a striped message into the slices, the slice i
+	// on streams[i] (the slices are multiple of the page size, the last one
+	// takes the rest).
+	void slice(size_t size, size_t* off, size_t* len) const {
+		const size_t n = streams.size();
+		const size_t chunk = (size / n) & ~(size_t)4095;
+		for(size_t i=0; i<n; ++i) {
+			off[i] = chunk * i;
+			len[i] = (i == n-1) ? size - off[i] : chunk;
+		}
+	}
+
+	// Transfers as much data of the slices as possible without blocking. It
+	// returns the number of bytes transferred or -1 (EAGAIN if no stream is
+	// ready). The primary socket is read through the read-ahead buffer.
+	ssize_t transferSome(char* buff, size_t* off, size_t* len, bool out) {
+		ssize_t moved = 0;
+		for(size_t i=0; i<streams.size(); ++i) {
+			while(len[i] > 0) {
+				ssize_t r;
+				if (out) r = ::send(streams[i], buff + off[i], len[i], MSG_DONTWAIT | MSG_NOSIGNAL);
+				else if (i == 0) r = rxRead(buff + off[i], len[i], MSG_DONTWAIT);
+				else r = ::recv(streams[i], buff + off[i], len[i], MSG_DONTWAIT);
+				if (r > 0) {
+					off[i] += r;
+					len[i] -= r;
+					moved  += r;
+					continue;
+				}
+				if (r < 0 && errno == EINTR) continue;
+				if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+				if (r == 0) errno = ECONNRESET;  // the stream broke within the message
+				MTCL_TCPX_PRINT(100, "HandleTCPX::transfer stream %ld errno=%d\n", i, errno);
+				return -1;
+			}
+		}
+		if (moved > 0) return moved;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// sets the streams with a slice still to transfer, it returns their number
+	int sliceFds(const size_t* len, bool out, struct pollfd* pfd) const {
+		int np = 0;
+		for(size_t i=0; i<streams.size(); ++i)
+			if (len[i] > 0) pfd[np++] = {streams[i], (short)(out ? POLLOUT : POLLIN), 0};
+		return np;
+	}
+
+	// Transfers the payload of a striped message, blocking until completion.
+	ssize_t transfer(char* buff, size_t size, bool out) {
+		size_t off[TCPX_MAX_STREAMS], len[TCPX_MAX_STREAMS];
+		slice(size, off, len);
+		for(size_t left = size; left > 0; ) {
+			const ssize_t r = transferSome(buff, off, len, out);
+			if (r > 0) {
+				left -= r;
+				continue;
+			}
+			if (errno != EAGAIN) return -1;
+			struct pollfd pfd[TCPX_MAX_STREAMS];
+			const int np = sliceFds(len, out, pfd);
+			if (poll(pfd, np, TCP_ASYNC_WAIT_TIMEOUT) < 0 && errno != EINTR) return -1;
+		}
+		return size;
+	}
+
+	// the striped message posted with ireceive, at the front of the receive
+	// queue: the slices left and the buffer draining a too large message
+	size_t oobOff[TCPX_MAX_STREAMS], oobLen[TCPX_MAX_STREAMS];
+	size_t oobLeft = 0;
+	std::vector<char> oobDrain;
+
+	ssize_t sendStriped(const char* buff, size_t size) {
+		if (flush() < 0) return -1;  // the buffered and pending sends go first
+		const uint64_t szbe = htobe64((uint64_t)size);
+		if (writen(fd, (const char*)&szbe, HDR_SZ) != (ssize_t)HDR_SZ) return -1;
+		return transfer(const_cast<char*>(buff), size, true);
+	}
+
+	// the striped messages are sent synchronously, the Request is complete
+	std::shared_ptr<tcpAsyncOp> sendCompleted(const void* buff, size_t size) {
+		auto op = std::make_shared<tcpAsyncOp>();
+		if (sendStriped((const char*)buff, size) < 0) completeOp(*op, -1, errno);
+		else completeOp(*op, size);
+		return op;
+	}
+
+protected:
+	// the payload of the striped messages posted with ireceive is read from
+	// all the streams, without blocking, by the progress of the receives
+	bool recvOutOfBand(tcpAsyncOp& op) {
+		if (!striped(op.msgsize)) return false;
+		slice(op.msgsize, oobOff, oobLen);
+		oobLeft = op.msgsize;
+		return true;
+	}
+
+	ssize_t progressOutOfBand(tcpAsyncOp& op) {
+		// too large messages are drained to keep the streams aligned (also
+		// the rest of the message whose Request has been destroyed)
+		const bool fits = op.rbuf && op.msgsize <= op.size;
+		if (!fits) oobDrain.resize(op.msgsize);
+		const ssize_t r = transferSome(fits ? op.rbuf : oobDrain.data(), oobOff, oobLen, false);
+		if (r > 0 && (oobLeft -= r) == 0) {
+			if (!fits) {
+				MTCL_TCPX_PRINT(100, "HandleTCPX::ireceive EMSGSIZE, buffer too small\n");
+				completeOp(op, op.msgsize, EMSGSIZE);
+			} else completeOp(op, op.msgsize);
+			std::vector<char>().swap(oobDrain);
+		}
+		return r;
+	}
+
+	int outOfBandFds(struct pollfd* pfd) { return sliceFds(oobLen, false, pfd); }
+
+public:
+	HandleTCPX(ConnType* parent, int fd, int shard=0) : HandleTCP(parent, fd, shard) {}
+
+	ssize_t send(const void* buff, size_t size) {
+		if (!striped(size)) return HandleTCP::send(buff, size);
+		return sendStriped((const char*)buff, size);
+	}
+
+	// the striped messages are gathered and sent by send
+	ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		if (iovcnt > 0 && iov && striped(iovLength(iov, iovcnt))) return Handle::sendv(iov, iovcnt);
+		return HandleTCP::sendv(iov, iovcnt);
+	}
+
+	ssize_t isend(const void* buff, size_t size, Request& r) {
+		if (!striped(size)) return HandleTCP::isend(buff, size, r);
+		r.__setInternalR(new requestTCP(this, sendCompleted(buff, size)));
+		return 0;
+	}
+
+	ssize_t isend(const void* buff, size_t size, RequestPool& r) {
+		if (!striped(size)) return HandleTCP::isend(buff, size, r);
+		auto* v = r._getInternalVector<ConnRequestVectorTCP>();
+		v->requests.push_back(new requestTCP(this, sendCompleted(buff, size)));
+		return 0;
+	}
+
+	ssize_t receive(void* buff, size_t size) {
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+		if (!striped(probedSize)) return HandleTCP::receive(buff, size);
+		if (probedSize > size){
+			MTCL_TCPX_PRINT(100, "HandleTCPX::receive EMSGSIZE, buffer too small\n");
+			errno=EMSGSIZE;
+			return -1;
+		}
+		probed = {false, 0};
+		if (transfer((char*)buff, probedSize, false) < 0) return -1;
+		return probedSize;
+	}
+
+	// the striped messages are received by receive and scattered
+	ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (iovcnt <= 0 || !iov) return Handle::receivev(iov, iovcnt);  // EINVAL
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+		if (striped(probedSize)) return Handle::receivev(iov, iovcnt);
+		return HandleTCP::receivev(iov, iovcnt);
+	}
+
+#if defined(MTCL_TCP_SENDFILE)
+	// the striped messages are sent and received through the mapped file
+	ssize_t sendFile(int ffd, off_t offset, size_t len) {
+		if (striped(len)) return Handle::sendFile(ffd, offset, len);
+		return HandleTCP::sendFile(ffd, offset, len);
+	}
+
+	ssize_t receiveToFile(int ffd, off_t offset, size_t maxlen) {
+		size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+		if (striped(probedSize)) return Handle::receiveToFile(ffd, offset, maxlen);
+		return HandleTCP::receiveToFile(ffd, offset, maxlen);
+	}
+#endif
+
+	~HandleTCPX() {
+		for(size_t i=1; i<streams.size(); ++i) ::close(streams[i]);
+	}
+};
+
+class ConnTcpX : public ConnTcp {
+	// sent by each socket of a connection (big-endian fields)
+	struct hello_t {
+		uint32_t magic;
+		uint32_t index;      // of the socket in the connection
+		uint32_t nstreams;
+		uint32_t unused;
+		uint64_t token;      // identifies the connection
+		uint64_t stripeMin;
+	};
+	static constexpr uint32_t HELLO_MAGIC = 0x54435058;  // "TCPX"
+
+	// The accepted sockets are managed by the IO thread of shard 0 and they
+	// never block it: a socket waits for its hello in greetings, polled with
+	// the connections of the shard, then it joins its connection in pending
+	// until all the sockets of the connection have been accepted. The sockets
+	// are closed if their hello does not arrive within TCPX_HELLO_TIMEOUT
+	// milliseconds, or their connection is not complete within
+	// TCPX_CONNECT_TIMEOUT milliseconds.
+	struct greeting_t {
+		hello_t hello;
+		size_t  got = 0;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	std::map<int, greeting_t> greetings;  // by socket
+	struct pending_t {
+		std::vector<int> fds;
+		size_t count = 0;
+		size_t stripeMin = 0;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	std::map<uint64_t, pending_t> pending;
+
+	size_t nstreams  = TCPX_STREAMS;
+	size_t stripeMin = TCPX_STRIPE_THRESHOLD;
+	std::atomic<uint64_t> nextToken{0};
+
+	int sendHello(int fd, uint64_t token, size_t index) {
+		hello_t hello{};
+		hello.magic     = htobe32(HELLO_MAGIC);
+		hello.index     = htobe32((uint32_t)index);
+		hello.nstreams  = htobe32((uint32_t)nstreams);
+		hello.token     = htobe64(token);
+		hello.stripeMin = htobe64((uint64_t)stripeMin);
+		ssize_t r;
+		while((r = ::send(fd, &hello, sizeof(hello), MSG_NOSIGNAL)) < 0 && errno == EINTR);
+		return (r == (ssize_t)sizeof(hello)) ? 0 : -1;
+	}
+
+	// Reads the hello of an accepted socket without blocking. It returns 1
+	// once it is complete, 0 if more data is needed and -1 on error.
+	int recvHello(int fd, greeting_t& g) {
+		while(g.got < sizeof(g.hello)) {
+			const ssize_t r = ::recv(fd, (char*)&g.hello + g.got, sizeof(g.hello) - g.got, MSG_DONTWAIT);
+			if (r == 0) {
+				errno = ECONNRESET;
+				return -1;
+			}
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+			}
+			g.got += r;
+		}
+		hello_t& hello  = g.hello;
+		hello.index     = be32toh(hello.index);
+		hello.nstreams  = be32toh(hello.nstreams);
+		hello.token     = be64toh(hello.token);
+		hello.stripeMin = be64toh(hello.stripeMin);
+		if (be32toh(hello.magic) != HELLO_MAGIC || hello.nstreams == 0 ||
+			hello.nstreams > TCPX_MAX_STREAMS || hello.index >= hello.nstreams) {
+			errno = EPROTO;
+			return -1;
+		}
+		return 1;
+	}
+
+	void invalidSocket(int fd) {
+		MTCL_TCPX_PRINT(100, "ConnTcpX::update invalid connection, errno=%d\n", errno);
+		close(fd);
+	}
+
+	// adds the socket to its connection, whose Handle is created once all
+	// its sockets have been accepted
+	void joinConnection(int connfd, const hello_t& hello) {
+		if (setupSocket(connfd) < 0) {
+			invalidSocket(connfd);
+			return;
+		}
+		auto& p = pending[hello.token];
+		if (p.fds.empty()) {
+			p.fds.assign(hello.nstreams, -1);
+			p.stripeMin = hello.stripeMin;
+			p.deadline  = std::chrono::steady_clock::now() + std::chrono::milliseconds(TCPX_CONNECT_TIMEOUT);
+		}
+		if (p.fds.size() != hello.nstreams || p.fds[hello.index] != -1) {
+			MTCL_TCPX_PRINT(100, "ConnTcpX::update unexpected socket %u of the connection %lx\n", hello.index, hello.token);
+			close(connfd);
+			return;
+		}
+		p.fds[hello.index] = connfd;
+		if (++p.count < p.fds.size()) return;
+		auto* h = addStreams(p.fds, p.stripeMin);
+		pending.erase(hello.token);
+		addinQ(true, h);
+	}
+
+	HandleTCPX* addStreams(std::vector<int>& fds, size_t stripe) {
+		auto* h = static_cast<HandleTCPX*>(addConnection(fds[0]));
+		h->streams.swap(fds);
+		h->stripeMin = stripe;
+		return h;
+	}
+
+protected:
+	HandleTCP* createHandle(int fd, int shard) { return new HandleTCPX(this, fd, shard); }
+
+	// the sockets of a connection are grouped by the listener of shard 0
+	void acceptedSocket(int connfd, int) {
+		greeting_t g;
+		g.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TCPX_HELLO_TIMEOUT);
+		const int r = recvHello(connfd, g);
+		if (r == 1) joinConnection(connfd, g.hello);
+		else if (r == 0 && watchSocket(connfd, 0) == 0) greetings.emplace(connfd, g);
+		else invalidSocket(connfd);
+	}
+
+	// the rest of a hello
+	bool socketEvent(int fd, int) {
+		auto it = greetings.find(fd);
+		if (it == greetings.end()) return false;
+		const int r = recvHello(fd, it->second);
+		if (r == 0) return true;
+		const hello_t hello = it->second.hello;
+		greetings.erase(it);
+		unwatchSocket(fd, 0);
+		if (r == 1) joinConnection(fd, hello);
+		else invalidSocket(fd);
+		return true;
+	}
+
+	void expireSockets(int shard) {
+		if (shard != 0 || (greetings.empty() && pending.empty())) return;
+		const auto now = std::chrono::steady_clock::now();
+		for(auto it = greetings.begin(); it != greetings.end(); ) {
+			if (it->second.deadline > now) {
+				++it;
+				continue;
+			}
+			unwatchSocket(it->first, 0);
+			errno = ETIMEDOUT;
+			invalidSocket(it->first);
+			it = greetings.erase(it);
+		}
+		for(auto it = pending.begin(); it != pending.end(); ) {
+			auto& p = it->second;
+			if (p.deadline > now) {
+				++it;
+				continue;
+			}
+			MTCL_TCPX_PRINT(100, "ConnTcpX::update connection %lx incomplete (%ld sockets out of %ld), closing it\n", it->first, p.count, p.fds.size());
+			for(int fd : p.fds) if (fd != -1) close(fd);
+			it = pending.erase(it);
+		}
+	}
+
+public:
+	int init(std::string s) {
+		const int r = ConnTcp::init(s);
+		reusePort = false;
+		char *env;
+		if ((env=std::getenv("MTCL_TCPX_STREAMS")) != NULL) {
+			try {
+				nstreams = std::stoul(env);
+			} catch(...) { nstreams = 0; }
+			if (nstreams == 0 || nstreams > TCPX_MAX_STREAMS) {
+				MTCL_TCPX_ERROR("invalid MTCL_TCPX_STREAMS value, it should be a number between 1 and %u\n", TCPX_MAX_STREAMS);
+				nstreams = TCPX_STREAMS;
+			}
+		}
+		if ((env=std::getenv("MTCL_TCPX_STRIPE_THRESHOLD")) != NULL) {
+			try {
+				stripeMin = std::stoull(env);
+			} catch(...) {
+				MTCL_TCPX_ERROR("invalid MTCL_TCPX_STRIPE_THRESHOLD value, it should be a number of bytes\n");
+			}
+		}
+		// tokens unique among the clients of a listener
+		nextToken = ((uint64_t)getpid() << 32) ^ (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+		return r;
+	}
+
+	Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
+		const uint64_t token = nextToken++;
+		std::vector<int> fds;
+		for(size_t i=0; i<nstreams; ++i) {
+			const int fd = connectSocket(address, retry, timeout_ms);
+			if (fd == -1 || setupSocket(fd) < 0 || sendHello(fd, token, i) < 0) {
+				MTCL_TCPX_PRINT(100, "ConnTcpX::connect socket %ld of %s failed, errno=%d\n", i, address.c_str(), errno);
+				if (fd != -1) close(fd);
+				for(int f : fds) close(f);
+				return nullptr;
+			}
+			fds.push_back(fd);
+		}
+		return addStreams(fds, stripeMin);
+	}
+
+	void end(bool blockflag=false) {
+		ConnTcp::end(blockflag);
+		for(auto& [fd, g] : greetings) close(fd);
+		greetings.clear();
+		for(auto& [token, p] : pending)
+			for(int fd : p.fds) if (fd != -1) close(fd);
+		pending.clear();
+	}
+};
+
+} // namespace
+
+#endif
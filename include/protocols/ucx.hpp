@@ -20,6 +20,7 @@
 #include <vector>
 #include <algorithm>
 #include <deque>
+#include <limits>
 
 #include <unistd.h>
 #include <sys/uio.h>
@@ -34,6 +35,10 @@
 #include "../utils.hpp" 
 #include "../config.hpp"
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+#include <sys/epoll.h>
+#endif
+
 namespace MTCL {
 
 class HandleUCX;
@@ -574,11 +579,12 @@ protected:
 	// Receive exactly 'size' bytes from the UCX stream (WAITALL).
 	// This is used only when the exact message size is already known (after probe).
 	// For variable-length receives, use requestUCXRecvVar.
-    ssize_t receive_internal(void* buff, size_t size, bool blocking) {
+	// With is_iov=true, buff is an array of 'size' ucp_dt_iov_t entries.
+    ssize_t receive_internal(void* buff, size_t size, bool blocking, bool is_iov=false) {
         size_t res = 0;
         test_req_t ctx{};
         ucp_request_param_t param{};
-		fill_request_param(&ctx, &param, false);
+		fill_request_param(&ctx, &param, is_iov);
 		param.op_attr_mask  |= UCP_OP_ATTR_FIELD_FLAGS;
 		param.flags          = UCP_STREAM_RECV_FLAG_WAITALL;
 		param.cb.recv_stream = stream_recv_cb;
@@ -670,10 +676,90 @@ public:
 
     size_t test_probe = 42;
 
-    HandleUCX(ConnType* parent, ucp_ep_h endpoint, ucp_worker_h worker) :
-		Handle(parent), endpoint(endpoint), ucp_worker(worker) {}
+    HandleUCX(ConnType* parent, ucp_ep_h endpoint, ucp_worker_h worker, int shard=0) :
+		Handle(parent, shard), endpoint(endpoint), ucp_worker(worker) {}
 
     ssize_t send(const void* buff, size_t size) {
+		if (corked) {
+			const struct iovec iov = {const_cast<void*>(buff), size};
+			const int r = corkMessage(&iov, 1, size);
+			if (r) return (r < 0) ? -1 : (ssize_t)size;
+		}
+		return sendFramed(buff, size);
+	}
+
+	// the header and the pieces are sent with one stream send (iov datatype)
+    ssize_t sendv(const struct iovec* iov, int iovcnt) {
+		if (iovcnt < 0 || (iovcnt > 0 && !iov)) return Handle::sendv(iov, iovcnt);  // EINVAL
+		const size_t size = iovLength(iov, iovcnt);
+		if (corked) {
+			const int r = corkMessage(iov, iovcnt, size);
+			if (r) return (r < 0) ? -1 : (ssize_t)size;
+		}
+		uint64_t sz = htobe64((uint64_t)size);
+		ucp_dt_iov_t small[16];
+		std::vector<ucp_dt_iov_t> large;
+		ucp_dt_iov_t* v = small;
+		if (iovcnt + 1 > 16) {
+			large.resize(iovcnt + 1);
+			v = large.data();
+		}
+		int niov = 0;
+		v[niov].buffer   = &sz;
+		v[niov++].length = sizeof(sz);
+		for(int i=0; i<iovcnt; ++i) {
+			if (iov[i].iov_len == 0) continue;
+			v[niov].buffer   = iov[i].iov_base;
+			v[niov++].length = iov[i].iov_len;
+		}
+		return (sendIov(v, niov) < 0) ? -1 : (ssize_t)size;
+	}
+
+	int setCork(bool enable) {
+		if (!enable && flush() < 0) return -1;
+		corked = enable;
+		if (corked) cork.reserve(CORK_BUFFER_SIZE);
+		return 0;
+	}
+
+	// sends the buffered messages (already framed) with one stream send
+	ssize_t flush() {
+		if (cork.empty()) return 0;
+		ucp_dt_iov_t iov[1];
+		iov[0].buffer = cork.data();
+		iov[0].length = cork.size();
+		const ssize_t r = sendIov(iov, 1);
+		cork.clear();
+		return (r < 0) ? -1 : 0;
+	}
+
+private:
+	// Aggregation mode (setCork): the buffer is flushed when full, on flush,
+	// before the other operations and by the first send after CORK_FLUSH_TIMEOUT.
+	bool corked = false;
+	std::vector<char> cork;
+	std::chrono::steady_clock::time_point corkSince;
+
+	// Appends the message to the buffer, flushing it when full or expired.
+	// It returns 1 if the message has been buffered, 0 if it has to be sent
+	// directly (the buffer has been flushed), -1 on error.
+	int corkMessage(const struct iovec* iov, int iovcnt, size_t size) {
+		constexpr size_t HDR_SZ = sizeof(uint64_t);
+		if (cork.size() + HDR_SZ + size > CORK_BUFFER_SIZE)
+			return (flush() < 0) ? -1 : 0;
+		const auto now = std::chrono::steady_clock::now();
+		if (cork.empty()) corkSince = now;
+		const uint64_t sz = htobe64((uint64_t)size);
+		cork.insert(cork.end(), (const char*)&sz, (const char*)&sz + HDR_SZ);
+		for(int i=0; i<iovcnt; ++i)
+			cork.insert(cork.end(), (const char*)iov[i].iov_base, (const char*)iov[i].iov_base + iov[i].iov_len);
+		if (cork.size() == CORK_BUFFER_SIZE ||
+			now - corkSince >= std::chrono::microseconds(CORK_FLUSH_TIMEOUT))
+			return (flush() < 0) ? -1 : 1;
+		return 1;
+	}
+
+    ssize_t sendFramed(const void* buff, size_t size) {
 		const int niov = (size == 0) ? 1 : 2;
 		uint64_t sz = htobe64((uint64_t)size);
     
@@ -684,7 +770,11 @@ public:
 			iov[1].buffer = const_cast<void*>(buff);
 			iov[1].length = size;
 		}
+		return (sendIov(iov, niov) < 0) ? -1 : (ssize_t)size;
+	}
 
+	// blocking stream send of the iov entries
+	ssize_t sendIov(ucp_dt_iov_t* iov, int niov) {
         ucp_request_param_t param{};
         test_req_t ctx{};
 
@@ -706,14 +796,18 @@ public:
 		// request_wait() does not free UCX requests
 		if (request_ && !UCS_PTR_IS_ERR(request_)) ucp_request_free(request_);
 		
-		return size;
+		return 0;
     }
+
+public:
     ssize_t sendEOS() {
+		if (flush() < 0) return -1;
 		// EOS is encoded as a framed message with size==0 (header only)
-		return send(nullptr, 0);
+		return sendFramed(nullptr, 0);
     }
 	
     ssize_t isend(const void* buff, size_t size, Request& r) {
+		if (flush() < 0) return -1;
 		requestUCX* rq=nullptr;
 		auto ret = isend_internal(buff, size, rq);
 		if (ret) {
@@ -726,6 +820,7 @@ public:
     }
 
     ssize_t isend(const void* buff, size_t size, RequestPool& r) {
+		if (flush() < 0) return -1;
 		requestUCX* rq=nullptr;
 		auto ret = isend_internal(buff, size, rq);
 		if (ret) {
@@ -758,7 +853,41 @@ public:
         return res;
     }
 
+	// the payload is received directly into the pieces (iov datatype)
+    ssize_t receivev(const struct iovec* iov, int iovcnt) {
+		if (iovcnt <= 0 || !iov) return Handle::receivev(iov, iovcnt);  // EINVAL
+        size_t probedSize;
+		if (!probed.first){
+			ssize_t r = probe(probedSize);
+			if (r <= 0)	return r;
+		} else
+			probedSize = probed.second;
+
+		if (probedSize == 0) {
+			probed = {false, 0};
+			return 0;
+		}
+		if (probedSize > iovLength(iov, iovcnt)){
+			MTCL_UCX_PRINT(100, "[internal]:\t", "HandleUCX::receivev EMSGSIZE, buffers too small\n");
+			errno=EMSGSIZE;
+			return -1;
+		}
+		// the entries cover exactly the message, WAITALL must not wait for more
+		std::vector<ucp_dt_iov_t> v;
+		size_t got = 0;
+		for(int i=0; i<iovcnt && got < probedSize; ++i) {
+			const size_t n = std::min(probedSize - got, iov[i].iov_len);
+			if (n == 0) continue;
+			v.push_back({iov[i].iov_base, n});
+			got += n;
+		}
+        ssize_t res = receive_internal(v.data(), v.size(), true, true);
+        probed={false, 0};
+        return res;
+    }
+
     ssize_t ireceive(void* buff, size_t size, RequestPool& r) {
+		if (flush() < 0) return -1;  // the peer may be waiting for the buffered messages
         if (probed.first){
 			const size_t msg_sz = probed.second;
 			auto* req = new requestUCXRecvVar(endpoint, ucp_worker, buff, size, msg_sz,
@@ -778,6 +907,7 @@ public:
     }
 
     ssize_t ireceive(void* buff, size_t size, Request& r) {
+		if (flush() < 0) return -1;  // the peer may be waiting for the buffered messages
 		if (probed.first){
 			const size_t msg_sz = probed.second;
 			auto* req = new requestUCXRecvVar(endpoint, ucp_worker, buff, size, msg_sz,
@@ -802,6 +932,7 @@ public:
 			size = probed.second;
 			return (size ? sizeof(size_t) : 0);
 		}
+		if (flush() < 0) return -1;  // the peer may be waiting for the buffered messages
 
 		// If we post an independent UCX recv for probing while there are
 		// pending framed receives on this stream (i.e., ireceive), the stream can desync.
@@ -931,17 +1062,31 @@ protected:
         int fdmax;
 #else	
     std::atomic<int> fdmax;
-    std::shared_mutex shm;
 #endif
 
     /* UCX-related */
-    ucp_address_t*  local_addr;
-    size_t          local_addr_len;
-    ucp_worker_h    ucp_worker;
     ucp_context_h   ucp_context;
 
-    // UCX endpoint object --> <handle, to_manage>
-    std::map<ucp_ep_h, std::pair<HandleUCX*, bool>> connections;
+	// Each shard has its own worker, so that the endpoints of different shards
+	// are progressed by different IO threads. New endpoints are assigned to the
+	// shards round-robin. The OOB listening socket is managed by shard 0.
+	struct shard_t {
+		ucp_address_t*  local_addr = nullptr;
+		size_t          local_addr_len = 0;
+		ucp_worker_h    ucp_worker = nullptr;
+
+		// UCX endpoint object --> <handle, to_manage>
+		std::map<ucp_ep_h, std::pair<HandleUCX*, bool>> connections;
+#if !defined(NO_MTCL_MULTITHREADED)
+		std::shared_mutex shm;
+#endif
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		// epoll fd aggregating the worker event fd and the OOB listening socket
+		int epfd = -1;
+#endif
+	};
+	std::deque<shard_t> shards;
+	std::atomic<unsigned> nextShard{0};
 
 private:
 
@@ -958,28 +1103,21 @@ private:
             return -1;
         }
 
-		struct addrinfo hints;
-		struct addrinfo *result, *rp;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family   = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-		hints.ai_socktype = SOCK_STREAM;  /* Stream socket */
-		hints.ai_flags    = AI_PASSIVE;
-		hints.ai_protocol = IPPROTO_TCP;  /* Allow only TCP */
-		if (getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
-			MTCL_UCX_PRINT(100, "ConnUCX::_init getaddrinfo errno=%d\n", errno);		
+		const auto addrs = resolveCache::resolve(address, std::to_string(port), true);
+		if (addrs.empty()) {
+			MTCL_UCX_PRINT(100, "ConnUCX::_init resolve errno=%d\n", errno);		
 			return -1;
 		}
 
 		bool ok = false;
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			if (bind(listen_sck, rp->ai_addr, (int)rp->ai_addrlen) < 0){
+		for (auto& a : addrs) {
+			if (bind(listen_sck, (const struct sockaddr*)&a.addr, a.len) < 0){
 				MTCL_UCX_PRINT(100, "ConnUCX::_init bind errno=%d, continue\n", errno);
 				continue;
 			}
 			ok = true;
 			break;
 		}
-		free(result);
 		if (!ok) {
 			MTCL_UCX_PRINT(100, "ConnUCX::_init bind loop exit with errno=%d\n", errno);
 			return -1;
@@ -1032,7 +1170,7 @@ private:
     }
 
 
-    void ep_close(ucp_ep_h ep) {
+    void ep_close(ucp_ep_h ep, ucp_worker_h ucp_worker) {
         // ucp_request_param_t param;
         ucs_status_t status;
         void *close_req;
@@ -1077,10 +1215,8 @@ public:
         ucs_status_t        ep_status = UCS_OK;
         ucp_config_t*       config;
         ucp_params_t        ucp_params;
-        ucp_worker_params_t worker_params{};
 
         memset(&ucp_params, 0, sizeof(ucp_params));
-        memset(&worker_params, 0, sizeof(worker_params));
 
 
         // Reads environment configuration
@@ -1094,6 +1230,10 @@ public:
         /* UCX context initialization */
         ucp_params.field_mask   = UCP_PARAM_FIELD_FEATURES;
         ucp_params.features     = UCP_FEATURE_STREAM;
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		// needed for ucp_worker_get_efd/ucp_worker_arm
+        ucp_params.features    |= UCP_FEATURE_WAKEUP;
+#endif
 
         // Initialize context with requested features and parameters
         ep_status = ucp_init(&ucp_params, config, &ucp_context);
@@ -1110,6 +1250,20 @@ public:
 #endif
         ucp_config_release(config);
 
+		shards.clear();
+		for(int i=0; i<nshards; ++i) {
+			shards.emplace_back();
+			if (initShard(shards.back()) == -1) return -1;
+		}
+        return 0;
+	}
+
+private:
+
+	// creates the worker of a shard and, if possible, its event fd
+	int initShard(shard_t& sh) {
+        ucs_status_t        ep_status = UCS_OK;
+        ucp_worker_params_t worker_params{};
 
         /* UCX worker initialization */
         worker_params.field_mask    = UCP_WORKER_PARAM_FIELD_THREAD_MODE;
@@ -1126,7 +1280,7 @@ public:
         worker_params.thread_mode   = UCS_THREAD_MODE_MULTI;
 
         // Initialize worker
-        ep_status = ucp_worker_create(ucp_context, &worker_params, &ucp_worker);
+        ep_status = ucp_worker_create(ucp_context, &worker_params, &sh.ucp_worker);
         if(ep_status != UCS_OK) {
             MTCL_UCX_PRINT(100, "ConnUCX::init error initializing worker\n");
             errno = EINVAL;
@@ -1135,16 +1289,40 @@ public:
 
         // Retrieve local address of the current worker, to be exchanged upon
         // handshake with the OOB connections
-        ep_status = ucp_worker_get_address(ucp_worker, &local_addr, &local_addr_len);
+        ep_status = ucp_worker_get_address(sh.ucp_worker, &sh.local_addr, &sh.local_addr_len);
         if(ep_status != UCS_OK) {
             MTCL_UCX_PRINT(100, "ConnUCX::init error retrieving worker address\n");
             errno = EINVAL;
             return -1;
         }
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		int ucp_efd;
+		ep_status = ucp_worker_get_efd(sh.ucp_worker, &ucp_efd);
+        if(ep_status != UCS_OK) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init error retrieving worker event fd, the worker will be polled\n");
+			return 0;
+		}
+		if ((sh.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init epoll_create1 errno=%d, the worker will be polled\n", errno);
+			return 0;
+		}
+		struct epoll_event ev{};
+		ev.events  = EPOLLIN;
+		ev.data.fd = ucp_efd;
+		if (epoll_ctl(sh.epfd, EPOLL_CTL_ADD, ucp_efd, &ev) == -1) {
+            MTCL_UCX_PRINT(100, "ConnUCX::init epoll_ctl errno=%d, the worker will be polled\n", errno);
+			close(sh.epfd);
+			sh.epfd = -1;
+		}
+#endif
         return 0;
     }
 
+public:
+
+	int maxShards() { return std::numeric_limits<int>::max(); }
+
 
     int listen(std::string s) {
         address = s.substr(0, s.find(":"));
@@ -1158,22 +1336,51 @@ public:
         
         MTCL_UCX_PRINT(1, "ConnUCX::listen OOB socket listening on: %s:%d\n", address.c_str(), port);
 
-        FD_SET(listen_sck, &set);
-        fdmax = listen_sck;
+        {
+			REMOVE_CODE_IF(std::unique_lock lock(shards[0].shm));
+			FD_SET(listen_sck, &set);
+			fdmax = listen_sck;
+		}
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+		if (shards[0].epfd != -1) {
+			struct epoll_event ev{};
+			ev.events  = EPOLLIN;
+			ev.data.fd = listen_sck;
+			if (epoll_ctl(shards[0].epfd, EPOLL_CTL_ADD, listen_sck, &ev) == -1) {
+				MTCL_UCX_PRINT(100, "ConnUCX::listen epoll_ctl errno=%d\n", errno);
+				return -1;
+			}
+		}
+#endif
         return 0;
     }
 
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+	int getEventFd(int shard=0) { return shards[shard].epfd; }
+
+	// The worker event fd is signaled only if the worker has been armed,
+	// UCS_ERR_BUSY means that there are events still to be progressed.
+	bool prepareWait(int shard=0) {
+		auto& sh = shards[shard];
+		if (sh.epfd == -1) return true;
+		return ucp_worker_arm(sh.ucp_worker) == UCS_OK;
+	}
+#endif
+
 
     Handle* connect(const std::string& address, int retry, unsigned timeout_ms) {
 		
 		int fd=internal_connect(address, retry, timeout_ms);
 		if (fd==-1) return nullptr;
+
+		const int s = nextShard++ % shards.size();
+		auto& sh = shards[s];
 		
         // To store address info of the remote peer
         ucp_address_t* peer_addr;
         size_t peer_addr_len;
-        int res = exchange_address(fd, local_addr, local_addr_len, &peer_addr, &peer_addr_len);
+        int res = exchange_address(fd, sh.local_addr, sh.local_addr_len, &peer_addr, &peer_addr_len);
         if(res != 0) {
             MTCL_UCX_PRINT(100, "ConnUCX::connect error exchanging address, handle is invalid\n");
 			close(fd);
@@ -1189,7 +1396,7 @@ public:
         //ep_params.user_data = &ep_status;
 
         ucs_status_t ep_status = UCS_OK;
-        ep_status = ucp_ep_create(ucp_worker, &ep_params, &server_ep);
+        ep_status = ucp_ep_create(sh.ucp_worker, &ep_params, &server_ep);
         if(ep_status != UCS_OK) {
             MTCL_UCX_PRINT(100, "ConnUCX::connect error creating the endpoint\n");
 			close(fd);
@@ -1203,28 +1410,31 @@ public:
         ucp_ep_print_info(server_ep, stderr);
 #endif
 
-        HandleUCX *handle = new HandleUCX(this, server_ep, ucp_worker);
+        HandleUCX *handle = new HandleUCX(this, server_ep, sh.ucp_worker, s);
         {
-			REMOVE_CODE_IF(std::unique_lock lock(shm));
-			connections.insert({server_ep, {handle, false}});
+			REMOVE_CODE_IF(std::unique_lock lock(sh.shm));
+			sh.connections.insert({server_ep, {handle, false}});
 		}
         MTCL_UCX_PRINT(100, "Connect ok to UCX:%s\n", address.c_str());
         return handle;
     }
 
 
-    void update() {
-        REMOVE_CODE_IF(std::unique_lock ulock(shm, std::defer_lock));
+    void update() { updateShard(0); }
 
-        REMOVE_CODE_IF(ulock.lock());
-        tmpset = set;
-        REMOVE_CODE_IF(ulock.unlock());
+    void updateShard(int shard) {
+		auto& sh = shards[shard];
+        REMOVE_CODE_IF(std::unique_lock ulock(sh.shm, std::defer_lock));
 
         struct timeval wait_time = {.tv_sec = 0, .tv_usec=UCX_POLL_TIMEOUT};
         int nready = 0;
         
         // Only if we are listening for new connections
-        if(fdmax != -1) {
+        if(shard == 0 && fdmax != -1) {
+			REMOVE_CODE_IF(ulock.lock());
+			tmpset = set;
+			REMOVE_CODE_IF(ulock.unlock());
+
             switch (nready=select(fdmax+1, &tmpset, NULL, NULL, &wait_time)) {
             case -1: {
                 if(errno == EBADF) {
@@ -1245,9 +1455,12 @@ public:
                     return;
                 }
 
+                const int s = nextShard++ % shards.size();
+                auto& newsh = shards[s];
+
                 ucp_address_t* peer_addr;
                 size_t peer_addr_len;
-                int res = exchange_address(connfd, local_addr, local_addr_len, &peer_addr, &peer_addr_len);
+                int res = exchange_address(connfd, newsh.local_addr, newsh.local_addr_len, &peer_addr, &peer_addr_len);
                 if(res != 0) {
                     MTCL_UCX_PRINT(100, "ConnUCX::update error exchanging address\n");
                     return;
@@ -1264,18 +1477,18 @@ public:
                 ep_params.address         = peer_addr;
                 ep_params.user_data       = &ep_status;
 
-                ep_status = ucp_ep_create(ucp_worker, &ep_params, &client_ep);
+                ep_status = ucp_ep_create(newsh.ucp_worker, &ep_params, &client_ep);
                 if(ep_status != UCS_OK) {
                     MTCL_UCX_PRINT(100, "ConnUCX::update error creating the endpoint\n");
                     return;
                 }
                 free(peer_addr);
 
-                HandleUCX* handle = new HandleUCX(this, client_ep, ucp_worker);
-
-                REMOVE_CODE_IF(ulock.lock());
-                connections.insert({client_ep, {handle, false}});
-                REMOVE_CODE_IF(ulock.unlock());            
+                HandleUCX* handle = new HandleUCX(this, client_ep, newsh.ucp_worker, s);
+                {
+					REMOVE_CODE_IF(std::unique_lock lock(newsh.shm));
+					newsh.connections.insert({client_ep, {handle, false}});
+				}
                 addinQ(true, handle);
             }
         }
@@ -1283,11 +1496,11 @@ public:
         // Poll on managed endpoints to detect something is ready to be read
         // This will cause, at the same time, progress on the user handles
         size_t size = -1;
-        size_t max_eps = connections.size();
+        size_t max_eps = sh.connections.size();
 
         // One-shot progress
         int prog = -1;
-        prog = ucp_worker_progress(ucp_worker);
+        prog = ucp_worker_progress(sh.ucp_worker);
         (void)prog;
 
         // The polling mechanism provided by ucp_stream_worker_poll does not
@@ -1296,7 +1509,7 @@ public:
         // but not managed by the user (by a receive/probe) the endpoint will
         // not be displayed again even if data are ready to be read
         ucp_stream_poll_ep_t* ready_eps = new ucp_stream_poll_ep_t[max_eps];
-        size = ucp_stream_worker_poll(ucp_worker, ready_eps, max_eps, 0);
+        size = ucp_stream_worker_poll(sh.ucp_worker, ready_eps, max_eps, 0);
         if(size < 0) {
             MTCL_UCX_PRINT(100, "ConnUCX::update error in ucp_stream_worker_poll\n");
             return;
@@ -1307,8 +1520,8 @@ public:
         for(size_t i=0; i<size; i++) {
             ucp_stream_poll_ep_t ep = ready_eps[i];
 
-            auto it = connections.find(ep.ep);
-            if(it != connections.end()) {
+            auto it = sh.connections.find(ep.ep);
+            if(it != sh.connections.end()) {
                 auto& handlePair = it->second;
                 if(handlePair.second) {
                     handlePair.second = false;
@@ -1352,13 +1565,14 @@ public:
 			addinQ(false, handle);
 			return;
 		}
-        REMOVE_CODE_IF(std::unique_lock l(shm));
-        auto it = connections.find(handle->endpoint);
-        if(it == connections.end()) {
+        auto& sh = shards[h->getShard()];
+        REMOVE_CODE_IF(std::unique_lock l(sh.shm));
+        auto it = sh.connections.find(handle->endpoint);
+        if(it == sh.connections.end()) {
             MTCL_UCX_ERROR("Couldn't yield handle\n");
 			return;
 		}
-        connections[handle->endpoint].second = true;
+        it->second.second = true;
 		
         return;
     }
@@ -1369,26 +1583,35 @@ public:
         if(handle->already_closed) return;
 		if (!close_rd) return;
 		
-        REMOVE_CODE_IF(std::unique_lock l(shm));
-		connections.erase(handle->endpoint);
+        auto& sh = shards[h->getShard()];
+        REMOVE_CODE_IF(std::unique_lock l(sh.shm));
+		sh.connections.erase(handle->endpoint);
 		handle->already_closed = true;
 		REMOVE_CODE_IF(l.unlock());
 
 		handle->cancel_pending_probe();
-		ep_close(handle->endpoint);
+		ep_close(handle->endpoint, handle->ucp_worker);
 		handle->cleanup_pending_probe();
     }
 
     void end(bool blockflag=false) {
-        if(connections.empty()) return;
-        auto modified_connections = connections;
-        for(auto& [_, handlePair] : modified_connections) {
-            if(handlePair.first->already_closed) continue;
-			setAsClosed(handlePair.first, blockflag);
-        }
-        
-        ucp_worker_release_address(ucp_worker, local_addr);
-        ucp_worker_destroy(ucp_worker);
+		if (std::all_of(shards.begin(), shards.end(),
+						[](shard_t& sh) { return sh.connections.empty(); })) return;
+		for(auto& sh : shards) {
+			auto modified_connections = sh.connections;
+			for(auto& [_, handlePair] : modified_connections) {
+				if(handlePair.first->already_closed) continue;
+				setAsClosed(handlePair.first, blockflag);
+			}
+		}
+		for(auto& sh : shards) {
+			ucp_worker_release_address(sh.ucp_worker, sh.local_addr);
+			ucp_worker_destroy(sh.ucp_worker);
+#if defined(MTCL_IO_THREAD_EVENT_WAIT)
+			if (sh.epfd != -1) close(sh.epfd);
+			sh.epfd = -1;
+#endif
+		}
         ucp_cleanup(ucp_context);
     }
 
@@ -0,0 +1,246 @@
+#ifndef UDS_HPP
+#define UDS_HPP
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <deque>
+#include <string>
+
+#include "tcp.hpp"
+
+namespace MTCL {
+
+/*
+ * Unix domain sockets (AF_UNIX, SOCK_STREAM) for peers on the same host.
+ *
+ * The connections use the same framing, read-ahead buffer, asynchronous
+ * engine and readiness logic of the TCP ones (HandleTCP and ConnTcp), only
+ * the socket layer differs. The address is a name in the abstract namespace
+ * (e.g. "UDS:server"), or a path in the file system if it starts with '/'
+ * or '.' (e.g. "UDS:/tmp/server.sock").
+ *
+ * File descriptors can be passed to the peer (SCM_RIGHTS) with sendFds and
+ * receiveFds, every read from the socket collects the descriptors received.
+ */
+
+class HandleUDS : public HandleTCP {
+	std::deque<int> rxfds;  // descriptors received and not claimed yet
+
+	ssize_t recvFds(struct iovec* v, int count, int flags) {
+		union {  // aligned control buffer
+			char buf[CMSG_SPACE(sizeof(int) * UDS_MAX_FDS)];
+			struct cmsghdr align;
+		} ctrl;
+		struct msghdr msg{};
+		msg.msg_iov        = v;
+		msg.msg_iovlen     = count;
+		msg.msg_control    = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		const ssize_t r = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+		if (r < 0) return r;
+		for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+			const int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(int i=0; i<n; ++i) {
+				int rfd;
+				memcpy(&rfd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+				rxfds.push_back(rfd);
+			}
+		}
+		if (msg.msg_flags & MSG_CTRUNC)
+			MTCL_UDS_ERROR("HandleUDS::recvFds more than %u descriptors in one message, some have been discarded\n", UDS_MAX_FDS);
+		return r;
+	}
+
+protected:
+	ssize_t sockRecv(void* buf, size_t n, int flags) {
+		struct iovec v = {buf, n};
+		return recvFds(&v, 1, flags);
+	}
+	ssize_t sockReadv(struct iovec* v, int count) { return recvFds(v, count, 0); }
+
+public:
+	HandleUDS(ConnType* parent, int fd, int shard=0) : HandleTCP(parent, fd, shard) {}
+
+	// The descriptors travel with a message whose payload is their number
+	// on the sender side, the message is received by receiveFds.
+	ssize_t sendFds(const int* fds, int nfds) {
+		if (nfds <= 0 || nfds > (int)UDS_MAX_FDS || !fds) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (flush() < 0) return -1;  // the pending messages go first
+		const size_t size = nfds * sizeof(int);
+		uint64_t szbe = htobe64((uint64_t)size);
+		struct iovec iov[2];
+		iov[0].iov_base = &szbe;
+		iov[0].iov_len  = HDR_SZ;
+		iov[1].iov_base = const_cast<int*>(fds);
+		iov[1].iov_len  = size;
+
+		union {
+			char buf[CMSG_SPACE(sizeof(int) * UDS_MAX_FDS)];
+			struct cmsghdr align;
+		} ctrl;
+		struct msghdr msg{};
+		msg.msg_iov        = iov;
+		msg.msg_iovlen     = 2;
+		msg.msg_control    = ctrl.buf;
+		msg.msg_controllen = CMSG_SPACE(size);
+		struct cmsghdr* c  = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type  = SCM_RIGHTS;
+		c->cmsg_len   = CMSG_LEN(size);
+		memcpy(CMSG_DATA(c), fds, size);
+
+		ssize_t r;
+		while((r = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+		if (r < 0) return -1;
+		// the descriptors went with the first byte, the rest is plain data
+		for(int i=0; i<2 && r > 0; ++i) {
+			const size_t c = std::min((size_t)r, iov[i].iov_len);
+			iov[i].iov_base = (char*)iov[i].iov_base + c;
+			iov[i].iov_len -= c;
+			r -= c;
+		}
+		if (iov[1].iov_len > 0 && writevn(fd, iov, 2) < 0) return -1;
+		return nfds;
+	}
+
+	// It returns the number of descriptors received (at most nfds), 0 at
+	// the end of the stream, -1 with EPROTO if the message is not the one
+	// sent by sendFds.
+	ssize_t receiveFds(int* fds, int nfds) {
+		if (nfds <= 0 || !fds) {
+			errno = EINVAL;
+			return -1;
+		}
+		int sent[UDS_MAX_FDS];
+		const ssize_t r = receive(sent, sizeof(sent));
+		if (r <= 0) return r;
+		const size_t n = r / sizeof(int);
+		if (r % sizeof(int) || n > rxfds.size() || n > (size_t)nfds) {
+			MTCL_UDS_PRINT(100, "HandleUDS::receiveFds unexpected message of %ld bytes (%ld descriptors received)\n", r, rxfds.size());
+			errno = EPROTO;
+			return -1;
+		}
+		for(size_t i=0; i<n; ++i) {
+			fds[i] = rxfds.front();
+			rxfds.pop_front();
+		}
+		return n;
+	}
+
+	~HandleUDS() {
+		for(int rfd : rxfds) ::close(rfd);
+	}
+};
+
+class ConnUDS : public ConnTcp {
+protected:
+	std::string path;  // file system path of the listening socket, if any
+
+	// fills the address, it returns its length or -1
+	static socklen_t udsAddress(const std::string& name, struct sockaddr_un& sa) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		const bool abstract = name.empty() || (name[0] != '/' && name[0] != '.');
+		// the abstract names start with a null byte and are not null terminated
+		const size_t len = name.length() + (abstract ? 1 : 0);
+		if (name.empty() || len >= sizeof(sa.sun_path)) {
+			errno = ENAMETOOLONG;
+			return (socklen_t)-1;
+		}
+		memcpy(sa.sun_path + (abstract ? 1 : 0), name.c_str(), name.length());
+		return offsetof(struct sockaddr_un, sun_path) + len + (abstract ? 0 : 1);
+	}
+
+	// removes the file of a stale socket left by a previous run. It fails with
+	// EADDRINUSE if the path is not a socket or if a server still accepts on it
+	static int removeStale(const struct sockaddr_un& sa, socklen_t len) {
+		struct stat st;
+		if (lstat(sa.sun_path, &st) == -1) return (errno == ENOENT) ? 0 : -1;
+		if (!S_ISSOCK(st.st_mode)) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		const bool stale = ::connect(fd, (const struct sockaddr*)&sa, len) == -1 && errno == ECONNREFUSED;
+		::close(fd);
+		if (!stale) {
+			errno = EADDRINUSE;
+			return -1;
+		}
+		return ::unlink(sa.sun_path);
+	}
+
+	int listenSocket(const std::string& s) {
+		struct sockaddr_un sa;
+		const socklen_t len = udsAddress(s, sa);
+		if (len == (socklen_t)-1) {
+			MTCL_UDS_PRINT(100, "ConnUDS::listen invalid address %s\n", s.c_str());
+			return -1;
+		}
+		if (sa.sun_path[0] && removeStale(sa, len) < 0) {
+			MTCL_UDS_PRINT(100, "ConnUDS::listen cannot use %s, errno=%d\n", sa.sun_path, errno);
+			return -1;
+		}
+		int sck;
+		if ((sck = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+			MTCL_UDS_PRINT(100, "ConnUDS::listen socket errno=%d\n", errno);
+			return -1;
+		}
+		if (bind(sck, (struct sockaddr*)&sa, len) < 0 || ::listen(sck, TCP_BACKLOG) < 0) {
+			MTCL_UDS_PRINT(100, "ConnUDS::listen bind/listen errno=%d\n", errno);
+			::close(sck);
+			return -1;
+		}
+		if (sa.sun_path[0]) path = sa.sun_path;
+		MTCL_UDS_PRINT(1, "listen to %s\n", s.c_str());
+		return sck;
+	}
+
+	int connectSocket(const std::string& address, int retry, unsigned timeout_ms) {
+		struct sockaddr_un sa;
+		const socklen_t len = udsAddress(address, sa);
+		if (len == (socklen_t)-1) {
+			MTCL_UDS_PRINT(100, "ConnUDS::connect invalid address %s\n", address.c_str());
+			return -1;
+		}
+		do {
+			int fd;
+			if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+				MTCL_UDS_PRINT(100, "ConnUDS::connect socket errno=%d\n", errno);
+				return -1;
+			}
+			if (::connect(fd, (struct sockaddr*)&sa, len) == 0) return fd;
+			MTCL_UDS_PRINT(100, "ConnUDS::connect to %s errno=%d\n", address.c_str(), errno);
+			::close(fd);
+			if (retry-- > 0 && !connectRetrySleep(timeout_ms)) return -1;
+		} while(retry >= 0);
+		return -1;
+	}
+
+	int setupSocket(int) { return 0; }
+
+	HandleTCP* createHandle(int fd, int shard) { return new HandleUDS(this, fd, shard); }
+
+public:
+	// the listening socket is a single one, SO_REUSEPORT is for TCP only
+	int init(std::string s) {
+		const int r = ConnTcp::init(s);
+		reusePort = false;
+		return r;
+	}
+
+	void end(bool blockflag=false) {
+		ConnTcp::end(blockflag);
+		if (!path.empty()) ::unlink(path.c_str());
+	}
+};
+
+} // namespace
+
+#endif
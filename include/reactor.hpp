@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <functional>
+
+#include "config.hpp"
+#include "utils.hpp"
+#include "readyQueue.hpp"
+
+namespace MTCL {
+
+/*
+ * Work-stealing thread pool used by the Manager to run the message and
+ * connection callbacks (see Manager::onMessage and Manager::onConnection).
+ *
+ * Each worker has its own task deque: tasks are pushed at the back of the
+ * deque selected by the submitter, the owner pops from the front and idle
+ * workers steal from the back of the others' deques. Idle workers park on
+ * an event count, thus submit does not issue any system call if all the
+ * workers are busy. Before exiting, the workers run all the pending tasks.
+ * The pool does not order tasks: the Manager never has more than one task
+ * for the same handle in the pool.
+ */
+template<typename T>
+class workStealingPool {
+	struct alignas(64) worker_t {
+		std::mutex          mtx;
+		std::deque<T>       tasks;
+		std::atomic<size_t> size{0};
+	};
+
+	std::unique_ptr<worker_t[]> workers;
+	const size_t                nworkers;
+	std::vector<std::thread>    threads;
+	std::function<void(T&)>     func;
+	alignas(64) std::atomic<size_t> queued{0};
+	std::atomic<bool>           stopping{false};
+	eventCount                  idle;
+
+	// pops from the front of the worker's own deque or steals from the back
+	// of the other deques
+	bool pop(size_t self, T& out) {
+		for(size_t i = 0; i < nworkers; ++i) {
+			worker_t& w = workers[(self + i) % nworkers];
+			if (w.size.load(std::memory_order_acquire) == 0) continue;
+			std::lock_guard lk(w.mtx);
+			if (w.tasks.empty()) continue;
+			if (i == 0) {
+				out = std::move(w.tasks.front());
+				w.tasks.pop_front();
+			} else {
+				out = std::move(w.tasks.back());
+				w.tasks.pop_back();
+			}
+			w.size.fetch_sub(1, std::memory_order_relaxed);
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t self) {
+		while(true) {
+			{
+				T t;
+				if (pop(self, t)) {
+					func(t);
+					continue;  // t is destroyed before taking the next task
+				}
+			}
+			const uint32_t key = idle.prepareWait();
+			if (queued.load(std::memory_order_seq_cst) > 0) {
+				idle.cancelWait();
+				continue;
+			}
+			if (stopping.load(std::memory_order_acquire)) {
+				idle.cancelWait();
+				return;
+			}
+			idle.wait(key, std::chrono::microseconds(IO_THREAD_IDLE_TIMEOUT));
+		}
+	}
+
+public:
+	/**
+	 * @brief Starts \b n workers (at least one) running \b f on each task.
+	 */
+	workStealingPool(size_t n, std::function<void(T&)> f) :
+		workers(new worker_t[std::max<size_t>(n, 1)]), nworkers(std::max<size_t>(n, 1)),
+		func(std::move(f)) {
+		threads.reserve(nworkers);
+		for(size_t i = 0; i < nworkers; ++i)
+			threads.emplace_back([this, i](){ run(i); });
+	}
+	workStealingPool(const workStealingPool&) = delete;
+	workStealingPool& operator=(const workStealingPool&) = delete;
+
+	~workStealingPool() { stop(); }
+
+	/**
+	 * @brief Queues \b t on the deque of the worker \b hint % size(), it
+	 * never blocks.
+	 */
+	void submit(T&& t, size_t hint) {
+		worker_t& w = workers[hint % nworkers];
+		{
+			std::lock_guard lk(w.mtx);
+			w.tasks.push_back(std::move(t));
+			w.size.fetch_add(1, std::memory_order_release);
+		}
+		queued.fetch_add(1, std::memory_order_seq_cst);
+		idle.notify();
+	}
+
+	/**
+	 * @brief Waits until the workers have run all the pending tasks and
+	 * terminates them.
+	 */
+	void stop() {
+		stopping.store(true, std::memory_order_release);
+		idle.notify(true);
+		for(auto& th : threads)
+			if (th.joinable()) th.join();
+		threads.clear();
+	}
+
+	size_t size() const { return nworkers; }
+};
+
+} // namespace
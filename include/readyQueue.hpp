@@ -0,0 +1,248 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#if !defined(__linux__)
+#include <condition_variable>
+#endif
+
+#include "config.hpp"
+#include "utils.hpp"
+
+namespace MTCL {
+
+/*
+ * Bounded multi-producer multi-consumer lock-free queue (D. Vyukov's design).
+ *
+ * Each cell has a sequence number telling whether it is free or full for the
+ * current lap of the ring, so that push and pop only need one CAS on the
+ * enqueue/dequeue position and producers and consumers never share a lock.
+ * If the ring is full, elements are stored in an overflow list protected by a
+ * mutex, thus push never fails nor blocks waiting for the consumers. In the
+ * Manager the number of queued elements is bounded by the number of open
+ * handles, so the overflow list is expected to be rarely used.
+ * The FIFO order is not guaranteed between elements of the ring and
+ * elements of the overflow list.
+ */
+template<typename T>
+class readyQueue {
+	struct cell_t {
+		std::atomic<size_t> seq;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	const size_t mask;
+	std::unique_ptr<cell_t[]> cells;
+	alignas(64) std::atomic<size_t> enqueuePos{0};
+	alignas(64) std::atomic<size_t> dequeuePos{0};
+	alignas(64) std::atomic<size_t> overflowSize{0};
+	std::mutex    overflowMutex;
+	std::deque<T> overflow;
+
+	static size_t roundPow2(size_t n) {
+		size_t p = 2;
+		while (p < n) p <<= 1;
+		return p;
+	}
+
+	bool tryPush(T& v) {
+		cell_t* cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			const size_t seq = cell->seq.load(std::memory_order_acquire);
+			const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false; // full
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		new (cell->storage) T(std::move(v));
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool tryPop(T& out) {
+		cell_t* cell;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			const size_t seq = cell->seq.load(std::memory_order_acquire);
+			const intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false; // empty
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		T* p = std::launder(reinterpret_cast<T*>(cell->storage));
+		out = std::move(*p);
+		p->~T();
+		cell->seq.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+public:
+	/**
+	 * @brief Creates a queue whose ring has at least \b capacity slots
+	 * (rounded up to a power of two).
+	 */
+	explicit readyQueue(size_t capacity = READY_QUEUE_SIZE) :
+		mask(roundPow2(capacity) - 1), cells(new cell_t[mask + 1]) {
+		for(size_t i = 0; i <= mask; ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+	readyQueue(const readyQueue&) = delete;
+	readyQueue& operator=(const readyQueue&) = delete;
+
+	~readyQueue() {
+		T tmp;
+		while(tryPop(tmp)) { T discard(std::move(tmp)); }
+	}
+
+	/**
+	 * @brief Inserts \b v in the queue, it never blocks.
+	 */
+	void push(T&& v) {
+		if (tryPush(v)) return;
+		std::lock_guard lk(overflowMutex);
+		overflow.push_back(std::move(v));
+		overflowSize.fetch_add(1, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Extracts one element from the queue, if any.
+	 *
+	 * @return \b true if an element has been moved into \b out, \b false if
+	 * the queue is empty
+	 */
+	bool pop(T& out) {
+		if (tryPop(out)) return true;
+		if (overflowSize.load(std::memory_order_acquire) == 0) return false;
+		std::lock_guard lk(overflowMutex);
+		if (overflow.empty()) return false;
+		out = std::move(overflow.front());
+		overflow.pop_front();
+		overflowSize.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/**
+	 * @brief Extracts up to \b n elements from the queue. Consecutive ready
+	 * cells of the ring are claimed with a single CAS.
+	 *
+	 * @return the number of elements moved into \b out (0 if the queue is empty)
+	 */
+	size_t pop(T* out, size_t n) {
+		size_t k = 0;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		while(n) {
+			for(k = 0; k < n; ++k) {
+				const size_t seq = cells[(pos + k) & mask].seq.load(std::memory_order_acquire);
+				if ((intptr_t)seq - (intptr_t)(pos + k + 1) != 0) break;
+			}
+			if (k == 0) {
+				const size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+				if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) break; // empty
+				pos = dequeuePos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (dequeuePos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+				for(size_t i = 0; i < k; ++i) {
+					cell_t& cell = cells[(pos + i) & mask];
+					T* p = std::launder(reinterpret_cast<T*>(cell.storage));
+					out[i] = std::move(*p);
+					p->~T();
+					cell.seq.store(pos + i + mask + 1, std::memory_order_release);
+				}
+				break;
+			}
+			k = 0;
+		}
+		while(k < n && overflowSize.load(std::memory_order_acquire) > 0 && pop(out[k])) ++k;
+		return k;
+	}
+
+	/**
+	 * @brief Returns true if the queue looks empty. The result may be already
+	 * stale when the function returns if there are concurrent producers or
+	 * consumers.
+	 */
+	bool empty() const {
+		return dequeuePos.load(std::memory_order_acquire) == enqueuePos.load(std::memory_order_acquire) &&
+			overflowSize.load(std::memory_order_acquire) == 0;
+	}
+};
+
+
+/*
+ * Event count used by consumers to park until a producer publishes new
+ * elements. It is based on a futex on Linux, on a mutex and a condition
+ * variable elsewhere.
+ *
+ * A consumer calls prepareWait, checks its condition again and then calls
+ * either cancelWait (condition satisfied) or wait. A producer calls notify
+ * after having published the element, notify does not issue any system
+ * call if there are no parked consumers, so producers never block.
+ */
+class eventCount {
+	std::atomic<uint32_t> epoch{0};
+	std::atomic<int>      waiters{0};
+#if !defined(__linux__)
+	std::mutex              mtx;
+	std::condition_variable cv;
+#endif
+
+public:
+	uint32_t prepareWait() {
+		waiters.fetch_add(1, std::memory_order_seq_cst);
+		return epoch.load(std::memory_order_seq_cst);
+	}
+
+	void cancelWait() {
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// blocks until notify is called after prepareWait returned key, or the
+	// timeout expires (spurious wake-ups are possible)
+	void wait(uint32_t key, std::chrono::microseconds timeout) {
+#if defined(__linux__)
+		struct timespec ts = { .tv_sec  = (time_t)(timeout.count() / 1000000),
+							   .tv_nsec = (long)(timeout.count() % 1000000) * 1000 };
+		mtcl_futex_wait(&epoch, key, &ts);
+#else
+		std::unique_lock lk(mtx);
+		cv.wait_for(lk, timeout, [&]{ return epoch.load() != key; });
+#endif
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void notify(bool all=false) {
+		// pairs with the seq_cst increment of waiters in prepareWait: either
+		// the consumer sees the new element or we see the consumer
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) == 0) return;
+		epoch.fetch_add(1, std::memory_order_seq_cst);
+#if defined(__linux__)
+		mtcl_futex_wake(&epoch, all ? INT_MAX : 1);
+#else
+		{ std::lock_guard lk(mtx); }
+		if (all) cv.notify_all(); else cv.notify_one();
+#endif
+	}
+};
+
+} // namespace
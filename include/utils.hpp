@@ -7,6 +7,8 @@
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -20,6 +22,20 @@
 #include <cstring>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <string>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 
 namespace MTCL {
@@ -38,12 +54,16 @@ extern int mtcl_verbose;
 #define MTCL_MPI_PRINT(LEVEL, str, ...) MTCL_PRINT(LEVEL, "[MTCL MPI]:",str, ##__VA_ARGS__)
 #define MTCL_MQTT_PRINT(LEVEL, str, ...) MTCL_PRINT(LEVEL, "[MTCL MQTT]:",str, ##__VA_ARGS__)
 #define MTCL_MPIP2P_PRINT(LEVEL, str, ...) MTCL_PRINT(LEVEL, "[MTCL MPIP2P]:",str, ##__VA_ARGS__)
+#define MTCL_UDS_PRINT(LEVEL, str, ...) MTCL_PRINT(LEVEL, "[MTCL UDS]:",str, ##__VA_ARGS__)
+#define MTCL_TCPX_PRINT(LEVEL, str, ...) MTCL_PRINT(LEVEL, "[MTCL TCPX]:",str, ##__VA_ARGS__)
 #define MTCL_TCP_ERROR(str, ...) MTCL_ERROR("[MTCL TCP]:",str, ##__VA_ARGS__)
 #define MTCL_SHM_ERROR(str, ...) MTCL_ERROR("[MTCL SHM]:",str, ##__VA_ARGS__)
 #define MTCL_UCX_ERROR(str, ...) MTCL_ERROR("[MTCL UCX]:",str, ##__VA_ARGS__)
 #define MTCL_MPI_ERROR(str, ...) MTCL_ERROR("[MTCL MPI]:",str, ##__VA_ARGS__)
 #define MTCL_MQTT_ERROR(str, ...) MTCL_ERROR("[MTCL MQTT]:",str, ##__VA_ARGS__)
 #define MTCL_MPIP2P_ERROR(str, ...) MTCL_ERROR("[MTCL MPIP2P]:",str, ##__VA_ARGS__)
+#define MTCL_UDS_ERROR(str, ...) MTCL_ERROR("[MTCL UDS]:",str, ##__VA_ARGS__)
+#define MTCL_TCPX_ERROR(str, ...) MTCL_ERROR("[MTCL TCPX]:",str, ##__VA_ARGS__)
 
 static inline void print_prefix(FILE *stream, const char *str, const char *prefix, ...) {
     va_list argp;
@@ -60,6 +80,13 @@ std::string getPoolFromHost(const std::string& host){
     return host.substr(0, pos);
 }
 
+// host name of a component host ([pool:]hostname)
+static inline std::string getNameFromHost(const std::string& host){
+    auto pos = host.find(':');
+    if (pos == std::string::npos) return host;
+    return host.substr(pos + 1);
+}
+
 static inline bool splitProtoRest(const std::string& s, std::string& proto, std::string& rest) {
 	auto pos = s.find(':');
 	if (pos == std::string::npos) return false;
@@ -161,56 +188,253 @@ static inline ssize_t nb_probe_with_timeout(H* h, size_t& size,	int retry, unsig
 	
 // -------------------- TCP utilty functions -----------------------------------
 
-static inline int internal_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-	int saved_errno=0;
-    int rc = 0;
-    // Set O_NONBLOCK
-    int sockfd_flags_before;
-    if((sockfd_flags_before=fcntl(sockfd,F_GETFL,0)<0)) return -1;
-    if(fcntl(sockfd,F_SETFL,sockfd_flags_before | O_NONBLOCK)<0) return -1;
-    // Start connecting (asynchronously)
-    do {
-        if (connect(sockfd, addr, addrlen)<0) {
-            // Did connect return an error? If so, we'll fail.
-            if ((errno != EWOULDBLOCK) && (errno != EINPROGRESS)) {
-				rc = -1;
-				saved_errno=errno;
-            } else {  // Otherwise, we'll wait for it to complete.
-				saved_errno= EHOSTUNREACH;
-
-                // Set a deadline timestamp 'timeout' ms from now (needed b/c poll can be interrupted)
-                struct timespec now;
-                if(clock_gettime(CLOCK_MONOTONIC, &now)<0) { rc=-1; break; }
-                struct timespec deadline = { .tv_sec = now.tv_sec,
-                                             .tv_nsec = now.tv_nsec + (UNREACHABLE_ADDR_TIMOUT*1000000l)};
-                // Wait for the connection to complete.
-                do {
-                    // Calculate how long until the deadline
-                    if(clock_gettime(CLOCK_MONOTONIC, &now)<0) {rc=-1; break;}
-
-                    int ms_until_deadline = (int)(  (deadline.tv_sec  - now.tv_sec)*1000l
-													+ (deadline.tv_nsec - now.tv_nsec)/1000000l);
-                    if(ms_until_deadline<0) { rc=0;	break; }
-                    // Wait for connect to complete (or for the timeout deadline)
-                    struct pollfd pfds[] = { { .fd = sockfd, .events = POLLOUT } };
-					
-                    rc = poll(pfds, 1, ms_until_deadline);
-                    // If poll 'succeeded', make sure it *really* succeeded
-                    if(rc>0) {
-                        int error = 0; socklen_t len = sizeof(error);
-                        int retval = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
-                        if(retval==0) saved_errno = error;
-                        if(error!=0)  rc=-1; 
-                    }
-                } while(rc==-1 && errno==EINTR); // If poll was interrupted, try again.
-                if(rc==0) rc=-1;                 // Did poll timeout? If so, fail.
-            }
-        }
-    } while(0);
-    // Restore original O_NONBLOCK state
-    if(fcntl(sockfd,F_SETFL,sockfd_flags_before)<0) return -1;
-	errno = saved_errno;
-    return rc;
+// An address of a host resolved by getaddrinfo
+struct resolvedAddr {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int       family;
+
+	void setPort(uint16_t port) {
+		if (family == AF_INET) ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+		else if (family == AF_INET6) ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+	}
+};
+
+/*
+ * Process-wide cache of the addresses of the hosts, shared by the connects
+ * and the listens of the TCP-based protocols so that getaddrinfo runs once
+ * for each host. The entries expire after the TTL (RESOLVE_CACHE_TTL, env
+ * MTCL_RESOLVE_TTL, 0 disables the cache) and can be invalidated explicitly,
+ * e.g. when a host has changed address. Concurrent resolutions of the same
+ * host wait for the first one. The failures are not cached.
+ */
+class resolveCache {
+	using addrs_t = std::shared_ptr<const std::vector<resolvedAddr>>;
+	struct entry {
+		std::shared_future<addrs_t> addrs;
+		std::chrono::steady_clock::time_point expires;
+		uint64_t id;  // to find the entry after the resolution
+	};
+	inline static std::mutex mtx;
+	inline static std::map<std::pair<std::string, bool>, entry> entries;  // (host, passive)
+	inline static std::atomic<unsigned> ttl{RESOLVE_CACHE_TTL};
+	inline static uint64_t nextId = 0;
+
+	// resolves host and svc (if not null), nullptr on error (errno is set)
+	static addrs_t lookup(const std::string& host, const char* svc, bool passive) {
+		struct addrinfo hints;
+		struct addrinfo *result;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family   = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+		hints.ai_socktype = SOCK_STREAM;  /* Stream socket */
+		hints.ai_flags    = passive ? AI_PASSIVE : 0;
+		hints.ai_protocol = IPPROTO_TCP;  /* Allow only TCP */
+		const int r = getaddrinfo(host.c_str(), svc, &hints, &result);
+		if (r != 0) {
+			MTCL_PRINT(100, "[MTCL]:", "resolveCache getaddrinfo of %s error: %s\n", host.c_str(), gai_strerror(r));
+			errno = (r == EAI_SYSTEM) ? errno : EADDRNOTAVAIL;
+			return nullptr;
+		}
+		auto addrs = std::make_shared<std::vector<resolvedAddr>>();
+		for(struct addrinfo* rp = result; rp != NULL; rp = rp->ai_next) {
+			if (rp->ai_addrlen > sizeof(sockaddr_storage)) continue;
+			resolvedAddr a;
+			memcpy(&a.addr, rp->ai_addr, rp->ai_addrlen);
+			a.len    = rp->ai_addrlen;
+			a.family = rp->ai_family;
+			addrs->push_back(a);
+		}
+		freeaddrinfo(result);
+		return addrs;
+	}
+
+	static addrs_t cached(const std::string& host, bool passive) {
+		if (ttl == 0) return lookup(host, nullptr, passive);
+		const auto key = std::make_pair(host, passive);
+		std::promise<addrs_t> p;
+		std::shared_future<addrs_t> f;
+		uint64_t id;
+		{
+			std::unique_lock lk(mtx);
+			auto it = entries.find(key);
+			const auto now = std::chrono::steady_clock::now();
+			// an entry being resolved has not expired yet
+			if (it != entries.end() && now < it->second.expires) {
+				f = it->second.addrs;
+				lk.unlock();
+				auto addrs = f.get();
+				if (!addrs) errno = EADDRNOTAVAIL;
+				return addrs;
+			}
+			f  = p.get_future().share();
+			id = nextId++;
+			entries[key] = {f, std::chrono::steady_clock::time_point::max(), id};
+		}
+		MTCL_PRINT(100, "[MTCL]:", "resolveCache resolving %s\n", host.c_str());
+		auto addrs = lookup(host, nullptr, passive);
+		const int saved_errno = errno;
+		{
+			std::unique_lock lk(mtx);
+			auto it = entries.find(key);
+			if (it != entries.end() && it->second.id == id) {
+				if (addrs) it->second.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl.load());
+				else entries.erase(it);
+			}
+		}
+		p.set_value(addrs);
+		errno = saved_errno;
+		return addrs;
+	}
+
+public:
+	/**
+	 * \brief The addresses of host:svc, with svc a port number or a service
+	 * name (resolved every time). The passive addresses are the ones to listen
+	 * to. It returns an empty vector on error (errno is set).
+	 */
+	static std::vector<resolvedAddr> resolve(const std::string& host, const std::string& svc, bool passive=false) {
+		char* end;
+		const long port = strtol(svc.c_str(), &end, 10);
+		const bool numeric = !svc.empty() && *end == '\0' && port >= 0 && port <= 65535;
+		auto addrs = numeric ? cached(host, passive) : lookup(host, svc.c_str(), passive);
+		if (!addrs) return {};
+		std::vector<resolvedAddr> r(*addrs);
+		if (numeric) for(auto& a : r) a.setPort((uint16_t)port);
+		return r;
+	}
+
+	// \brief Invalidates the addresses of host, of all the hosts if empty.
+	static void invalidate(const std::string& host = "") {
+		std::unique_lock lk(mtx);
+		for(auto it = entries.begin(); it != entries.end();) {
+			if (host.empty() || it->first.first == host) it = entries.erase(it);
+			else ++it;
+		}
+	}
+
+	// \brief Sets the lifetime (milliseconds) of the entries, 0 disables the cache.
+	static void setTTL(unsigned ms) {
+		ttl = ms;
+		if (ms == 0) invalidate();
+	}
+
+	// \brief Resolves the hosts in parallel, to have them in the cache.
+	static void prefetch(const std::vector<std::string>& hosts) {
+		std::vector<std::thread> th;
+		for(auto& h : hosts) th.emplace_back([h]() { cached(h, false); });
+		for(auto& t : th) t.join();
+	}
+};
+
+// Cancellation of the connection attempts that the Manager runs in parallel
+// (see Manager::connectHandle): the thread of an attempt points it to the
+// flag of its race, the protocols check it while they connect and retry.
+inline thread_local const std::atomic<bool>* mtcl_connect_cancel = nullptr;
+
+static inline bool connectCancelled() {
+	return mtcl_connect_cancel && mtcl_connect_cancel->load(std::memory_order_acquire);
+}
+
+// Waits ms milliseconds before retrying a connect. It returns false, with
+// errno set to ECANCELED, if the attempt is cancelled meanwhile.
+static inline bool connectRetrySleep(unsigned ms) {
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	while(!connectCancelled()) {
+		const auto now = std::chrono::steady_clock::now();
+		if (now >= deadline) return true;
+		std::this_thread::sleep_for(mtcl_connect_cancel ?
+									std::min<std::chrono::steady_clock::duration>(deadline - now, std::chrono::milliseconds(10)) :
+									deadline - now);
+	}
+	errno = ECANCELED;
+	return false;
+}
+
+// Connects to one of the addresses of the list (happy eyeballs, RFC 8305).
+// The attempts run in parallel: they start CONNECT_ATTEMPT_DELAY
+// milliseconds apart, or at once when the previous one fails, and each one
+// lasts at most UNREACHABLE_ADDR_TIMOUT milliseconds. The first connection
+// established wins and the others are closed. It returns the connected
+// (blocking) socket, or -1 with errno of the last failure.
+static inline int internal_connect(const std::vector<resolvedAddr>& addrs) {
+	using clock = std::chrono::steady_clock;
+	struct attempt_t { int fd; clock::time_point deadline; };
+	std::vector<attempt_t>     attempts;
+	std::vector<struct pollfd> pfds;
+	auto rp = addrs.begin();
+	int saved_errno = EHOSTUNREACH;
+	int fd = -1;
+	auto nextStart = clock::now();
+
+	while(fd == -1 && (rp != addrs.end() || !attempts.empty())) {
+		if (connectCancelled()) { saved_errno = ECANCELED; break; }
+		auto now = clock::now();
+		if (rp != addrs.end() && (attempts.empty() || now >= nextStart)) {
+			const resolvedAddr& a = *rp++;
+			const int s = socket(a.family, SOCK_STREAM, IPPROTO_TCP);
+			if (s == -1) {
+				saved_errno = errno;
+				MTCL_PRINT(100, "[MTCL]:", "internal_connect socket error, errno=%d\n", errno);
+				continue;
+			}
+			const int flags = fcntl(s, F_GETFL, 0);
+			if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+				saved_errno = errno;
+				close(s);
+				continue;
+			}
+			if (connect(s, (const struct sockaddr*)&a.addr, a.len) == 0) { fd = s; break; }
+			if (errno != EINPROGRESS && errno != EWOULDBLOCK) {  // the next one at once
+				saved_errno = errno;
+				close(s);
+				continue;
+			}
+			attempts.push_back({s, now + std::chrono::milliseconds(UNREACHABLE_ADDR_TIMOUT)});
+			nextStart = now + std::chrono::milliseconds(CONNECT_ATTEMPT_DELAY);
+			continue;
+		}
+		// waits for an attempt to complete or expire, or for the next start
+		auto until = attempts.front().deadline;
+		for(auto& a : attempts) until = std::min(until, a.deadline);
+		if (rp != addrs.end()) until = std::min(until, nextStart);
+		auto wait = std::chrono::ceil<std::chrono::milliseconds>(until - now).count();
+		if (mtcl_connect_cancel) wait = std::min<decltype(wait)>(wait, 10);
+		pfds.clear();
+		for(auto& a : attempts) pfds.push_back({a.fd, POLLOUT, 0});
+		const int r = poll(pfds.data(), pfds.size(), (int)std::max<decltype(wait)>(wait, 0));
+		if (r < 0 && errno != EINTR) { saved_errno = errno; break; }
+		now = clock::now();
+		size_t j = 0;
+		for(size_t i=0; i<attempts.size(); ++i) {
+			int error = -1;
+			if (r > 0 && pfds[i].revents) {
+				socklen_t len = sizeof(error);
+				if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) error = errno;
+				if (error == 0 && fd == -1) { fd = attempts[i].fd; continue; }
+			} else if (now >= attempts[i].deadline) error = EHOSTUNREACH;
+			if (error > 0) {
+				saved_errno = error;
+				close(attempts[i].fd);
+				nextStart = now;
+				continue;
+			}
+			attempts[j++] = attempts[i];
+		}
+		attempts.resize(j);
+	}
+	for(auto& a : attempts) close(a.fd);
+	if (fd == -1) {
+		errno = saved_errno;
+		return -1;
+	}
+	const int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
 }
 
 
@@ -220,54 +444,122 @@ static inline int internal_connect(const std::string& address, int retry, unsign
 	
 	MTCL_PRINT(100, "[MTCL]:", "connecting to %s:%s\n", host.c_str(), svc.c_str());
 	
-	int fd=-1;	
-	struct addrinfo hints;
-	struct addrinfo *result, *rp;
-	
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_UNSPEC;              /* Allow IPv4 or IPv6 */
-	hints.ai_socktype = SOCK_STREAM;            /* Stream socket */
-	hints.ai_flags    = 0;
-	hints.ai_protocol = IPPROTO_TCP;            /* Allow only TCP */
-	
 	// resolve the address (assumo stringa formattata come host:port)
-	if (getaddrinfo(host.c_str(), svc.c_str(), &hints, &result) != 0) {
-		MTCL_PRINT(100, "MTCL:", "internal_connect  getaddrinfo error, errno=%d\n", errno);
+	const auto addrs = resolveCache::resolve(host, svc);
+	if (addrs.empty()) {
+		MTCL_PRINT(100, "MTCL:", "internal_connect resolve error, errno=%d\n", errno);
 		return -1;
 	}
 
-	bool connected=false;
-	do {			
-		// try to connect to a possible one of the resolution results
-		for (rp = result; rp != NULL; rp = rp->ai_next) {
-			fd = socket(rp->ai_family, rp->ai_socktype,
-						rp->ai_protocol);
-			if (fd == -1) {
-				MTCL_PRINT(100, "[MTCL]:", "internal_connect socket error, errno=%d\n", errno);
-				continue;
+	// all the resolved addresses are tried at each attempt
+	int fd;
+	for(int attempt=1; (fd = internal_connect(addrs)) == -1 && attempt < retry; ++attempt) {
+		if (errno == ECANCELED || !connectRetrySleep(timeout_ms)) break;
+		MTCL_PRINT(100, "[MTCL]:", "retry to connect to %s:%s\n", host.c_str(), svc.c_str());
+	}
+	return fd;
+}
+
+/*
+ * A range of a file accessed in memory, used by the default implementation
+ * of sendFile and receiveToFile. The range of a regular file is mapped, the
+ * other files (e.g. pipes, or files opened write-only) are copied through a
+ * temporary buffer. An offset of -1 means the current position of the file,
+ * that is advanced by the length of the range.
+ */
+class fileRange {
+	int    fd     = -1;
+	off_t  offset = -1;       // start of the range, -1 if the file is not seekable
+	size_t len    = 0;
+	bool   out    = false;    // the range is written (receiveToFile)
+	bool   advance = false;   // the file position has to be moved
+	void*  base   = nullptr;  // the mapping (page aligned)
+	size_t maplen = 0;
+	std::vector<char> copy;
+
+public:
+	// It returns the address of the range (len > 0) or nullptr on error. The
+	// range read from a file must be within its size (EINVAL otherwise),
+	// the written one extends the file if needed.
+	char* open(int fd, off_t offset, size_t len, bool out) {
+		this->fd = fd; this->len = len; this->out = out;
+		struct stat st;
+		if (len == 0 || fstat(fd, &st) < 0) {
+			if (len == 0) errno = EINVAL;
+			return nullptr;
+		}
+		advance = offset < 0;
+		if (advance && (offset = lseek(fd, 0, SEEK_CUR)) < 0) offset = -1;  // ESPIPE
+		this->offset = offset;
+		if (S_ISREG(st.st_mode)) {
+			if (!out && (size_t)offset + len > (size_t)st.st_size) {
+				errno = EINVAL;
+				return nullptr;
 			}
-						
-			if (internal_connect(fd, rp->ai_addr, rp->ai_addrlen) != -1) {			   
-				retry=0;     
-				connected=true;
-				break;                  /* Success */
-			} 
-			close(fd);
+			if (out && (size_t)offset + len > (size_t)st.st_size && ftruncate(fd, offset + len) < 0)
+				return nullptr;
+			const off_t pa = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+			maplen = len + (offset - pa);
+			base = mmap(NULL, maplen, out ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, pa);
+			if (base != MAP_FAILED) {
+				madvise(base, maplen, MADV_SEQUENTIAL);
+				return (char*)base + (offset - pa);
+			}
+			base = nullptr;  // e.g. EACCES for the files opened write-only
 		}
-		if (!connected && retry>0) {
-			--retry;		
-			std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
-			MTCL_PRINT(100, "[MTCL]:", "retry to connect to %s:%s\n", host.c_str(), svc.c_str());
+		copy.resize(len);
+		if (out) return copy.data();
+		for(size_t got = 0; got < len; ) {
+			const ssize_t r = (offset < 0) ? read(fd, copy.data() + got, len - got)
+				: pread(fd, copy.data() + got, len - got, offset + got);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) {
+				if (r == 0) errno = EINVAL;  // shorter than len
+				return nullptr;
+			}
+			got += r;
 		}
-	} while(retry>0);
-	
-	free(result);
-    
-	if (rp == NULL) /* No address succeeded */
-		return -1;
-	return fd;
-}
+		return copy.data();
+	}
 
+	// writes the copied range and moves the file position, it returns 0 or -1
+	int close() {
+		if (out && !base) {
+			for(size_t put = 0; put < len; ) {
+				const ssize_t r = (offset < 0) ? write(fd, copy.data() + put, len - put)
+					: pwrite(fd, copy.data() + put, len - put, offset + put);
+				if (r < 0 && errno == EINTR) continue;
+				if (r <= 0) return -1;
+				put += r;
+			}
+		}
+		if (advance && offset >= 0 && lseek(fd, offset + len, SEEK_SET) < 0) return -1;
+		return 0;
+	}
+
+	~fileRange() { if (base) munmap(base, maplen); }
+};
+
+#if defined(__linux__)
+/*
+ * Thin wrappers around the futex system call. The futex word is private to
+ * the process unless shared is true, in this case it can be placed in a
+ * shared-memory segment and used by different processes.
+ *
+ * mtcl_futex_wait blocks only if *addr == expected (it returns -1 with
+ * errno=EAGAIN otherwise), timeout is relative and nullptr means forever.
+ * mtcl_futex_wake wakes up at most nwaiters threads blocked on addr.
+ */
+static inline int mtcl_futex_wait(std::atomic<uint32_t>* addr, uint32_t expected,
+								  const struct timespec* timeout=nullptr, bool shared=false) {
+	return (int)syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+						FUTEX_WAIT | (shared ? 0 : FUTEX_PRIVATE_FLAG), expected, timeout, NULL, 0);
+}
+static inline int mtcl_futex_wake(std::atomic<uint32_t>* addr, int nwaiters=1, bool shared=false) {
+	return (int)syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+						FUTEX_WAKE | (shared ? 0 : FUTEX_PRIVATE_FLAG), nwaiters, NULL, NULL, 0);
+}
+#endif
 
 } // namespace
 
@@ -284,6 +576,14 @@ static inline int internal_connect(const std::string& address, int retry, unsign
 #define ADD_CODE_IF(X) 
 #endif
 
+// By default the IO thread blocks on the event file descriptors provided by
+// the protocols (see ConnType::getEventFd). If MTCL_IO_THREAD_BUSY_POLL is
+// defined, the IO thread polls all protocols sleeping IO_THREAD_POLL_TIMEOUT
+// microseconds between two consecutive rounds.
+#if defined(__linux__) && !defined(MTCL_IO_THREAD_BUSY_POLL)
+#define MTCL_IO_THREAD_EVENT_WAIT
+#endif
+
 
 #ifdef __APPLE__
     #include <libkern/OSByteOrder.h>
@@ -0,0 +1,104 @@
+/*
+ * Test of the aggregation of small messages (HandleUser::setCork).
+ *
+ * The client enables the aggregation and sends NMSGS small messages, then:
+ *  1. it waits (without receiving) for the server to acknowledge them: the
+ *     buffer must be flushed by the IO thread after CORK_FLUSH_TIMEOUT;
+ *  2. it sends NMSGS more messages and calls receive, that flushes them;
+ *  3. it sends NMSGS more messages, flushes them explicitly and waits
+ *     for the acknowledgement with a non-blocking probe loop.
+ * The server checks the content and the order of all the messages.
+ *
+ * $> ./test_cork [protocol=TCP]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int NMSGS = 1000;
+
+static bool client(const std::string& ep) {
+	auto h = Manager::connect(ep, 50, 100);
+	if (!h.isValid() || h.setCork(true) < 0) {
+		MTCL_ERROR("[Client]:", "cannot connect/cork %s, errno=%d (%s)\n", ep.c_str(), errno, strerror(errno));
+		return false;
+	}
+	int seq = 0;
+	for(int phase = 0; phase < 3; ++phase) {
+		for(int i=0; i<NMSGS; ++i, ++seq) {
+			if (h.send(&seq, sizeof(seq)) != sizeof(seq)) {
+				MTCL_ERROR("[Client]:", "send error, errno=%d (%s)\n", errno, strerror(errno));
+				return false;
+			}
+		}
+		int ack = -1;
+		size_t sz;
+		if (phase == 0) {
+			// the IO thread must have flushed the buffer, thus the ack
+			// has to be already available
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+			if (h.probe(sz, false) <= 0) {
+				MTCL_ERROR("[Client]:", "the buffered messages have not been flushed\n");
+				return false;
+			}
+		}
+		if (phase == 2 && h.flush() < 0) {
+			MTCL_ERROR("[Client]:", "flush error, errno=%d (%s)\n", errno, strerror(errno));
+			return false;
+		}
+		if (h.receive(&ack, sizeof(ack)) != sizeof(ack) || ack != seq) {
+			MTCL_ERROR("[Client]:", "wrong ack %d in phase %d (expected %d)\n", ack, phase, seq);
+			return false;
+		}
+	}
+	h.close();
+	return true;
+}
+
+int main(int argc, char** argv){
+	std::string proto = (argc > 1) ? argv[1] : "TCP";
+	const std::string ep = proto + ":localhost:13030";
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client(ep);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen(ep) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid();
+	for(int seq = 0; ok && seq < 3*NMSGS; ) {
+		int v;
+		if (h.receive(&v, sizeof(v)) != sizeof(v) || v != seq) {
+			MTCL_ERROR("[Server]:", "wrong message %d (expected %d)\n", v, seq);
+			ok = false;
+			break;
+		}
+		if (++seq % NMSGS == 0) ok = h.send(&seq, sizeof(seq)) == sizeof(seq);
+	}
+	char c;
+	ok = ok && h.receive(&c, 1) == 0;  // EOS
+	h.close();
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
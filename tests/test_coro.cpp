@@ -0,0 +1,120 @@
+/*
+ * Test of the coroutine interface (coScheduler, async_receive, async_send
+ * and Manager::next). It requires C++20.
+ *
+ * The client process runs one flow for each of its N connections: each flow
+ * makes M ping-pong exchanges with the server, then it closes the connection
+ * and waits for the EOS. The server runs an acceptor flow that spawns one
+ * echo flow for each new connection. All the flows of a process are run by
+ * a single thread.
+ *
+ * $> ./test_coro [#connections=256] [#exchanges=50]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include "mtcl.hpp"
+
+#if defined(MTCL_ENABLE_COROUTINES)
+
+using namespace MTCL;
+
+static int nerrors = 0, nexchanges = 0, nclosed = 0;
+
+static coTask pingpong(HandleUser h, int id, int nexch) {
+	for(int m=0;m<nexch;++m) {
+		int msg[2] = {id, m};
+		if (co_await h.async_send(msg, sizeof(msg)) != sizeof(msg)) { ++nerrors; co_return; }
+		int echo[2];
+		if (co_await h.async_receive(echo, sizeof(echo)) != sizeof(echo) ||
+			echo[0] != id || echo[1] != m) { ++nerrors; co_return; }
+		++nexchanges;
+	}
+	h.close();
+	char c;
+	if (co_await h.async_receive(&c, sizeof(c)) != 0) ++nerrors;  // EOS from the server
+	else ++nclosed;
+}
+
+static coTask echo(HandleUser h) {
+	int msg[2];
+	ssize_t r;
+	while((r = co_await h.async_receive(msg, sizeof(msg))) > 0) {
+		if (co_await h.async_send(msg, r) != r) { ++nerrors; co_return; }
+		++nexchanges;
+	}
+	if (r < 0) ++nerrors;
+	h.close();
+	++nclosed;
+}
+
+static coTask acceptor(coScheduler& sched, int nconn) {
+	for(int i=0;i<nconn;) {
+		HandleUser h = co_await Manager::next();
+		if (!h.isValid()) { ++nerrors; co_return; }
+		if (!h.isNewConnection()) { ++nerrors; continue; }
+		sched.spawn(echo(std::move(h)));
+		++i;
+	}
+}
+
+int main(int argc, char** argv){
+	const int nconn = (argc > 1) ? std::stoi(argv[1]) : 256;
+	const int nexch = (argc > 2) ? std::stoi(argv[2]) : 50;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		coScheduler sched;
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13006", 50, 100);
+			if (!h.isValid()) {
+				MTCL_ERROR("[Client]:", "cannot connect to server (connection %d), errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			sched.spawn(pingpong(std::move(h), i, nexch));
+		}
+		sched.run();
+		Manager::finalize();
+		if (nerrors || nexchanges != nconn * nexch || nclosed != nconn) {
+			std::cerr << "TEST FAILED (client): exchanges=" << nexchanges << " closed=" << nclosed
+					  << " errors=" << nerrors << "\n";
+			return -1;
+		}
+		return 0;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13006") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	coScheduler sched;
+	sched.spawn(acceptor(sched, nconn));
+	const auto start = std::chrono::steady_clock::now();
+	sched.run();
+	const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	Manager::finalize();
+
+	if (nerrors || nexchanges != nconn * nexch || nclosed != nconn ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: exchanges=" << nexchanges << " closed=" << nclosed
+				  << " errors=" << nerrors << "\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << nconn << " flows, " << nconn * nexch << " exchanges in "
+			  << elapsed.count() << "ms)\n";
+	return 0;
+}
+
+#else
+int main() {
+	std::cout << "TEST SKIPPED (C++20 coroutines not available)\n";
+	return 0;
+}
+#endif
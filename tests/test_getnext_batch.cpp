@@ -0,0 +1,111 @@
+/*
+ * Test of Manager::getNextBatch.
+ *
+ * The client process opens N connections and sends M messages on each of
+ * them (connection index and sequence number), then closes all of them.
+ * The server collects the ready handles with getNextBatch (at most BATCH at
+ * a time) and checks that all the messages and all the EOS are received,
+ * that the messages of each connection arrive in order and that the same
+ * handle is never returned twice in the same batch.
+ *
+ * $> ./test_getnext_batch [#IO-threads=2] [#connections=32] [#messages=100] [batch=16]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <set>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+int main(int argc, char** argv){
+	const int nthreads = (argc > 1) ? std::stoi(argv[1]) : 2;
+	const int nconn    = (argc > 2) ? std::stoi(argv[2]) : 32;
+	const int nmsg     = (argc > 3) ? std::stoi(argv[3]) : 100;
+	const size_t batch = (argc > 4) ? std::stoul(argv[4]) : 16;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		std::vector<HandleUser> handles;
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13003", 50, 100);
+			if (!h.isValid()) {
+				MTCL_ERROR("[Client]:", "cannot connect to server (connection %d), errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			handles.push_back(std::move(h));
+		}
+		for(int m=0;m<nmsg;++m)
+			for(int i=0;i<nconn;++i) {
+				int msg[2] = {i, m};
+				if (handles[i].send(msg, sizeof(msg)) != sizeof(msg)) {
+					MTCL_ERROR("[Client]:", "send error on connection %d, errno=%d (%s)\n",
+							   i, errno, strerror(errno));
+					Manager::finalize();
+					return -1;
+				}
+			}
+		for(auto& h: handles) h.close();
+		Manager::finalize();
+		return 0;
+	}
+	Manager::setIOThreads(nthreads);
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13003") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	std::vector<HandleUser> out(batch);
+	std::vector<int> expectedSeq(nconn, 0);
+	int nmsgs = 0, neos = 0, errors = 0;
+	size_t ncalls = 0, maxBatch = 0;
+	while(neos < nconn) {
+		const size_t n = Manager::getNextBatch(out.data(), batch, std::chrono::seconds(10));
+		if (n == 0) {
+			MTCL_ERROR("[Server]:", "timeout, received %d messages and %d EOS\n", nmsgs, neos);
+			break;
+		}
+		++ncalls;
+		maxBatch = std::max(maxBatch, n);
+		std::set<size_t> ids;
+		for(size_t i=0;i<n;++i) {
+			auto& h = out[i];
+			if (!h.isValid() || !ids.insert(h.getID()).second) { ++errors; continue; }
+			if (h.isNewConnection()) continue;  // yielded by the next getNextBatch
+			size_t sz;
+			if (h.probe(sz) <= 0) { // EOS, the handle has been closed
+				++neos;
+				continue;
+			}
+			int msg[2];
+			if (h.receive(msg, sizeof(msg)) != sizeof(msg) || msg[0] < 0 || msg[0] >= nconn ||
+				msg[1] != expectedSeq[msg[0]]) {
+				++errors;
+				continue;
+			}
+			++expectedSeq[msg[0]];
+			++nmsgs;
+		}
+	}
+	// gives the last batch back to the Manager before finalizing
+	out.clear();
+	Manager::finalize();
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (nmsgs != nconn*nmsg || neos != nconn || errors != 0 ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: messages=" << nmsgs << " (expected " << nconn*nmsg << ")"
+				  << " EOS=" << neos << " errors=" << errors << "\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << Manager::getIOThreads() << " IO threads, " << nmsgs << " messages, "
+			  << ncalls << " calls, max batch " << maxBatch << ")\n";
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Test of the parallel connection attempts to the addresses of a host
+ * (internal_connect, happy eyeballs).
+ *
+ * The "slow" address is a listening socket whose accept queue is full: the
+ * SYNs sent to it are dropped and its connects hang. The "refused" address
+ * has no listener. The connection to the list {slow, good} must be
+ * established to the good address well before the slow attempt expires,
+ * the one to {refused, good} at once, and the losing sockets must be closed
+ * (the process gets exactly one more descriptor). The list {slow} alone
+ * fails after UNREACHABLE_ADDR_TIMOUT milliseconds, without leaks.
+ *
+ * $> ./test_happy_eyeballs
+ */
+#include <dirent.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+// number of open descriptors of the process
+static int openFds() {
+	DIR* d = opendir("/proc/self/fd");
+	if (!d) return -1;
+	int n = 0;
+	while(readdir(d)) ++n;
+	closedir(d);
+	return n;
+}
+
+static resolvedAddr loopback(uint16_t port) {
+	resolvedAddr a{};
+	struct sockaddr_in* in = (struct sockaddr_in*)&a.addr;
+	in->sin_family      = AF_INET;
+	in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	a.len    = sizeof(*in);
+	a.family = AF_INET;
+	a.setPort(port);
+	return a;
+}
+
+// listening socket on a free port of the loopback interface
+static int listener(int backlog, uint16_t& port) {
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	resolvedAddr a = loopback(0);
+	if (s == -1 || bind(s, (struct sockaddr*)&a.addr, a.len) < 0 || listen(s, backlog) < 0) return -1;
+	socklen_t len = sizeof(a.addr);
+	getsockname(s, (struct sockaddr*)&a.addr, &len);
+	port = ntohs(((struct sockaddr_in*)&a.addr)->sin_port);
+	return s;
+}
+
+static uint16_t peerPort(int fd) {
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+	if (getpeername(fd, (struct sockaddr*)&peer, &len) < 0) return 0;
+	return ntohs(peer.sin_port);
+}
+
+static long elapsedMs(std::chrono::steady_clock::time_point t0) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bool test() {
+	uint16_t goodPort, slowPort, refusedPort;
+	const int good = listener(16, goodPort);
+	const int slow = listener(0, slowPort);
+	CHECK(good != -1 && slow != -1);
+	// fills the accept queue of the slow listener (never accepted)
+	std::vector<int> fillers;
+	for(int i=0; i<2; ++i) {
+		int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		resolvedAddr a = loopback(slowPort);
+		connect(s, (struct sockaddr*)&a.addr, a.len);
+		fillers.push_back(s);
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	{
+		const int refused = listener(1, refusedPort);
+		CHECK(refused != -1);
+		close(refused);
+	}
+	// the slow address is really slow
+	{
+		int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		resolvedAddr a = loopback(slowPort);
+		CHECK(connect(s, (struct sockaddr*)&a.addr, a.len) == -1 && errno == EINPROGRESS);
+		struct pollfd pfd = {s, POLLOUT, 0};
+		CHECK(poll(&pfd, 1, 2 * UNREACHABLE_ADDR_TIMOUT) == 0);
+		close(s);
+	}
+
+	const int fds = openFds();
+	auto t0 = std::chrono::steady_clock::now();
+	int fd = internal_connect({loopback(slowPort), loopback(goodPort)});
+	long ms = elapsedMs(t0);
+	CHECK(fd != -1);
+	CHECK(peerPort(fd) == goodPort);
+	CHECK(ms < (long)UNREACHABLE_ADDR_TIMOUT);
+	CHECK(openFds() == fds + 1);  // the slow attempt has been closed
+	close(fd);
+
+	t0 = std::chrono::steady_clock::now();
+	fd = internal_connect({loopback(refusedPort), loopback(goodPort)});
+	ms = elapsedMs(t0);
+	CHECK(fd != -1);
+	CHECK(peerPort(fd) == goodPort);
+	CHECK(ms < (long)CONNECT_ATTEMPT_DELAY);  // the next one starts at once
+	CHECK(openFds() == fds + 1);
+	close(fd);
+
+	t0 = std::chrono::steady_clock::now();
+	fd = internal_connect({loopback(slowPort)});
+	ms = elapsedMs(t0);
+	CHECK(fd == -1 && errno == EHOSTUNREACH);
+	CHECK(ms >= (long)UNREACHABLE_ADDR_TIMOUT && ms < 2 * (long)UNREACHABLE_ADDR_TIMOUT);
+	CHECK(openFds() == fds);
+
+	// only the two connections to the good address have been established
+	CHECK(fcntl(good, F_SETFL, O_NONBLOCK) == 0);
+	int accepted = 0, c;
+	while((c = accept(good, nullptr, nullptr)) != -1) {
+		close(c);
+		++accepted;
+	}
+	CHECK(accepted == 2);
+
+	for(auto s : fillers) close(s);
+	close(good);
+	close(slow);
+	return true;
+}
+
+int main() {
+	if (!test()) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
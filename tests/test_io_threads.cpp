@@ -0,0 +1,116 @@
+/*
+ * Test of the sharded Manager with multiple IO threads.
+ *
+ * The server uses NSHARDS IO threads and one consumer thread for each shard,
+ * every consumer calls Manager::getNext(shard). The client process opens N
+ * connections, sends one message on each of them and then closes all of
+ * them. The server checks that all the messages and all the EOS are received,
+ * that each handle is returned only by the consumer of its shard and that
+ * the connections are evenly distributed among the shards (epoll version).
+ *
+ * $> ./test_io_threads [#shards=4] [#connections=64]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+int main(int argc, char** argv){
+	const int nshards = (argc > 1) ? std::stoi(argv[1]) : 4;
+	const int nconn   = (argc > 2) ? std::stoi(argv[2]) : 64;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		std::vector<HandleUser> handles;
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13002", 50, 100);
+			if (!h.isValid()) {
+				MTCL_ERROR("[Client]:", "cannot connect to server (connection %d), errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			if (h.send(&i, sizeof(i)) != sizeof(i)) {
+				MTCL_ERROR("[Client]:", "send error on connection %d, errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			handles.push_back(std::move(h));
+		}
+		for(auto& h: handles) h.close();
+		Manager::finalize();
+		return 0;
+	}
+	if (Manager::setIOThreads(nshards) < 0) {
+		MTCL_ERROR("[Server]:", "setIOThreads error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13002") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	const int shards = Manager::getIOThreads();
+
+	std::atomic<long long> sum{0};
+	std::atomic<int> nmsgs{0}, neos{0}, wrongShard{0};
+	std::vector<int> perShard(shards, 0);
+	std::vector<std::thread> consumers;
+	for(int s=0; s<shards; ++s) {
+		consumers.emplace_back([&, s]() {
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+			while(neos < nconn && std::chrono::steady_clock::now() < deadline) {
+				auto h = Manager::getNext(s, std::chrono::milliseconds(100));
+				if (!h.isValid()) continue;
+				if (h.getShard() != s) ++wrongShard;
+				if (h.isNewConnection()) {
+					++perShard[s];
+					h.yield();
+					continue;
+				}
+				size_t sz;
+				if (h.probe(sz) <= 0) { // EOS, the handle has been closed
+					++neos;
+					continue;
+				}
+				int x;
+				if (h.receive(&x, sizeof(x)) != sizeof(x)) {
+					MTCL_ERROR("[Server]:", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+					continue;
+				}
+				sum += x;
+				++nmsgs;
+			}
+		});
+	}
+	for(auto& t: consumers) t.join();
+	Manager::finalize();
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	const long long expected = (long long)nconn * (nconn - 1) / 2;
+	bool balanced = true;
+#if defined(MTCL_TCP_EPOLL)  // the select version of TCP has one shard only
+	for(int s=0; s<shards; ++s)
+		if (perShard[s] < nconn / shards || perShard[s] > (nconn + shards - 1) / shards) balanced = false;
+#endif
+	if (nmsgs != nconn || neos != nconn || sum != expected || wrongShard != 0 || !balanced ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: messages=" << nmsgs << " EOS=" << neos
+				  << " checksum=" << sum << " (expected " << expected << ")"
+				  << " wrong-shard=" << wrongShard << " balanced=" << balanced << "\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << shards << " IO threads, " << nconn << " connections)\n";
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Test of the zero-copy interface (loan/commit and receiveView/release).
+ *
+ * The client writes the messages into the buffers returned by loan, with
+ * sizes that make the records wrap around the end of the ring, and mixes
+ * them with plain sends. The server receives them with receiveView: over
+ * SHM the messages loaned must be returned in place, i.e., in the shared
+ * segment (checked in /proc/self/maps), the larger ones are copied. The
+ * same exchange is repeated over TCP, that uses the copying implementation.
+ *
+ * $> ./test_loan
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int NMSGS = 200;
+
+// messages sent with send (i%5 == 4) or larger than the ring are not in place
+static size_t msgSize(int i) {
+	if (i == NMSGS-2) return shmBuffer::MAX_LOAN;
+	if (i == NMSGS-1) return 2 * SHM_SMALL_MSG_SIZE + 5;
+	return 1 + ((size_t)i * 7919 * 97) % 700000;
+}
+static bool loaned(int i) { return i % 5 != 4; }
+static char byteAt(int i, size_t j) { return (char)(i * 31 + j); }
+
+// true if p is in a shared-memory segment
+static bool inShm(const void* p) {
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	while(std::getline(maps, line)) {
+		if (line.find("/dev/shm/") == std::string::npos) continue;
+		uintptr_t from, to;
+		if (sscanf(line.c_str(), "%lx-%lx", &from, &to) == 2 &&
+			(uintptr_t)p >= from && (uintptr_t)p < to) return true;
+	}
+	return false;
+}
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+static bool client(const std::string& ep) {
+	HandleUser h;
+	for(int i=0; i<500 && !(h = Manager::connect(ep)).isValid(); ++i) usleep(10000);
+	CHECK(h.isValid());
+	CHECK(h.loan(0) == nullptr && errno == EINVAL);
+	std::vector<char> buff(msgSize(NMSGS-1));
+	for(int i=0; i<NMSGS; ++i) {
+		const size_t sz = msgSize(i);
+		if (!loaned(i)) {
+			for(size_t j=0; j<sz; ++j) buff[j] = byteAt(i, j);
+			CHECK(h.send(buff.data(), sz) == (ssize_t)sz);
+			continue;
+		}
+		char* p = (char*)h.loan(sz);
+		CHECK(p != nullptr);
+		CHECK(h.loan(sz) == nullptr && errno == EBUSY);
+		if (ep[0] == 'S') CHECK(h.send("x", 1) == -1 && errno == EBUSY);
+		for(size_t j=0; j<sz; ++j) p[j] = byteAt(i, j);
+		CHECK(h.commit() == (ssize_t)sz);
+	}
+	CHECK(h.commit() == -1 && errno == EINVAL);
+	h.close();
+	return true;
+}
+
+static bool serve(HandleUser& h, bool shm) {
+	for(int i=0; i<NMSGS; ++i) {
+		const size_t sz = msgSize(i);
+		const void* v = nullptr;
+		CHECK(h.receiveView(v) == (ssize_t)sz);
+		const char* p = (const char*)v;
+		if (shm && loaned(i) && sz <= shmBuffer::MAX_LOAN) CHECK(inShm(p));
+		if (!shm || sz > shmBuffer::MAX_LOAN) CHECK(!inShm(p));
+		for(size_t j=0; j<sz; ++j)
+			if (p[j] != byteAt(i, j)) {
+				MTCL_ERROR("[Test]:", "message %d: wrong byte at %ld\n", i, j);
+				return false;
+			}
+		CHECK(h.receiveView(v) == -1 && errno == EBUSY);
+		CHECK(h.release() == 0);
+	}
+	CHECK(h.release() == -1 && errno == EINVAL);
+	const void* v;
+	CHECK(h.receiveView(v) == 0);  // EOS
+	return true;
+}
+
+static const char* EPS[] = {"SHM:/mtcl_test_loan", "TCP:localhost:13300"};
+
+int main() {
+	// the client connects to the next endpoint after the previous exchange
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client(EPS[0]) && client(EPS[1]);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	for(auto ep : EPS)
+		if (Manager::listen(ep) < 0) {
+			MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+			kill(pid, SIGTERM);
+			return -1;
+		}
+	bool ok = true;
+	for(int n=0; n<2;) {
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) continue;
+		ok = serve(h, n == 0) && ok;
+		h.close();
+		++n;
+	}
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
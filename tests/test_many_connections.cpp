@@ -0,0 +1,105 @@
+/*
+ * Fan-in test with many concurrent TCP connections.
+ *
+ * The client process opens N connections towards the server (by default
+ * more than FD_SETSIZE=1024), sends one message on each of them and then
+ * closes all of them. The server checks that all the messages and all the
+ * EOS are received.
+ *
+ * If needed, the soft limit on the number of open files is raised up to the
+ * hard limit.
+ *
+ * $> ./test_many_connections [#connections=1500]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static constexpr int DEFAULT_NCONN = 1500;
+
+static void raise_nofile_limit(size_t nconn) {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) return;
+	if (rl.rlim_cur >= nconn + 64) return;
+	rl.rlim_cur = std::min<rlim_t>(rl.rlim_max, nconn + 64);
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		MTCL_ERROR("[TEST]:", "cannot raise RLIMIT_NOFILE, errno=%d (%s)\n", errno, strerror(errno));
+}
+
+int main(int argc, char** argv){
+	const int nconn = (argc > 1) ? std::stoi(argv[1]) : DEFAULT_NCONN;
+	raise_nofile_limit(nconn);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		std::vector<HandleUser> handles;
+		handles.reserve(nconn);
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13000", 50, 100);
+			if (!h.isValid()) {
+				MTCL_ERROR("[Client]:", "cannot connect to server (connection %d), errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			if (h.send(&i, sizeof(i)) != sizeof(i)) {
+				MTCL_ERROR("[Client]:", "send error on connection %d, errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			handles.push_back(std::move(h));
+		}
+		for(auto& h: handles) h.close();
+		Manager::finalize();
+		return 0;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13000") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	long long sum = 0;
+	int nmsgs = 0, neos = 0;
+	while(neos < nconn) {
+		auto h = Manager::getNext(std::chrono::seconds(10));
+		if (!h.isValid()) {
+			MTCL_ERROR("[Server]:", "timeout, received %d messages and %d EOS out of %d\n",
+					   nmsgs, neos, nconn);
+			break;
+		}
+		size_t sz;
+		if (h.probe(sz) <= 0) { // EOS, the handle has been closed
+			++neos;
+			continue;
+		}
+		int x;
+		if (h.receive(&x, sizeof(x)) != sizeof(x)) {
+			MTCL_ERROR("[Server]:", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+			break;
+		}
+		sum += x;
+		++nmsgs;
+	}
+	Manager::finalize();
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	const long long expected = (long long)nconn * (nconn - 1) / 2;
+	if (nmsgs != nconn || neos != nconn || sum != expected ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: messages=" << nmsgs << " EOS=" << neos
+				  << " checksum=" << sum << " (expected " << expected << ")\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << nconn << " connections)\n";
+	return 0;
+}
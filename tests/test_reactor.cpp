@@ -0,0 +1,122 @@
+/*
+ * Test of the reactor API (Manager::onConnection and Manager::onMessage).
+ *
+ * The client process opens N connections, sends M messages on each of them
+ * (connection index and sequence number) and checks that the server echoes
+ * all of them back in order, then it closes the connections. The server
+ * only uses callbacks: it checks that no handle is returned by getNext,
+ * that the messages of each connection are delivered in order, that the
+ * callbacks of the same connection never run concurrently and that the
+ * closing of each connection is notified once.
+ *
+ * $> ./test_reactor [#IO-threads=2] [#reactor-threads=4] [#connections=32] [#messages=100]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+int main(int argc, char** argv){
+	const int niothreads = (argc > 1) ? std::stoi(argv[1]) : 2;
+	const int nworkers   = (argc > 2) ? std::stoi(argv[2]) : 4;
+	const int nconn      = (argc > 3) ? std::stoi(argv[3]) : 32;
+	const int nmsg       = (argc > 4) ? std::stoi(argv[4]) : 100;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		std::vector<HandleUser> handles;
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13005", 50, 100);
+			if (!h.isValid()) {
+				MTCL_ERROR("[Client]:", "cannot connect to server (connection %d), errno=%d (%s)\n",
+						   i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			handles.push_back(std::move(h));
+		}
+		for(int m=0;m<nmsg;++m)
+			for(int i=0;i<nconn;++i) {
+				int msg[2] = {i, m};
+				if (handles[i].send(msg, sizeof(msg)) != sizeof(msg)) {
+					MTCL_ERROR("[Client]:", "send error on connection %d, errno=%d (%s)\n",
+							   i, errno, strerror(errno));
+					Manager::finalize();
+					return -1;
+				}
+			}
+		int nerrors = 0;
+		for(int i=0;i<nconn;++i) {
+			for(int m=0;m<nmsg;++m) {
+				int msg[2];
+				if (handles[i].receive(msg, sizeof(msg)) != sizeof(msg) || msg[0] != i || msg[1] != m) {
+					MTCL_ERROR("[Client]:", "wrong echo on connection %d (message %d)\n", i, m);
+					++nerrors;
+					break;
+				}
+			}
+			handles[i].close();
+			size_t sz;
+			if (handles[i].probe(sz) != 0) ++nerrors;  // EOS from the server
+		}
+		Manager::finalize();
+		return nerrors ? -1 : 0;
+	}
+	Manager::setIOThreads(niothreads);
+	Manager::setReactorThreads(nworkers);
+	Manager::init("server");
+
+	struct connState {
+		std::atomic<int> inflight{0};
+		int next = 0;
+	};
+	std::atomic<int> nconnected{0}, nmsgs{0}, neos{0}, nerrors{0};
+	Manager::onConnection([&](HandleUser& h) {
+		++nconnected;
+		auto st = std::make_shared<connState>();
+		Manager::onMessage(h, [&, st](HandleUser& h, const char* buff, size_t size) {
+			if (st->inflight.fetch_add(1) != 0) ++nerrors;  // concurrent callbacks
+			if (size == 0) {
+				++neos;
+				h.close();
+			} else {
+				int msg[2];
+				std::memcpy(msg, buff, sizeof(msg));
+				if (size != sizeof(msg) || msg[1] != st->next++) ++nerrors;
+				if (h.send(msg, sizeof(msg)) != sizeof(msg)) ++nerrors;
+				++nmsgs;
+			}
+			st->inflight.fetch_sub(1);
+		});
+	});
+	if (Manager::listen("TCP:localhost:13005") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+	int nunexpected = 0;
+	while(neos < nconn && std::chrono::steady_clock::now() < deadline) {
+		auto h = Manager::getNext(std::chrono::milliseconds(10));
+		if (h.isValid()) ++nunexpected;
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	Manager::finalize();
+
+	if (nconnected != nconn || nmsgs != nconn * nmsg || neos != nconn || nerrors || nunexpected ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: connections=" << nconnected << " messages=" << nmsgs
+				  << " EOS=" << neos << " errors=" << nerrors << " unexpected=" << nunexpected << "\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << niothreads << " IO threads, " << nworkers << " reactor threads, "
+			  << nconn * nmsg << " messages)\n";
+	return 0;
+}
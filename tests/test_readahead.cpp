@@ -0,0 +1,103 @@
+/*
+ * Test of the readiness of the Handles whose messages have been read ahead.
+ *
+ * The client sends NMSGS small messages with a single write (setCork and
+ * flush), so that the first receive of the server takes all of them from
+ * the socket into the read-ahead buffer. The server receives one message
+ * at a time and yields the handle after each of them: getNext must report
+ * it as ready again even if the socket is no longer readable, since the
+ * complete messages are in the buffer. The same exchange is repeated over
+ * the Unix domain sockets.
+ *
+ * $> ./test_readahead
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int NMSGS = 16;
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+static bool client(const std::string& ep) {
+	HandleUser h;
+	for(int i=0; i<500 && !(h = Manager::connect(ep)).isValid(); ++i) usleep(10000);
+	CHECK(h.isValid());
+	CHECK(h.setCork(true) == 0);
+	for(int i=0; i<NMSGS; ++i) CHECK(h.send(&i, sizeof(i)) == sizeof(i));
+	CHECK(h.flush() == 0);
+	int ack = -1;
+	CHECK(h.receive(&ack, sizeof(ack)) == sizeof(ack) && ack == NMSGS);
+	h.close();
+	return true;
+}
+
+// receives the messages of the connection h, yielding it after each of them
+static bool serve(HandleUser h) {
+	for(int i=0; i<NMSGS; ++i) {
+		int v = -1;
+		CHECK(h.receive(&v, sizeof(v)) == sizeof(v) && v == i);
+		if (i == NMSGS-1) break;
+		const size_t id = h.getID();
+		h.yield();
+		// the other messages are only in the read-ahead buffer (the handles
+		// of the previous exchange may be returned first)
+		do h = Manager::getNext(std::chrono::seconds(5));
+		while(h.isValid() && h.getID() != id);
+		CHECK(h.isValid());
+	}
+	const int ack = NMSGS;
+	CHECK(h.send(&ack, sizeof(ack)) == sizeof(ack));
+	int eos;
+	CHECK(h.receive(&eos, sizeof(eos)) == 0);
+	h.close();
+	return true;
+}
+
+static const char* EPS[] = {"TCP:localhost:13310", "UDS:mtcl_test_readahead"};
+
+int main() {
+	// the client connects to the next endpoint after the previous exchange
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client(EPS[0]) && client(EPS[1]);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	for(auto ep : EPS)
+		if (Manager::listen(ep) < 0) {
+			MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+			kill(pid, SIGTERM);
+			return -1;
+		}
+	bool ok = true;
+	for(int n=0; n<2 && ok;) {
+		auto h = Manager::getNext(std::chrono::seconds(10));
+		if (!h.isValid()) {
+			ok = false;
+			break;
+		}
+		if (!h.isNewConnection()) continue;
+		// waits for the whole burst, then it is read at once
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		ok = serve(std::move(h));
+		++n;
+	}
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Test of the cache of the host addresses (resolveCache).
+ *
+ * getaddrinfo is interposed to count the resolutions. Many threads resolve
+ * the same host with different ports: getaddrinfo must run once and each
+ * thread gets its own port. Then the entry is invalidated, it expires after
+ * the TTL, and a listen and the connects to it resolve the host once.
+ *
+ * $> ./test_resolve
+ */
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static std::atomic<int> lookups{0};
+
+extern "C" int getaddrinfo(const char* node, const char* service,
+						   const struct addrinfo* hints, struct addrinfo** res) {
+	using fn_t = int(*)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+	static fn_t real = (fn_t)dlsym(RTLD_NEXT, "getaddrinfo");
+	++lookups;
+	return real(node, service, hints, res);
+}
+
+static uint16_t portOf(const resolvedAddr& a) {
+	if (a.family == AF_INET)  return ntohs(((const struct sockaddr_in*)&a.addr)->sin_port);
+	if (a.family == AF_INET6) return ntohs(((const struct sockaddr_in6*)&a.addr)->sin6_port);
+	return 0;
+}
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+static bool cacheTest() {
+	std::vector<std::thread> th;
+	std::atomic<int> wrong{0};
+	for(int i=0; i<32; ++i)
+		th.emplace_back([i, &wrong]() {
+			auto addrs = resolveCache::resolve("localhost", std::to_string(14000 + i));
+			if (addrs.empty()) ++wrong;
+			for(auto& a : addrs) if (portOf(a) != 14000 + i) ++wrong;
+		});
+	for(auto& t : th) t.join();
+	CHECK(wrong == 0);
+	CHECK(lookups == 1);
+
+	// the passive addresses are a different entry
+	CHECK(!resolveCache::resolve("localhost", "14000", true).empty());
+	CHECK(lookups == 2);
+	resolveCache::invalidate("localhost");
+	CHECK(!resolveCache::resolve("localhost", "14000").empty());
+	CHECK(lookups == 3);
+	// the failures are not cached
+	CHECK(resolveCache::resolve("mtcl-no-such-host.invalid", "14000").empty());
+	CHECK(resolveCache::resolve("mtcl-no-such-host.invalid", "14000").empty());
+	CHECK(lookups == 5);
+
+	resolveCache::setTTL(50);
+	resolveCache::invalidate();
+	CHECK(!resolveCache::resolve("localhost", "14000").empty());
+	CHECK(!resolveCache::resolve("localhost", "14001").empty());
+	CHECK(lookups == 6);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(!resolveCache::resolve("localhost", "14000").empty());
+	CHECK(lookups == 7);
+	resolveCache::setTTL(RESOLVE_CACHE_TTL);
+	resolveCache::invalidate();
+	return true;
+}
+
+int main() {
+	if (!cacheTest()) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	const int N = 8;
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		lookups = 0;
+		int ok = 0;
+		for(int i=0; i<N; ++i) {
+			auto h = Manager::connect("TCP:localhost:13090", 50, 100);
+			if (h.isValid() && h.send(&i, sizeof(i)) == sizeof(i)) ++ok;
+			h.close();
+		}
+		const int n = lookups;
+		Manager::finalize(true);
+		if (ok != N || n != 1) {
+			MTCL_ERROR("[Client]:", "%d connections, %d resolutions\n", ok, n);
+			return -1;
+		}
+		return 0;
+	}
+	Manager::init("server");
+	lookups = 0;
+	if (Manager::listen("TCP:localhost:13090") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	bool ok = lookups == 1;
+	for(int i=0; i<N;) {
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) {
+			h.close();
+			continue;
+		}
+		int v;
+		ok = ok && h.receive(&v, sizeof(v)) == sizeof(v);
+		++i;
+	}
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
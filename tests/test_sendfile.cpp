@@ -0,0 +1,146 @@
+/*
+ * Test of the file transfers (HandleUser::sendFile/receiveToFile).
+ *
+ * The client sends ranges of a file with sendFile (the whole file, a range
+ * at an offset, two ranges from the current position) and a message from
+ * memory. The server receives them into files, into memory and into a pipe,
+ * and checks their content. Also the errors are checked: a range beyond the
+ * end of the file (EINVAL) and a message larger than the capacity (EMSGSIZE,
+ * the message is not consumed).
+ *
+ * $> ./test_sendfile [endpoint=TCP:localhost:13080]
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const size_t FSIZE = (3<<20) + 123;
+static char byteAt(size_t j) { return (char)(j * 13 + j / 4096); }
+
+static int tmpFile(int flags=O_RDWR) {
+	char name[] = "/tmp/mtcl_test_sendfileXXXXXX";
+	int fd = mkstemp(name);
+	if (fd < 0) return -1;
+	unlink(name);
+	if (flags != O_RDWR) {  // reopened with the requested access mode
+		const std::string path = "/proc/self/fd/" + std::to_string(fd);
+		int fd2 = open(path.c_str(), flags);
+		close(fd);
+		fd = fd2;
+	}
+	return fd;
+}
+
+// the content of the file from off is the one of the source from soff
+static bool checkFile(int fd, off_t off, size_t len, size_t soff) {
+	std::vector<char> b(len);
+	if (pread(fd, b.data(), len, off) != (ssize_t)len) return false;
+	for(size_t j=0; j<len; ++j) if (b[j] != byteAt(soff + j)) return false;
+	return true;
+}
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+static bool client(const std::string& ep) {
+	int src = tmpFile();
+	CHECK(src >= 0);
+	std::vector<char> data(FSIZE);
+	for(size_t j=0; j<FSIZE; ++j) data[j] = byteAt(j);
+	CHECK(write(src, data.data(), FSIZE) == (ssize_t)FSIZE);
+
+	auto h = Manager::connect(ep, 50, 100);
+	CHECK(h.isValid());
+	CHECK(h.sendFile(src, 0, FSIZE) == (ssize_t)FSIZE);
+	CHECK(h.sendFile(src, 4096 + 5, 100000) == 100000);
+	CHECK(lseek(src, 777, SEEK_SET) == 777);
+	CHECK(h.sendFile(src, -1, 5000) == 5000);
+	CHECK(h.sendFile(src, -1, 5000) == 5000);
+	CHECK(lseek(src, 0, SEEK_CUR) == 777 + 10000);
+	CHECK(h.sendFile(src, FSIZE - 10, 11) == -1 && errno == EINVAL);
+	CHECK(h.send(data.data() + 1000, 200000) == 200000);
+	CHECK(h.sendFile(src, 0, 1000) == 1000);
+	CHECK(h.sendFile(src, 10, 300000) == 300000);
+	int ack = 0;
+	CHECK(h.receive(&ack, sizeof(ack)) == sizeof(ack) && ack == 1);
+	h.close();
+	close(src);
+	return true;
+}
+
+static bool server(HandleUser& h) {
+	int dst = tmpFile();
+	CHECK(dst >= 0);
+	// the whole file
+	CHECK(h.receiveToFile(dst, 0, FSIZE) == (ssize_t)FSIZE);
+	CHECK(checkFile(dst, 0, FSIZE, 0));
+	// a range into memory
+	std::vector<char> buff(100000);
+	CHECK(h.receive(buff.data(), buff.size()) == 100000);
+	for(size_t j=0; j<buff.size(); ++j) CHECK(buff[j] == byteAt(4096 + 5 + j));
+	// appended at the current position
+	int app = tmpFile();
+	CHECK(app >= 0 && lseek(app, 3, SEEK_SET) == 3);
+	CHECK(h.receiveToFile(app, -1, 5000) == 5000);
+	CHECK(h.receiveToFile(app, -1, 5000) == 5000);
+	CHECK(lseek(app, 0, SEEK_CUR) == 10003);
+	CHECK(checkFile(app, 3, 10000, 777));
+	// from memory to a file opened write-only, after a too small capacity
+	int wr = tmpFile(O_WRONLY);
+	CHECK(wr >= 0);
+	CHECK(h.receiveToFile(wr, 100, 199999) == -1 && errno == EMSGSIZE);
+	CHECK(h.receiveToFile(wr, 100, 200000) == 200000);
+	int rd = open(("/proc/self/fd/" + std::to_string(wr)).c_str(), O_RDONLY);
+	CHECK(rd >= 0 && checkFile(rd, 100, 200000, 1000));
+	// into a pipe
+	int p[2];
+	CHECK(pipe(p) == 0);
+	CHECK(h.receiveToFile(p[1], -1, 1000) == 1000);
+	CHECK(read(p[0], buff.data(), 1000) == 1000);
+	for(size_t j=0; j<1000; ++j) CHECK(buff[j] == byteAt(j));
+	// overwrites part of the first file
+	CHECK(h.receiveToFile(dst, 50, FSIZE) == 300000);
+	CHECK(checkFile(dst, 50, 300000, 10) && checkFile(dst, 300050, FSIZE - 300050, 300050));
+	const int ack = 1;
+	CHECK(h.send(&ack, sizeof(ack)) == sizeof(ack));
+	char c;
+	CHECK(h.receive(&c, 1) == 0);  // EOS
+	close(dst); close(app); close(wr); close(rd); close(p[0]); close(p[1]);
+	return true;
+}
+
+int main(int argc, char** argv){
+	const std::string ep = (argc > 1) ? argv[1] : "TCP:localhost:13080";
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client(ep);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen(ep) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid() && server(h);
+	h.close();
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
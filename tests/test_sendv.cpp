@@ -0,0 +1,124 @@
+/*
+ * Test of the vectored send and receive (HandleUser::sendv/receivev).
+ *
+ * The client sends NMSGS messages made of a header and two payload blocks
+ * in different buffers (one of them possibly empty), small and large ones,
+ * with and without the aggregation of the sends (setCork). The server
+ * receives them alternating receive (one buffer) and receivev with pieces
+ * whose boundaries do not match the ones used by the sender. Before each
+ * receivev the server also checks that too small buffers give EMSGSIZE
+ * without consuming the message.
+ *
+ * $> ./test_sendv [endpoint=TCP:localhost:13050]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int NMSGS = 64;
+
+struct header_t {
+	int    id;
+	size_t len1, len2;
+};
+
+static size_t len1(int i) { return (i % 3 == 0) ? 0 : 100 * i; }
+static size_t len2(int i) { return (i % 4 == 0) ? (1<<20) + i : 10 + i; }
+static char   byteAt(int i, size_t j) { return (char)(i + j * 7); }
+
+static bool client(const std::string& ep) {
+	auto h = Manager::connect(ep, 50, 100);
+	if (!h.isValid()) return false;
+	std::vector<char> p1, p2;
+	for(int i=0; i<NMSGS; ++i) {
+		if (i == NMSGS/2 && h.setCork(true) < 0 && errno != ENOTSUP) return false;
+		header_t hdr{i, len1(i), len2(i)};
+		p1.resize(hdr.len1);
+		p2.resize(hdr.len2);
+		for(size_t j=0; j<hdr.len1; ++j) p1[j] = byteAt(i, j);
+		for(size_t j=0; j<hdr.len2; ++j) p2[j] = byteAt(i, hdr.len1 + j);
+		struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {p1.data(), p1.size()}, {p2.data(), p2.size()}};
+		const ssize_t total = sizeof(hdr) + hdr.len1 + hdr.len2;
+		if (h.sendv(iov, 3) != total) {
+			MTCL_ERROR("[Client]:", "sendv error, errno=%d (%s)\n", errno, strerror(errno));
+			return false;
+		}
+	}
+	h.close();
+	return true;
+}
+
+static bool check(int i, const header_t& hdr, const char* payload) {
+	if (hdr.id != i || hdr.len1 != len1(i) || hdr.len2 != len2(i)) {
+		MTCL_ERROR("[Server]:", "wrong header of message %d\n", i);
+		return false;
+	}
+	for(size_t j=0; j<hdr.len1 + hdr.len2; ++j)
+		if (payload[j] != byteAt(i, j)) {
+			MTCL_ERROR("[Server]:", "wrong payload of message %d at %ld\n", i, j);
+			return false;
+		}
+	return true;
+}
+
+int main(int argc, char** argv){
+	const std::string ep = (argc > 1) ? argv[1] : "TCP:localhost:13050";
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client(ep);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen(ep) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid();
+	std::vector<char> buff(sizeof(header_t) + 100 * NMSGS + (1<<20) + NMSGS);
+	for(int i=0; ok && i<NMSGS; ++i) {
+		const ssize_t total = sizeof(header_t) + len1(i) + len2(i);
+		header_t hdr;
+		if (i % 2) {
+			ok = h.receive(buff.data(), buff.size()) == total;
+			memcpy(&hdr, buff.data(), sizeof(hdr));
+			ok = ok && check(i, hdr, buff.data() + sizeof(hdr));
+			continue;
+		}
+		// the header and the payload split in 3 pieces of different sizes
+		const size_t plen = total - sizeof(hdr), a = plen / 3, b = plen / 5;
+		char* payload = buff.data();
+		struct iovec small[4] = {{&hdr, sizeof(hdr)}, {payload, a}, {payload + a, 0}, {payload + a, b}};
+		if (h.receivev(small, 4) != -1 || errno != EMSGSIZE) {
+			MTCL_ERROR("[Server]:", "receivev of message %d did not fail with EMSGSIZE\n", i);
+			ok = false;
+			break;
+		}
+		struct iovec iov[4] = {{&hdr, sizeof(hdr)}, {payload, a}, {payload + a, b},
+							   {payload + a + b, buff.size() - sizeof(hdr) - a - b}};
+		ok = h.receivev(iov, 4) == total && check(i, hdr, payload);
+		if (!ok) MTCL_ERROR("[Server]:", "receivev of message %d failed, errno=%d\n", i, errno);
+	}
+	char c;
+	ok = ok && h.receive(&c, 1) == 0;  // EOS
+	h.close();
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
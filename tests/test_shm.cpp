@@ -0,0 +1,172 @@
+/*
+ * Test of the shared-memory transport (SHM).
+ *
+ * NCLIENTS processes connect at the same time (the connection buffer has
+ * several producers) and send messages of many sizes with send and sendv:
+ * small ones that wrap around the end of the ring, and ones larger than the
+ * ring that the server reads from the memory of the client (client 1 streams
+ * them through the ring instead, MTCL_SHM_CMA_THRESHOLD=0). The server
+ * receives them with receive and receivev, checks their content and that a
+ * too small buffer gives an error without consuming the message, then it
+ * replies to each client. At the end both sides send a message of SYM_SIZE
+ * bytes before receiving the one of the peer: it fits in the ring, so the
+ * sends must not wait for the peer even if the message is above the
+ * threshold of the rendezvous (1MB in the server and in client 2).
+ * The server waits a while before receiving: the blocked senders and the
+ * blocked receiver must sleep instead of spinning.
+ *
+ * $> ./test_shm
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const std::string EP = "SHM:/mtcl_test_shm";
+static const int NCLIENTS = 3;
+static const int NMSGS    = 300;
+static const size_t SYM_SIZE = SHM_SMALL_MSG_SIZE / 2;
+
+static size_t msgSize(int i) {
+	if (i % 100 == 99) return 2 * SHM_SMALL_MSG_SIZE + 3 * i;  // larger than the ring
+	if (i % 10 == 9)   return (1<<16) + i;
+	return 1 + (i * 37) % 300;
+}
+static char byteAt(int c, int i, size_t j) { return (char)(c * 7 + i * 31 + j); }
+
+static const int IDLE_MS = 200;
+
+// CPU time consumed by the calling thread
+static double threadCpuMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+// both sides send before receiving, each one checks the message of the other
+static bool exchange(HandleUser& h, int c, bool server=false) {
+	std::vector<char> buff(SYM_SIZE);
+	for(size_t j=0; j<SYM_SIZE; ++j) buff[j] = byteAt(c, server, j);
+	CHECK(h.send(buff.data(), SYM_SIZE) == (ssize_t)SYM_SIZE);
+	CHECK(h.receive(buff.data(), SYM_SIZE) == (ssize_t)SYM_SIZE);
+	for(size_t j=0; j<SYM_SIZE; ++j)
+		if (buff[j] != byteAt(c, !server, j)) {
+			MTCL_ERROR("[Test]:", "client %d exchange: wrong byte at %ld\n", c, j);
+			return false;
+		}
+	return true;
+}
+
+static bool client(int c) {
+	HandleUser h;
+	for(int i=0; i<500 && !(h = Manager::connect(EP)).isValid(); ++i) usleep(10000);
+	CHECK(h.isValid());
+	CHECK(h.send(&c, sizeof(c)) == sizeof(c));
+	if (c == 0) {  // the server is blocked in receive meanwhile
+		std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+		CHECK(h.send("x", 1) == 1);
+	}
+	std::vector<char> buff(msgSize(NMSGS-1));
+	const double cpu = threadCpuMs();
+	for(int i=0; i<NMSGS; ++i) {
+		const size_t sz = msgSize(i);
+		for(size_t j=0; j<sz; ++j) buff[j] = byteAt(c, i, j);
+		if (i % 2) {
+			const size_t a = sz / 3;
+			struct iovec iov[3] = {{buff.data(), a}, {buff.data() + a, 0}, {buff.data() + a, sz - a}};
+			CHECK(h.sendv(iov, 3) == (ssize_t)sz);
+		} else CHECK(h.send(buff.data(), sz) == (ssize_t)sz);
+		// the ring is full until the server starts receiving
+		if (i == 99) CHECK(threadCpuMs() - cpu < IDLE_MS / 2);
+	}
+	int ack = 0;
+	CHECK(h.receive(&ack, sizeof(ack)) == sizeof(ack) && ack == c + 1);
+	CHECK(exchange(h, c));
+	h.close();
+	return true;
+}
+
+static bool serve(HandleUser& h) {
+	int c;
+	CHECK(h.receive(&c, sizeof(c)) == sizeof(c));
+	if (c == 0) {
+		const double cpu = threadCpuMs();
+		char x;
+		CHECK(h.receive(&x, 1) == 1 && x == 'x');
+		CHECK(threadCpuMs() - cpu < IDLE_MS / 2);
+	}
+	// the client fills the ring meanwhile
+	std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+	std::vector<char> buff(msgSize(NMSGS-1));
+	for(int i=0; i<NMSGS; ++i) {
+		const size_t sz = msgSize(i);
+		if (sz > 1) CHECK(h.receive(buff.data(), sz - 1) == -1);
+		if (i % 2) {
+			const size_t a = sz / 2;
+			struct iovec iov[2] = {{buff.data(), a}, {buff.data() + a, buff.size() - a}};
+			CHECK(h.receivev(iov, 2) == (ssize_t)sz);
+		} else CHECK(h.receive(buff.data(), buff.size()) == (ssize_t)sz);
+		for(size_t j=0; j<sz; ++j)
+			if (buff[j] != byteAt(c, i, j)) {
+				MTCL_ERROR("[Test]:", "client %d message %d: wrong byte at %ld\n", c, i, j);
+				return false;
+			}
+	}
+	const int ack = c + 1;
+	CHECK(h.send(&ack, sizeof(ack)) == sizeof(ack));
+	CHECK(exchange(h, c, true));
+	char e;
+	CHECK(h.receive(&e, 1) == 0);  // EOS
+	return true;
+}
+
+int main() {
+	std::vector<pid_t> pids;
+	for(int c=0; c<NCLIENTS; ++c) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			if (c == 1) setenv("MTCL_SHM_CMA_THRESHOLD", "0", 1);
+			if (c == 2) setenv("MTCL_SHM_CMA_THRESHOLD", "1048576", 1);
+			Manager::init("client" + std::to_string(c));
+			bool ok = client(c);
+			Manager::finalize(true);
+			return ok ? 0 : -1;
+		}
+		pids.push_back(pid);
+	}
+	setenv("MTCL_SHM_CMA_THRESHOLD", "1048576", 1);
+	Manager::init("server");
+	if (Manager::listen(EP) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		for(auto pid : pids) kill(pid, SIGTERM);
+		return -1;
+	}
+	bool ok = true;
+	for(int n=0; n<NCLIENTS;) {
+		auto h = Manager::getNext();
+		if (!h.isNewConnection()) continue;
+		ok = serve(h) && ok;
+		h.close();
+		++n;
+	}
+	Manager::finalize(true);
+
+	for(auto pid : pids) {
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+	}
+	if (!ok) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Test of the readiness of the SHM connections managed by the IO threads.
+ *
+ * NCLIENTS processes open NCONN connections each. The server serves them
+ * with getNext: it receives one message and yields the handle. The clients
+ * send the messages in rounds, between two rounds they stay idle for a
+ * while: meanwhile the server is blocked in getNext and its IO threads must
+ * sleep on the doorbells instead of polling the connections.
+ *
+ * $> ./test_shm_doorbell
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const std::string EP = "SHM:/mtcl_test_doorbell";
+static const int NCLIENTS = 4;
+static const int NCONN    = 16;
+static const int NROUNDS  = 4;
+static const int IDLE_MS  = 200;
+
+// CPU time consumed by the process
+static double processCpuMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int client(int c) {
+	std::vector<HandleUser> handles;
+	for(int i=0; i<NCONN; ++i) {
+		HandleUser h;
+		for(int k=0; k<500 && !(h = Manager::connect(EP)).isValid(); ++k) usleep(10000);
+		if (!h.isValid()) {
+			MTCL_ERROR("[Client]:", "cannot connect, errno=%d\n", errno);
+			return -1;
+		}
+		handles.push_back(std::move(h));
+	}
+	for(int r=0; r<NROUNDS; ++r) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+		for(int i=0; i<NCONN; ++i) {
+			const int v = (c * NCONN + i) * NROUNDS + r;
+			if (handles[i].send(&v, sizeof(v)) != sizeof(v)) return -1;
+		}
+	}
+	for(auto& h : handles) h.close();
+	return 0;
+}
+
+int main() {
+	std::vector<pid_t> pids;
+	for(int c=0; c<NCLIENTS; ++c) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			Manager::init("client" + std::to_string(c));
+			int r = client(c);
+			Manager::finalize(true);
+			return r;
+		}
+		pids.push_back(pid);
+	}
+	Manager::init("server");
+	if (Manager::listen(EP) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		for(auto pid : pids) kill(pid, SIGTERM);
+		return -1;
+	}
+	const int total = NCLIENTS * NCONN;
+	std::vector<int> next(total * NROUNDS, 0);
+	int received = 0, closed = 0;
+	double cpu = 0, idle = 0, maxIdle = 0;
+	bool ok = true;
+	while(closed < total) {
+		double t0 = processCpuMs();
+		auto h = Manager::getNext();
+		if (h.isNewConnection()) continue;
+		int v;
+		ssize_t r = h.receive(&v, sizeof(v));
+		if (r == 0) {
+			h.close();
+			++closed;
+			continue;
+		}
+		if (r != sizeof(v) || v < 0 || v >= total * NROUNDS || next[v]++) {
+			MTCL_ERROR("[Server]:", "wrong message %d (r=%ld)\n", v, r);
+			ok = false;
+			break;
+		}
+		// the first message of each round arrives after the idle time
+		if (++received % total == 1) {
+			idle = processCpuMs() - t0;
+			maxIdle = std::max(maxIdle, idle);
+			cpu += idle;
+		}
+	}
+	Manager::finalize(true);
+
+	for(auto pid : pids) {
+		int status = 0;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+	}
+	if (ok && received != total * NROUNDS) {
+		MTCL_ERROR("[Server]:", "received %d messages out of %d\n", received, total * NROUNDS);
+		ok = false;
+	}
+	// the first wait overlaps with the connection phase
+	if (ok && cpu - maxIdle > (NROUNDS - 1) * IDLE_MS / 20) {
+		MTCL_ERROR("[Server]:", "%.1f ms of CPU time in %d idle waits\n", cpu - maxIdle, NROUNDS - 1);
+		ok = false;
+	}
+	if (!ok) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << total << " connections, " << received << " messages, "
+			  << cpu - maxIdle << " ms of CPU time in " << NROUNDS - 1 << " idle waits)\n";
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Test of the checks of the rendezvous records of the SHM transport.
+ *
+ * The descriptor of a rendezvous record is written in the shared segment by
+ * the peer. A producer forges records with no buffers, too many buffers,
+ * lengths that do not add up to the size of the message (or that overflow)
+ * and the pid of another process: each receive must fail with EPROTO, the
+ * record must be completed with EPROTO and the next messages must be
+ * received correctly. A valid record and a large message sent with put are
+ * read from the memory of the producer.
+ *
+ * $> ./test_shm_rendezvous
+ */
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const std::string NAME = "/mtcl_test_rendezvous";
+static const size_t SIZE = 1<<16;
+
+// producer that writes the rendezvous records directly
+struct forger : public shmBuffer {
+	using shmBuffer::cmaDesc;
+
+	// publishes a record for a message of size bytes, without waiting for it
+	void post(cmaDesc d, size_t size) {
+		std::unique_lock lk(mutex);
+		d.ticket = shmp->cmaPosted++;
+		append(CMA | size, sizeof(d), [&d](char* dst, size_t off, size_t n) { memcpy(dst, (const char*)&d + off, n); });
+		publishTail(ptail);
+	}
+	bool completed(int status) {
+		return shmp->cmaDone.load() == shmp->cmaPosted && shmp->cmaStatus == status;
+	}
+};
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+static bool test(forger& p, shmBuffer& c) {
+	std::vector<char> msg(SIZE), buff(SIZE);
+	for(size_t j=0; j<SIZE; ++j) msg[j] = (char)(j * 7);
+	const uint64_t base = (uint64_t)msg.data();
+
+	// a valid record is read from the memory of this process
+	forger::cmaDesc d{};
+	d.pid = getpid();
+	d.iovcnt = 2;
+	d.iov[0] = {base, SIZE / 2};
+	d.iov[1] = {base + SIZE / 2, SIZE / 2};
+	p.post(d, SIZE);
+	CHECK(c.get(buff.data(), SIZE) == (ssize_t)SIZE && buff == msg);
+	CHECK(p.completed(0));
+
+	std::vector<forger::cmaDesc> invalid(6, d);
+	invalid[0].iovcnt = 0;
+	invalid[1].iovcnt = SHM_CMA_MAX_IOV + 1;
+	invalid[2].iovcnt = 1u << 30;
+	invalid[3].iov[1].len = SIZE / 2 - 1;  // shorter
+	invalid[4].iov[0].len = ~(uint64_t)0;  // the sum overflows
+	invalid[4].iov[1].len = SIZE + 1;
+	invalid[5].pid = getppid();            // not the peer
+	for(auto& bad : invalid) {
+		p.post(bad, SIZE);
+		CHECK(c.get(buff.data(), SIZE) == -1 && errno == EPROTO);
+		CHECK(p.completed(EPROTO));
+		// the stream goes on
+		CHECK(p.put("x", 1) == 1);
+		char x = 0;
+		CHECK(c.get(&x, 1) == 1 && x == 'x');
+	}
+
+	// a message larger than the ring is sent by rendezvous
+	std::vector<char> large(2 * SHM_SMALL_MSG_SIZE + 5), rlarge(large.size());
+	for(size_t j=0; j<large.size(); ++j) large[j] = (char)(j * 13);
+	p.setCmaThreshold(1);
+	ssize_t r = 0;
+	std::thread t([&]() { r = p.put(large.data(), large.size()); });
+	const ssize_t n = c.get(rlarge.data(), rlarge.size());
+	t.join();
+	CHECK(n == (ssize_t)large.size() && r == n && rlarge == large);
+	CHECK(p.completed(0));
+	return true;
+}
+
+int main() {
+	forger p;
+	shmBuffer c;
+	if (p.create(NAME, true) < 0 || c.open(NAME) < 0) {
+		MTCL_ERROR("[Test]:", "cannot create the buffer %s, errno=%d (%s)\n", NAME.c_str(), errno, strerror(errno));
+		return -1;
+	}
+	const bool ok = test(p, c);
+	c.close();
+	p.close(true);
+	if (!ok) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Test of the non-blocking connection handshake.
+ *
+ * The client process first opens S raw TCP connections towards the server
+ * that never complete the MTCL handshake (a third of them send a partial
+ * header, a third a full header followed by a partial payload, the others
+ * nothing at all), then it opens N regular connections
+ * and sends one message on each of them. The server checks that the regular
+ * connections are served within a bound that does not depend on S (with a 
+ * blocking handshake each stalled connection would stall the IO thread for 
+ * CCONNECTION_RETRY*CCONNECTION_TIMEOUT milliseconds) and the client checks
+ * that the stalled connections are closed by the server when their handshake
+ * times out.
+ *
+ * $> ./test_slow_handshake [#stalled=8] [#connections=32]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static int rawConnect(int port) {
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port   = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	for(int i=0; i<50; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1) return -1;
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+		close(fd);
+		usleep(100000);
+	}
+	return -1;
+}
+
+int main(int argc, char** argv){
+	const int nstalled = (argc > 1) ? std::stoi(argv[1]) : 8;
+	const int nconn    = (argc > 2) ? std::stoi(argv[2]) : 32;
+	// generous bound, it does not depend on the number of stalled connections
+	const auto maxDelay = std::chrono::milliseconds(2 * CCONNECTION_RETRY * CCONNECTION_TIMEOUT);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		std::vector<int> stalled;
+		for(int i=0;i<nstalled;++i) {
+			int fd = rawConnect(13004);
+			if (fd == -1) {
+				MTCL_ERROR("[Client]:", "raw connect error, errno=%d (%s)\n", errno, strerror(errno));
+				return -1;
+			}
+			if (i % 3 == 1) {
+				char partial[3] = {0, 0, 0};
+				if (write(fd, partial, sizeof(partial)) != sizeof(partial)) return -1;
+			}
+			if (i % 3 == 2) {  // the header of the collective flag and half of it
+				char stalled[8 + 2] = {0, 0, 0, 0, 0, 0, 0, sizeof(int), 1, 0};
+				if (write(fd, stalled, sizeof(stalled)) != sizeof(stalled)) return -1;
+			}
+			stalled.push_back(fd);
+		}
+		Manager::init("client");
+		std::vector<HandleUser> handles;
+		for(int i=0;i<nconn;++i) {
+			auto h = Manager::connect("TCP:localhost:13004", 50, 100);
+			if (!h.isValid() || h.send(&i, sizeof(i)) != sizeof(i)) {
+				MTCL_ERROR("[Client]:", "connection %d error, errno=%d (%s)\n", i, errno, strerror(errno));
+				Manager::finalize();
+				return -1;
+			}
+			handles.push_back(std::move(h));
+		}
+		for(auto& h: handles) h.close();
+		// the server must close the stalled connections
+		int nclosed = 0;
+		for(int fd : stalled) {
+			struct timeval tv = { .tv_sec = 10, .tv_usec = 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			char buf[64];
+			ssize_t r;
+			while((r = read(fd, buf, sizeof(buf))) > 0);  // skips the EOS message
+			if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) ++nclosed;
+			close(fd);
+		}
+		Manager::finalize();
+		if (nclosed != nstalled) {
+			std::cerr << "TEST FAILED: " << nclosed << " out of " << nstalled << " stalled connections closed\n";
+			return -1;
+		}
+		return 0;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13004") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	int nmsgs = 0, neos = 0;
+	long long sum = 0;
+	const auto start = std::chrono::steady_clock::now();
+	auto last = start;
+	while(neos < nconn) {
+		auto h = Manager::getNext(std::chrono::seconds(20));
+		if (!h.isValid()) {
+			MTCL_ERROR("[Server]:", "timeout, received %d messages and %d EOS\n", nmsgs, neos);
+			break;
+		}
+		if (h.isNewConnection()) continue;
+		size_t sz;
+		if (h.probe(sz) <= 0) {
+			++neos;
+			continue;
+		}
+		int x;
+		if (h.receive(&x, sizeof(x)) != sizeof(x)) break;
+		sum += x;
+		last = std::chrono::steady_clock::now();
+		++nmsgs;
+	}
+	// the server stays alive until the client has checked the stalled connections
+	int status = 0;
+	while(waitpid(pid, &status, WNOHANG) == 0) Manager::getNext(std::chrono::milliseconds(100));
+	Manager::finalize();
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(last - start);
+	const long long expected = (long long)nconn * (nconn - 1) / 2;
+	if (nmsgs != nconn || neos != nconn || sum != expected || elapsed > maxDelay ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: messages=" << nmsgs << " EOS=" << neos
+				  << " checksum=" << sum << " (expected " << expected << ")"
+				  << " elapsed=" << elapsed.count() << "ms\n";
+		return -1;
+	}
+	std::cout << "TEST OK (" << nstalled << " stalled, " << nconn << " connections served in "
+			  << elapsed.count() << "ms)\n";
+	return 0;
+}
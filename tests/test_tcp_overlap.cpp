@@ -0,0 +1,100 @@
+/*
+ * Test of the asynchronous isend/ireceive of the TCP transport.
+ *
+ * Both processes first post NMSGS isend of large messages and only then
+ * post the matching ireceive. The data exceeds the socket buffers, so the
+ * test completes only if isend does not block until the peer receives.
+ * While the requests are in flight the processes keep "computing" and
+ * calling test(). Finally, the receives are checked (content and count()).
+ *
+ * $> ./test_tcp_overlap
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int    NMSGS = 16;
+static const size_t MSGSZ = 1<<20;
+
+static bool run(HandleUser& h, int me) {
+	std::vector<std::vector<char>> out(NMSGS), in(NMSGS);
+	RequestPool sends(NMSGS);
+	std::vector<Request> recvs(NMSGS);
+	for(int i=0; i<NMSGS; ++i) {
+		out[i].assign(MSGSZ - i, (char)(me * NMSGS + i));
+		if (h.isend(out[i].data(), out[i].size(), sends) < 0) {
+			MTCL_ERROR("[Test]:", "isend error, errno=%d (%s)\n", errno, strerror(errno));
+			return false;
+		}
+	}
+	for(int i=0; i<NMSGS; ++i) {
+		in[i].assign(MSGSZ, 0);
+		if (h.ireceive(in[i].data(), in[i].size(), recvs[i]) < 0) {
+			MTCL_ERROR("[Test]:", "ireceive error, errno=%d (%s)\n", errno, strerror(errno));
+			return false;
+		}
+	}
+	// overlap: the requests advance each time they are tested
+	size_t iters = 0;
+	while(!sends.testAll() || !test(recvs[NMSGS-1])) ++iters;
+	sends.waitAll();
+
+	const int peer = 1 - me;
+	for(int i=0; i<NMSGS; ++i) {
+		if (recvs[i].wait() < 0 || recvs[i].count() != (ssize_t)(MSGSZ - i)) {
+			MTCL_ERROR("[Test]:", "wrong receive %d, count=%ld errno=%d\n", i, recvs[i].count(), errno);
+			return false;
+		}
+		for(size_t j=0; j<(size_t)recvs[i].count(); ++j)
+			if (in[i][j] != (char)(peer * NMSGS + i)) {
+				MTCL_ERROR("[Test]:", "wrong content of message %d\n", i);
+				return false;
+			}
+	}
+	std::cout << "[" << me << "] " << iters << " test iterations while transferring\n";
+
+	// EOS through ireceive
+	h.close();
+	char c;
+	Request eos;
+	if (h.ireceive(&c, 1, eos) < 0 || eos.wait() < 0 || eos.count() > 0) {
+		MTCL_ERROR("[Test]:", "EOS not received\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv){
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		auto h = Manager::connect("TCP:localhost:13020", 50, 100);
+		bool ok = h.isValid() && run(h, 1);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13020") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid() && run(h, 0);
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Test of the zero-copy sends of the TCP transport (MSG_ZEROCOPY).
+ *
+ * The threshold is set to 64KB (MTCL_TCP_ZEROCOPY_THRESHOLD). The client
+ * sends interleaved small (copied) and large (zero-copy) messages, with
+ * isend and with send. After each completed isend the buffer is
+ * immediately overwritten: the server checks that the data received is
+ * the one present when the message was sent.
+ * Then the server sends a large message with isend and yields the handle:
+ * the zero-copy notifications signaled on the socket must not make it
+ * ready, since the client has nothing to send.
+ *
+ * $> ./test_tcp_zerocopy
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int    NMSGS = 40;
+static const size_t LARGE = 4<<20;
+static const size_t SMALL = 100;
+
+static size_t msgSize(int i) { return (i % 2) ? SMALL + i : LARGE + i; }
+
+static bool client() {
+	auto h = Manager::connect("TCP:localhost:13040", 50, 100);
+	if (!h.isValid()) return false;
+	std::vector<char> buff(LARGE + NMSGS);
+	for(int i=0; i<NMSGS; ++i) {
+		std::fill(buff.begin(), buff.end(), (char)i);
+		if (i % 4 < 2) {
+			Request r;
+			if (h.isend(buff.data(), msgSize(i), r) < 0 || r.wait() < 0) {
+				MTCL_ERROR("[Client]:", "isend error, errno=%d (%s)\n", errno, strerror(errno));
+				return false;
+			}
+		} else if (h.send(buff.data(), msgSize(i)) != (ssize_t)msgSize(i)) {
+			MTCL_ERROR("[Client]:", "send error, errno=%d (%s)\n", errno, strerror(errno));
+			return false;
+		}
+		std::fill(buff.begin(), buff.end(), (char)0xff);  // the buffer can be reused
+	}
+	if (h.receive(buff.data(), buff.size()) != (ssize_t)LARGE) {
+		MTCL_ERROR("[Client]:", "receive error, errno=%d (%s)\n", errno, strerror(errno));
+		return false;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+	h.close();
+	return true;
+}
+
+int main(int argc, char** argv){
+	setenv("MTCL_TCP_ZEROCOPY_THRESHOLD", "65536", 1);
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client();
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCP:localhost:13040") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid();
+	std::vector<char> buff(LARGE + NMSGS);
+	for(int i=0; ok && i<NMSGS; ++i) {
+		const ssize_t r = h.receive(buff.data(), buff.size());
+		ok = (r == (ssize_t)msgSize(i));
+		for(ssize_t j=0; ok && j<r; ++j) ok = (buff[j] == (char)i);
+		if (!ok) MTCL_ERROR("[Server]:", "wrong message %d (size %ld)\n", i, r);
+	}
+	if (ok) {
+		Request r;
+		ok = h.isend(buff.data(), LARGE, r) == 0;
+		h.yield();
+		// the handle becomes ready only at the end of the stream
+		if (ok && Manager::getNext(std::chrono::milliseconds(500)).isValid()) {
+			MTCL_ERROR("[Server]:", "the handle is ready while the client is idle\n");
+			ok = false;
+		}
+		ok = ok && r.wait() == 0;
+		if (ok) h = Manager::getNext(std::chrono::seconds(5));
+		ok = ok && h.isValid();
+	}
+	ok = ok && h.receive(buff.data(), buff.size()) == 0;  // EOS
+	h.close();
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Test of the io_uring TCP transport (TCPU) and of its interoperability
+ * with the TCP transport.
+ *
+ * The server listens on a TCPU and on a TCP endpoint and echoes back every
+ * message it receives. The client process opens three connections:
+ * TCP->TCPU, TCPU->TCPU and TCPU->TCP. On each of them it sends messages
+ * of increasing size (up to 8MB, more than the receive high watermark of
+ * TCPU) checking the echoes, then it posts a burst of isend and ireceive
+ * and checks the completed requests and their count().
+ *
+ * $> ./test_tcpu
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const size_t sizes[] = {1, 8, 100, 4096, 16385, 100000, 1<<20, 8<<20};
+static const int    NASYNC  = 32;
+static const size_t ASYNCSZ = 3000;
+
+static void fill(std::vector<char>& b, size_t sz, int seed) {
+	b.resize(sz);
+	for(size_t i=0; i<sz; ++i) b[i] = (char)((i * 31 + seed) & 0xff);
+}
+
+static bool client(const std::string& ep) {
+	auto h = Manager::connect(ep, 50, 100);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:", "cannot connect to %s, errno=%d (%s)\n", ep.c_str(), errno, strerror(errno));
+		return false;
+	}
+	std::vector<char> out, in;
+	int seed = 0;
+	for(size_t sz : sizes) {
+		fill(out, sz, ++seed);
+		in.assign(sz, 0);
+		if (h.send(out.data(), sz) != (ssize_t)sz) {
+			MTCL_ERROR("[Client]:", "%s send error (size %ld), errno=%d (%s)\n", ep.c_str(), sz, errno, strerror(errno));
+			return false;
+		}
+		if (h.receive(in.data(), sz) != (ssize_t)sz || in != out) {
+			MTCL_ERROR("[Client]:", "%s wrong echo (size %ld)\n", ep.c_str(), sz);
+			return false;
+		}
+	}
+
+	std::vector<std::vector<char>> aout(NASYNC), ain(NASYNC);
+	std::vector<Request> sreq(NASYNC), rreq(NASYNC);
+	for(int i=0; i<NASYNC; ++i) {
+		fill(aout[i], ASYNCSZ - i, i);
+		ain[i].assign(ASYNCSZ, 0);
+		if (h.isend(aout[i].data(), aout[i].size(), sreq[i]) < 0 ||
+			h.ireceive(ain[i].data(), ain[i].size(), rreq[i]) < 0) {
+			MTCL_ERROR("[Client]:", "%s isend/ireceive error, errno=%d (%s)\n", ep.c_str(), errno, strerror(errno));
+			return false;
+		}
+	}
+	for(int i=0; i<NASYNC; ++i) {
+		if (sreq[i].wait() < 0 || rreq[i].wait() < 0) {
+			MTCL_ERROR("[Client]:", "%s wait error, errno=%d (%s)\n", ep.c_str(), errno, strerror(errno));
+			return false;
+		}
+		ain[i].resize(rreq[i].count() < 0 ? 0 : rreq[i].count());
+		if (ain[i] != aout[i]) {
+			MTCL_ERROR("[Client]:", "%s wrong asynchronous echo %d (count %ld)\n", ep.c_str(), i, rreq[i].count());
+			return false;
+		}
+	}
+	h.close();
+	return true;
+}
+
+int main(int argc, char** argv){
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client("TCP:localhost:13010") &&
+			      client("TCPU:localhost:13010") &&
+			      client("TCPU:localhost:13011");
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen("TCPU:localhost:13010") < 0 || Manager::listen("TCP:localhost:13011") < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	int neos = 0, nmsgs = 0;
+	std::vector<char> buff;
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while(neos < 3 && std::chrono::steady_clock::now() < deadline) {
+		auto h = Manager::getNext(std::chrono::milliseconds(100));
+		if (!h.isValid()) continue;
+		if (h.isNewConnection()) {
+			h.yield();
+			continue;
+		}
+		size_t sz;
+		if (h.probe(sz) <= 0) {  // EOS
+			h.close();
+			++neos;
+			continue;
+		}
+		buff.resize(sz);
+		if (h.receive(buff.data(), sz) != (ssize_t)sz || h.send(buff.data(), sz) != (ssize_t)sz) {
+			MTCL_ERROR("[Server]:", "echo error, errno=%d (%s)\n", errno, strerror(errno));
+			break;
+		}
+		++nmsgs;
+	}
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	const int expected = 3 * (sizeof(sizes)/sizeof(sizes[0]) + NASYNC);
+	if (neos != 3 || nmsgs != expected || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED: messages=" << nmsgs << " (expected " << expected << ") EOS=" << neos << "\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Test of the multi-stream TCP transport (TCPX).
+ *
+ * The client sends small messages and large ones (above the stripe
+ * threshold, split across the streams) with send, isend and sendv; the
+ * server receives them alternating receive, ireceive and receivev, checks
+ * their content and that a too small buffer gives EMSGSIZE without
+ * consuming the message. Then the server replies with a large message.
+ * Before connecting, the client opens some raw sockets towards the server
+ * that never send their hello, and one that sends the hello of a
+ * connection whose other sockets never arrive: they must not delay the
+ * connection and the server must close them.
+ *
+ * $> ./test_tcpx [streams=4]
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const std::string EP = "TCPX:localhost:13070";
+static const int    NMSGS  = 24;
+static const size_t STRIPE = 1<<16;
+static const int    NSTALLED = 4;
+
+static size_t msgSize(int i) {
+	switch(i % 4) {
+	case 0:  return 10 + i;
+	case 1:  return STRIPE;                 // exactly the threshold
+	case 2:  return (1<<20) + 3 * i;        // slices not multiple of the page
+	default: return (5<<20) + 4096 * i;
+	}
+}
+static char byteAt(int i, size_t j) { return (char)(i * 31 + j); }
+
+static void fill(std::vector<char>& b, int i) {
+	for(size_t j=0; j<msgSize(i); ++j) b[j] = byteAt(i, j);
+}
+static bool check(const std::vector<char>& b, int i, ssize_t r) {
+	if (r != (ssize_t)msgSize(i)) {
+		MTCL_ERROR("[Test]:", "message %d: wrong size %ld (errno=%d)\n", i, r, errno);
+		return false;
+	}
+	for(size_t j=0; j<msgSize(i); ++j)
+		if (b[j] != byteAt(i, j)) {
+			MTCL_ERROR("[Test]:", "message %d: wrong byte at %ld\n", i, j);
+			return false;
+		}
+	return true;
+}
+
+static int rawConnect(int port) {
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port   = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	for(int i=0; i<50; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1) return -1;
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+		close(fd);
+		usleep(100000);
+	}
+	return -1;
+}
+
+// true if the server closes the socket within the timeout
+static bool closedByServer(int fd, int timeout_s) {
+	struct timeval tv = { .tv_sec = timeout_s, .tv_usec = 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char buf[64];
+	ssize_t r;
+	while((r = read(fd, buf, sizeof(buf))) > 0);
+	const bool closed = r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+	close(fd);
+	return closed;
+}
+
+static bool client() {
+	std::vector<int> stalled;
+	for(int i=0; i<=NSTALLED; ++i) {
+		const int fd = rawConnect(13070);
+		if (fd == -1) return false;
+		stalled.push_back(fd);
+	}
+	// the first socket of a connection of 2 streams (see ConnTcpX::hello_t)
+	const uint32_t hello[8] = {htonl(0x54435058), htonl(0), htonl(2), 0, 0, htonl(1), 0, htonl(STRIPE)};
+	if (write(stalled.back(), hello, sizeof(hello)) != sizeof(hello)) return false;
+
+	const auto start = std::chrono::steady_clock::now();
+	auto h = Manager::connect(EP, 50, 100);
+	if (!h.isValid()) return false;
+	std::vector<char> buff(msgSize(NMSGS-1) + 1);
+	for(int i=0; i<NMSGS; ++i) {
+		fill(buff, i);
+		ssize_t r;
+		switch(i % 3) {
+		case 0: r = h.send(buff.data(), msgSize(i)); break;
+		case 1: {
+			Request req;
+			r = (h.isend(buff.data(), msgSize(i), req) < 0 || req.wait() < 0) ? -1 : msgSize(i);
+		} break;
+		default: {
+			const size_t a = msgSize(i) / 3;
+			struct iovec iov[2] = {{buff.data(), a}, {buff.data() + a, msgSize(i) - a}};
+			r = h.sendv(iov, 2);
+		}}
+		if (r != (ssize_t)msgSize(i)) {
+			MTCL_ERROR("[Client]:", "send of message %d failed, errno=%d\n", i, errno);
+			return false;
+		}
+	}
+	const int last = NMSGS - 1;
+	bool ok = check(buff, last, h.receive(buff.data(), buff.size()));
+	h.close();
+	// with a blocking hello each stalled socket would delay the connection
+	// by TCPX_HELLO_TIMEOUT milliseconds
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	if (ok && elapsed > std::chrono::milliseconds(2 * TCPX_HELLO_TIMEOUT)) {
+		MTCL_ERROR("[Client]:", "the exchange took %ld ms\n", (long)std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+		ok = false;
+	}
+	for(int fd : stalled)
+		if (!closedByServer(fd, 2 * TCPX_CONNECT_TIMEOUT / 1000)) {
+			MTCL_ERROR("[Client]:", "a stalled socket has not been closed by the server\n");
+			ok = false;
+		}
+	return ok;
+}
+
+int main(int argc, char** argv){
+	if (argc > 1) setenv("MTCL_TCPX_STREAMS", argv[1], 1);
+	setenv("MTCL_TCPX_STRIPE_THRESHOLD", std::to_string(STRIPE).c_str(), 1);
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = client();
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen(EP) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid();
+	std::vector<char> buff(msgSize(NMSGS-1) + 1);
+	for(int i=0; ok && i<NMSGS; ++i) {
+		if (h.receive(buff.data(), msgSize(i) - 1) != -1 || errno != EMSGSIZE) {
+			MTCL_ERROR("[Server]:", "message %d: too small buffer not detected\n", i);
+			ok = false;
+			break;
+		}
+		ssize_t r;
+		switch(i % 3) {
+		case 0: r = h.receive(buff.data(), buff.size()); break;
+		case 1: {
+			Request req;
+			r = (h.ireceive(buff.data(), buff.size(), req) < 0 || req.wait() < 0) ? -1 : req.count();
+		} break;
+		default: {
+			const size_t a = msgSize(i) / 2 + 1;
+			struct iovec iov[2] = {{buff.data(), a}, {buff.data() + a, buff.size() - a}};
+			r = h.receivev(iov, 2);
+		}}
+		ok = check(buff, i, r);
+	}
+	if (ok) {
+		fill(buff, NMSGS-1);
+		ok = h.send(buff.data(), msgSize(NMSGS-1)) == (ssize_t)msgSize(NMSGS-1);
+	}
+	char c;
+	ok = ok && h.receive(&c, 1) == 0;  // EOS
+	h.close();
+	// the server stays alive until the client has checked the stalled sockets
+	int status = 0;
+	while(waitpid(pid, &status, WNOHANG) == 0) Manager::getNext(std::chrono::milliseconds(100));
+	Manager::finalize(true);
+
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Test of the Unix domain sockets transport (UDS).
+ *
+ * The client connects to an abstract name and sends small and large
+ * messages with send and isend, then it passes the write end of a pipe to
+ * the server with sendFds. The server checks the messages, writes a string
+ * into the received descriptor and replies through the connection; the
+ * client finally reads the string from the read end of its pipe.
+ * The default endpoint is an abstract name, a path in the file system
+ * can be used as well (e.g. UDS:/tmp/mtcl_test_uds.sock).
+ * Before connecting, the client checks that listen on a path does not
+ * remove a regular file nor the socket of a live server, but replaces a
+ * stale socket.
+ *
+ * $> ./test_uds [endpoint=UDS:mtcl_test_uds]
+ */
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "mtcl.hpp"
+
+using namespace MTCL;
+
+static const int    NMSGS = 20;
+static const size_t LARGE = 1<<20;
+static const char   HELLO[] = "hello through the pipe";
+
+static size_t msgSize(int i) { return (i % 2) ? 10 + i : LARGE + i; }
+
+static const char PATH[] = "/tmp/mtcl_test_uds_path";
+
+#define CHECK(X) if (!(X)) { MTCL_ERROR("[Test]:", "line %d: %s failed (errno=%d)\n", __LINE__, #X, errno); return false; }
+
+// socket bound to PATH, listening if live
+static int bindPath(bool live) {
+	struct sockaddr_un sa{};
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, PATH);
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0 || bind(s, (struct sockaddr*)&sa, sizeof(sa)) < 0 || (live && listen(s, 1) < 0)) return -1;
+	return s;
+}
+
+static bool pathTest() {
+	const std::string ep = std::string("UDS:") + PATH;
+	struct stat st;
+	unlink(PATH);
+	// a regular file
+	FILE* f = fopen(PATH, "w");
+	CHECK(f != nullptr);
+	fclose(f);
+	CHECK(Manager::listen(ep) < 0 && errno == EADDRINUSE);
+	CHECK(lstat(PATH, &st) == 0 && S_ISREG(st.st_mode));
+	unlink(PATH);
+	// the socket of a live server
+	int s = bindPath(true);
+	CHECK(s != -1);
+	CHECK(Manager::listen(ep) < 0 && errno == EADDRINUSE);
+	CHECK(lstat(PATH, &st) == 0 && S_ISSOCK(st.st_mode));
+	// the socket is stale once closed
+	close(s);
+	CHECK(Manager::listen(ep) == 0);
+	return true;
+}
+
+static bool client(const std::string& ep) {
+	auto h = Manager::connect(ep, 50, 100);
+	if (!h.isValid()) {
+		MTCL_ERROR("[Client]:", "cannot connect to %s\n", ep.c_str());
+		return false;
+	}
+	std::vector<char> buff(LARGE + NMSGS);
+	for(int i=0; i<NMSGS; ++i) {
+		std::fill(buff.begin(), buff.end(), (char)i);
+		if (i % 4 == 0) {
+			Request r;
+			if (h.isend(buff.data(), msgSize(i), r) < 0 || r.wait() < 0) return false;
+		} else if (h.send(buff.data(), msgSize(i)) != (ssize_t)msgSize(i)) return false;
+	}
+	int p[2];
+	if (pipe(p) < 0) return false;
+	if (h.sendFds(&p[1], 1) != 1) {
+		MTCL_ERROR("[Client]:", "sendFds error, errno=%d (%s)\n", errno, strerror(errno));
+		return false;
+	}
+	close(p[1]);
+	int ack = 0;
+	if (h.receive(&ack, sizeof(ack)) != sizeof(ack) || ack != NMSGS) return false;
+	char str[sizeof(HELLO)] = {0};
+	if (read(p[0], str, sizeof(str)) != sizeof(HELLO) || strcmp(str, HELLO)) {
+		MTCL_ERROR("[Client]:", "wrong data from the pipe\n");
+		return false;
+	}
+	close(p[0]);
+	h.close();
+	return true;
+}
+
+static bool server(HandleUser& h) {
+	std::vector<char> buff(LARGE + NMSGS);
+	for(int i=0; i<NMSGS; ++i) {
+		const ssize_t r = h.receive(buff.data(), buff.size());
+		bool ok = (r == (ssize_t)msgSize(i));
+		for(ssize_t j=0; ok && j<r; ++j) ok = (buff[j] == (char)i);
+		if (!ok) {
+			MTCL_ERROR("[Server]:", "wrong message %d (size %ld)\n", i, r);
+			return false;
+		}
+	}
+	int fd = -1;
+	if (h.receiveFds(&fd, 1) != 1 || fd < 0) {
+		MTCL_ERROR("[Server]:", "receiveFds error, errno=%d (%s)\n", errno, strerror(errno));
+		return false;
+	}
+	if (write(fd, HELLO, sizeof(HELLO)) != sizeof(HELLO)) return false;
+	close(fd);
+	const int ack = NMSGS;
+	if (h.send(&ack, sizeof(ack)) != sizeof(ack)) return false;
+	char c;
+	return h.receive(&c, 1) == 0;  // EOS
+}
+
+int main(int argc, char** argv){
+	const std::string ep = (argc > 1) ? argv[1] : "UDS:mtcl_test_uds";
+	pid_t pid = fork();
+	if (pid == 0) {
+		Manager::init("client");
+		bool ok = pathTest() && client(ep);
+		Manager::finalize(true);
+		return ok ? 0 : -1;
+	}
+	Manager::init("server");
+	if (Manager::listen(ep) < 0) {
+		MTCL_ERROR("[Server]:", "listen error, errno=%d (%s)\n", errno, strerror(errno));
+		kill(pid, SIGTERM);
+		return -1;
+	}
+	auto h = Manager::getNext();
+	bool ok = h.isValid() && server(h);
+	h.close();
+	Manager::finalize(true);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::cerr << "TEST FAILED\n";
+		return -1;
+	}
+	std::cout << "TEST OK\n";
+	return 0;
+}